@@ -196,6 +196,20 @@ void LibVEX_default_VexControl ( /*OUT*/ VexControl* vcon )
 }
 
 
+static void check_vex_control ( const VexControl* vcon )
+{
+   vassert(vcon->iropt_verbosity >= 0);
+   vassert(vcon->iropt_level >= 0);
+   vassert(vcon->iropt_level <= 2);
+   vassert(vcon->iropt_unroll_thresh >= 0);
+   vassert(vcon->iropt_unroll_thresh <= 400);
+   vassert(vcon->guest_max_insns >= 1);
+   vassert(vcon->guest_max_insns <= 100);
+   vassert(vcon->guest_chase == False || vcon->guest_chase == True);
+   vassert(vcon->regalloc_version == 2 || vcon->regalloc_version == 3);
+}
+
+
 /* Exported to library client. */
 
 void LibVEX_Init (
@@ -221,15 +235,7 @@ void LibVEX_Init (
    vassert(log_bytes);
    vassert(debuglevel >= 0);
 
-   vassert(vcon->iropt_verbosity >= 0);
-   vassert(vcon->iropt_level >= 0);
-   vassert(vcon->iropt_level <= 2);
-   vassert(vcon->iropt_unroll_thresh >= 0);
-   vassert(vcon->iropt_unroll_thresh <= 400);
-   vassert(vcon->guest_max_insns >= 1);
-   vassert(vcon->guest_max_insns <= 100);
-   vassert(vcon->guest_chase == False || vcon->guest_chase == True);
-   vassert(vcon->regalloc_version == 2 || vcon->regalloc_version == 3);
+   check_vex_control(vcon);
 
    /* Check that Vex has been built with sizes of basic types as
       stated in priv/libvex_basictypes.h.  Failure of any of these is
@@ -299,6 +305,16 @@ void LibVEX_Init (
 }
 
 
+/* Exported to library client. */
+
+void LibVEX_Update_Control ( const VexControl* vcon )
+{
+   vassert(vex_initdone);
+   check_vex_control(vcon);
+   vex_control = *vcon;
+}
+
+
 /* --------- Make a translation. --------- */
 
 /* KLUDGE: S390 need to know the hwcaps of the host when generating
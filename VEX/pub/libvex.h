@@ -660,6 +660,12 @@ extern void LibVEX_Init (
    const VexControl* vcon
 );
 
+/* Replace the control settings given to LibVEX_Init.  They apply to
+   translations made from then on.  The new settings are subject to
+   the same limits as those for LibVEX_Init. */
+
+extern void LibVEX_Update_Control ( const VexControl* vcon );
+
 
 /*-------------------------------------------------------*/
 /*--- Make a translation                              ---*/
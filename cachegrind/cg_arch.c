@@ -111,6 +111,12 @@ static void parse_cache_opt ( cache_t* cache, const HChar* opt,
 }
 
 
+void VG_(parse_cache_clo_value)(const HChar* opt, const HChar* optval,
+                                cache_t* cache)
+{
+   parse_cache_opt(cache, opt, optval);
+}
+
 Bool VG_(str_clo_cache_opt)(const HChar *arg,
                             cache_t* clo_I1c,
                             cache_t* clo_D1c,
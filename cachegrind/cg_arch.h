@@ -62,14 +62,15 @@ static inline Int cache_hit_char(CacheHitType hit_type)
     }
 }
 
-// Double buffered logging system
-#define BUFFER_SIZE 1024  // Number of entries per buffer
+// Memory access logging, see cg_mem_format.h for the on-disk format
+#define BUFFER_SIZE 1024  // Number of entries decoded at a time
 typedef enum {
     ACCESS_READ,
     ACCESS_WRITE,
     ACCESS_INSTR,
     ACCESS_STORE,
-    ACCESS_LOAD
+    ACCESS_LOAD,
+    ACCESS_PREFETCH  // an LL fill made by a prefetcher
 } AccessType;
 
 static inline Int access_type_char(AccessType atype)
@@ -85,24 +86,56 @@ static inline Int access_type_char(AccessType atype)
         return 'S';
     case ACCESS_LOAD:
         return 'L';
+    case ACCESS_PREFETCH:
+        return 'P';
     default:
         return '?';
     }
 }
 
+// Where a data access went, see cg_segmap.c (--regions=yes).
+typedef enum {
+    REGION_NONE,  // not classified: instruction fetch, LL traffic, or --regions=no
+    REGION_STACK,
+    REGION_HEAP,
+    REGION_GLOBAL,
+    REGION_MMAP,
+    REGION_OTHER,
+    N_REGIONS
+} RegionKind;
+
+static inline const HChar* region_name(RegionKind region)
+{
+    switch (region) {
+    case REGION_STACK:
+        return "stack";
+    case REGION_HEAP:
+        return "heap";
+    case REGION_GLOBAL:
+        return "global";
+    case REGION_MMAP:
+        return "mmap";
+    case REGION_OTHER:
+        return "other";
+    default:
+        return "-";
+    }
+}
+
 typedef struct {
     Addr addr;
     UChar size;
+    UChar region;       // RegionKind
     AccessType type;
     CacheHitType hit_type;
-    ULong timestamp;  // High resolution timestamp
+    ThreadId tid;       // thread that made the access, 0 if unknown
+    UInt instr;         // id of the instruction making a read or write, 0 if unknown
+    ULong timestamp;    // guest instructions executed by all threads
+    ULong thread_ts;    // guest instructions executed by 'tid'
 } LogEntry;
 
-typedef struct {
-    LogEntry entries[BUFFER_SIZE];
-    Int count;
-    Bool is_active;
-} LogBuffer;
+// Cache levels that can be added between L1 and LL with --cache-level.
+#define MAX_MID_LEVELS 4
 
 typedef struct {
     ULong a;         /* total # memory accesses of this kind */
@@ -114,6 +147,22 @@ typedef struct {
                          l1 evicted lines */
     ULong llc_words; /* number of different 32 bit words accessed in
                         llc evicted lines */
+    ULong ev1;       /* l1 lines loaded by these accesses, since evicted */
+    ULong wb1;       /* bytes of those lines never accessed ("wasted") */
+    ULong evL;       /* the same for llc lines */
+    ULong wbL;
+    ULong inv;       /* copies in other cores' l1 invalidated by these writes */
+    ULong fs;        /* of those, copies none of whose accessed words were
+                        written: false sharing */
+    ULong cm;        /* coherence misses: misses on lines invalidated by
+                        another core */
+    ULong mm[MAX_MID_LEVELS]; /* misses in each --cache-level level */
+    ULong pf;        /* prefetches triggered by these accesses */
+    ULong pfu;       /* of those, lines then accessed ("useful") */
+    ULong pfl;       /* and lines accessed before the prefetch could have
+                        completed ("late") */
+    ULong tm;        /* misses in the first level TLB */
+    ULong tw;        /* of those, misses in the STLB too: page walks */
 } CacheCC;
 
 #define MIN_LINE_SIZE 16
@@ -127,6 +176,10 @@ typedef struct {
 // Returns True if arg is a cache command line option, False otherwise.
 Bool VG_(str_clo_cache_opt)(const HChar* arg, cache_t* clo_I1c, cache_t* clo_D1c, cache_t* clo_LLc);
 
+// Parses "<size>,<assoc>,<line_size>" into 'cache', checking it as the
+// options above do; 'opt' is the option, for error messages.
+void VG_(parse_cache_clo_value)(const HChar* opt, const HChar* optval, cache_t* cache);
+
 // Checks the correctness of the auto-detected caches.
 // If a cache has been configured by command line options, it
 // replaces the equivalent auto-detected cache.
@@ -29,15 +29,19 @@
 
 /* This file contains the actual branch predictor simulator and its
    associated state.  As with cg_sim.c it is #included directly into
-   cg_main.c.  It provides:
-
-   - a taken/not-taken predictor for conditional branches
-   - a branch target address predictor for indirect branches
-
-   Function return-address prediction is not modelled, on the basis
-   that return stack predictors almost always predict correctly, and
-   also that it is difficult for Valgrind to robustly identify
-   function calls and returns.
+   cg_main.c, and into Callgrind's main.c.  It provides:
+
+   - a taken/not-taken predictor for conditional branches, selected by
+     --cond-predictor: the original gshare-like one, a TAGE-like one or
+     a perceptron
+   - a branch target address predictor for indirect branches, selected
+     by --ind-predictor: a BTAC indexed by the branch address, or one
+     backed by a table indexed by the path of recent targets too
+
+   Function return-address prediction is not modelled here, on the
+   basis that return stack predictors almost always predict correctly,
+   and also that it is difficult for Valgrind to robustly identify
+   function calls and returns.  Cachegrind's --ras models it anyway.
 */
 
 /* How many bits at the bottom of an instruction address are
@@ -54,6 +58,14 @@
 #  error "Unsupported architecture"
 #endif
 
+typedef enum { COND_GSHARE, COND_TAGE, COND_PERCEPTRON } CondPredictor;
+typedef enum { IND_BTAC, IND_PATH } IndPredictor;
+
+static CondPredictor clo_cond_predictor = COND_GSHARE;
+static Int           clo_cond_predictor_bits = 0;  /* 0: the model's default */
+static IndPredictor  clo_ind_predictor = IND_BTAC;
+static Int           clo_ind_predictor_bits = 9;
+
 
 /* Get a taken/not-taken prediction for the instruction (presumably a
    conditional branch) at instr_addr.  Once that's done, update the
@@ -69,26 +81,24 @@
    makes the predictor able to correlate this branch's behaviour with
    that of other branches. 
 
-   TODO: use predictor written by someone who understands this stuff.
-   Perhaps it would be better to move to a standard GShare predictor
-   and/or tournament predictor.
+   --cond-predictor-bits=<n> makes it 2^n counters.
 */
 /* The index is composed of N_HIST bits at the top and N_IADD bits at
    the bottom.  These numbers chosen somewhat arbitrarily, but note
    that making N_IADD_BITS too small (eg 4) can cause large amounts of
    aliasing, and hence misprediction, particularly if the history bits
-   are mostly unchanging. */
-#define N_HIST_BITS 7
-#define N_IADD_BITS 7
+   are mostly unchanging.  By default, both are 7. */
+static Int N_HIST_BITS;
+static Int N_IADD_BITS;
 
 #define N_BITS     (N_HIST_BITS + N_IADD_BITS)
 #define N_COUNTERS (1 << N_BITS)
 
-static UWord shift_register = 0;   /* Contains global history */
-static UChar counters[N_COUNTERS]; /* Counter array; presumably auto-zeroed */
+static UWord  shift_register = 0;  /* Contains global history */
+static UChar* counters;            /* Counter array */
 
 
-static ULong do_cond_branch_predict ( Addr instr_addr, Word takenW )
+static ULong do_gshare_predict ( Addr instr_addr, Word takenW )
 {
    UWord indx;
    Bool  predicted_taken, actually_taken, mispredict;
@@ -129,13 +139,287 @@ static ULong do_cond_branch_predict ( Addr instr_addr, Word takenW )
 }
 
 
+/* A TAGE-like predictor (Seznec and Michaud, "A case for (partially)
+   TAgged GEometric history length branch prediction", 2006).  A bimodal
+   table of 2^n 2-bit counters is backed by TAGE_N_TABLES tables of
+   2^(n-2) tagged 3-bit counters, each indexed by the branch address and
+   a longer global history.  The longest history whose entry's tag
+   matches gives the prediction, unless that entry is new and the
+   predictor has learnt that new entries are worse than the next
+   longest match.  A misprediction allocates an entry in a table with a
+   longer history.  By default, n is 12: about 8KB of state.
+
+   The histories are kept folded down to the width of an index or a tag,
+   so that hashing them costs the same whatever their length. */
+#define TAGE_N_TABLES 4
+#define TAGE_TAG_BITS 9
+#define TAGE_HIST_BUF 256              /* history bits kept, a power of 2 */
+#define TAGE_U_AGING  (1 << 18)        /* branches between halvings of u */
+
+static const Int tage_hist_len[TAGE_N_TABLES] = { 5, 15, 44, 130 };
+
+typedef struct {
+   UShort tag;
+   Char   ctr;     /* -4..3, taken if >= 0 */
+   UChar  u;       /* 0..3: how useful the entry has been */
+} TageEntry;
+
+typedef struct {
+   UInt comp;      /* the last 'len' history bits, folded to 'olen' bits */
+   Int  len;
+   Int  olen;
+} FoldedHist;
+
+static UChar      tage_hist[TAGE_HIST_BUF];   /* one outcome per byte */
+static UInt       tage_hist_pos = 0;
+static UChar*     tage_base;
+static Int        tage_base_bits;
+static TageEntry* tage_tables[TAGE_N_TABLES];
+static Int        tage_table_bits;
+static FoldedHist tage_fold_idx[TAGE_N_TABLES];
+static FoldedHist tage_fold_tag[2][TAGE_N_TABLES];
+static Int        tage_use_alt = 8;    /* 0..15: use alt on a new entry if >= 8 */
+static ULong      tage_n_branches = 0;
+
+static void fold_hist_init ( FoldedHist* f, Int len, Int olen )
+{
+   f->comp = 0;
+   f->len  = len;
+   f->olen = olen;
+}
+
+// Shifts 'newest' into the history, and 'oldest', which has just fallen
+// out of its last 'len' bits, out.
+static void fold_hist_update ( FoldedHist* f, UInt newest, UInt oldest )
+{
+   f->comp = (f->comp << 1) | newest;
+   f->comp ^= oldest << (f->len % f->olen);
+   f->comp ^= f->comp >> f->olen;
+   f->comp &= (1u << f->olen) - 1;
+}
+
+static void tage_init ( Int bits )
+{
+   Int i;
+
+   tage_base_bits  = bits;
+   tage_table_bits = bits - 2;
+   // The folded histories start empty, so the history they fold must too.
+   VG_(memset)(tage_hist, 0, sizeof(tage_hist));
+   tage_hist_pos   = 0;
+   tage_use_alt    = 8;
+   tage_n_branches = 0;
+   tage_base = VG_(malloc)("cg.branchpred.tage.1", 1 << bits);
+   VG_(memset)(tage_base, 2, 1 << bits);      /* weakly taken */
+   for (i = 0; i < TAGE_N_TABLES; i++) {
+      tage_tables[i] = VG_(calloc)("cg.branchpred.tage.2",
+                                   1 << tage_table_bits, sizeof(TageEntry));
+      fold_hist_init(&tage_fold_idx[i], tage_hist_len[i], tage_table_bits);
+      fold_hist_init(&tage_fold_tag[0][i], tage_hist_len[i], TAGE_TAG_BITS);
+      fold_hist_init(&tage_fold_tag[1][i], tage_hist_len[i], TAGE_TAG_BITS - 1);
+   }
+}
+
+static UWord tage_index ( UWord pc, Int i )
+{
+   return (pc ^ (pc >> (tage_table_bits + i)) ^ tage_fold_idx[i].comp)
+          & ((1 << tage_table_bits) - 1);
+}
+
+static UShort tage_tag ( UWord pc, Int i )
+{
+   return (pc ^ tage_fold_tag[0][i].comp ^ (tage_fold_tag[1][i].comp << 1))
+          & ((1 << TAGE_TAG_BITS) - 1);
+}
+
+static void tage_push_history ( Bool taken )
+{
+   Int i;
+
+   tage_hist_pos = (tage_hist_pos + 1) % TAGE_HIST_BUF;
+   tage_hist[tage_hist_pos] = taken;
+   for (i = 0; i < TAGE_N_TABLES; i++) {
+      UInt oldest = tage_hist[(tage_hist_pos - tage_hist_len[i]) % TAGE_HIST_BUF];
+      fold_hist_update(&tage_fold_idx[i], taken, oldest);
+      fold_hist_update(&tage_fold_tag[0][i], taken, oldest);
+      fold_hist_update(&tage_fold_tag[1][i], taken, oldest);
+   }
+}
+
+static void sat_update ( Char* ctr, Bool up, Int min, Int max )
+{
+   if (up && *ctr < max)
+      (*ctr)++;
+   else if (!up && *ctr > min)
+      (*ctr)--;
+}
+
+static ULong do_tage_predict ( Addr instr_addr, Word takenW )
+{
+   UWord      pc = instr_addr >> N_IADDR_LO_ZERO_BITS;
+   UWord      base_indx = pc & ((1 << tage_base_bits) - 1);
+   TageEntry* hit[TAGE_N_TABLES];
+   UShort     tag[TAGE_N_TABLES];
+   Int        i, provider = -1, alt = -1;
+   Bool       taken = takenW > 0, pred, alt_pred, provider_pred = False;
+
+   tl_assert(takenW <= 1);
+   for (i = TAGE_N_TABLES - 1; i >= 0; i--) {
+      tag[i] = tage_tag(pc, i);
+      hit[i] = &tage_tables[i][tage_index(pc, i)];
+      if (hit[i]->tag != tag[i])
+         continue;
+      if (provider < 0)
+         provider = i;
+      else if (alt < 0)
+         alt = i;
+   }
+
+   alt_pred = alt >= 0 ? hit[alt]->ctr >= 0 : tage_base[base_indx] >= 2;
+   pred = alt_pred;
+   if (provider >= 0) {
+      TageEntry* e = hit[provider];
+      Bool is_new = (e->ctr == 0 || e->ctr == -1) && e->u == 0;
+
+      provider_pred = e->ctr >= 0;
+      pred = is_new && tage_use_alt >= 8 ? alt_pred : provider_pred;
+      if (is_new && provider_pred != alt_pred) {
+         if (alt_pred == taken && tage_use_alt < 15)
+            tage_use_alt++;
+         else if (alt_pred != taken && tage_use_alt > 0)
+            tage_use_alt--;
+      }
+   }
+
+   // Train the provider, or the bimodal table if there is none.
+   if (provider >= 0) {
+      TageEntry* e = hit[provider];
+      sat_update(&e->ctr, taken, -4, 3);
+      if (provider_pred != alt_pred) {
+         if (provider_pred == taken && e->u < 3)
+            e->u++;
+         else if (provider_pred != taken && e->u > 0)
+            e->u--;
+      }
+   } else {
+      if (taken && tage_base[base_indx] < 3)
+         tage_base[base_indx]++;
+      else if (!taken && tage_base[base_indx] > 0)
+         tage_base[base_indx]--;
+   }
+
+   // On a mispredict, try a longer history: take an entry which hasn't
+   // been useful, or make those in the way less useful.
+   if (pred != taken && provider < TAGE_N_TABLES - 1) {
+      Int j = -1;
+      for (i = provider + 1; i < TAGE_N_TABLES; i++) {
+         if (hit[i]->u == 0) {
+            j = i;
+            break;
+         }
+      }
+      if (j >= 0) {
+         hit[j]->tag = tag[j];
+         hit[j]->ctr = taken ? 0 : -1;
+         hit[j]->u   = 0;
+      } else {
+         for (i = provider + 1; i < TAGE_N_TABLES; i++)
+            hit[i]->u--;
+      }
+   }
+
+   // Let entries which are no longer useful be replaced.
+   if (++tage_n_branches % TAGE_U_AGING == 0) {
+      for (i = 0; i < TAGE_N_TABLES; i++) {
+         UWord k;
+         for (k = 0; k < (1 << tage_table_bits); k++)
+            tage_tables[i][k].u >>= 1;
+      }
+   }
+
+   tage_push_history(taken);
+   return pred != taken ? 1 : 0;
+}
+
+
+/* A perceptron predictor (Jimenez and Lin, "Dynamic branch prediction
+   with perceptrons", 2001).  The branch address selects one of 2^n
+   perceptrons, each a bias and a signed 8-bit weight for each of the
+   last PERCEPTRON_HIST outcomes.  The branch is predicted taken if the
+   bias plus the weights of taken branches, less those of untaken ones,
+   is not negative.  The weights are trained on a mispredict, or when
+   that sum is within PERCEPTRON_THETA of 0.  By default, n is 7: about
+   4KB of state. */
+#define PERCEPTRON_HIST  32
+#define PERCEPTRON_THETA ((193 * PERCEPTRON_HIST) / 100 + 14)
+
+static Char* perceptron_weights;  /* PERCEPTRON_HIST + 1 per perceptron */
+static Int   perceptron_bits;
+static UInt  perceptron_hist = 0; /* bit i: the outcome i + 1 branches ago */
+
+static void perceptron_init ( Int bits )
+{
+   perceptron_bits = bits;
+   perceptron_weights = VG_(calloc)("cg.branchpred.perceptron.1",
+                                    (1 << bits) * (PERCEPTRON_HIST + 1), 1);
+}
+
+static ULong do_perceptron_predict ( Addr instr_addr, Word takenW )
+{
+   UWord indx = (instr_addr >> N_IADDR_LO_ZERO_BITS)
+                & ((1 << perceptron_bits) - 1);
+   Char* w = &perceptron_weights[indx * (PERCEPTRON_HIST + 1)];
+   Bool  taken = takenW > 0, pred;
+   Int   i, y = w[0];
+
+   tl_assert(takenW <= 1);
+   for (i = 0; i < PERCEPTRON_HIST; i++)
+      y += (perceptron_hist >> i) & 1 ? w[i + 1] : -w[i + 1];
+   pred = y >= 0;
+
+   if (pred != taken || (y < PERCEPTRON_THETA && y > -PERCEPTRON_THETA)) {
+      sat_update(&w[0], taken, -128, 127);
+      for (i = 0; i < PERCEPTRON_HIST; i++)
+         sat_update(&w[i + 1], taken == ((perceptron_hist >> i) & 1), -128, 127);
+   }
+
+   perceptron_hist = (perceptron_hist << 1) | taken;
+   return pred != taken ? 1 : 0;
+}
+
+
+static ULong do_cond_branch_predict ( Addr instr_addr, Word takenW )
+{
+   switch (clo_cond_predictor) {
+      case COND_TAGE:       return do_tage_predict(instr_addr, takenW);
+      case COND_PERCEPTRON: return do_perceptron_predict(instr_addr, takenW);
+      default:              return do_gshare_predict(instr_addr, takenW);
+   }
+}
+
+
 /* A very simple indirect branch predictor.  Use the branch's address
    to index a table which records the previous target address for this
    branch (or whatever aliased with it) and use that as the
-   prediction. */
-#define N_BTAC_BITS 9
+   prediction.  It has 2^N_BTAC_BITS entries, 512 by default.
+
+   With --ind-predictor=path, a second table of as many entries is
+   indexed by the branch's address hashed with the path history, the
+   last few targets of indirect branches, and tagged with the branch's
+   address.  When the tag matches, it predicts instead: that catches
+   the branches of interpreters and virtual calls whose target depends
+   on how they were reached. */
+static Int N_BTAC_BITS;
 #define N_BTAC      (1 << N_BTAC_BITS)
-static Addr btac[N_BTAC]; /* BTAC; presumably auto-zeroed */
+static Addr* btac;  /* BTAC */
+
+typedef struct {
+   Addr branch;
+   Addr target;
+} PathEntry;
+
+static PathEntry* path_table;
+static UWord      path_hist = 0;
 
 static ULong do_ind_branch_predict ( Addr instr_addr, Addr actual )
 {
@@ -144,13 +428,80 @@ static ULong do_ind_branch_predict ( Addr instr_addr, Addr actual )
          UWord indx = (instr_addr >> N_IADDR_LO_ZERO_BITS) 
                       & mask;
    tl_assert(indx < N_BTAC);
-   mispredict = btac[indx] != actual;
+   if (clo_ind_predictor == IND_PATH) {
+      PathEntry* e = &path_table[(indx ^ path_hist) & mask];
+      mispredict = (e->branch == instr_addr ? e->target : btac[indx]) != actual;
+      e->branch = instr_addr;
+      e->target = actual;
+      path_hist = ((path_hist << 3) ^ (actual >> N_IADDR_LO_ZERO_BITS)) & mask;
+   } else {
+      mispredict = btac[indx] != actual;
+   }
    btac[indx] = actual;
    return mispredict ? 1 : 0;
 }
 
 
+static Bool branchpred_process_option ( const HChar* arg )
+{
+   if      VG_XACT_CLO(arg, "--cond-predictor=gshare",
+                       clo_cond_predictor, COND_GSHARE) {}
+   else if VG_XACT_CLO(arg, "--cond-predictor=tage",
+                       clo_cond_predictor, COND_TAGE) {}
+   else if VG_XACT_CLO(arg, "--cond-predictor=perceptron",
+                       clo_cond_predictor, COND_PERCEPTRON) {}
+   else if VG_BINT_CLO(arg, "--cond-predictor-bits",
+                       clo_cond_predictor_bits, 4, 24) {}
+   else if VG_XACT_CLO(arg, "--ind-predictor=btac",
+                       clo_ind_predictor, IND_BTAC) {}
+   else if VG_XACT_CLO(arg, "--ind-predictor=path",
+                       clo_ind_predictor, IND_PATH) {}
+   else if VG_BINT_CLO(arg, "--ind-predictor-bits",
+                       clo_ind_predictor_bits, 2, 24) {}
+   else
+      return False;
+   return True;
+}
+
+static void branchpred_print_usage ( void )
+{
+   VG_(printf)(
+"    --cond-predictor=gshare|tage|perceptron  conditional branch\n"
+"                                     predictor [gshare]\n"
+"    --cond-predictor-bits=<n>        log2 of the entries of its tables\n"
+"                                     [14, or 12 for tage, 7 for perceptron]\n"
+"    --ind-predictor=btac|path        indirect branch predictor: by address,\n"
+"                                     or by address and path history [btac]\n"
+"    --ind-predictor-bits=<n>         log2 of the entries of its tables [9]\n"
+   );
+}
+
+static void branchpred_init ( void )
+{
+   Int bits = clo_cond_predictor_bits;
+
+   switch (clo_cond_predictor) {
+      case COND_TAGE:
+         tage_init(bits > 0 ? bits : 12);
+         break;
+      case COND_PERCEPTRON:
+         perceptron_init(bits > 0 ? bits : 7);
+         break;
+      default:
+         if (bits == 0)
+            bits = 14;
+         N_HIST_BITS = bits / 2;
+         N_IADD_BITS = bits - N_HIST_BITS;
+         counters = VG_(calloc)("cg.branchpred.1", N_COUNTERS, 1);
+         break;
+   }
+   N_BTAC_BITS = clo_ind_predictor_bits;
+   btac = VG_(calloc)("cg.branchpred.2", N_BTAC, sizeof(Addr));
+   if (clo_ind_predictor == IND_PATH)
+      path_table = VG_(calloc)("cg.branchpred.3", N_BTAC, sizeof(PathEntry));
+}
+
+
 /*--------------------------------------------------------------------*/
 /*--- end                                          cg_branchpred.c ---*/
 /*--------------------------------------------------------------------*/
-
@@ -0,0 +1,406 @@
+/*--------------------------------------------------------------------*/
+/*--- Attribution of data accesses to heap blocks for Cachegrind. ---*/
+/*--------------------------------------------------------------------*/
+
+/*
+ * With --heap-sites=yes Cachegrind replaces malloc and friends, as DHAT
+ * does, and keeps the live heap blocks in an interval map.  A data access
+ * inside a block is charged to the block's allocation site, its stack
+ * trace (--num-callers deep): the access, and its D1 and LL misses.  A D1
+ * or LL line evicted is charged to the block holding its first word
+ * accessed, with the bytes of it never accessed, so the wasted bytes per
+ * line evicted show how densely a site's blocks are used.  A line holding
+ * several small blocks is charged to one of them only.
+ *
+ * At exit the sites with the most D1 misses are printed, as candidates
+ * for a different layout.
+ *
+ * Without --heap-sites=yes the client keeps its own malloc: the
+ * replacement is only asked for after the options are read, and the
+ * redirections of vgpreload_cachegrind-*.so are not done without it.
+ */
+
+#include "pub_tool_basics.h"
+#include "pub_tool_execontext.h"
+#include "pub_tool_libcassert.h"
+#include "pub_tool_libcbase.h"
+#include "pub_tool_libcprint.h"
+#include "pub_tool_mallocfree.h"
+#include "pub_tool_options.h"
+#include "pub_tool_replacemalloc.h"
+#include "pub_tool_tooliface.h"
+#include "pub_tool_wordfm.h"
+#include "cg_arch.h"
+
+static Bool clo_heap_sites = False;  // --heap-sites=yes
+static Int clo_heap_sites_top = 10;  // sites printed at exit
+
+typedef struct {
+    ExeContext* ec;
+    ULong blocks;  // allocated here
+    ULong bytes;
+    CacheCC cc[2];  // data accesses to the blocks, [0 = read, 1 = write]
+    ULong ev1, wb1;  // D1 lines evicted, and their bytes never accessed
+    ULong evL, wbL;  // the same for LL
+} HeapSite;
+
+typedef struct {
+    Addr payload;
+    SizeT req_szB;  // never 0
+    HeapSite* site;
+} HeapBlock;
+
+// The live blocks.  They never overlap, so any overlap is a match.
+static WordFM* heap_blocks = NULL;  // HeapBlock* -> void
+// The allocation sites.
+static WordFM* heap_sites = NULL;   // ExeContext* -> HeapSite*
+
+// The two blocks found most recently, most recent first.
+static HeapBlock* heap_mru[2];
+
+// Stats
+static ULong heap_lookups = 0;
+static ULong heap_searches = 0;
+
+static Word cmp_HeapBlock(UWord k1, UWord k2)
+{
+    const HeapBlock* b1 = (const HeapBlock*)k1;
+    const HeapBlock* b2 = (const HeapBlock*)k2;
+
+    if (b1->payload + b1->req_szB <= b2->payload)
+        return -1;
+    if (b2->payload + b2->req_szB <= b1->payload)
+        return 1;
+    return 0;
+}
+
+// The live block holding 'a', or NULL.
+static HeapBlock* heap_find_block(Addr a)
+{
+    HeapBlock fake;
+    UWord found;
+
+    heap_lookups++;
+    if (heap_mru[0] && a - heap_mru[0]->payload < heap_mru[0]->req_szB)
+        return heap_mru[0];
+    if (heap_mru[1] && a - heap_mru[1]->payload < heap_mru[1]->req_szB) {
+        HeapBlock* tmp = heap_mru[0];
+        heap_mru[0] = heap_mru[1];
+        heap_mru[1] = tmp;
+        return heap_mru[0];
+    }
+    heap_searches++;
+    fake.payload = a;
+    fake.req_szB = 1;
+    if (!VG_(lookupFM)(heap_blocks, &found, NULL, (UWord)&fake))
+        return NULL;
+    heap_mru[1] = heap_mru[0];
+    heap_mru[0] = (HeapBlock*)found;
+    return heap_mru[0];
+}
+
+static void heap_add_block(HeapBlock* hb)
+{
+    Bool present = VG_(addToFM)(heap_blocks, (UWord)hb, 0);
+    tl_assert(!present);
+    heap_mru[0] = heap_mru[1] = NULL;
+}
+
+static void heap_remove_block(HeapBlock* hb)
+{
+    Bool found = VG_(delFromFM)(heap_blocks, NULL, NULL, (UWord)hb);
+    tl_assert(found);
+    heap_mru[0] = heap_mru[1] = NULL;
+}
+
+static HeapSite* heap_get_site(ThreadId tid)
+{
+    ExeContext* ec = VG_(record_ExeContext)(tid, 0);
+    HeapSite* site;
+
+    if (!VG_(lookupFM)(heap_sites, NULL, (UWord*)&site, (UWord)ec)) {
+        site = VG_(calloc)("cg.heap.site.1", 1, sizeof(HeapSite));
+        site->ec = ec;
+        VG_(addToFM)(heap_sites, (UWord)ec, (UWord)site);
+    }
+    return site;
+}
+
+/*------------------------------------------------------------*/
+/*--- malloc() et al replacement                           ---*/
+/*------------------------------------------------------------*/
+
+static void* heap_new_block(ThreadId tid, SizeT req_szB, SizeT req_alignB, Bool is_zeroed)
+{
+    HeapBlock* hb;
+    void* p;
+
+    if ((SSizeT)req_szB < 0)
+        return NULL;
+    if (req_szB == 0)
+        req_szB = 1;  // the interval map cannot hold empty blocks
+    p = VG_(cli_malloc)(req_alignB, req_szB);
+    if (p == NULL)
+        return NULL;
+    if (is_zeroed)
+        VG_(memset)(p, 0, req_szB);
+
+    hb = VG_(malloc)("cg.heap.block.1", sizeof(HeapBlock));
+    hb->payload = (Addr)p;
+    hb->req_szB = req_szB;
+    hb->site = heap_get_site(tid);
+    hb->site->blocks++;
+    hb->site->bytes += req_szB;
+    heap_add_block(hb);
+    return p;
+}
+
+static void heap_die_block(void* p)
+{
+    HeapBlock* hb = heap_find_block((Addr)p);
+
+    if (hb == NULL || hb->payload != (Addr)p)
+        return;  // bogus free
+    heap_remove_block(hb);
+    VG_(free)(hb);
+    VG_(cli_free)(p);
+}
+
+static void* heap_renew_block(ThreadId tid, void* p_old, SizeT new_req_szB)
+{
+    HeapBlock* hb = heap_find_block((Addr)p_old);
+    void* p_new;
+
+    if (hb == NULL || hb->payload != (Addr)p_old)
+        return NULL;  // bogus realloc
+    if (new_req_szB <= hb->req_szB) {
+        hb->req_szB = new_req_szB;
+        return p_old;
+    }
+    p_new = VG_(cli_malloc)(VG_(clo_alignment), new_req_szB);
+    if (p_new == NULL)
+        return NULL;
+    VG_(memcpy)(p_new, p_old, hb->req_szB);
+    VG_(cli_free)(p_old);
+
+    // The block keeps its allocation site, as the data is the same.
+    heap_remove_block(hb);
+    hb->site->bytes += new_req_szB - hb->req_szB;
+    hb->payload = (Addr)p_new;
+    hb->req_szB = new_req_szB;
+    heap_add_block(hb);
+    return p_new;
+}
+
+static void* heap_malloc(ThreadId tid, SizeT szB)
+{
+    return heap_new_block(tid, szB, VG_(clo_alignment), False);
+}
+
+static void* heap___builtin_new(ThreadId tid, SizeT szB)
+{
+    return heap_new_block(tid, szB, VG_(clo_alignment), False);
+}
+
+static void* heap___builtin_new_aligned(ThreadId tid, SizeT szB, SizeT alignB)
+{
+    return heap_new_block(tid, szB, alignB, False);
+}
+
+static void* heap___builtin_vec_new(ThreadId tid, SizeT szB)
+{
+    return heap_new_block(tid, szB, VG_(clo_alignment), False);
+}
+
+static void* heap___builtin_vec_new_aligned(ThreadId tid, SizeT szB, SizeT alignB)
+{
+    return heap_new_block(tid, szB, alignB, False);
+}
+
+static void* heap_calloc(ThreadId tid, SizeT m, SizeT szB)
+{
+    return heap_new_block(tid, m * szB, VG_(clo_alignment), True);
+}
+
+static void* heap_memalign(ThreadId tid, SizeT alignB, SizeT szB)
+{
+    return heap_new_block(tid, szB, alignB, False);
+}
+
+static void heap_free(ThreadId tid, void* p)
+{
+    heap_die_block(p);
+}
+
+static void heap___builtin_delete(ThreadId tid, void* p)
+{
+    heap_die_block(p);
+}
+
+static void heap___builtin_delete_aligned(ThreadId tid, void* p, SizeT align)
+{
+    heap_die_block(p);
+}
+
+static void heap___builtin_vec_delete(ThreadId tid, void* p)
+{
+    heap_die_block(p);
+}
+
+static void heap___builtin_vec_delete_aligned(ThreadId tid, void* p, SizeT align)
+{
+    heap_die_block(p);
+}
+
+static void* heap_realloc(ThreadId tid, void* p_old, SizeT new_szB)
+{
+    if (p_old == NULL)
+        return heap_malloc(tid, new_szB);
+    if (new_szB == 0) {
+        heap_free(tid, p_old);
+        return NULL;
+    }
+    return heap_renew_block(tid, p_old, new_szB);
+}
+
+static SizeT heap_malloc_usable_size(ThreadId tid, void* p)
+{
+    HeapBlock* hb = heap_find_block((Addr)p);
+    return hb ? hb->req_szB : 0;
+}
+
+/*------------------------------------------------------------*/
+/*--- Accesses and evictions                               ---*/
+/*------------------------------------------------------------*/
+
+// Called from log_mem_access for every data access.
+static __attribute__((noinline)) void heap_note_access(Addr a, AccessType type, CacheHitType hit_type)
+{
+    HeapBlock* hb = heap_find_block(a);
+    CacheCC* cc;
+
+    if (hb == NULL)
+        return;
+    cc = &hb->site->cc[type == ACCESS_WRITE];
+    cc->a++;
+    if (hit_type != CACHE_HIT_L1)
+        cc->m1++;
+    if (hit_type == CACHE_MISS_LL)
+        cc->mL++;
+}
+
+// Called from cg_sim.c for every D1 and LL line evicted.
+static void heapsim_note_eviction(Addr a, Int wasted, Bool llc)
+{
+    HeapBlock* hb = heap_find_block(a);
+
+    if (hb == NULL)
+        return;
+    if (llc) {
+        hb->site->evL++;
+        hb->site->wbL += wasted;
+    } else {
+        hb->site->ev1++;
+        hb->site->wb1 += wasted;
+    }
+}
+
+/*------------------------------------------------------------*/
+/*--- Options and setup                                    ---*/
+/*------------------------------------------------------------*/
+
+static Bool heap_process_option(const HChar* arg)
+{
+    if VG_BOOL_CLO (arg, "--heap-sites", clo_heap_sites) {
+    } else if VG_BINT_CLO (arg, "--heap-sites-top", clo_heap_sites_top, 1, 1000000) {
+    } else
+        return VG_(replacement_malloc_process_cmd_line_option)(arg);
+    return True;
+}
+
+static void heap_print_usage(void)
+{
+    VG_(printf)(
+            "    --heap-sites=yes|no              charge data accesses, misses and wasted\n"
+            "                                     bytes to the allocation sites of the heap\n"
+            "                                     blocks accessed? [no]\n"
+            "    --heap-sites-top=<n>             allocation sites printed at exit [10]\n");
+}
+
+static void heap_init(void)
+{
+    heap_blocks = VG_(newFM)(VG_(malloc), "cg.heap.init.1", VG_(free), cmp_HeapBlock);
+    heap_sites = VG_(newFM)(VG_(malloc), "cg.heap.init.2", VG_(free), NULL);
+    VG_(needs_malloc_replacement)(heap_malloc, heap___builtin_new, heap___builtin_new_aligned, heap___builtin_vec_new,
+                                  heap___builtin_vec_new_aligned, heap_memalign, heap_calloc, heap_free,
+                                  heap___builtin_delete, heap___builtin_delete_aligned, heap___builtin_vec_delete,
+                                  heap___builtin_vec_delete_aligned, heap_realloc, heap_malloc_usable_size, 0);
+}
+
+/*------------------------------------------------------------*/
+/*--- Output                                               ---*/
+/*------------------------------------------------------------*/
+
+static ULong heap_site_misses(const HeapSite* site)
+{
+    return site->cc[0].m1 + site->cc[1].m1;
+}
+
+static Int cmp_HeapSite(const void* a, const void* b)
+{
+    const HeapSite* sa = *(const HeapSite* const*)a;
+    const HeapSite* sb = *(const HeapSite* const*)b;
+    ULong ma = heap_site_misses(sa), mb = heap_site_misses(sb);
+
+    if (ma != mb)
+        return ma < mb ? 1 : -1;
+    ma = sa->cc[0].mL + sa->cc[1].mL;
+    mb = sb->cc[0].mL + sb->cc[1].mL;
+    return ma < mb ? 1 : ma > mb ? -1 : 0;
+}
+
+// The allocation sites with the most D1 misses, with their share of the
+// misses of all data accesses, 'm1' and 'mL'.
+static void heap_print_sites(ULong m1, ULong mL)
+{
+    HeapSite** sites;
+    HeapSite* site;
+    UWord key, n = 0, i;
+
+    sites = VG_(malloc)("cg.heap.print.1", VG_(sizeFM)(heap_sites) * sizeof(HeapSite*) + 1);
+    VG_(initIterFM)(heap_sites);
+    while (VG_(nextIterFM)(heap_sites, &key, (UWord*)&site))
+        sites[n++] = site;
+    VG_(doneIterFM)(heap_sites);
+    VG_(ssort)(sites, n, sizeof(HeapSite*), cmp_HeapSite);
+
+    VG_(umsg)("\n");
+    VG_(umsg)("Heap allocation sites with the most D1 misses:\n");
+    for (i = 0; i < n && i < clo_heap_sites_top; i++) {
+        const CacheCC* rd = &sites[i]->cc[0];
+        const CacheCC* wr = &sites[i]->cc[1];
+        site = sites[i];
+        VG_(umsg)("\n");
+        VG_(umsg)("%lu: %llu blocks, %llu bytes\n", i + 1, site->blocks, site->bytes);
+        VG_(umsg)("  D refs %llu (%llu rd + %llu wr)\n", rd->a + wr->a, rd->a, wr->a);
+        VG_(umsg)("  D1 misses %llu (%.1f%% of all), LLd misses %llu (%.1f%% of all)\n", rd->m1 + wr->m1,
+                  m1 ? (rd->m1 + wr->m1) * 100.0 / m1 : 0.0, rd->mL + wr->mL,
+                  mL ? (rd->mL + wr->mL) * 100.0 / mL : 0.0);
+        VG_(umsg)("  D1 wasted %.1f B/eviction (%llu evictions), LLd wasted %.1f B/eviction (%llu evictions)\n",
+                  site->ev1 ? site->wb1 * 1.0 / site->ev1 : 0.0, site->ev1,
+                  site->evL ? site->wbL * 1.0 / site->evL : 0.0, site->evL);
+        VG_(pp_ExeContext)(site->ec);
+    }
+    VG_(free)(sites);
+}
+
+static void heap_print_stats(void)
+{
+    VG_(dmsg)("cachegrind: heap sites     : %lu\n", VG_(sizeFM)(heap_sites));
+    VG_(dmsg)("cachegrind: heap lookups   : %llu\n", heap_lookups);
+    VG_(dmsg)("cachegrind: heap searches  : %llu\n", heap_searches);
+}
+
+/*--------------------------------------------------------------------*/
+/*--- end                                                cg_heap.c ---*/
+/*--------------------------------------------------------------------*/
@@ -42,14 +42,17 @@
 #include "pub_tool_threadstate.h"
 #include "pub_tool_tooliface.h"
 #include "pub_tool_xarray.h"
+#include "cachegrind.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include "cg_arch.h"
 #include "cg_branchpred.c"
-#include "cg_mem_logger.c"
 #include "cg_segmap.c"
+#include "cg_heap.c"
+#include "cg_mem_logger.c"
 #include "cg_sim.c"
+#include "cg_tlb.c"
 
 /*------------------------------------------------------------*/
 /*--- Constants                                            ---*/
@@ -65,6 +68,20 @@
 static Bool clo_cache_sim = True;   /* do cache simulation? */
 static Bool clo_branch_sim = False; /* do branch simulation? */
 static Bool clo_mem_log = False;    /* do memory logging? */
+static Bool clo_mem_log_drain = False; /* encode and write the log in a helper process? */
+static UInt clo_mem_log_ring_mb = 64;  /* size of the ring shared with that process */
+static Bool clo_regions = False;       /* classify data accesses by region? */
+static Bool clo_wasted_bytes = False;  /* charge unused bytes of evicted lines to their loader? */
+static Int clo_cores = 0;              /* simulated cores with private L1s, 0 for one shared L1 */
+static const HChar* clo_core_map = NULL; /* cores of threads 1, 2, ...; the rest round robin */
+static CacheLevelConfig clo_cache_levels[MAX_MID_LEVELS]; /* --cache-level, from the top */
+static Int clo_n_cache_levels = 0;
+static UChar clo_LL_inclusion = CACHE_NINE;
+static const HChar* clo_replacement = NULL; /* replacement policies, lru if not given */
+static Long clo_replacement_seed = 1;       /* seed of --replacement=random */
+static const HChar* clo_prefetch = NULL;    /* prefetchers, none if not given */
+static Long clo_prefetch_latency = 50;      /* data accesses a prefetch takes */
+static Int clo_ras = 0;                     /* return stack entries, 0 to ignore returns */
 static const HChar* clo_cachegrind_out_file = "cachegrind.out.%p";
 static const HChar* clo_cachegrind_mem_file = "cachegrind.mem.%p";
 /*------------------------------------------------------------*/
@@ -102,6 +119,7 @@ typedef struct {
     CacheCC Dw;  /* Data write/modify counts */
     BranchCC Bc; /* Conditional branch counts */
     BranchCC Bi; /* Indirect branch counts */
+    struct _LineSnap* interval; /* with --interval, see "Interval snapshots" */
 } LineCC;
 
 // First compare file, then fn, then line.
@@ -137,13 +155,15 @@ typedef struct _InstrInfo InstrInfo;
 struct _InstrInfo {
     Addr instr_addr;
     UChar instr_len;
-    LineCC* parent;  // parent line-CC
+    UInt mem_log_id;  // id in the --mem-log trace, 0 if not logging
+    LineCC* parent;   // parent line-CC
 };
 
 typedef struct _SB_info SB_info;
 struct _SB_info {
     Addr SB_addr;  // key;  MUST BE FIRST
     Int n_instrs;
+    UWord interval_epoch;  // with --interval, the interval it last ran in
     InstrInfo instrs[0];
 };
 
@@ -270,16 +290,279 @@ static LineCC* get_lineCC(Addr origAddr)
         lineCC->Dw.m1 = 0;
         lineCC->Dw.mL = 0;
         lineCC->Dw.l1_words = lineCC->Dw.llc_words = 0;
+        lineCC->Dr.ev1 = lineCC->Dr.wb1 = lineCC->Dr.evL = lineCC->Dr.wbL = 0;
+        lineCC->Dw.ev1 = lineCC->Dw.wb1 = lineCC->Dw.evL = lineCC->Dw.wbL = 0;
+        lineCC->Dr.inv = lineCC->Dr.fs = lineCC->Dr.cm = 0;
+        lineCC->Dw.inv = lineCC->Dw.fs = lineCC->Dw.cm = 0;
+        lineCC->Dr.pf = lineCC->Dr.pfu = lineCC->Dr.pfl = 0;
+        lineCC->Dw.pf = lineCC->Dw.pfu = lineCC->Dw.pfl = 0;
+        lineCC->Ir.tm = lineCC->Ir.tw = 0;
+        lineCC->Dr.tm = lineCC->Dr.tw = 0;
+        lineCC->Dw.tm = lineCC->Dw.tw = 0;
+        VG_(memset)(lineCC->Ir.mm, 0, sizeof(lineCC->Ir.mm));
+        VG_(memset)(lineCC->Dr.mm, 0, sizeof(lineCC->Dr.mm));
+        VG_(memset)(lineCC->Dw.mm, 0, sizeof(lineCC->Dw.mm));
         lineCC->Bc.b = 0;
         lineCC->Bc.mp = 0;
         lineCC->Bi.b = 0;
         lineCC->Bi.mp = 0;
+        lineCC->interval = NULL;
         VG_(OSetGen_Insert)(CC_table, lineCC);
     }
 
     return lineCC;
 }
 
+/*------------------------------------------------------------*/
+/*--- Cache hierarchy                                      ---*/
+/*------------------------------------------------------------*/
+
+// Parses --cache-level=<name>:<size>,<assoc>,<line_size>[,<inclusion>].
+static void parse_cache_level(const HChar* arg, const HChar* val)
+{
+    const HChar* colon = VG_(strchr)(val, ':');
+    CacheLevelConfig* lc;
+    HChar spec[64];
+    HChar* p;
+    Int i, commas;
+
+    if (clo_n_cache_levels == MAX_MID_LEVELS)
+        VG_(fmsg_bad_option)(arg, "At most %d cache levels can be added\n", MAX_MID_LEVELS);
+    lc = &clo_cache_levels[clo_n_cache_levels++];
+    if (colon == NULL || colon == val || colon - val >= sizeof(lc->name) || VG_(strlen)(colon + 1) >= sizeof(spec))
+        VG_(fmsg_bad_option)(arg, "Expected <name>:<size>,<assoc>,<line_size>[,<inclusion>]\n");
+    VG_(strncpy)(lc->name, val, colon - val);
+    lc->name[colon - val] = '\0';
+    for (p = lc->name; *p; p++) {
+        if (!VG_(isdigit)(*p) && !(*p >= 'A' && *p <= 'Z') && !(*p >= 'a' && *p <= 'z'))
+            VG_(fmsg_bad_option)(arg, "A cache level name has only letters and digits\n");
+    }
+    if (VG_(strcmp)(lc->name, "I1") == 0 || VG_(strcmp)(lc->name, "D1") == 0 || VG_(strcmp)(lc->name, "L1") == 0 ||
+        VG_(strcmp)(lc->name, "LL") == 0 || VG_(strcmp)(lc->name, "L") == 0)
+        VG_(fmsg_bad_option)(arg, "Cache level %s already exists\n", lc->name);
+    for (i = 0; i < clo_n_cache_levels - 1; i++) {
+        if (VG_(strcmp)(lc->name, clo_cache_levels[i].name) == 0)
+            VG_(fmsg_bad_option)(arg, "Cache level %s is given twice\n", lc->name);
+    }
+
+    // An optional fourth field is the inclusion policy.
+    VG_(strcpy)(spec, colon + 1);
+    lc->inclusion = CACHE_NINE;
+    for (p = spec, commas = 0; *p; p++) {
+        if (*p == ',' && ++commas == 3) {
+            *p = '\0';
+            if (VG_(strcmp)(p + 1, "inclusive") == 0)
+                lc->inclusion = CACHE_INCLUSIVE;
+            else if (VG_(strcmp)(p + 1, "exclusive") == 0)
+                lc->inclusion = CACHE_EXCLUSIVE;
+            else if (VG_(strcmp)(p + 1, "nine") != 0)
+                VG_(fmsg_bad_option)(arg, "The inclusion policy is nine, inclusive or exclusive\n");
+            break;
+        }
+    }
+    VG_(parse_cache_clo_value)(arg, spec, &lc->config);
+}
+
+// Inclusive and exclusive levels track the lines of the levels above by tag,
+// which only works if they have the same line size.
+static void check_cache_levels(const cache_t* I1c, const cache_t* D1c, const cache_t* LLc)
+{
+    Int i, line_size = I1c->line_size;
+    Bool same = I1c->line_size == D1c->line_size;
+
+    for (i = 0; i <= clo_n_cache_levels; i++) {
+        const cache_t* c = i < clo_n_cache_levels ? &clo_cache_levels[i].config : LLc;
+        UChar inclusion = i < clo_n_cache_levels ? clo_cache_levels[i].inclusion : clo_LL_inclusion;
+        if (inclusion != CACHE_NINE && (!same || c->line_size != line_size)) {
+            VG_(umsg)("Cachegrind: cannot continue: the %s cache is %s, but its line size (%d)\n",
+                      i < clo_n_cache_levels ? clo_cache_levels[i].name : "LL", cachesim_inclusion_name(inclusion),
+                      c->line_size);
+            VG_(umsg)("  differs from that of the levels above it.  Exiting now.\n");
+            VG_(exit)(1);
+        }
+        same = same && c->line_size == line_size;
+    }
+}
+
+// Parses an option of the form [<level>:]<value>,..., giving a value to
+// each cache level from the top, as in CacheSimConfig: --replacement and
+// --prefetch.  A value without a level is for all levels, or for D1 only if
+// not 'for_all'.  Later items override earlier ones.  Levels are left as
+// they are unless given.
+static void parse_level_option(const HChar* opt, const HChar* val, UChar* values, Int (*parse)(const HChar*),
+                               const HChar* expected, Bool for_all)
+{
+    Int n_levels = clo_n_cache_levels + 3;
+    HChar spec[256];
+    HChar *item, *save;
+    Int i;
+
+    if (val == NULL)
+        return;
+    if (VG_(strlen)(val) >= sizeof(spec))
+        VG_(fmsg_bad_option)(opt, "Too long\n");
+    VG_(strcpy)(spec, val);
+    for (item = VG_(strtok_r)(spec, ",", &save); item; item = VG_(strtok_r)(NULL, ",", &save)) {
+        HChar* colon = VG_(strchr)(item, ':');
+        Int value = parse(colon ? colon + 1 : item);
+        Int level = -1;
+
+        if (value < 0)
+            VG_(fmsg_bad_option)(opt, "Unknown value in '%s': expected %s\n", item, expected);
+        if (colon == NULL) {
+            for (i = for_all ? 0 : 1; i < (for_all ? n_levels : 2); i++)
+                values[i] = value;
+            continue;
+        }
+        *colon = '\0';
+        if (VG_(strcmp)(item, "I1") == 0 && for_all)
+            level = 0;
+        else if (VG_(strcmp)(item, "D1") == 0)
+            level = 1;
+        else if (VG_(strcmp)(item, "LL") == 0)
+            level = n_levels - 1;
+        for (i = 0; i < clo_n_cache_levels; i++) {
+            if (VG_(strcmp)(item, clo_cache_levels[i].name) == 0)
+                level = i + 2;
+        }
+        if (level < 0)
+            VG_(fmsg_bad_option)(opt, "Unknown cache level '%s'\n", item);
+        values[level] = value;
+    }
+}
+
+// The events of a level are named after it without its 'L': I2mr for L2.
+static const HChar* level_event_suffix(Int level)
+{
+    const HChar* name = clo_cache_levels[level].name;
+    return name[0] == 'L' ? name + 1 : name;
+}
+
+/*------------------------------------------------------------*/
+/*--- Simulated cores                                      ---*/
+/*------------------------------------------------------------*/
+
+// Core of each thread, with --cores.
+static Int* core_of_thread;
+
+static void init_core_map(void)
+{
+    const HChar* p = clo_core_map;
+    ThreadId tid;
+
+    core_of_thread = VG_(malloc)("cg.cores.map", VG_N_THREADS * sizeof(Int));
+    for (tid = 0; tid < VG_N_THREADS; tid++)
+        core_of_thread[tid] = tid == 0 ? 0 : (tid - 1) % clo_cores;
+    for (tid = 1; p && *p && tid < VG_N_THREADS; tid++) {
+        HChar* end;
+        Long core = VG_(strtoll10)(p, &end);
+        if (end == p || core < 0 || core >= clo_cores || (*end != ',' && *end != '\0'))
+            VG_(fmsg_bad_option)("--core-map", "expected a list of cores below %d\n", clo_cores);
+        core_of_thread[tid] = core;
+        p = *end ? end + 1 : end;
+    }
+}
+
+static void cg_start_client_code(ThreadId tid, ULong blocks_dispatched)
+{
+    if (clo_mem_log)
+        mem_log_start_client_code(tid, blocks_dispatched);
+    if (clo_cores > 0)
+        cachesim_switch_core(core_of_thread[tid]);
+}
+
+// Cache lines with false sharing, and how often.
+typedef struct {
+    UWord block;
+    ULong count;
+} FalseSharing;
+
+static OSet* false_sharing_table = NULL;
+
+static void cachesim_note_false_sharing(UWord block)
+{
+    FalseSharing* fs;
+
+    if (false_sharing_table == NULL)
+        false_sharing_table =
+                VG_(OSetGen_Create)(offsetof(FalseSharing, block), NULL, VG_(malloc), "cg.fs.1", VG_(free));
+    fs = VG_(OSetGen_Lookup)(false_sharing_table, &block);
+    if (fs == NULL) {
+        fs = VG_(OSetGen_AllocNode)(false_sharing_table, sizeof(FalseSharing));
+        fs->block = block;
+        fs->count = 0;
+        VG_(OSetGen_Insert)(false_sharing_table, fs);
+    }
+    fs->count++;
+}
+
+static Int cmp_FalseSharing(const void* a, const void* b)
+{
+    ULong ca = (*(const FalseSharing* const*)a)->count;
+    ULong cb = (*(const FalseSharing* const*)b)->count;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+// The prefetches of level k, summed over the cores for private levels.
+static void prefetch_totals(Int k, ULong* issued, ULong* useful, ULong* late)
+{
+    Int core, cores = k > n_mid_levels || sim_cores == 0 ? 1 : sim_cores;
+
+    *issued = *useful = *late = 0;
+    for (core = 0; core < cores; core++) {
+        cache_t2* c = k > n_mid_levels ? &LL : k == 0 ? cachesim_core_D1(core) : cachesim_core_mid(core, k - 1);
+        if (c->pf == NULL)
+            continue;
+        *issued += c->pf->issued;
+        *useful += c->pf->useful;
+        *late += c->pf->late;
+    }
+}
+
+static void print_prefetch_stats(void)
+{
+    ULong issued, useful, late;
+    Int k;
+
+    VG_(umsg)("\n");
+    for (k = 0; k <= n_mid_levels + 1; k++) {
+        const HChar* name = k == 0 ? "D1" : k <= n_mid_levels ? clo_cache_levels[k - 1].name : "LL";
+        if (cachesim_level(k)->pf == NULL)
+            continue;
+        prefetch_totals(k, &issued, &useful, &late);
+        VG_(umsg)("%s prefetches: %llu issued, %llu useful, %llu late (%.1f%% accuracy)\n", name, issued, useful,
+                  late, issued ? (useful + late) * 100.0 / issued : 0.0);
+    }
+}
+
+// The lines invalidated most often by false sharing, with the data
+// symbol they start in, if any.
+static void print_false_sharing(void)
+{
+    FalseSharing** lines;
+    FalseSharing* fs;
+    UInt n = 0, i;
+
+    if (false_sharing_table == NULL)
+        return;
+    lines = VG_(malloc)("cg.fs.2", VG_(OSetGen_Size)(false_sharing_table) * sizeof(FalseSharing*));
+    VG_(OSetGen_ResetIter)(false_sharing_table);
+    while ((fs = VG_(OSetGen_Next)(false_sharing_table)))
+        lines[n++] = fs;
+    VG_(ssort)(lines, n, sizeof(FalseSharing*), cmp_FalseSharing);
+    VG_(umsg)("Lines with the most false sharing:\n");
+    for (i = 0; i < n && i < 10; i++) {
+        Addr a = lines[i]->block << D1.line_size_bits;
+        const HChar* name;
+        PtrdiffT offset;
+        if (VG_(get_datasym_and_offset)(VG_(current_DiEpoch)(), a, &name, &offset))
+            VG_(umsg)("  %#lx %12llu  %s+%ld\n", a, lines[i]->count, name, (long)offset);
+        else
+            VG_(umsg)("  %#lx %12llu\n", a, lines[i]->count);
+    }
+    VG_(free)(lines);
+}
+
 /*------------------------------------------------------------*/
 /*--- Cache simulation functions                           ---*/
 /*------------------------------------------------------------*/
@@ -363,7 +646,8 @@ static VG_REGPARM(3) void log_1IrNoX_1Dr_cache_access(InstrInfo* n, Addr data_ad
     //            n, n->instr_addr, n->instr_len, data_addr, data_size);
     cachesim_I1_doref_NoX(n->instr_addr, n->instr_len, &n->parent->Ir);
 
-    cachesim_D1_doref(data_addr, data_size, &n->parent->Dr, ACCESS_READ);
+    mem_log_instr = n->mem_log_id;
+    cachesim_D1_doref(data_addr, data_size, &n->parent->Dr, ACCESS_READ, n->instr_addr);
 }
 
 static VG_REGPARM(3) void log_1IrNoX_1Dw_cache_access(InstrInfo* n, Addr data_addr, Word data_size)
@@ -373,7 +657,8 @@ static VG_REGPARM(3) void log_1IrNoX_1Dw_cache_access(InstrInfo* n, Addr data_ad
     //            n, n->instr_addr, n->instr_len, data_addr, data_size);
     cachesim_I1_doref_NoX(n->instr_addr, n->instr_len, &n->parent->Ir);
 
-    cachesim_D1_doref(data_addr, data_size, &n->parent->Dw, ACCESS_WRITE);
+    mem_log_instr = n->mem_log_id;
+    cachesim_D1_doref(data_addr, data_size, &n->parent->Dw, ACCESS_WRITE, n->instr_addr);
 }
 
 /* Note that addEvent_D_guarded assumes that log_0Ir_1Dr_cache_access
@@ -383,7 +668,8 @@ static VG_REGPARM(3) void log_0Ir_1Dr_cache_access(InstrInfo* n, Addr data_addr,
 {
     //VG_(printf)("0Ir_1Dr:  CCaddr=0x%010lx,  daddr=0x%010lx,  dsize=%lu\n",
     //            n, data_addr, data_size);
-    cachesim_D1_doref(data_addr, data_size, &n->parent->Dr, ACCESS_READ);
+    mem_log_instr = n->mem_log_id;
+    cachesim_D1_doref(data_addr, data_size, &n->parent->Dr, ACCESS_READ, n->instr_addr);
 }
 
 /* See comment on log_0Ir_1Dr_cache_access. */
@@ -391,7 +677,8 @@ static VG_REGPARM(3) void log_0Ir_1Dw_cache_access(InstrInfo* n, Addr data_addr,
 {
     //VG_(printf)("0Ir_1Dw:  CCaddr=0x%010lx,  daddr=0x%010lx,  dsize=%lu\n",
     //            n, data_addr, data_size);
-    cachesim_D1_doref(data_addr, data_size, &n->parent->Dw, ACCESS_WRITE);
+    mem_log_instr = n->mem_log_id;
+    cachesim_D1_doref(data_addr, data_size, &n->parent->Dw, ACCESS_WRITE, n->instr_addr);
 }
 
 /* For branches, we consult two different predictors, one which
@@ -415,6 +702,541 @@ static VG_REGPARM(2) void log_ind_branch(InstrInfo* n, UWord actual_dst)
     n->parent->Bi.mp += (1 & do_ind_branch_predict(n->instr_addr, actual_dst));
 }
 
+/* With --ras=<n>, a return stack buffer of <n> entries predicts the
+   target of function returns, which are then counted as indirect
+   branches.  It is a ring, so that once it overflows the oldest return
+   addresses are lost, and once it underflows it predicts stale ones.
+   It relies on the calls and returns Vex finds: code which returns
+   elsewhere than to its caller, or calls to get its own address, upsets
+   it as it does a real one. */
+static Addr* ras;
+static UInt ras_top = 0;
+
+static void ras_push(Addr return_addr)
+{
+    ras_top = (ras_top + 1) % clo_ras;
+    ras[ras_top] = return_addr;
+}
+
+static ULong do_ret_predict(Addr actual)
+{
+    Addr predicted = ras[ras_top];
+
+    ras_top = (ras_top + clo_ras - 1) % clo_ras;
+    return predicted != actual ? 1 : 0;
+}
+
+static VG_REGPARM(2) void log_ind_call(InstrInfo* n, UWord actual_dst)
+{
+    log_ind_branch(n, actual_dst);
+    ras_push(n->instr_addr + n->instr_len);
+}
+
+static VG_REGPARM(1) void log_call(InstrInfo* n)
+{
+    ras_push(n->instr_addr + n->instr_len);
+}
+
+static VG_REGPARM(2) void log_ret_branch(InstrInfo* n, UWord actual_dst)
+{
+    n->parent->Bi.b++;
+    n->parent->Bi.mp += (1 & do_ret_predict(actual_dst));
+}
+
+/*------------------------------------------------------------*/
+/*--- Output events                                        ---*/
+/*------------------------------------------------------------*/
+
+// The most events a line can have, see get_event_values.
+#define MAX_EVENTS (1 + 14 + 4 + 4 + 3 + 3 + 3 * MAX_MID_LEVELS + 4)
+
+// The "desc:" lines (giving I1/D1/LL cache configuration) and "cmd:" line
+// which start the output files.  The spaces after the 2nd colon makes
+// cg_annotate's output look nicer.
+static void fprint_desc_and_cmd(VgFile* fp)
+{
+    Int i;
+
+    VG_(fprintf)(fp,
+                 "desc: I1 cache:         %s\n"
+                 "desc: D1 cache:         %s\n",
+                 I1.desc_line, D1.desc_line);
+    for (i = 0; i < n_mid_levels; i++)
+        VG_(fprintf)(fp, "desc: %s cache:%*s%s\n", clo_cache_levels[i].name,
+                     (Int)(11 - VG_(strlen)(clo_cache_levels[i].name)), "", mid_levels[i].desc_line);
+    VG_(fprintf)(fp, "desc: LL cache:         %s\n", LL.desc_line);
+    if (sim_tlb)
+        tlbsim_fprint_desc(fp);
+    segmap_fprint_desc(fp);
+
+    VG_(fprintf)(fp, "cmd: %s", VG_(args_the_exename));
+    for (i = 0; i < VG_(sizeXA)(VG_(args_for_client)); i++) {
+        HChar* arg = *(HChar**)VG_(indexXA)(VG_(args_for_client), i);
+        VG_(fprintf)(fp, " %s", arg);
+    }
+    VG_(fprintf)(fp, "\n");
+}
+
+// The "events:" line, naming the counts get_event_values gives.
+static void fprint_event_names(VgFile* fp)
+{
+    Int i;
+
+    VG_(fprintf)(fp, "events: Ir");
+    if (clo_cache_sim)
+        VG_(fprintf)(fp, " I1mr ILmr I1u ILu Dr D1mr DLmr D1ru DLru Dw D1mw DLmw D1wu DLwu");
+    if (clo_branch_sim)
+        VG_(fprintf)(fp, " Bc Bcm Bi Bim");
+    // Lines evicted from D1 and LL, and their bytes never accessed, charged
+    // to the data accesses that loaded them.
+    if (clo_wasted_bytes)
+        VG_(fprintf)(fp, " D1ev D1wb DLev DLwb");
+    // Invalidations of other cores' copies, false sharing among them, and
+    // coherence misses.
+    if (clo_cores > 0)
+        VG_(fprintf)(fp, " Dinv Dfs Dcm");
+    // Prefetches triggered, and those useful or late.
+    if (sim_prefetch)
+        VG_(fprintf)(fp, " Dpf Dpfu Dpfl");
+    // Misses in each --cache-level level, eg. "I2mr D2mr D2mw" for L2.
+    for (i = 0; i < n_mid_levels; i++) {
+        const HChar* s = level_event_suffix(i);
+        VG_(fprintf)(fp, " I%smr D%smr D%smw", s, s, s);
+    }
+    // TLB misses and page walks.
+    if (sim_tlb)
+        VG_(fprintf)(fp, " ITm ITw DTm DTw");
+    VG_(fprintf)(fp, "\n");
+}
+
+// Puts the counts of 'lineCC' in 'v', in "events:" line order, and returns
+// how many there are.
+static Int get_event_values(const LineCC* lineCC, ULong* v)
+{
+    Int i, n = 0;
+
+    v[n++] = lineCC->Ir.a;
+    if (clo_cache_sim) {
+        v[n++] = lineCC->Ir.m1;
+        v[n++] = lineCC->Ir.mL;
+        v[n++] = lineCC->Ir.l1_words;
+        v[n++] = lineCC->Ir.llc_words;
+        v[n++] = lineCC->Dr.a;
+        v[n++] = lineCC->Dr.m1;
+        v[n++] = lineCC->Dr.mL;
+        v[n++] = lineCC->Dr.l1_words;
+        v[n++] = lineCC->Dr.llc_words;
+        v[n++] = lineCC->Dw.a;
+        v[n++] = lineCC->Dw.m1;
+        v[n++] = lineCC->Dw.mL;
+        v[n++] = lineCC->Dw.l1_words;
+        v[n++] = lineCC->Dw.llc_words;
+    }
+    if (clo_branch_sim) {
+        v[n++] = lineCC->Bc.b;
+        v[n++] = lineCC->Bc.mp;
+        v[n++] = lineCC->Bi.b;
+        v[n++] = lineCC->Bi.mp;
+    }
+    if (clo_wasted_bytes) {
+        v[n++] = lineCC->Dr.ev1 + lineCC->Dw.ev1;
+        v[n++] = lineCC->Dr.wb1 + lineCC->Dw.wb1;
+        v[n++] = lineCC->Dr.evL + lineCC->Dw.evL;
+        v[n++] = lineCC->Dr.wbL + lineCC->Dw.wbL;
+    }
+    if (clo_cores > 0) {
+        v[n++] = lineCC->Dr.inv + lineCC->Dw.inv;
+        v[n++] = lineCC->Dr.fs + lineCC->Dw.fs;
+        v[n++] = lineCC->Dr.cm + lineCC->Dw.cm;
+    }
+    if (sim_prefetch) {
+        v[n++] = lineCC->Dr.pf + lineCC->Dw.pf;
+        v[n++] = lineCC->Dr.pfu + lineCC->Dw.pfu;
+        v[n++] = lineCC->Dr.pfl + lineCC->Dw.pfl;
+    }
+    for (i = 0; i < n_mid_levels; i++) {
+        v[n++] = lineCC->Ir.mm[i];
+        v[n++] = lineCC->Dr.mm[i];
+        v[n++] = lineCC->Dw.mm[i];
+    }
+    if (sim_tlb) {
+        v[n++] = lineCC->Ir.tm;
+        v[n++] = lineCC->Ir.tw;
+        v[n++] = lineCC->Dr.tm + lineCC->Dw.tm;
+        v[n++] = lineCC->Dr.tw + lineCC->Dw.tw;
+    }
+    tl_assert(n <= MAX_EVENTS);
+    return n;
+}
+
+// How many counts get_event_values gives.
+static Int get_n_events(void)
+{
+    LineCC zero;
+    ULong v[MAX_EVENTS];
+
+    VG_(memset)(&zero, 0, sizeof(zero));
+    return get_event_values(&zero, v);
+}
+
+/*------------------------------------------------------------*/
+/*--- Interval snapshots                                   ---*/
+/*------------------------------------------------------------*/
+
+/* With --interval=<n>, the counts are appended to the file given by
+   --interval-out-file every <n> guest instructions, or every <n>
+   milliseconds with --interval=<n>ms.  After the header of a
+   cachegrind.out file and an "interval:" line, each snapshot is
+
+     snapshot: <seq> <instructions> <ms>
+     fn <id> <file>:<fn>      the first time a function's counts change
+     <id> <counts>            each function whose counts changed
+     total: <counts>
+
+   where the counts are the changes since the previous snapshot, in the
+   order of the "events:" line, without trailing zeros.  So the counts of
+   a phase are the sum of its snapshots.  cg_annotate --phase shows a
+   phase.
+
+   A snapshot only looks at the lines which ran since the previous one.
+   The first time a superblock runs in an interval, which it checks
+   inline against interval_epoch, it puts the lines of its instructions
+   on the interval_touched list.  With --wasted-bytes=yes or --prefetch,
+   counts are also charged to lines which did not run: evicted bytes to
+   the access which loaded the line, prefetch outcomes to the access
+   which triggered the prefetch.  Then a snapshot looks at every line.
+
+   Guest instructions are counted at the entry of each superblock, from an
+   inline countdown; interval_tick is only called when it runs out.  So a
+   snapshot is taken at the first superblock boundary after its
+   instruction, or, in ms mode, within INTERVAL_MS_CHECK instructions of
+   its time. */
+
+#define INTERVAL_MS_CHECK 100000   // instructions between reads of the timer
+#define INTERVAL_MAX_CHUNK 0x40000000 // the countdown fits a 32 bit Word
+
+static ULong clo_interval = 0; /* instructions or ms between snapshots, 0 for none */
+static Bool clo_interval_ms = False;
+static const HChar* clo_interval_out_file = "cachegrind.intervals.%p";
+
+static Word interval_left = 0;   /* instructions until interval_tick, counted down inline */
+static Word interval_loaded = 0; /* what interval_left started from */
+static ULong interval_instrs = 0; /* instructions counted until interval_left was loaded */
+static ULong interval_next = 0;   /* instructions or ms of the next snapshot */
+static UInt interval_start_ms = 0;
+static UInt interval_seq = 0;
+static Int interval_fd = -1;
+static Int interval_n_events = 0;
+static UInt interval_n_fns = 0;
+static UWord interval_epoch = 1; /* bumped by every snapshot */
+
+// A function with lines in the snapshots, keyed by its file and function
+// name pointers, which the string table makes unique.
+typedef struct {
+    HChar* file;
+    const HChar* fn;
+} FnKey;
+
+typedef struct _FnSnap {
+    FnKey key;
+    UInt id;                      /* 0 until the function's "fn" line is written */
+    UWord epoch;                  /* interval_epoch of the snapshot 'delta' is for */
+    ULong delta[MAX_EVENTS];      /* the changes in the counts of its lines */
+    struct _FnSnap* next_changed; /* in the functions of that snapshot */
+} FnSnap;
+
+static OSet* interval_fns = NULL;
+
+// The counts of a line at the last snapshot.
+typedef struct _LineSnap {
+    LineCC* line;
+    FnSnap* fn;
+    UWord epoch;                   /* interval_epoch when last put on interval_touched */
+    struct _LineSnap* next_touched;
+    ULong last[0];                 /* [interval_n_events] */
+} LineSnap;
+
+static LineSnap* interval_touched = NULL;
+
+static HChar interval_buf[65536];
+static Int interval_buf_used = 0;
+
+static Word cmp_FnKey_FnSnap(const void* vkey, const void* vsnap)
+{
+    const FnKey* a = (const FnKey*)vkey;
+    const FnKey* b = &((const FnSnap*)vsnap)->key;
+
+    if (a->file != b->file)
+        return (Addr)a->file < (Addr)b->file ? -1 : 1;
+    if (a->fn != b->fn)
+        return (Addr)a->fn < (Addr)b->fn ? -1 : 1;
+    return 0;
+}
+
+static void parse_interval(const HChar* arg, const HChar* val)
+{
+    HChar* end;
+    Long n = VG_(strtoll10)(val, &end);
+
+    clo_interval_ms = VG_(strcmp)(end, "ms") == 0;
+    if (n <= 0 || (*end != '\0' && !clo_interval_ms))
+        VG_(fmsg_bad_option)(arg, "Expected <n> instructions or <n>ms\n");
+    clo_interval = n;
+}
+
+// The stream is written a snapshot at a time, so that nothing is buffered
+// when the client forks.
+static void interval_flush(void)
+{
+    if (interval_buf_used > 0 && interval_fd >= 0)
+        VG_(write)(interval_fd, interval_buf, interval_buf_used);
+    interval_buf_used = 0;
+}
+
+static void interval_puts(const HChar* s)
+{
+    while (*s != '\0') {
+        if (interval_buf_used == sizeof(interval_buf))
+            interval_flush();
+        interval_buf[interval_buf_used++] = *s++;
+    }
+}
+
+// Writes " <count>" for the counts in 'v' up to the last non-zero one.
+static void interval_put_counts(const ULong* v)
+{
+    HChar buf[32];
+    Int i, n = interval_n_events;
+
+    while (n > 0 && v[n - 1] == 0)
+        n--;
+    for (i = 0; i < n; i++) {
+        VG_(sprintf)(buf, " %llu", v[i]);
+        interval_puts(buf);
+    }
+    interval_puts("\n");
+}
+
+static FnSnap* interval_fn(const LineCC* lineCC)
+{
+    FnKey key = {lineCC->loc.file, lineCC->loc.fn};
+    FnSnap* snap = VG_(OSetGen_Lookup)(interval_fns, &key);
+
+    if (snap == NULL) {
+        snap = VG_(OSetGen_AllocNode)(interval_fns, sizeof(FnSnap));
+        VG_(memset)(snap, 0, sizeof(FnSnap));
+        snap->key = key;
+        VG_(OSetGen_Insert)(interval_fns, snap);
+    }
+    return snap;
+}
+
+// Makes the next snapshot look at a line.
+static void interval_touch_line(LineCC* lineCC)
+{
+    LineSnap* snap = lineCC->interval;
+    SizeT szB = sizeof(LineSnap) + interval_n_events * sizeof(ULong);
+
+    if (snap == NULL) {
+        snap = VG_(malloc)("cg.interval.2", szB);
+        VG_(memset)(snap, 0, szB);
+        snap->line = lineCC;
+        snap->fn = interval_fn(lineCC);
+        lineCC->interval = snap;
+    }
+    if (snap->epoch != interval_epoch) {
+        snap->epoch = interval_epoch;
+        snap->next_touched = interval_touched;
+        interval_touched = snap;
+    }
+}
+
+// Called the first time a superblock runs in an interval.
+static VG_REGPARM(1) void interval_touch(SB_info* sbInfo)
+{
+    Int i;
+
+    sbInfo->interval_epoch = interval_epoch;
+    for (i = 0; i < sbInfo->n_instrs; i++)
+        interval_touch_line(sbInfo->instrs[i].parent);
+}
+
+// Writes the changes in the counts of one function, if any.
+static void interval_put_fn(FnSnap* snap, ULong* total)
+{
+    Bool changed = False;
+    HChar buf[32];
+    Int i;
+
+    for (i = 0; i < interval_n_events; i++) {
+        total[i] += snap->delta[i];
+        changed |= snap->delta[i] != 0;
+    }
+    if (!changed)
+        return;
+    if (snap->id == 0) {
+        snap->id = ++interval_n_fns;
+        VG_(sprintf)(buf, "fn %u ", snap->id);
+        interval_puts(buf);
+        interval_puts(snap->key.file);
+        interval_puts(":");
+        interval_puts(snap->key.fn);
+        interval_puts("\n");
+    }
+    VG_(sprintf)(buf, "%u", snap->id);
+    interval_puts(buf);
+    interval_put_counts(snap->delta);
+}
+
+static void interval_snapshot(ULong ms)
+{
+    ULong v[MAX_EVENTS], total[MAX_EVENTS];
+    FnSnap *fn, *changed = NULL;
+    LineSnap* snap;
+    LineCC* lineCC;
+    HChar buf[80];
+    Int i;
+
+    if (interval_fd < 0)
+        return;
+    VG_(sprintf)(buf, "snapshot: %u %llu %llu\n", ++interval_seq, interval_instrs + interval_loaded - interval_left,
+                 ms);
+    interval_puts(buf);
+
+    if (clo_wasted_bytes || sim_prefetch) {
+        VG_(OSetGen_ResetIter)(CC_table);
+        while ((lineCC = VG_(OSetGen_Next)(CC_table)))
+            interval_touch_line(lineCC);
+    }
+
+    // Sum the changes of the lines of each function.
+    for (snap = interval_touched; snap; snap = snap->next_touched) {
+        fn = snap->fn;
+        if (fn->epoch != interval_epoch) {
+            fn->epoch = interval_epoch;
+            VG_(memset)(fn->delta, 0, sizeof(fn->delta));
+            fn->next_changed = changed;
+            changed = fn;
+        }
+        get_event_values(snap->line, v);
+        for (i = 0; i < interval_n_events; i++) {
+            fn->delta[i] += v[i] - snap->last[i];
+            snap->last[i] = v[i];
+        }
+    }
+    interval_touched = NULL;
+    interval_epoch++;
+
+    VG_(memset)(total, 0, sizeof(total));
+    for (fn = changed; fn; fn = fn->next_changed)
+        interval_put_fn(fn, total);
+    interval_puts("total:");
+    interval_put_counts(total);
+    interval_flush();
+}
+
+// Loads the countdown with the instructions until interval_tick is next
+// needed.
+static void interval_reload(void)
+{
+    ULong left;
+
+    interval_instrs += interval_loaded - interval_left;
+    left = clo_interval_ms ? INTERVAL_MS_CHECK : interval_next - interval_instrs;
+    interval_loaded = interval_left = (Word)(left < INTERVAL_MAX_CHUNK ? left : INTERVAL_MAX_CHUNK);
+}
+
+static VG_REGPARM(0) void interval_tick(void)
+{
+    ULong now, ms = VG_(read_millisecond_timer)() - interval_start_ms;
+
+    now = clo_interval_ms ? ms : interval_instrs + interval_loaded - interval_left;
+    if (now >= interval_next) {
+        interval_snapshot(ms);
+        interval_next = (now / clo_interval + 1) * clo_interval;
+    }
+    interval_reload();
+}
+
+// Creates the file, named now so that a forked child gets its own, and
+// writes its header.
+static void open_interval_file(void)
+{
+    HChar* name = VG_(expand_file_name)("--interval-out-file", clo_interval_out_file);
+    VgFile* fp = VG_(fopen)(name, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_WRONLY, VKI_S_IRUSR | VKI_S_IWUSR);
+    SysRes sres;
+
+    if (fp == NULL) {
+        VG_(umsg)("error: can't open interval output file '%s'\n", name);
+        VG_(umsg)("       ... so interval snapshots will be missing.\n");
+        VG_(free)(name);
+        return;
+    }
+    fprint_desc_and_cmd(fp);
+    fprint_event_names(fp);
+    VG_(fprintf)(fp, "interval: %llu %s\n", clo_interval, clo_interval_ms ? "ms" : "instructions");
+    VG_(fclose)(fp);
+
+    sres = VG_(open)(name, VKI_O_WRONLY, 0);
+    if (!sr_isError(sres)) {
+        interval_fd = sr_Res(sres);
+        VG_(lseek)(interval_fd, 0, VKI_SEEK_END);
+    }
+    VG_(free)(name);
+}
+
+static void init_intervals(void)
+{
+    if (clo_interval == 0)
+        return;
+    interval_n_events = get_n_events();
+    interval_fns = VG_(OSetGen_Create)(offsetof(FnSnap, key), cmp_FnKey_FnSnap, VG_(malloc), "cg.interval.1",
+                                       VG_(free));
+    interval_start_ms = VG_(read_millisecond_timer)();
+    interval_next = clo_interval;
+    interval_reload();
+    open_interval_file();
+}
+
+// A forked child starts a stream of its own, whose first snapshot has all
+// the counts so far.
+static void interval_atfork_child(ThreadId tid)
+{
+    FnSnap* fn;
+    LineCC* lineCC;
+
+    if (clo_interval == 0)
+        return;
+    if (interval_fd >= 0)
+        VG_(close)(interval_fd);
+    interval_fd = -1;
+    VG_(OSetGen_ResetIter)(interval_fns);
+    while ((fn = VG_(OSetGen_Next)(interval_fns)))
+        fn->id = 0;
+    interval_touched = NULL;
+    interval_epoch++;
+    VG_(OSetGen_ResetIter)(CC_table);
+    while ((lineCC = VG_(OSetGen_Next)(CC_table))) {
+        if (lineCC->interval) {
+            VG_(memset)(lineCC->interval->last, 0, interval_n_events * sizeof(ULong));
+            interval_touch_line(lineCC);
+        }
+    }
+    interval_n_fns = 0;
+    interval_seq = 0;
+    open_interval_file();
+}
+
+static void fini_intervals(void)
+{
+    if (clo_interval == 0)
+        return;
+    interval_snapshot(VG_(read_millisecond_timer)() - interval_start_ms);
+    if (interval_fd >= 0)
+        VG_(close)(interval_fd);
+    interval_fd = -1;
+}
+
 /*------------------------------------------------------------*/
 /*--- Instrumentation types and structures                 ---*/
 /*------------------------------------------------------------*/
@@ -484,7 +1306,8 @@ typedef struct {
             IRAtom* taken; /* :: Ity_I1 */
         } Bc;
         struct {
-            IRAtom* dst;
+            IRAtom* dst;   /* NULL for a direct call */
+            IRJumpKind jk; /* Ijk_Boring, Ijk_Call or Ijk_Ret */
         } Bi;
     } Ev;
 } Event;
@@ -577,6 +1400,7 @@ static SB_info* get_SB_info(IRSB* sbIn, Addr origAddr)
     sbInfo = VG_(OSetGen_AllocNode)(instrInfoTable, sizeof(SB_info) + n_instrs * sizeof(InstrInfo));
     sbInfo->SB_addr = origAddr;
     sbInfo->n_instrs = n_instrs;
+    sbInfo->interval_epoch = 0;
     VG_(OSetGen_Insert)(instrInfoTable, sbInfo);
 
     return sbInfo;
@@ -613,7 +1437,10 @@ static void showEvent(Event* ev)
         break;
     case Ev_Bi:
         VG_(printf)("Bi %p  DST=", ev->inode);
-        ppIRExpr(ev->Ev.Bi.dst);
+        if (ev->Ev.Bi.dst)
+            ppIRExpr(ev->Ev.Bi.dst);
+        VG_(printf)(" ");
+        ppIRJumpKind(ev->Ev.Bi.jk);
         VG_(printf)("\n");
         break;
     default:
@@ -632,10 +1459,199 @@ static InstrInfo* setup_InstrInfo(CgState* cgs, Addr instr_addr, UInt instr_len)
     i_node->instr_addr = instr_addr;
     i_node->instr_len = instr_len;
     i_node->parent = get_lineCC(instr_addr);
+    i_node->mem_log_id = mem_log_instrs ? mem_log_instr_id(instr_addr, i_node->parent->loc.file,
+                                                            i_node->parent->loc.fn, i_node->parent->loc.line)
+                                        : 0;
     cgs->sbInfo_i++;
     return i_node;
 }
 
+/*------------------------------------------------------------*/
+/*--- Inline L1 hit fast path                              ---*/
+/*------------------------------------------------------------*/
+
+/* Most accesses hit the MRU way of their I1 or D1 set, and then the
+   simulator only counts them.  So with --inline-l1-hits=yes (the
+   default), an IrNoX, Dr, Dw or Dm event checks inline whether
+
+   - the access is within one line, and that line is in the MRU way;
+   - the words accessed are already marked used in that line;
+   - for a write, the line is already dirty;
+
+   and if so, counts the access inline.  Otherwise it calls the usual
+   one-event helper, guarded on the check failing.  The check reads the
+   tags, used and dirty arrays of I1 and D1 directly, which is why it
+   needs their addresses to be fixed, and an LRU cache (whose MRU line
+   is always in way 0).  Whatever the simulator does on every access,
+   even a hit, rules the fast path out: --mem-log, --regions, --cores,
+   --prefetch, --tlb-sim and --heap-sites.
+*/
+
+static Bool clo_inline_l1_hits = True;
+static Bool inline_I1_hits = False;
+static Bool inline_D1_hits = False;
+
+#if defined(VG_BIGENDIAN)
+#define CG_END Iend_BE
+#elif defined(VG_LITTLEENDIAN)
+#define CG_END Iend_LE
+#else
+#error "Unknown endianness"
+#endif
+
+#define HWORD_TY (sizeof(HWord) == 8 ? Ity_I64 : Ity_I32)
+
+static void init_inline_l1_hits(void)
+{
+    // The used bits of a line, and their shifts, must fit a host word.
+    Bool ok = clo_inline_l1_hits && clo_cache_sim && !clo_mem_log && !clo_regions && clo_cores == 0 &&
+              !sim_prefetch && !sim_tlb && !clo_heap_sites;
+
+    inline_I1_hits = ok && I1.policy == REPL_LRU && I1.line_size / 4 < sizeof(HWord) * 8;
+    inline_D1_hits = ok && D1.policy == REPL_LRU && D1.line_size / 4 < sizeof(HWord) * 8;
+}
+
+static IRAtom* fp_assign(CgState* cgs, IRType ty, IRExpr* e)
+{
+    IRTemp t = newIRTemp(cgs->sbOut->tyenv, ty);
+    addStmtToIRSB(cgs->sbOut, IRStmt_WrTmp(t, e));
+    return IRExpr_RdTmp(t);
+}
+
+// A binary operation on host words.
+static IRAtom* fp_binop(CgState* cgs, IROp op32, IROp op64, IRAtom* a, IRAtom* b)
+{
+    return fp_assign(cgs, HWORD_TY, IRExpr_Binop(sizeof(HWord) == 8 ? op64 : op32, a, b));
+}
+
+static IRAtom* fp_load_word(CgState* cgs, IRAtom* addr)
+{
+    return fp_assign(cgs, HWORD_TY, IRExpr_Load(CG_END, HWORD_TY, addr));
+}
+
+// A shift amount, which is 8 bits.
+static IRAtom* fp_shift_amount(CgState* cgs, IRAtom* a)
+{
+    return fp_assign(cgs, Ity_I8, IRExpr_Unop(sizeof(HWord) == 8 ? Iop_64to8 : Iop_32to8, a));
+}
+
+// *p += (miss ? 0 : v), where v is an Ity_I64 atom.
+static void fp_add_if_hit(CgState* cgs, ULong* p, IRAtom* miss, IRAtom* v)
+{
+    IRAtom* addr = mkIRExpr_HWord((HWord)p);
+    IRAtom* old = fp_assign(cgs, Ity_I64, IRExpr_Load(CG_END, Ity_I64, addr));
+    IRAtom* inc = fp_assign(cgs, Ity_I64, IRExpr_ITE(miss, IRExpr_Const(IRConst_U64(0)), v));
+
+    addStmtToIRSB(cgs->sbOut, IRStmt_Store(CG_END, addr, fp_assign(cgs, Ity_I64, IRExpr_Binop(Iop_Add64, old, inc))));
+}
+
+// What the simulator counts for a hit in 'c': see cachesim_D1_doref.
+static void fp_count_hit(CgState* cgs, CacheCC* cc, cache_t2* c, IRAtom* miss)
+{
+    IRAtom* l1_used = fp_assign(cgs, Ity_I32, IRExpr_Load(CG_END, Ity_I32, mkIRExpr_HWord((HWord)&c->total_used)));
+    IRAtom* ll_used = fp_assign(cgs, Ity_I32, IRExpr_Load(CG_END, Ity_I32, mkIRExpr_HWord((HWord)&LL.total_used)));
+
+    fp_add_if_hit(cgs, &cc->a, miss, IRExpr_Const(IRConst_U64(1)));
+    fp_add_if_hit(cgs, &cc->l1_words, miss, fp_assign(cgs, Ity_I64, IRExpr_Unop(Iop_32Uto64, l1_used)));
+    fp_add_if_hit(cgs, &cc->llc_words, miss, fp_assign(cgs, Ity_I64, IRExpr_Unop(Iop_32Uto64, ll_used)));
+}
+
+static void fp_call_if_miss(CgState* cgs, Int regparms, const HChar* helperName, void* helperAddr, IRExpr** argv,
+                            IRAtom* miss)
+{
+    IRDirty* di = unsafeIRDirty_0_N(regparms, helperName, VG_(fnptr_to_fnentry)(helperAddr), argv);
+
+    di->guard = miss;
+    addStmtToIRSB(cgs->sbOut, IRStmt_Dirty(di));
+}
+
+// The IrNoX check: everything but the tags and used bits is known here.
+static void fp_IrNoX(CgState* cgs, InstrInfo* n)
+{
+    UWord block = n->instr_addr >> I1.line_size_bits;
+    Int line = (block & I1.sets_min_1) * I1.assoc;
+    UWord u;
+    IRAtom *tag, *used, *diff, *miss;
+
+    set_used(n->instr_addr, n->instr_len, I1.line_size, &u);
+    tag = fp_load_word(cgs, mkIRExpr_HWord((HWord)&I1.tags[line]));
+    used = fp_load_word(cgs, mkIRExpr_HWord((HWord)&I1.used[line]));
+    diff = fp_binop(cgs, Iop_Xor32, Iop_Xor64, fp_binop(cgs, Iop_And32, Iop_And64, used, mkIRExpr_HWord(u)),
+                    mkIRExpr_HWord(u));
+    diff = fp_binop(cgs, Iop_Or32, Iop_Or64, diff, fp_binop(cgs, Iop_Xor32, Iop_Xor64, tag, mkIRExpr_HWord(block)));
+    miss = fp_assign(cgs, Ity_I1,
+                     IRExpr_Binop(sizeof(HWord) == 8 ? Iop_CmpNE64 : Iop_CmpNE32, diff, mkIRExpr_HWord(0)));
+    fp_count_hit(cgs, &n->parent->Ir, &I1, miss);
+    fp_call_if_miss(cgs, 1, "log_1IrNoX_0D_cache_access", &log_1IrNoX_0D_cache_access,
+                    mkIRExprVec_1(mkIRExpr_HWord((HWord)n)), miss);
+}
+
+// The Dr/Dw/Dm check, on the address computed by the client code.
+static void fp_D(CgState* cgs, InstrInfo* n, IRAtom* ea, Int size, Bool write)
+{
+    IRAtom *block, *end, *idx, *off, *tag, *used, *first, *last, *u, *diff, *miss;
+    IRAtom* one = mkIRExpr_HWord(1);
+
+#define FP_BINOP(op, a, b) fp_binop(cgs, Iop_##op##32, Iop_##op##64, a, b)
+    block = FP_BINOP(Shr, ea, IRExpr_Const(IRConst_U8(D1.line_size_bits)));
+    end = FP_BINOP(Shr, FP_BINOP(Add, ea, mkIRExpr_HWord(size - 1)), IRExpr_Const(IRConst_U8(D1.line_size_bits)));
+    idx = FP_BINOP(Mul, FP_BINOP(And, block, mkIRExpr_HWord(D1.sets_min_1)), mkIRExpr_HWord(D1.assoc));
+    off = FP_BINOP(Mul, idx, mkIRExpr_HWord(sizeof(UWord)));
+    tag = fp_load_word(cgs, FP_BINOP(Add, off, mkIRExpr_HWord((HWord)D1.tags)));
+    used = fp_load_word(cgs, FP_BINOP(Add, off, mkIRExpr_HWord((HWord)D1.used)));
+
+    // The used bits, as set_used makes them: words first .. last - 1.  If
+    // the access crosses lines, they are wrong, but 'end' differs anyway.
+    off = FP_BINOP(And, ea, mkIRExpr_HWord(D1.line_size - 1));
+    first = FP_BINOP(Shr, off, IRExpr_Const(IRConst_U8(2)));
+    last = FP_BINOP(Add, FP_BINOP(Shr, FP_BINOP(Add, off, mkIRExpr_HWord(size - 1)), IRExpr_Const(IRConst_U8(2))),
+                    one);
+    u = FP_BINOP(Sub, FP_BINOP(Shl, one, fp_shift_amount(cgs, last)),
+                 FP_BINOP(Shl, one, fp_shift_amount(cgs, first)));
+
+    diff = FP_BINOP(Xor, FP_BINOP(And, used, u), u);
+    diff = FP_BINOP(Or, diff, FP_BINOP(Xor, tag, block));
+    diff = FP_BINOP(Or, diff, FP_BINOP(Xor, end, block));
+    if (write) {
+        IRAtom* dirty = fp_assign(cgs, Ity_I8, IRExpr_Load(CG_END, Ity_I8, FP_BINOP(Add, idx,
+                                                                             mkIRExpr_HWord((HWord)D1.dirty))));
+        dirty = fp_assign(cgs, HWORD_TY, IRExpr_Unop(sizeof(HWord) == 8 ? Iop_8Uto64 : Iop_8Uto32, dirty));
+        diff = FP_BINOP(Or, diff, FP_BINOP(Xor, dirty, one));
+    }
+#undef FP_BINOP
+    miss = fp_assign(cgs, Ity_I1,
+                     IRExpr_Binop(sizeof(HWord) == 8 ? Iop_CmpNE64 : Iop_CmpNE32, diff, mkIRExpr_HWord(0)));
+    fp_count_hit(cgs, write ? &n->parent->Dw : &n->parent->Dr, &D1, miss);
+    if (write)
+        fp_call_if_miss(cgs, 3, "log_0Ir_1Dw_cache_access", &log_0Ir_1Dw_cache_access,
+                        mkIRExprVec_3(mkIRExpr_HWord((HWord)n), ea, mkIRExpr_HWord(size)), miss);
+    else
+        fp_call_if_miss(cgs, 3, "log_0Ir_1Dr_cache_access", &log_0Ir_1Dr_cache_access,
+                        mkIRExprVec_3(mkIRExpr_HWord((HWord)n), ea, mkIRExpr_HWord(size)), miss);
+}
+
+// Emits the fast path for 'ev', if it has one.
+static Bool fp_event(CgState* cgs, Event* ev)
+{
+    switch (ev->tag) {
+    case Ev_IrNoX:
+        if (!inline_I1_hits)
+            return False;
+        fp_IrNoX(cgs, ev->inode);
+        return True;
+    case Ev_Dr:
+    case Ev_Dm:
+    case Ev_Dw:
+        if (!inline_D1_hits)
+            return False;
+        // As in flushEvents, a Dm is simulated as a read.
+        fp_D(cgs, ev->inode, get_Event_dea(ev), get_Event_dszB(ev), ev->tag == Ev_Dw);
+        return True;
+    default:
+        return False;
+    }
+}
+
 /* Generate code for all outstanding memory events, and mark the queue
    empty.  Code is generated into cgs->bbOut, and this activity
    'consumes' slots in cgs->sbInfo. */
@@ -673,6 +1689,11 @@ static void flushEvents(CgState* cgs)
             showEvent(ev);
         }
 
+        if (fp_event(cgs, ev)) {
+            i++;
+            continue;
+        }
+
         i_node_expr = mkIRExpr_HWord((HWord)ev->inode);
 
         /* Decide on helper fn to call and args to pass it, and advance
@@ -784,10 +1805,25 @@ static void flushEvents(CgState* cgs)
             break;
         case Ev_Bi:
             /* Branch to an unknown destination */
-            helperName = "log_ind_branch";
-            helperAddr = &log_ind_branch;
-            argv = mkIRExprVec_2(i_node_expr, ev->Ev.Bi.dst);
-            regparms = 2;
+            if (ev->Ev.Bi.jk == Ijk_Call && ev->Ev.Bi.dst == NULL) {
+                helperName = "log_call";
+                helperAddr = &log_call;
+                argv = mkIRExprVec_1(i_node_expr);
+                regparms = 1;
+            } else {
+                if (ev->Ev.Bi.jk == Ijk_Ret) {
+                    helperName = "log_ret_branch";
+                    helperAddr = &log_ret_branch;
+                } else if (ev->Ev.Bi.jk == Ijk_Call) {
+                    helperName = "log_ind_call";
+                    helperAddr = &log_ind_call;
+                } else {
+                    helperName = "log_ind_branch";
+                    helperAddr = &log_ind_branch;
+                }
+                argv = mkIRExprVec_2(i_node_expr, ev->Ev.Bi.dst);
+                regparms = 2;
+            }
             i++;
             break;
         default:
@@ -930,11 +1966,15 @@ static void addEvent_Bc(CgState* cgs, InstrInfo* inode, IRAtom* guard)
     cgs->events_used++;
 }
 
-static void addEvent_Bi(CgState* cgs, InstrInfo* inode, IRAtom* whereTo)
+// 'jk' is Ijk_Call or Ijk_Ret only with --ras, and 'whereTo' NULL only
+// for a direct call.
+static void addEvent_Bi(CgState* cgs, InstrInfo* inode, IRAtom* whereTo, IRJumpKind jk)
 {
     Event* evt;
-    tl_assert(isIRAtom(whereTo));
-    tl_assert(typeOfIRExpr(cgs->sbOut->tyenv, whereTo) == (sizeof(RegWord) == 4 ? Ity_I32 : Ity_I64));
+    tl_assert(whereTo != NULL || jk == Ijk_Call);
+    tl_assert(whereTo == NULL || isIRAtom(whereTo));
+    tl_assert(whereTo == NULL ||
+              typeOfIRExpr(cgs->sbOut->tyenv, whereTo) == (sizeof(RegWord) == 4 ? Ity_I32 : Ity_I64));
     if (!clo_branch_sim)
         return;
     if (cgs->events_used == N_EVENTS)
@@ -945,11 +1985,51 @@ static void addEvent_Bi(CgState* cgs, InstrInfo* inode, IRAtom* whereTo)
     evt->tag = Ev_Bi;
     evt->inode = inode;
     evt->Ev.Bi.dst = whereTo;
+    evt->Ev.Bi.jk = clo_ras > 0 ? jk : Ijk_Boring;
     cgs->events_used++;
 }
 
 ////////////////////////////////////////////////////////////
 
+/* Call mem_log_fn_entry before the instruction at 'cia' if it is the
+   entry of a --mem-log-start-fn/stop-fn function. */
+static void addWindowHook(CgState* cgs, Addr cia)
+{
+    Int which = mem_log_window_fn(cia);
+    IRDirty* di;
+
+    if (which < 0)
+        return;
+    flushEvents(cgs);
+    di = unsafeIRDirty_0_N(1, "mem_log_fn_entry", VG_(fnptr_to_fnentry)(&mem_log_fn_entry),
+                           mkIRExprVec_1(mkIRExpr_HWord(which)));
+    addStmtToIRSB(cgs->sbOut, IRStmt_Dirty(di));
+}
+
+/* Count down the guest instructions of the superblock, and call
+   interval_tick when the --interval countdown runs out.  Then call
+   interval_touch if the superblock has not run yet in this interval. */
+static void addIntervalCount(CgState* cgs)
+{
+    IRAtom* addr = mkIRExpr_HWord((HWord)&interval_left);
+    IRAtom* left = fp_binop(cgs, Iop_Sub32, Iop_Sub64, fp_load_word(cgs, addr), mkIRExpr_HWord(cgs->sbInfo->n_instrs));
+    IRAtom *epoch, *now;
+    IRDirty* di;
+
+    addStmtToIRSB(cgs->sbOut, IRStmt_Store(CG_END, addr, left));
+    di = unsafeIRDirty_0_N(0, "interval_tick", VG_(fnptr_to_fnentry)(&interval_tick), mkIRExprVec_0());
+    di->guard = fp_assign(cgs, Ity_I1,
+                          IRExpr_Binop(sizeof(HWord) == 8 ? Iop_CmpLE64S : Iop_CmpLE32S, left, mkIRExpr_HWord(0)));
+    addStmtToIRSB(cgs->sbOut, IRStmt_Dirty(di));
+
+    epoch = fp_load_word(cgs, mkIRExpr_HWord((HWord)&cgs->sbInfo->interval_epoch));
+    now = fp_load_word(cgs, mkIRExpr_HWord((HWord)&interval_epoch));
+    di = unsafeIRDirty_0_N(1, "interval_touch", VG_(fnptr_to_fnentry)(&interval_touch),
+                           mkIRExprVec_1(mkIRExpr_HWord((HWord)cgs->sbInfo)));
+    di->guard = fp_assign(cgs, Ity_I1, IRExpr_Binop(sizeof(HWord) == 8 ? Iop_CmpNE64 : Iop_CmpNE32, epoch, now));
+    addStmtToIRSB(cgs->sbOut, IRStmt_Dirty(di));
+}
+
 static IRSB* cg_instrument(VgCallbackClosure* closure, IRSB* sbIn, const VexGuestLayout* layout,
                            const VexGuestExtents* vge, const VexArchInfo* archinfo_host, IRType gWordTy, IRType hWordTy)
 {
@@ -966,6 +2046,10 @@ static IRSB* cg_instrument(VgCallbackClosure* closure, IRSB* sbIn, const VexGues
         VG_(tool_panic)("host/guest word size mismatch");
     }
 
+    // Outside of a --mem-log window: nothing to simulate.
+    if (!mem_log_simulating)
+        return sbIn;
+
     // Set up new SB
     cgs.sbOut = deepCopyIRSBExceptStmts(sbIn);
 
@@ -994,6 +2078,8 @@ static IRSB* cg_instrument(VgCallbackClosure* closure, IRSB* sbIn, const VexGues
     cgs.events_used = 0;
     cgs.sbInfo = get_SB_info(sbIn, (Addr)closure->readdr);
     cgs.sbInfo_i = 0;
+    if (clo_interval > 0)
+        addIntervalCount(&cgs);
 
     if (DEBUG_CG)
         VG_(printf)("\n\n---------- cg_instrument ----------\n");
@@ -1025,6 +2111,9 @@ static IRSB* cg_instrument(VgCallbackClosure* closure, IRSB* sbIn, const VexGues
             // Sanity-check size.
             tl_assert((VG_MIN_INSTR_SZB <= isize && isize <= VG_MAX_INSTR_SZB) || VG_CLREQ_SZB == isize);
 
+            if (mem_log_window_fns)
+                addWindowHook(&cgs, cia);
+
             // Get space for and init the inode, record it as the current one.
             // Subsequent Dr/Dw/Dm events from the same instruction will
             // also use it.
@@ -1203,18 +2292,23 @@ static IRSB* cg_instrument(VgCallbackClosure* closure, IRSB* sbIn, const VexGues
 
     /* Deal with branches to unknown destinations.  Except ignore ones
       which are function returns as we assume the return stack
-      predictor never mispredicts. */
-    if ((sbIn->jumpkind == Ijk_Boring) || (sbIn->jumpkind == Ijk_Call)) {
+      predictor never mispredicts, unless --ras models it. */
+    if ((sbIn->jumpkind == Ijk_Boring) || (sbIn->jumpkind == Ijk_Call) ||
+        (sbIn->jumpkind == Ijk_Ret && clo_ras > 0)) {
         if (0) {
             ppIRExpr(sbIn->next);
             VG_(printf)("\n");
         }
         switch (sbIn->next->tag) {
         case Iex_Const:
-            break; /* boring - branch to known address */
+            /* boring - branch to known address, but a call pushes its
+               return address on the return stack */
+            if (sbIn->jumpkind == Ijk_Call && clo_ras > 0)
+                addEvent_Bi(&cgs, curr_inode, NULL, Ijk_Call);
+            break;
         case Iex_RdTmp:
             /* looks like an indirect branch (branch to unknown) */
-            addEvent_Bi(&cgs, curr_inode, sbIn->next);
+            addEvent_Bi(&cgs, curr_inode, sbIn->next, sbIn->jumpkind);
             break;
         default:
             /* shouldn't happen - if the incoming IR is properly
@@ -1258,16 +2352,18 @@ static cache_t clo_LL_cache = UNDEFINED_CACHE;
 static CacheCC Ir_total;
 static CacheCC Dr_total;
 static CacheCC Dw_total;
+static CacheCC D_evict_total; /* only the eviction and coherence fields, for Dr and Dw */
 static BranchCC Bc_total;
 static BranchCC Bi_total;
 
 static void fprint_CC_table_and_calc_totals(void)
 {
-    Int i;
+    Int i, n_events;
     VgFile* fp;
     HChar* currFile = NULL;
     const HChar* currFn = NULL;
     LineCC* lineCC;
+    ULong v[MAX_EVENTS], summary[MAX_EVENTS];
 
     // Setup output filename.  Nb: it's important to do this now, ie. as late
     // as possible.  If we do it at start-up and the program forks and the
@@ -1288,34 +2384,10 @@ static void fprint_CC_table_and_calc_totals(void)
         VG_(free)(cachegrind_out_file);
     }
 
-    // "desc:" lines (giving I1/D1/LL cache configuration).  The spaces after
-    // the 2nd colon makes cg_annotate's output look nicer.
-    VG_(fprintf)(fp,
-                 "desc: I1 cache:         %s\n"
-                 "desc: D1 cache:         %s\n"
-                 "desc: LL cache:         %s\n",
-                 I1.desc_line, D1.desc_line, LL.desc_line);
-
-    // "cmd:" line
-    VG_(fprintf)(fp, "cmd: %s", VG_(args_the_exename));
-    for (i = 0; i < VG_(sizeXA)(VG_(args_for_client)); i++) {
-        HChar* arg = *(HChar**)VG_(indexXA)(VG_(args_for_client), i);
-        VG_(fprintf)(fp, " %s", arg);
-    }
-    // "events:" line
-    if (clo_cache_sim && clo_branch_sim) {
-        VG_(fprintf)(fp,
-                     "\nevents: Ir I1mr ILmr I1u ILu Dr D1mr DLmr D1ru DLru Dw D1mw DLmw D1wu DLwu"
-                     "Bc Bcm Bi Bim\n");
-    } else if (clo_cache_sim && !clo_branch_sim) {
-        VG_(fprintf)(fp,
-                     "\nevents: Ir I1mr ILmr I1u ILu Dr D1mr DLmr D1ru DLru Dw D1mw DLmw D1wu DLwu "
-                     "\n");
-    } else if (!clo_cache_sim && clo_branch_sim) {
-        VG_(fprintf)(fp, "\nevents: Ir Bc Bcm Bi Bim\n");
-    } else {
-        VG_(fprintf)(fp, "\nevents: Ir\n");
-    }
+    fprint_desc_and_cmd(fp);
+    fprint_event_names(fp);
+    VG_(memset)(summary, 0, sizeof(summary));
+    n_events = get_n_events();
 
     // Traverse every lineCC
     VG_(OSetGen_ResetIter)(CC_table);
@@ -1343,33 +2415,13 @@ static void fprint_CC_table_and_calc_totals(void)
         }
 
         // Print the LineCC
-        if (clo_cache_sim && clo_branch_sim) {
-            VG_(fprintf)(fp,
-                         "%d %llu %llu %llu %llu %llu"
-                         " %llu %llu %llu %llu %llu"
-                         " %llu %llu %llu %llu %llu"
-                         " %llu %llu %llu %llu\n",
-                         lineCC->loc.line, lineCC->Ir.a, lineCC->Ir.m1, lineCC->Ir.mL, lineCC->Ir.l1_words,
-                         lineCC->Ir.llc_words, lineCC->Dr.a, lineCC->Dr.m1, lineCC->Dr.mL, lineCC->Dr.l1_words,
-                         lineCC->Dr.llc_words, lineCC->Dw.a, lineCC->Dw.m1, lineCC->Dw.mL, lineCC->Dw.l1_words,
-                         lineCC->Dw.llc_words, lineCC->Bc.b, lineCC->Bc.mp, lineCC->Bi.b, lineCC->Bi.mp);
-        } else if (clo_cache_sim && !clo_branch_sim) {
-            VG_(fprintf)(fp,
-                         "%d %llu %llu %llu %llu %llu"
-                         " %llu %llu %llu %llu %llu"
-                         " %llu %llu %llu %llu %llu\n",
-                         lineCC->loc.line, lineCC->Ir.a, lineCC->Ir.m1, lineCC->Ir.mL, lineCC->Ir.l1_words,
-                         lineCC->Ir.llc_words, lineCC->Dr.a, lineCC->Dr.m1, lineCC->Dr.mL, lineCC->Dr.l1_words,
-                         lineCC->Dr.llc_words, lineCC->Dw.a, lineCC->Dw.m1, lineCC->Dw.mL, lineCC->Dw.l1_words,
-                         lineCC->Dw.llc_words);
-        } else if (!clo_cache_sim && clo_branch_sim) {
-            VG_(fprintf)(fp,
-                         "%d %llu"
-                         " %llu %llu %llu %llu\n",
-                         lineCC->loc.line, lineCC->Ir.a, lineCC->Bc.b, lineCC->Bc.mp, lineCC->Bi.b, lineCC->Bi.mp);
-        } else {
-            VG_(fprintf)(fp, "%d %llu\n", lineCC->loc.line, lineCC->Ir.a);
+        n_events = get_event_values(lineCC, v);
+        VG_(fprintf)(fp, "%d", lineCC->loc.line);
+        for (i = 0; i < n_events; i++) {
+            VG_(fprintf)(fp, " %llu", v[i]);
+            summary[i] += v[i];
         }
+        VG_(fprintf)(fp, "\n");
 
         // Update summary stats
         Ir_total.a += lineCC->Ir.a;
@@ -1387,6 +2439,27 @@ static void fprint_CC_table_and_calc_totals(void)
         Dw_total.mL += lineCC->Dw.mL;
         Dw_total.l1_words += lineCC->Dw.l1_words;
         Dw_total.llc_words += lineCC->Dw.llc_words;
+        Ir_total.tm += lineCC->Ir.tm;
+        Ir_total.tw += lineCC->Ir.tw;
+        Dr_total.tm += lineCC->Dr.tm;
+        Dr_total.tw += lineCC->Dr.tw;
+        Dw_total.tm += lineCC->Dw.tm;
+        Dw_total.tw += lineCC->Dw.tw;
+        for (i = 0; i < n_mid_levels; i++) {
+            Ir_total.mm[i] += lineCC->Ir.mm[i];
+            Dr_total.mm[i] += lineCC->Dr.mm[i];
+            Dw_total.mm[i] += lineCC->Dw.mm[i];
+        }
+        D_evict_total.ev1 += lineCC->Dr.ev1 + lineCC->Dw.ev1;
+        D_evict_total.wb1 += lineCC->Dr.wb1 + lineCC->Dw.wb1;
+        D_evict_total.evL += lineCC->Dr.evL + lineCC->Dw.evL;
+        D_evict_total.wbL += lineCC->Dr.wbL + lineCC->Dw.wbL;
+        D_evict_total.inv += lineCC->Dr.inv + lineCC->Dw.inv;
+        D_evict_total.fs += lineCC->Dr.fs + lineCC->Dw.fs;
+        D_evict_total.cm += lineCC->Dr.cm + lineCC->Dw.cm;
+        D_evict_total.pf += lineCC->Dr.pf + lineCC->Dw.pf;
+        D_evict_total.pfu += lineCC->Dr.pfu + lineCC->Dw.pfu;
+        D_evict_total.pfl += lineCC->Dr.pfl + lineCC->Dw.pfl;
         Bc_total.b += lineCC->Bc.b;
         Bc_total.mp += lineCC->Bc.mp;
         Bi_total.b += lineCC->Bi.b;
@@ -1402,38 +2475,10 @@ static void fprint_CC_table_and_calc_totals(void)
 
     // Summary stats must come after rest of table, since we calculate them
     // during traversal.  */
-    if (clo_cache_sim && clo_branch_sim) {
-        VG_(fprintf)(fp,
-                     "summary:"
-                     " %llu %llu %llu %llu %llu"
-                     " %llu %llu %llu %llu %llu"
-                     " %llu %llu %llu %llu %llu"
-                     " %llu %llu %llu %llu\n",
-                     Ir_total.a, Ir_total.m1, Ir_total.mL, Ir_total.l1_words, Ir_total.llc_words, Dr_total.a,
-                     Dr_total.m1, Dr_total.mL, Dr_total.l1_words, Dr_total.llc_words, Dw_total.a, Dw_total.m1,
-                     Dw_total.mL, Dw_total.l1_words, Dw_total.llc_words, Bc_total.b, Bc_total.mp, Bi_total.b,
-                     Bi_total.mp);
-    } else if (clo_cache_sim && !clo_branch_sim) {
-        VG_(fprintf)(fp,
-                     "summary:"
-                     " %llu %llu %llu %llu %llu"
-                     " %llu %llu %llu %llu %llu"
-                     " %llu %llu %llu %llu %llu\n",
-                     Ir_total.a, Ir_total.m1, Ir_total.mL, Ir_total.l1_words, Ir_total.llc_words, Dr_total.a,
-                     Dr_total.m1, Dr_total.mL, Dr_total.l1_words, Dr_total.llc_words, Dw_total.a, Dw_total.m1,
-                     Dw_total.mL, Dw_total.l1_words, Dw_total.llc_words);
-    } else if (!clo_cache_sim && clo_branch_sim) {
-        VG_(fprintf)(fp,
-                     "summary:"
-                     " %llu"
-                     " %llu %llu %llu %llu\n",
-                     Ir_total.a, Bc_total.b, Bc_total.mp, Bi_total.b, Bi_total.mp);
-    } else {
-        VG_(fprintf)(fp,
-                     "summary:"
-                     " %llu\n",
-                     Ir_total.a);
-    }
+    VG_(fprintf)(fp, "summary:");
+    for (i = 0; i < n_events; i++)
+        VG_(fprintf)(fp, " %llu", summary[i]);
+    VG_(fprintf)(fp, "\n");
 
     VG_(fclose)(fp);
 }
@@ -1454,15 +2499,15 @@ static void cg_fini(Int exitcode)
 {
     static HChar fmt[128];  // OK; large enough
 
-    detect_stack_and_heap();
-
     CacheCC D_total;
     BranchCC B_total;
     ULong LL_total_m, LL_total_mr, LL_total_mw, LL_total, LL_total_r, LL_total_w, LL_a;
+    Int i;
     Double LL_avg_words;
     Int l1, l2, l3;
 
     fprint_CC_table_and_calc_totals();
+    fini_intervals();
 
     if (clo_mem_log) {
         flush_mem_logging();
@@ -1533,6 +2578,17 @@ static void cg_fini(Int exitcode)
         VG_(umsg)("LLd miss rate: %*.1f%% (%*.1f%%     + %*.1f%%  )\n", l1, D_total.mL * 100.0 / D_total.a, l2,
                   Dr_total.mL * 100.0 / Dr_total.a, l3, Dw_total.mL * 100.0 / Dw_total.a);
         VG_(umsg)("D1 avg usage:  %*.2f%%\n", l1, D_total.l1_words * 4 * 100.0 / D1.size);
+        if (clo_wasted_bytes) {
+            VG_(umsg)("D1 wasted:     %*.1f B/eviction (%llu evictions)\n", l1,
+                      D_evict_total.ev1 ? D_evict_total.wb1 * 1.0 / D_evict_total.ev1 : 0.0, D_evict_total.ev1);
+            VG_(umsg)("LLd wasted:    %*.1f B/eviction (%llu evictions)\n", l1,
+                      D_evict_total.evL ? D_evict_total.wbL * 1.0 / D_evict_total.evL : 0.0, D_evict_total.evL);
+        }
+        if (clo_cores > 0) {
+            VG_(umsg)("D1 invalidations: %llu  (%llu false sharing)\n", D_evict_total.inv, D_evict_total.fs);
+            VG_(umsg)("D1 coherence misses: %llu\n", D_evict_total.cm);
+            print_false_sharing();
+        }
         VG_(umsg)("\n");
 
         /* LL overall results */
@@ -1542,6 +2598,13 @@ static void cg_fini(Int exitcode)
         LL_total_w = Dw_total.m1;
         LL_a = Dr_total.a + Dw_total.a + Ir_total.a;
         LL_avg_words = (Dr_total.llc_words + Dw_total.llc_words + Ir_total.llc_words * 1.0) / LL_a;
+        for (i = 0; i < n_mid_levels; i++) {
+            HChar label[16];
+            VG_(sprintf)(label, "%s misses:", clo_cache_levels[i].name);
+            VG_(sprintf)(label + VG_(strlen)(label), "%*s", (Int)(14 - VG_(strlen)(label)), "");
+            VG_(umsg)(fmt, label, Ir_total.mm[i] + Dr_total.mm[i] + Dw_total.mm[i], Ir_total.mm[i] + Dr_total.mm[i],
+                      Dw_total.mm[i]);
+        }
         VG_(umsg)(fmt, "LL-refs:      ", LL_total, LL_total_r, LL_total_w);
 
         LL_total_m = Dr_total.mL + Dw_total.mL + Ir_total.mL;
@@ -1558,6 +2621,19 @@ static void cg_fini(Int exitcode)
         VG_(umsg)("LL local miss: %*.1f%% (%*.1f%%     + %*.1f%%  )\n", l1, LL_total_m * 100.0 / LL_total, l2,
                   LL_total_mr * 100.0 / LL_total_r, l3, LL_total_mw * 100.0 / LL_total_w);
         VG_(umsg)("LL avg usage:  %*.2f%%\n", l1, LL_avg_words * 4 * 100.0 / LL.size);
+        if (sim_prefetch)
+            print_prefetch_stats();
+        if (sim_tlb) {
+            VG_(umsg)("\n");
+            VG_(sprintf)(fmt, "%%s %%,%dllu\n", l1);
+            VG_(umsg)(fmt, "ITLB misses:  ", Ir_total.tm);
+            VG_(umsg)(fmt, "ITLB walks:   ", Ir_total.tw);
+            VG_(sprintf)(fmt, "%%s %%,%dllu  (%%,%dllu rd   + %%,%dllu wr)\n", l1, l2, l3);
+            VG_(umsg)(fmt, "DTLB misses:  ", Dr_total.tm + Dw_total.tm, Dr_total.tm, Dw_total.tm);
+            VG_(umsg)(fmt, "DTLB walks:   ", Dr_total.tw + Dw_total.tw, Dr_total.tw, Dw_total.tw);
+        }
+        if (clo_heap_sites)
+            heap_print_sites(D_total.m1, D_total.mL);
     }
 
     /* If branch profiling is enabled, show branch overall results. */
@@ -1602,6 +2678,12 @@ static void cg_fini(Int exitcode)
         VG_(dmsg)("cachegrind: string table size: %u\n", VG_(OSetGen_Size)(stringTable));
         VG_(dmsg)("cachegrind: CC table size: %u\n", VG_(OSetGen_Size)(CC_table));
         VG_(dmsg)("cachegrind: InstrInfo table size: %u\n", VG_(OSetGen_Size)(instrInfoTable));
+        if (clo_mem_log)
+            print_mem_log_stats();
+        if (clo_regions)
+            segmap_print_stats();
+        if (clo_heap_sites)
+            heap_print_stats();
     }
 }
 
@@ -1624,10 +2706,12 @@ static void cg_discard_superblock_info(Addr orig_addr64, VexGuestExtents vge)
                     (ULong)vge.len[0]);
 
     // Get BB info, remove from table, free BB info.  Simple!  Note that we
-    // use orig_addr, not the first instruction address in vge.
+    // use orig_addr, not the first instruction address in vge.  Blocks
+    // translated outside of a --mem-log window have no info.
     sbInfo = VG_(OSetGen_Remove)(instrInfoTable, &orig_addr);
-    tl_assert(NULL != sbInfo);
-    VG_(OSetGen_FreeNode)(instrInfoTable, sbInfo);
+    tl_assert(NULL != sbInfo || mem_log_windows_enabled);
+    if (sbInfo)
+        VG_(OSetGen_FreeNode)(instrInfoTable, sbInfo);
 }
 
 /*--------------------------------------------------------------------*/
@@ -1636,6 +2720,8 @@ static void cg_discard_superblock_info(Addr orig_addr64, VexGuestExtents vge)
 
 static Bool cg_process_cmd_line_option(const HChar* arg)
 {
+    const HChar* tmp_str;
+
     if (VG_(str_clo_cache_opt)(arg, &clo_I1_cache, &clo_D1_cache, &clo_LL_cache)) {
     }
 
@@ -1644,6 +2730,29 @@ static Bool cg_process_cmd_line_option(const HChar* arg)
     } else if VG_BOOL_CLO (arg, "--cache-sim", clo_cache_sim) {
     } else if VG_BOOL_CLO (arg, "--branch-sim", clo_branch_sim) {
     } else if VG_BOOL_CLO (arg, "--mem-log", clo_mem_log) {
+    } else if VG_BOOL_CLO (arg, "--regions", clo_regions) {
+    } else if VG_BOOL_CLO (arg, "--wasted-bytes", clo_wasted_bytes) {
+    } else if VG_BINT_CLO (arg, "--cores", clo_cores, 0, MAX_CORES) {
+    } else if VG_STR_CLO (arg, "--core-map", clo_core_map) {
+    } else if VG_STR_CLO (arg, "--cache-level", tmp_str) {
+        parse_cache_level(arg, tmp_str);
+    } else if VG_XACT_CLO (arg, "--LL-inclusion=nine", clo_LL_inclusion, CACHE_NINE) {
+    } else if VG_XACT_CLO (arg, "--LL-inclusion=inclusive", clo_LL_inclusion, CACHE_INCLUSIVE) {
+    } else if VG_STR_CLO (arg, "--replacement", clo_replacement) {
+    } else if VG_INT_CLO (arg, "--replacement-seed", clo_replacement_seed) {
+    } else if VG_STR_CLO (arg, "--prefetch", clo_prefetch) {
+    } else if VG_BINT_CLO (arg, "--prefetch-latency", clo_prefetch_latency, 0, 1000000) {
+    } else if VG_BOOL_CLO (arg, "--mem-log-drain", clo_mem_log_drain) {
+    } else if VG_BINT_CLO (arg, "--mem-log-ring-mb", clo_mem_log_ring_mb, 1, 4096) {
+    } else if (mem_log_process_option(arg)) {
+    } else if (tlbsim_process_option(arg)) {
+    } else if (branchpred_process_option(arg)) {
+    } else if VG_BINT_CLO (arg, "--ras", clo_ras, 0, 1024) {
+    } else if VG_STR_CLO (arg, "--interval", tmp_str) {
+        parse_interval(arg, tmp_str);
+    } else if VG_STR_CLO (arg, "--interval-out-file", clo_interval_out_file) {
+    } else if VG_BOOL_CLO (arg, "--inline-l1-hits", clo_inline_l1_hits) {
+    } else if (heap_process_option(arg)) {
     } else
         return False;
 
@@ -1655,15 +2764,77 @@ static void cg_print_usage(void)
     VG_(print_cache_clo_opts)();
     VG_(printf)(
             "    --cache-sim=yes|no               collect cache stats? [yes]\n"
-            "    --branch-sim=yes|no              collect branch prediction stats? [no]\n"
+            "    --branch-sim=yes|no              collect branch prediction stats? [no]\n");
+    branchpred_print_usage();
+    VG_(printf)(
+            "    --ras=<n>                        predict returns with a return stack of\n"
+            "                                     <n> entries, counted as indirect\n"
+            "                                     branches; 0 ignores returns [0]\n"
             "    --mem-log=yes|no                 log memory accesses? [no]\n"
+            "    --mem-log-drain=yes|no           write the log from a helper process? [no]\n"
+            "    --mem-log-ring-mb=<n>            size of the ring shared with it [64]\n");
+    mem_log_print_usage();
+    VG_(printf)(
+            "    --regions=yes|no                 count data accesses per stack/heap/\n"
+            "                                     global/mmap region? [no]\n"
+            "    --wasted-bytes=yes|no            charge the bytes of evicted D1/LL lines that\n"
+            "                                     were never accessed to the line loading them? [no]\n");
+    heap_print_usage();
+    VG_(printf)(
+            "    --cores=<n>                      simulate <n> cores with private, coherent I1\n"
+            "                                     and D1 caches; 0 shares them [0]\n"
+            "    --core-map=<c1>,<c2>,...         cores of threads 1, 2, ...; the others are\n"
+            "                                     spread round robin [all round robin]\n"
+            "    --cache-level=<name>:<size>,<assoc>,<line_size>[,nine|inclusive|exclusive]\n"
+            "                                     add a cache level between L1 and LL, eg.\n"
+            "                                     L2; repeat for more levels, from the top [none]\n"
+            "    --LL-inclusion=nine|inclusive    does LL evict its victims from the levels\n"
+            "                                     above? [nine: no]\n"
+            "    --replacement=[<level>:]<policy>,...  replacement policy of all cache\n"
+            "                                     levels, or of one: lru, plru, srrip, brrip\n"
+            "                                     or random, eg. plru,LL:srrip [lru]\n"
+            "    --replacement-seed=<n>           seed of the random policy [1]\n"
+            "    --prefetch=[<level>:]<model>,... prefetcher of D1, or of a lower level:\n"
+            "                                     none, next-line, ip-stride or stream,\n"
+            "                                     eg. ip-stride,LL:stream [none]\n"
+            "    --prefetch-latency=<n>           data accesses after which a prefetch is\n"
+            "                                     no longer late [50]\n");
+    tlbsim_print_usage();
+    VG_(printf)(
+            "    --interval=<n>[ms]               snapshot the counts every <n> instructions,\n"
+            "                                     or <n> ms [no snapshots]\n"
             "    --cachegrind-out-file=<file>     output file name [cachegrind.out.%%p]\n"
-            "    --cachegrind-mem-file=<file>     output memory file name [cachegrind.mem.%%p]\n");
+            "    --cachegrind-mem-file=<file>     output memory file name [cachegrind.mem.%%p]\n"
+            "    --interval-out-file=<file>       snapshot file name [cachegrind.intervals.%%p]\n");
+}
+
+/*--------------------------------------------------------------------*/
+/*--- Client requests                                              ---*/
+/*--------------------------------------------------------------------*/
+
+static Bool cg_handle_client_request(ThreadId tid, UWord* args, UWord* ret)
+{
+    if (!VG_IS_TOOL_USERREQ('C', 'G', args[0]))
+        return False;
+
+    switch (args[0]) {
+    case VG_USERREQ__START_MEM_LOG:
+        set_mem_log_capture(True, "client request");
+        break;
+    case VG_USERREQ__STOP_MEM_LOG:
+        set_mem_log_capture(False, "client request");
+        break;
+    default:
+        return False;
+    }
+    *ret = 0; /* meaningless */
+    return True;
 }
 
 static void cg_print_debug_usage(void)
 {
-    VG_(printf)("    (none)\n");
+    VG_(printf)(
+            "    --inline-l1-hits=yes|no          count MRU hits in I1 and D1 inline? [yes]\n");
 }
 
 /*--------------------------------------------------------------------*/
@@ -1687,12 +2858,15 @@ static void cg_pre_clo_init(void)
     VG_(basic_tool_funcs)(cg_post_clo_init, cg_instrument, cg_fini);
 
     VG_(needs_superblock_discards)(cg_discard_superblock_info);
+    VG_(needs_client_requests)(cg_handle_client_request);
     VG_(needs_command_line_options)(cg_process_cmd_line_option, cg_print_usage, cg_print_debug_usage);
 }
 
 static void cg_post_clo_init(void)
 {
     cache_t I1c, D1c, LLc;
+    CacheSimConfig config;
+    Int i;
 
     CC_table = VG_(OSetGen_Create)(offsetof(LineCC, loc), cmp_CodeLoc_LineCC, VG_(malloc), "cg.main.cpci.1", VG_(free));
     instrInfoTable = VG_(OSetGen_Create)(/*keyOff*/ 0, NULL, VG_(malloc), "cg.main.cpci.2", VG_(free));
@@ -1705,6 +2879,10 @@ static void cg_post_clo_init(void)
     // cache lines at any cache level
     min_line_size = (I1c.line_size < D1c.line_size) ? I1c.line_size : D1c.line_size;
     min_line_size = (LLc.line_size < min_line_size) ? LLc.line_size : min_line_size;
+    for (i = 0; i < clo_n_cache_levels; i++)
+        min_line_size = (clo_cache_levels[i].config.line_size < min_line_size) ? clo_cache_levels[i].config.line_size
+                                                                                : min_line_size;
+    check_cache_levels(&I1c, &D1c, &LLc);
 
     Int largest_load_or_store_size = VG_(machine_get_size_of_largest_guest_register)();
     if (min_line_size < largest_load_or_store_size) {
@@ -1717,11 +2895,65 @@ static void cg_post_clo_init(void)
         VG_(exit)(1);
     }
 
-    //sg_build_segment_map();
+    if (clo_regions)
+        segmap_init();
 
-    cachesim_initcaches(I1c, D1c, LLc);
+    if (!clo_cache_sim) {
+        clo_wasted_bytes = False;
+        clo_heap_sites = False;
+        clo_cores = 0;
+        clo_n_cache_levels = 0;
+        clo_tlb_sim = False;
+    }
+    cachesim_default_config(&config);
+    config.I1 = I1c;
+    config.D1 = D1c;
+    config.LL = LLc;
+    for (i = 0; i < clo_n_cache_levels; i++)
+        config.mids[i] = clo_cache_levels[i];
+    config.n_mids = clo_n_cache_levels;
+    config.LL_inclusion = clo_LL_inclusion;
+    parse_level_option("--replacement", clo_replacement, config.policies, cachesim_parse_policy,
+                       "lru, plru, srrip, brrip or random", True);
+    if (clo_cache_sim)
+        parse_level_option("--prefetch", clo_prefetch, config.prefetchers, cachesim_parse_prefetcher,
+                           "none, next-line, ip-stride or stream", False);
+    config.prefetch_latency = clo_prefetch_latency;
+    config.wasted_bytes = clo_wasted_bytes;
+    config.cores = clo_cores;
+    cachesim_seed(clo_replacement_seed);
+    cachesim_initcaches(&config);
+    if (clo_tlb_sim)
+        tlbsim_init(clo_cores);
+    if (clo_heap_sites) {
+        heap_init();
+        sim_heap_sites = True;
+    } else {
+        // vgpreload_cachegrind only holds the malloc replacements.
+        VG_(needs_no_preload)();
+    }
+    init_inline_l1_hits();
+    if (clo_branch_sim)
+        branchpred_init();
+    else
+        clo_ras = 0;
+    if (clo_ras > 0) {
+        ras = VG_(calloc)("cg.main.ras.1", clo_ras, sizeof(Addr));
+        // A call chased into the middle of a superblock is not seen.
+        VG_(clo_vex_control).guest_chase = False;
+    }
+    init_intervals();
+    if (clo_interval > 0)
+        VG_(atfork)(NULL, NULL, interval_atfork_child);
+    if (clo_cores > 0)
+        init_core_map();
+    if (clo_mem_log || clo_cores > 0)
+        VG_(track_start_client_code)(cg_start_client_code);
     if (clo_mem_log) {
         init_mem_logging(clo_cachegrind_mem_file);
+        init_mem_log_capture();
+        if (clo_mem_log_drain)
+            start_mem_log_drainer(clo_mem_log_ring_mb);
     }
 }
 
@@ -0,0 +1,524 @@
+/*--------------------------------------------------------------------*/
+/*--- Compact on-disk format of the memory log.  cg_mem_format.h ---*/
+/*--------------------------------------------------------------------*/
+
+/*
+   This file is part of Cachegrind, a Valgrind tool for cache
+   profiling programs.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+/* This header is shared by the logger (cg_mem_logger.c, part of the tool)
+ * and by the standalone reader (cg_mem_log.c).  It must therefore not call
+ * any library function, neither libc nor VG_(...).
+ *
+ * File layout:
+ *
+ *   CgMemFileHeader
+ *   CgMemChunkHeader, <payload_bytes of encoded records>
+ *   CgMemChunkHeader, <payload_bytes of encoded records>
+ *   ...
+ *   CgMemChunkHeader (CGM_SYMS_MAGIC), <instruction table>
+ *   ...
+ *
+ * All encoder/decoder state is reset at the start of each chunk, so a
+ * chunk can be decoded without looking at the ones before it.
+ *
+ * Record encoding:
+ *
+ *   tag byte:   bits 0-2 AccessType, bits 3-5 CacheHitType,
+ *               bit 6 CGM_TAG_EXT, bit 7 CGM_TAG_SIZE
+ *   [size]      1 byte, present if CGM_TAG_SIZE; otherwise the size is
+ *               the one of the previous record of the same type
+ *   [ext]       1 byte of CGM_EXT_* flags, present if CGM_TAG_EXT;
+ *               followed by the fields flagged in it, in bit order:
+ *                 CGM_EXT_TS:  uvarint timestamp delta
+ *                 CGM_EXT_REGION:  1 byte RegionKind
+ *                 CGM_EXT_INSTR:   zigzag varint instruction id delta
+ *   addr        zigzag varint, delta against the predicted address of
+ *               the record's stream (see cgm_stream_of)
+ *
+ * Without CGM_EXT_TS, the timestamp delta is 1 for ACCESS_INSTR records
+ * (the timestamp is the guest instruction count) and 0 for the others.
+ * Instruction addresses are predicted to follow the previous instruction,
+ * so straight-line code costs two bytes per record or less.
+ *
+ * A tag with type CGM_TYPE_CTRL starts a control record instead; its hit
+ * bits give the kind.  Control records are not counted in n_records.
+ *
+ *   CGM_CTRL_THREAD:  uvarint ThreadId, uvarint thread clock
+ *               The following records were made by that thread.  The
+ *               thread clock (instructions executed by the thread) is the
+ *               one preceding the next record, and then advances by the
+ *               same deltas as the timestamp.
+ *
+ * Since version 2 the logger starts every chunk with a CGM_CTRL_THREAD
+ * record and emits one whenever another thread runs, so the file holds
+ * one stream in global timestamp order that can be split per thread.
+ * Version 1 files have no control records; their records get thread 0.
+ *
+ * Read and write records carry the RegionKind of the previous read or
+ * write record of the chunk (REGION_NONE at its start), unless they have
+ * CGM_EXT_REGION.  Other records have REGION_NONE.  Versions before 3 do
+ * not have regions.
+ *
+ * Likewise, read and write records carry the instruction id of the
+ * previous read or write record (0 at the start of a chunk), unless they
+ * have CGM_EXT_INSTR, whose delta is against that id.  Other records
+ * have instruction 0, unknown.  Ids are assigned by the logger, one per
+ * distinct instruction address.
+ *
+ * Since version 4 the file ends with the instruction table: chunks with
+ * CGM_SYMS_MAGIC whose n_records entries map ids to the instruction's
+ * address and source location.  They are written at exit, so a trace
+ * cut short has ids but no table.  Each entry is:
+ *
+ *   uvarint     id
+ *   varint      address, zigzag delta against the previous entry's
+ *   uvarint     line
+ *   flags       1 byte: CGM_SYM_FILE, CGM_SYM_FN
+ *   [file]      uvarint length, bytes; present if CGM_SYM_FILE, otherwise
+ *               the file is the previous entry's
+ *   [fn]        the same for the function name
+ *
+ * Entries are sorted by address and the previous-entry state is reset at
+ * the start of each chunk.
+ *
+ * Since version 5, LL fills made by a prefetcher (--prefetch) have type
+ * ACCESS_PREFETCH instead of ACCESS_LOAD.
+ */
+
+#ifndef __CG_MEM_FORMAT_H
+#define __CG_MEM_FORMAT_H
+
+#include "cg_arch.h"
+
+#define CGM_MAGIC         "CGMEMLOG"
+#define CGM_MAGIC_LEN     8
+#define CGM_VERSION       5
+#define CGM_CHUNK_MAGIC   0x4b484343 /* "CCHK" */
+#define CGM_SYMS_MAGIC    0x4d595343 /* "CSYM" */
+
+/* Payload bytes of a chunk.  The logger flushes a chunk when it can no
+   longer be sure the next record fits. */
+#define CGM_CHUNK_BYTES   (64 * 1024)
+#define CGM_MAX_VARINT    10
+#define CGM_MAX_RECORD    (4 + 3 * CGM_MAX_VARINT + 1 + 2 * CGM_MAX_VARINT)
+
+#define CGM_TAG_TYPE_MASK 0x07
+#define CGM_TAG_HIT_SHIFT 3
+#define CGM_TAG_HIT_MASK  0x07
+#define CGM_TAG_EXT       0x40
+#define CGM_TAG_SIZE      0x80
+
+#define CGM_EXT_TS        0x01
+#define CGM_EXT_REGION    0x02
+#define CGM_EXT_INSTR     0x04
+
+#define CGM_SYM_FILE      0x01
+#define CGM_SYM_FN        0x02
+/* Longer file and function names are cut. */
+#define CGM_MAX_NAME      1024
+#define CGM_MAX_SYM       (3 * CGM_MAX_VARINT + 1 + 2 * (CGM_MAX_VARINT + CGM_MAX_NAME))
+
+#define CGM_TYPE_CTRL     7
+#define CGM_CTRL_THREAD   0
+
+#define CGM_N_TYPES       (ACCESS_PREFETCH + 1)
+
+typedef struct {
+    UChar magic[CGM_MAGIC_LEN];
+    UInt version;
+    UInt header_size;  /* sizeof(CgMemFileHeader), to allow growing it */
+    UInt addr_bytes;   /* sizeof(Addr) in the logging process */
+    UInt chunk_bytes;  /* maximum payload size of a chunk */
+    UInt flags;        /* reserved, 0 */
+    UInt reserved;
+} CgMemFileHeader;
+
+typedef struct {
+    UInt magic;          /* CGM_CHUNK_MAGIC */
+    UInt payload_bytes;  /* encoded bytes following this header */
+    UInt n_records;
+    UInt reserved;
+    ULong base_timestamp;  /* timestamp preceding the first record */
+} CgMemChunkHeader;
+
+/* The raw record written by versions before the compact format existed.
+   Files starting without CGM_MAGIC are a plain array of these. */
+typedef struct {
+    Addr addr;
+    UChar size;
+    AccessType type;
+    CacheHitType hit_type;
+    ULong timestamp;
+} CgMemLegacyEntry;
+
+/* Delta state, identical on both sides of the codec. */
+typedef struct {
+    Addr next_addr[3];         /* predicted address, per stream */
+    UChar prev_size[CGM_N_TYPES];
+    ULong prev_ts;
+    ThreadId cur_tid;          /* thread of the following records */
+    ULong thread_ts;           /* cur_tid's clock at prev_ts */
+    UChar prev_region;         /* of the previous read or write */
+    UInt prev_instr;           /* of the previous read or write */
+} CgMemCodec;
+
+static inline void cgm_codec_reset(CgMemCodec* c, ULong base_timestamp)
+{
+    Int i;
+    for (i = 0; i < 3; i++)
+        c->next_addr[i] = 0;
+    for (i = 0; i < CGM_N_TYPES; i++)
+        c->prev_size[i] = 0;
+    c->prev_ts = base_timestamp;
+    c->cur_tid = 0;
+    c->thread_ts = base_timestamp;
+    c->prev_region = REGION_NONE;
+    c->prev_instr = 0;
+}
+
+/* Instruction fetches, data accesses and LL fills/evictions each form
+   their own address stream; deltas inside a stream are small. */
+static inline Int cgm_stream_of(AccessType type)
+{
+    switch (type) {
+    case ACCESS_INSTR:
+        return 0;
+    case ACCESS_READ:
+    case ACCESS_WRITE:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+static inline Int cgm_put_uvarint(UChar* p, ULong v)
+{
+    Int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (UChar)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (UChar)v;
+    return n;
+}
+
+/* Returns the number of bytes consumed, or 0 if the input is truncated
+   or malformed. */
+static inline Int cgm_get_uvarint(const UChar* p, const UChar* end, ULong* v)
+{
+    ULong res = 0;
+    Int shift = 0;
+    Int n = 0;
+    while (p + n < end && shift < 64) {
+        UChar b = p[n++];
+        res |= (ULong)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *v = res;
+            return n;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+static inline ULong cgm_zigzag(Long v)
+{
+    return ((ULong)v << 1) ^ (ULong)(v >> 63);
+}
+
+static inline Long cgm_unzigzag(ULong v)
+{
+    return (Long)(v >> 1) ^ -(Long)(v & 1);
+}
+
+static inline ULong cgm_implicit_ts_delta(AccessType type)
+{
+    return type == ACCESS_INSTR ? 1 : 0;
+}
+
+/* Encode 'e' at 'p', which must have room for CGM_MAX_RECORD bytes.
+   Returns the number of bytes written. */
+static inline Int cgm_encode_entry(CgMemCodec* c, UChar* p, const LogEntry* e)
+{
+    Int s = cgm_stream_of(e->type);
+    ULong ts_delta = e->timestamp - c->prev_ts;
+    UChar tag = (UChar)((e->type & CGM_TAG_TYPE_MASK) | ((e->hit_type & CGM_TAG_HIT_MASK) << CGM_TAG_HIT_SHIFT));
+    UChar ext = 0;
+    Int ctrl = 0;
+    Int n = 1;
+
+    // Switch threads, or resync a thread clock that did not advance with
+    // the timestamp.
+    if (e->tid != c->cur_tid || e->thread_ts - c->thread_ts != ts_delta) {
+        p[ctrl++] = CGM_TYPE_CTRL | (CGM_CTRL_THREAD << CGM_TAG_HIT_SHIFT);
+        ctrl += cgm_put_uvarint(p + ctrl, e->tid);
+        ctrl += cgm_put_uvarint(p + ctrl, e->thread_ts - ts_delta);
+        c->cur_tid = e->tid;
+        c->thread_ts = e->thread_ts - ts_delta;
+        p += ctrl;
+    }
+
+    if (ts_delta != cgm_implicit_ts_delta(e->type))
+        ext |= CGM_EXT_TS;
+    if (s == 1 && e->region != c->prev_region)
+        ext |= CGM_EXT_REGION;
+    if (s == 1 && e->instr != c->prev_instr)
+        ext |= CGM_EXT_INSTR;
+    if (ext)
+        tag |= CGM_TAG_EXT;
+    if (e->size != c->prev_size[e->type]) {
+        tag |= CGM_TAG_SIZE;
+        p[n++] = e->size;
+        c->prev_size[e->type] = e->size;
+    }
+    p[0] = tag;
+    if (ext) {
+        p[n++] = ext;
+        if (ext & CGM_EXT_TS)
+            n += cgm_put_uvarint(p + n, ts_delta);
+        if (ext & CGM_EXT_REGION) {
+            p[n++] = e->region;
+            c->prev_region = e->region;
+        }
+        if (ext & CGM_EXT_INSTR) {
+            n += cgm_put_uvarint(p + n, cgm_zigzag((Long)e->instr - (Long)c->prev_instr));
+            c->prev_instr = e->instr;
+        }
+    }
+    n += cgm_put_uvarint(p + n, cgm_zigzag((Long)(e->addr - c->next_addr[s])));
+
+    c->prev_ts = e->timestamp;
+    c->thread_ts = e->thread_ts;
+    c->next_addr[s] = e->type == ACCESS_INSTR ? e->addr + e->size : e->addr;
+    return ctrl + n;
+}
+
+/* Decode a control record; the tag at *pp has already been consumed. */
+static inline Bool cgm_decode_ctrl(CgMemCodec* c, UChar tag, const UChar** pp, const UChar* end)
+{
+    ULong tid, thread_ts;
+    Int n;
+
+    if (((tag >> CGM_TAG_HIT_SHIFT) & CGM_TAG_HIT_MASK) != CGM_CTRL_THREAD)
+        return False;
+    if ((n = cgm_get_uvarint(*pp, end, &tid)) == 0)
+        return False;
+    *pp += n;
+    if ((n = cgm_get_uvarint(*pp, end, &thread_ts)) == 0)
+        return False;
+    *pp += n;
+    c->cur_tid = (ThreadId)tid;
+    c->thread_ts = thread_ts;
+    return True;
+}
+
+/* Decode one record from [*pp, end) into 'e' and advance *pp, consuming
+   any control records before it.  Returns False if the input is truncated
+   or malformed. */
+static inline Bool cgm_decode_entry(CgMemCodec* c, const UChar** pp, const UChar* end, LogEntry* e)
+{
+    const UChar* p = *pp;
+    ULong v, ts_delta;
+    UChar tag, ext = 0;
+    Int n, s;
+
+    for (;;) {
+        if (p >= end)
+            return False;
+        tag = *p++;
+        if ((tag & CGM_TAG_TYPE_MASK) != CGM_TYPE_CTRL)
+            break;
+        if (!cgm_decode_ctrl(c, tag, &p, end))
+            return False;
+    }
+    e->type = (AccessType)(tag & CGM_TAG_TYPE_MASK);
+    e->hit_type = (CacheHitType)((tag >> CGM_TAG_HIT_SHIFT) & CGM_TAG_HIT_MASK);
+    if (e->type >= CGM_N_TYPES)
+        return False;
+    if (tag & CGM_TAG_SIZE) {
+        if (p >= end)
+            return False;
+        c->prev_size[e->type] = *p++;
+    }
+    e->size = c->prev_size[e->type];
+    ts_delta = cgm_implicit_ts_delta(e->type);
+    if (tag & CGM_TAG_EXT) {
+        if (p >= end)
+            return False;
+        ext = *p++;
+        if (ext & CGM_EXT_TS) {
+            if ((n = cgm_get_uvarint(p, end, &ts_delta)) == 0)
+                return False;
+            p += n;
+        }
+        if (ext & CGM_EXT_REGION) {
+            if (p >= end)
+                return False;
+            c->prev_region = *p++;
+        }
+        if (ext & CGM_EXT_INSTR) {
+            if ((n = cgm_get_uvarint(p, end, &v)) == 0)
+                return False;
+            p += n;
+            c->prev_instr = (UInt)((Long)c->prev_instr + cgm_unzigzag(v));
+        }
+    }
+    if ((n = cgm_get_uvarint(p, end, &v)) == 0)
+        return False;
+    p += n;
+
+    s = cgm_stream_of(e->type);
+    e->region = s == 1 ? c->prev_region : REGION_NONE;
+    e->instr = s == 1 ? c->prev_instr : 0;
+    e->addr = c->next_addr[s] + (Addr)cgm_unzigzag(v);
+    e->timestamp = c->prev_ts + ts_delta;
+    e->tid = c->cur_tid;
+    e->thread_ts = c->thread_ts + ts_delta;
+
+    c->prev_ts = e->timestamp;
+    c->thread_ts = e->thread_ts;
+    c->next_addr[s] = e->type == ACCESS_INSTR ? e->addr + e->size : e->addr;
+    *pp = p;
+    return True;
+}
+
+/* An entry of the instruction table.  Names are not NUL terminated; when
+   decoding they point into the input. */
+typedef struct {
+    UInt id;
+    Addr addr;
+    UInt line;
+    const HChar* file;
+    UInt file_len;
+    const HChar* fn;
+    UInt fn_len;
+} CgMemSym;
+
+/* Previous-entry state of an instruction table chunk. */
+typedef struct {
+    Addr prev_addr;
+    const HChar* file;
+    UInt file_len;
+    const HChar* fn;
+    UInt fn_len;
+} CgMemSymCodec;
+
+static inline void cgm_sym_codec_reset(CgMemSymCodec* c)
+{
+    c->prev_addr = 0;
+    c->file = c->fn = 0;
+    c->file_len = c->fn_len = 0;
+}
+
+static inline Int cgm_put_name(UChar* p, const HChar* name, UInt len)
+{
+    Int n;
+    UInt i;
+    if (len > CGM_MAX_NAME)
+        len = CGM_MAX_NAME;
+    n = cgm_put_uvarint(p, len);
+    for (i = 0; i < len; i++)
+        p[n++] = (UChar)name[i];
+    return n;
+}
+
+/* Encode 's' at 'p', which must have room for CGM_MAX_SYM bytes.  Names
+   are compared by address: the logger's are unique strings. */
+static inline Int cgm_encode_sym(CgMemSymCodec* c, UChar* p, const CgMemSym* s)
+{
+    UChar flags = 0;
+    Int n = 0, f;
+
+    n += cgm_put_uvarint(p + n, s->id);
+    n += cgm_put_uvarint(p + n, cgm_zigzag((Long)(s->addr - c->prev_addr)));
+    n += cgm_put_uvarint(p + n, s->line);
+    if (s->file != c->file || c->file_len == 0)
+        flags |= CGM_SYM_FILE;
+    if (s->fn != c->fn || c->fn_len == 0)
+        flags |= CGM_SYM_FN;
+    f = n++;
+    if (flags & CGM_SYM_FILE)
+        n += cgm_put_name(p + n, s->file, s->file_len);
+    if (flags & CGM_SYM_FN)
+        n += cgm_put_name(p + n, s->fn, s->fn_len);
+    p[f] = flags;
+
+    c->prev_addr = s->addr;
+    c->file = s->file;
+    c->file_len = s->file_len;
+    c->fn = s->fn;
+    c->fn_len = s->fn_len;
+    return n;
+}
+
+static inline Bool cgm_get_name(const UChar** pp, const UChar* end, const HChar** name, UInt* len)
+{
+    ULong v;
+    Int n = cgm_get_uvarint(*pp, end, &v);
+    if (n == 0 || v > CGM_MAX_NAME || (ULong)(end - (*pp + n)) < v)
+        return False;
+    *name = (const HChar*)(*pp + n);
+    *len = (UInt)v;
+    *pp += n + v;
+    return True;
+}
+
+/* Decode one instruction table entry from [*pp, end) and advance *pp.
+   Returns False if the input is truncated or malformed. */
+static inline Bool cgm_decode_sym(CgMemSymCodec* c, const UChar** pp, const UChar* end, CgMemSym* s)
+{
+    const UChar* p = *pp;
+    ULong v;
+    Int n;
+    UChar flags;
+
+    if ((n = cgm_get_uvarint(p, end, &v)) == 0)
+        return False;
+    s->id = (UInt)v;
+    p += n;
+    if ((n = cgm_get_uvarint(p, end, &v)) == 0)
+        return False;
+    s->addr = c->prev_addr + (Addr)cgm_unzigzag(v);
+    p += n;
+    if ((n = cgm_get_uvarint(p, end, &v)) == 0)
+        return False;
+    s->line = (UInt)v;
+    p += n;
+    if (p >= end)
+        return False;
+    flags = *p++;
+    if ((flags & CGM_SYM_FILE) && !cgm_get_name(&p, end, &c->file, &c->file_len))
+        return False;
+    if ((flags & CGM_SYM_FN) && !cgm_get_name(&p, end, &c->fn, &c->fn_len))
+        return False;
+    s->file = c->file;
+    s->file_len = c->file_len;
+    s->fn = c->fn;
+    s->fn_len = c->fn_len;
+    c->prev_addr = s->addr;
+    *pp = p;
+    return True;
+}
+
+#endif  // __CG_MEM_FORMAT_H
+
+/*--------------------------------------------------------------------*/
+/*--- end                                          cg_mem_format.h ---*/
+/*--------------------------------------------------------------------*/
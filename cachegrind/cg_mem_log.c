@@ -14,38 +14,123 @@
 #include "pub_tool_xarray.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include "cg_arch.h"
+#include "cg_mem_format.h"
+#include "cg_mem_reuse.h"
 
 static const char* argv0 = "cg_mem_log";
-static int mem_log_fd = -1;
-static LogBuffer buffer1;
 static int mem_log_debug = 0;
 
+// --thread=<tid>: only print the records of that thread.
+static Int only_tid = -1;
+// --split=<prefix>: write the records of thread N to <prefix>.N instead.
+static const char* split_prefix = NULL;
+
+// Analysis modes; when any is on, records are not printed.
+static Bool do_reuse = False;      // --reuse: reuse distance histograms
+static ULong wss_window = 0;       // --wss=<n>: working set every n instrs
+static Bool data_only = False;     // --data-only: ignore instruction fetches
+static UInt line_shift = 6;        // --line-size=<n>
+static UInt page_shift = 12;       // --page-size=<n>
+
+// --jobs=<n>: number of decoding threads.
+static UInt n_jobs = 0;
+
+// --regions: data access totals per region, from traces written with
+// --regions=yes.
+static Bool do_regions = False;
+
 typedef struct MemStats {
-    Int total_size;
-    Int total_count;
-    Int total_accesses;
-    Int total_hits;
-    Int total_misses;
+    ULong total_size;
+    ULong total_accesses;
+    ULong total_l1_misses;
+    ULong total_ll_misses;
 } MemStats;
 
-enum MemType {
-    DATA_READ,
-    DATA_WRITE,
-    INSTRUCTION_READ,
-    INSTRUCTION_WRITE,
-    STACK_READ,
-    STACK_WRITE,
-    HEAP_READ,
-    HEAP_WRITE,
-    OTHER,
-};
-
-static MemStats mem_stats[OTHER + 1];
+// --by-fn, --by-line: data accesses and misses per function or source
+// line, from the trace's instruction table; --top=<n> of them.
+static Bool by_fn = False;
+static Bool by_line = False;
+static UInt top_n = 20;
+
+typedef struct {
+    ULong Dr, D1mr, DLmr;
+    ULong Dw, D1mw, DLmw;
+} InstrStats;
+/*------------------------------------------------------------*/
+/*--- Parallel reading                                     ---*/
+/*------------------------------------------------------------*/
+
+/* Every input file is mapped and split into chunks, which worker threads
+ * decode in any order.  Each file has a consumer thread that takes the
+ * decoded chunks in file order, so the output is the same as a sequential
+ * read no matter how many workers there are.  The consumer of the first
+ * file writes to stdout; the others write to a temporary file that is
+ * copied to stdout once the files before it are done.
+ *
+ * Workers only run CHUNKS_AHEAD_PER_JOB * n_jobs chunks ahead of each
+ * consumer, which bounds the memory held by decoded chunks.
+ */
+
+#define CHUNKS_AHEAD_PER_JOB 4
+// Legacy files have no chunks; they are cut into slices of this many records.
+#define LEGACY_CHUNK_RECORDS (64 * 1024)
+
+typedef struct {
+    const UChar* data;     // encoded records, or CgMemLegacyEntry array
+    UInt payload_bytes;
+    UInt n_records;
+    ULong base_timestamp;
+
+    // Filled in by the worker.
+    LogEntry* entries;
+    char* text;  // formatted lines, when just printing
+    size_t text_len;
+    Bool ready;
+} Chunk;
+
+typedef struct {
+    const char* name;
+    UInt index;
+    UChar* map;
+    size_t map_size;
+    Bool legacy;
+
+    Chunk* chunks;
+    UInt n_chunks;
+
+    // The instruction table, indexed by id; entries with a NULL file are
+    // unused.
+    CgMemSym* syms;
+    UInt n_syms;
+    UInt next_to_decode;  // protected by work_lock
+    UInt consumed;        // protected by work_lock
+
+    FILE* out;
+    FILE** split_files;
+    UInt n_split_files;
+
+    ReuseEngine* line_engine;
+    ReuseEngine* page_engine;
+    ULong wss_next;  // timestamp ending the current window
+    ULong last_ts;   // timestamp of the last analysed record
+    MemStats mem_stats[N_REGIONS][2];  // [region][0 = read, 1 = write]
+    InstrStats* instr_stats;           // indexed by id, n_syms of them
+} MemLogFile;
+
+static MemLogFile* files = NULL;
+static UInt n_files = 0;
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
 static void Debug(const char* fmt, ...)
 {
     if (!mem_log_debug)
@@ -59,63 +144,661 @@ static void Debug(const char* fmt, ...)
     fprintf(stderr, "%s\n", str);
 }
 
-static void open_mem_log_file(const HChar* filename)
+static void* xmalloc(size_t n)
+{
+    void* p = malloc(n ? n : 1);
+    if (p == NULL) {
+        fprintf(stderr, "%s: out of memory\n", argv0);
+        exit(1);
+    }
+    return p;
+}
+
+static void bad_mem_log_file(const MemLogFile* f, const char* why)
+{
+    fprintf(stderr, "%s: %s: %s\n", argv0, f->name, why);
+    exit(1);
+}
+
+static void add_chunk(MemLogFile* f, const UChar* data, UInt payload_bytes, UInt n_records, ULong base_timestamp)
 {
-    // Initialize buffers
-    memset(&buffer1, 0, sizeof(LogBuffer));
+    Chunk* c;
 
-    // Copy filename
+    if ((f->n_chunks & (f->n_chunks - 1)) == 0) {
+        f->chunks = realloc(f->chunks, (f->n_chunks ? 2 * f->n_chunks : 1) * sizeof(Chunk));
+        if (f->chunks == NULL) {
+            fprintf(stderr, "%s: out of memory\n", argv0);
+            exit(1);
+        }
+    }
+    c = &f->chunks[f->n_chunks++];
+    memset(c, 0, sizeof(*c));
+    c->data = data;
+    c->payload_bytes = payload_bytes;
+    c->n_records = n_records;
+    c->base_timestamp = base_timestamp;
+}
+
+static void add_syms(MemLogFile* f, const UChar* data, UInt payload_bytes, UInt n_records)
+{
+    CgMemSymCodec codec;
+    const UChar* p = data;
+    const UChar* end = data + payload_bytes;
+
+    cgm_sym_codec_reset(&codec);
+    for (UInt i = 0; i < n_records; i++) {
+        CgMemSym sym;
+        if (!cgm_decode_sym(&codec, &p, end, &sym))
+            bad_mem_log_file(f, "corrupt instruction table");
+        if (sym.id >= f->n_syms) {
+            UInt n = f->n_syms ? f->n_syms : 1024;
+            while (n <= sym.id)
+                n *= 2;
+            f->syms = realloc(f->syms, n * sizeof(CgMemSym));
+            if (f->syms == NULL) {
+                fprintf(stderr, "%s: out of memory\n", argv0);
+                exit(1);
+            }
+            memset(f->syms + f->n_syms, 0, (n - f->n_syms) * sizeof(CgMemSym));
+            f->n_syms = n;
+        }
+        f->syms[sym.id] = sym;
+    }
+}
+
+// Map the file and find its chunks.  Only the chunk headers, and the
+// instruction table, are read.
+static void open_mem_log_file(MemLogFile* f, const char* filename, UInt index)
+{
+    struct stat st;
+    CgMemFileHeader fh;
+    size_t pos;
 
     Debug("Opening log file: %s", filename);
-    // Open log file
-    int o = open(filename, O_RDONLY);
-    if (o < 0) {
+    memset(f, 0, sizeof(*f));
+    f->name = filename;
+    f->index = index;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
         fprintf(stderr, "cannot open mem file '%s': %m\n", filename);
         exit(1);
+    }
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s: cannot stat: %m\n", argv0, filename);
+        exit(1);
+    }
+    f->map_size = st.st_size;
+    if (f->map_size > 0) {
+        void* m = mmap(NULL, f->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            fprintf(stderr, "%s: %s: cannot mmap: %m\n", argv0, filename);
+            exit(1);
+        }
+        madvise(m, f->map_size, MADV_SEQUENTIAL);
+        f->map = m;
+    }
+    close(fd);
+
+    if (f->map_size < sizeof(fh) || memcmp(f->map, CGM_MAGIC, CGM_MAGIC_LEN) != 0) {
+        // Files written before the compact format are a raw array of entries.
+        size_t n = f->map_size / sizeof(CgMemLegacyEntry);
+        Debug("Reading legacy raw format");
+        f->legacy = True;
+        for (pos = 0; pos < n; pos += LEGACY_CHUNK_RECORDS) {
+            UInt len = n - pos < LEGACY_CHUNK_RECORDS ? n - pos : LEGACY_CHUNK_RECORDS;
+            add_chunk(f, f->map + pos * sizeof(CgMemLegacyEntry), len * sizeof(CgMemLegacyEntry), len, 0);
+        }
+        return;
+    }
+
+    memcpy(&fh, f->map, sizeof(fh));
+    if (fh.version > CGM_VERSION)
+        bad_mem_log_file(f, "unsupported format version");
+    if (fh.addr_bytes != sizeof(Addr))
+        bad_mem_log_file(f, "written by a process with a different word size");
+    if (fh.header_size < sizeof(fh))
+        bad_mem_log_file(f, "bad file header");
+
+    for (pos = fh.header_size; pos < f->map_size;) {
+        CgMemChunkHeader ch;
+        if (f->map_size - pos < sizeof(ch))
+            bad_mem_log_file(f, "truncated file");
+        memcpy(&ch, f->map + pos, sizeof(ch));
+        if (ch.magic != CGM_CHUNK_MAGIC && ch.magic != CGM_SYMS_MAGIC)
+            bad_mem_log_file(f, "bad chunk header");
+        pos += sizeof(ch);
+        if (f->map_size - pos < ch.payload_bytes)
+            bad_mem_log_file(f, "truncated chunk");
+        if (ch.magic == CGM_SYMS_MAGIC)
+            add_syms(f, f->map + pos, ch.payload_bytes, ch.n_records);
+        else
+            add_chunk(f, f->map + pos, ch.payload_bytes, ch.n_records, ch.base_timestamp);
+        pos += ch.payload_bytes;
+    }
+    Debug("%s: %u chunks", filename, f->n_chunks);
+}
+
+static void close_mem_log_file(MemLogFile* f)
+{
+    if (f->map)
+        munmap(f->map, f->map_size);
+    free(f->chunks);
+    free(f->syms);
+    f->map = NULL;
+    f->chunks = NULL;
+    f->syms = NULL;
+}
+
+/*------------------------------------------------------------*/
+/*--- Decoding (worker threads)                            ---*/
+/*------------------------------------------------------------*/
+
+static Bool analysing(void)
+{
+    return do_reuse || wss_window > 0 || do_regions || by_fn || by_line;
+}
+
+static void decode_chunk(const MemLogFile* f, Chunk* c)
+{
+    c->entries = xmalloc(c->n_records * sizeof(LogEntry));
+    if (f->legacy) {
+        const CgMemLegacyEntry* raw = (const CgMemLegacyEntry*)c->data;
+        for (UInt i = 0; i < c->n_records; i++) {
+            c->entries[i].addr = raw[i].addr;
+            c->entries[i].size = raw[i].size;
+            c->entries[i].region = REGION_NONE;
+            c->entries[i].type = raw[i].type;
+            c->entries[i].hit_type = raw[i].hit_type;
+            c->entries[i].timestamp = raw[i].timestamp;
+            c->entries[i].tid = 0;
+            c->entries[i].instr = 0;
+            c->entries[i].thread_ts = raw[i].timestamp;
+        }
     } else {
-        mem_log_fd = o;
+        CgMemCodec codec;
+        const UChar* p = c->data;
+        const UChar* end = c->data + c->payload_bytes;
+
+        cgm_codec_reset(&codec, c->base_timestamp);
+        for (UInt i = 0; i < c->n_records; i++) {
+            if (!cgm_decode_entry(&codec, &p, end, &c->entries[i]))
+                bad_mem_log_file(f, "corrupt chunk");
+        }
+        if (p != end)
+            bad_mem_log_file(f, "chunk has trailing bytes");
+    }
+}
+
+static const CgMemSym* sym_of(const MemLogFile* f, UInt instr)
+{
+    if (instr == 0 || instr >= f->n_syms || f->syms[instr].file == NULL)
+        return NULL;
+    return &f->syms[instr];
+}
+
+/* Records come in global timestamp order, i.e. already merged.  Each line
+   is: timestamp tid thread-clock address size type hit region pc, where pc
+   is the address of the instruction making a read or write, or "-". */
+static Int format_entry(const MemLogFile* f, char* buf, size_t len, const LogEntry* e)
+{
+    const CgMemSym* sym = sym_of(f, e->instr);
+    char pc[24] = "-";
+
+    if (sym)
+        snprintf(pc, sizeof(pc), "%p", (void*)sym->addr);
+    return snprintf(buf, len, "%llu %u %llu %p %d %c %c %s %s\n", e->timestamp, e->tid, e->thread_ts,
+                    (void*)e->addr, (int)e->size, access_type_char(e->type), cache_hit_char(e->hit_type),
+                    region_name(e->region), pc);
+}
+
+// When just printing, the worker formats the chunk too.
+static void format_chunk(const MemLogFile* f, Chunk* c)
+{
+    // Lines are far shorter than this.
+    const size_t max_line = 128;
+    size_t pos = 0;
+
+    c->text = xmalloc(c->n_records * max_line);
+    for (UInt i = 0; i < c->n_records; i++) {
+        if (only_tid >= 0 && c->entries[i].tid != (ThreadId)only_tid)
+            continue;
+        pos += format_entry(f, c->text + pos, max_line, &c->entries[i]);
+    }
+    c->text_len = pos;
+    free(c->entries);
+    c->entries = NULL;
+}
+
+// Pick the next chunk to decode: the earliest one, over all files, that is
+// not too far ahead of its consumer.  Returns False when all are taken.
+static Bool take_chunk(MemLogFile** fp, Chunk** cp)
+{
+    UInt ahead = CHUNKS_AHEAD_PER_JOB * n_jobs;
+
+    pthread_mutex_lock(&work_lock);
+    for (;;) {
+        Bool left = False;
+        for (UInt i = 0; i < n_files; i++) {
+            MemLogFile* f = &files[i];
+            if (f->next_to_decode == f->n_chunks)
+                continue;
+            left = True;
+            if (f->next_to_decode < f->consumed + ahead) {
+                *fp = f;
+                *cp = &f->chunks[f->next_to_decode++];
+                pthread_mutex_unlock(&work_lock);
+                return True;
+            }
+        }
+        if (!left) {
+            pthread_mutex_unlock(&work_lock);
+            return False;
+        }
+        pthread_cond_wait(&work_cond, &work_lock);
+    }
+}
+
+static void* worker_main(void* arg)
+{
+    MemLogFile* f;
+    Chunk* c;
+
+    while (take_chunk(&f, &c)) {
+        decode_chunk(f, c);
+        if (!analysing() && !split_prefix)
+            format_chunk(f, c);
+        pthread_mutex_lock(&work_lock);
+        c->ready = True;
+        pthread_cond_broadcast(&work_cond);
+        pthread_mutex_unlock(&work_lock);
+    }
+    return NULL;
+}
+
+/*------------------------------------------------------------*/
+/*--- Consuming (one thread per file)                      ---*/
+/*------------------------------------------------------------*/
+
+static FILE* split_file_for(MemLogFile* f, ThreadId tid)
+{
+    if (tid >= f->n_split_files) {
+        UInt n = tid + 1;
+        f->split_files = realloc(f->split_files, n * sizeof(FILE*));
+        if (f->split_files == NULL) {
+            fprintf(stderr, "%s: out of memory\n", argv0);
+            exit(1);
+        }
+        memset(f->split_files + f->n_split_files, 0, (n - f->n_split_files) * sizeof(FILE*));
+        f->n_split_files = n;
+    }
+    if (f->split_files[tid] == NULL) {
+        // With several input files, each gets its own set.
+        char name[strlen(split_prefix) + 32];
+        if (n_files == 1)
+            snprintf(name, sizeof(name), "%s.%u", split_prefix, tid);
+        else
+            snprintf(name, sizeof(name), "%s.%u.%u", split_prefix, f->index, tid);
+        Debug("Creating %s", name);
+        f->split_files[tid] = fopen(name, "w");
+        if (f->split_files[tid] == NULL) {
+            fprintf(stderr, "%s: cannot create '%s': %m\n", argv0, name);
+            exit(1);
+        }
+    }
+    return f->split_files[tid];
+}
+
+static void close_split_files(MemLogFile* f)
+{
+    for (UInt i = 0; i < f->n_split_files; i++) {
+        if (f->split_files[i])
+            fclose(f->split_files[i]);
+    }
+    free(f->split_files);
+    f->split_files = NULL;
+    f->n_split_files = 0;
+}
+
+static void start_analysis(MemLogFile* f)
+{
+    if (!analysing())
+        return;
+    f->line_engine = reuse_new("line", line_shift);
+    f->page_engine = reuse_new("page", page_shift);
+    f->wss_next = wss_window;
+    if (by_fn || by_line) {
+        f->instr_stats = calloc(f->n_syms ? f->n_syms : 1, sizeof(InstrStats));
+        if (f->instr_stats == NULL) {
+            fprintf(stderr, "%s: out of memory\n", argv0);
+            exit(1);
+        }
+    }
+    if (wss_window > 0)
+        fprintf(f->out, "# working set per %llu instructions: timestamp lines pages\n", wss_window);
+}
+
+static void end_window(MemLogFile* f, ULong timestamp)
+{
+    ULong lines = reuse_end_window(f->line_engine);
+    ULong pages = reuse_end_window(f->page_engine);
+    fprintf(f->out, "%llu %llu %llu\n", timestamp, lines, pages);
+}
+
+static void print_region_stats(const MemLogFile* f)
+{
+    fprintf(f->out, "%-8s %-5s %14s %14s %12s %12s %8s %8s\n", "region", "kind", "accesses", "bytes", "L1 misses",
+            "LL misses", "L1 mr%", "LL mr%");
+    for (Int r = 0; r < N_REGIONS; r++) {
+        for (Int w = 0; w < 2; w++) {
+            const MemStats* ms = &f->mem_stats[r][w];
+            if (ms->total_accesses == 0)
+                continue;
+            fprintf(f->out, "%-8s %-5s %14llu %14llu %12llu %12llu %7.3f%% %7.3f%%\n", region_name(r),
+                    w ? "write" : "read", ms->total_accesses, ms->total_size, ms->total_l1_misses,
+                    ms->total_ll_misses, ms->total_l1_misses * 100.0 / ms->total_accesses,
+                    ms->total_ll_misses * 100.0 / ms->total_accesses);
+        }
+    }
+}
+
+typedef struct {
+    const CgMemSym* sym;  // NULL for the accesses of unknown instructions
+    InstrStats st;
+} AttrGroup;
+
+static int cmp_name(const HChar* a, UInt a_len, const HChar* b, UInt b_len)
+{
+    int r = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    return r ? r : (a_len > b_len) - (a_len < b_len);
+}
+
+// Order by file, function, and with --by-line, line; unknown first.
+static int cmp_attr_location(const void* va, const void* vb)
+{
+    const CgMemSym* a = ((const AttrGroup*)va)->sym;
+    const CgMemSym* b = ((const AttrGroup*)vb)->sym;
+    int r;
+
+    if (a == NULL || b == NULL)
+        return (a != NULL) - (b != NULL);
+    if ((r = cmp_name(a->file, a->file_len, b->file, b->file_len)) != 0)
+        return r;
+    if ((r = cmp_name(a->fn, a->fn_len, b->fn, b->fn_len)) != 0)
+        return r;
+    return by_line ? (a->line > b->line) - (a->line < b->line) : 0;
+}
+
+// Most LL misses first, then most L1 misses, then most accesses.
+static int cmp_attr_cost(const void* va, const void* vb)
+{
+    const InstrStats* a = &((const AttrGroup*)va)->st;
+    const InstrStats* b = &((const AttrGroup*)vb)->st;
+    ULong x, y;
+
+    x = a->DLmr + a->DLmw, y = b->DLmr + b->DLmw;
+    if (x != y)
+        return x < y ? 1 : -1;
+    x = a->D1mr + a->D1mw, y = b->D1mr + b->D1mw;
+    if (x != y)
+        return x < y ? 1 : -1;
+    x = a->Dr + a->Dw, y = b->Dr + b->Dw;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void add_instr_stats(InstrStats* to, const InstrStats* from)
+{
+    to->Dr += from->Dr;
+    to->D1mr += from->D1mr;
+    to->DLmr += from->DLmr;
+    to->Dw += from->Dw;
+    to->D1mw += from->D1mw;
+    to->DLmw += from->DLmw;
+}
+
+static void print_attribution(MemLogFile* f)
+{
+    AttrGroup* groups = xmalloc((f->n_syms + 1) * sizeof(AttrGroup));
+    UInt n = 0, merged = 0;
+    InstrStats total;
+
+    memset(&total, 0, sizeof(total));
+    for (UInt id = 0; id < (f->n_syms ? f->n_syms : 1); id++) {
+        const InstrStats* st = &f->instr_stats[id];
+        if (st->Dr + st->Dw == 0)
+            continue;
+        groups[n].sym = sym_of(f, id);
+        groups[n].st = *st;
+        add_instr_stats(&total, st);
+        n++;
+    }
+    qsort(groups, n, sizeof(AttrGroup), cmp_attr_location);
+    for (UInt i = 0; i < n; i++) {
+        if (merged > 0 && cmp_attr_location(&groups[merged - 1], &groups[i]) == 0)
+            add_instr_stats(&groups[merged - 1].st, &groups[i].st);
+        else
+            groups[merged++] = groups[i];
     }
+    qsort(groups, merged, sizeof(AttrGroup), cmp_attr_cost);
+
+    fprintf(f->out, "data accesses by %s (top %u of %u)\n", by_line ? "line" : "function",
+            merged < top_n ? merged : top_n, merged);
+    fprintf(f->out, "%12s %10s %10s %12s %10s %10s  %s\n", "Dr", "D1mr", "DLmr", "Dw", "D1mw", "DLmw",
+            by_line ? "file:function:line" : "file:function");
+    fprintf(f->out, "%12llu %10llu %10llu %12llu %10llu %10llu  %s\n", total.Dr, total.D1mr, total.DLmr, total.Dw,
+            total.D1mw, total.DLmw, "PROGRAM TOTALS");
+    for (UInt i = 0; i < merged && i < top_n; i++) {
+        const InstrStats* st = &groups[i].st;
+        const CgMemSym* sym = groups[i].sym;
+        fprintf(f->out, "%12llu %10llu %10llu %12llu %10llu %10llu  ", st->Dr, st->D1mr, st->DLmr, st->Dw, st->D1mw,
+                st->DLmw);
+        if (sym == NULL)
+            fprintf(f->out, "???\n");
+        else if (by_line)
+            fprintf(f->out, "%.*s:%.*s:%u\n", (int)sym->file_len, sym->file, (int)sym->fn_len, sym->fn, sym->line);
+        else
+            fprintf(f->out, "%.*s:%.*s\n", (int)sym->file_len, sym->file, (int)sym->fn_len, sym->fn);
+    }
+    free(groups);
 }
 
-static void dump_buffer(LogEntry* buffer, Int n)
+static void finish_analysis(MemLogFile* f)
 {
-    Debug("Dumping buffer\n");
-    for (Int i = 0; i < n; i++, buffer++) {
-        printf("%llu %p %d %c %c\n", buffer->timestamp, (void*)buffer->addr, (int)buffer->size,
-               access_type_char(buffer->type), cache_hit_char(buffer->hit_type));
+    if (!analysing())
+        return;
+    // The last, partial, window.
+    if (wss_window > 0)
+        end_window(f, f->last_ts);
+    if (do_reuse) {
+        reuse_print(f->line_engine, f->out);
+        reuse_print(f->page_engine, f->out);
     }
+    if (do_regions)
+        print_region_stats(f);
+    if (by_fn || by_line)
+        print_attribution(f);
+    free(f->instr_stats);
+    f->instr_stats = NULL;
+    reuse_delete(f->line_engine);
+    reuse_delete(f->page_engine);
+    f->line_engine = f->page_engine = NULL;
 }
 
-static int read_buffer(void)
+// Only the accesses made by the program count, not the LL fills and
+// evictions.  The time axis is the thread clock with --thread.
+static void analyse_entry(MemLogFile* f, const LogEntry* e)
 {
-    LogEntry buffer[BUFFER_SIZE];
-    Debug("Reading buffer");
-    Int n = read(mem_log_fd, (void*)buffer, sizeof(buffer));
-    if (n <= 0) {
-        return -1;
+    ULong ts = only_tid >= 0 ? e->thread_ts : e->timestamp;
+
+    f->last_ts = ts;
+    if (wss_window > 0) {
+        while (ts >= f->wss_next) {
+            end_window(f, f->wss_next);
+            f->wss_next += wss_window;
+        }
+    }
+    if (e->type == ACCESS_READ || e->type == ACCESS_WRITE) {
+        MemStats* ms = &f->mem_stats[e->region < N_REGIONS ? e->region : REGION_NONE][e->type == ACCESS_WRITE];
+        ms->total_size += e->size;
+        ms->total_accesses++;
+        ms->total_l1_misses += e->hit_type != CACHE_HIT_L1;
+        ms->total_ll_misses += e->hit_type == CACHE_MISS_LL;
+        if (f->instr_stats) {
+            // Unknown instructions, or a trace without a table, go to id 0.
+            InstrStats* st = &f->instr_stats[e->instr < f->n_syms ? e->instr : 0];
+            if (e->type == ACCESS_READ) {
+                st->Dr++;
+                st->D1mr += e->hit_type != CACHE_HIT_L1;
+                st->DLmr += e->hit_type == CACHE_MISS_LL;
+            } else {
+                st->Dw++;
+                st->D1mw += e->hit_type != CACHE_HIT_L1;
+                st->DLmw += e->hit_type == CACHE_MISS_LL;
+            }
+        }
     }
-    Debug("Read %d entries", n);
-    dump_buffer(buffer, n / sizeof(LogEntry));
-    return n;
+    if (e->type == ACCESS_INSTR ? data_only : e->type != ACCESS_READ && e->type != ACCESS_WRITE)
+        return;
+    reuse_access(f->line_engine, e->addr, e->size);
+    reuse_access(f->page_engine, e->addr, e->size);
 }
 
-static void read_all_buffers(void)
+static void consume_chunk(MemLogFile* f, Chunk* c)
 {
-    while (read_buffer() > 0) {
-        ;
+    if (c->text) {
+        if (fwrite(c->text, 1, c->text_len, f->out) != c->text_len) {
+            fprintf(stderr, "%s: write error: %m\n", argv0);
+            exit(1);
+        }
+        free(c->text);
+        c->text = NULL;
+        return;
+    }
+    for (UInt i = 0; i < c->n_records; i++) {
+        const LogEntry* e = &c->entries[i];
+        if (only_tid >= 0 && e->tid != (ThreadId)only_tid)
+            continue;
+        if (analysing()) {
+            analyse_entry(f, e);
+        } else {
+            char line[128];
+            fwrite(line, 1, format_entry(f, line, sizeof(line), e), split_file_for(f, e->tid));
+        }
     }
-    close(mem_log_fd);
-    mem_log_fd = -1;
+    free(c->entries);
+    c->entries = NULL;
+}
+
+static void* consumer_main(void* arg)
+{
+    MemLogFile* f = arg;
+
+    start_analysis(f);
+    for (UInt i = 0; i < f->n_chunks; i++) {
+        Chunk* c = &f->chunks[i];
+        pthread_mutex_lock(&work_lock);
+        while (!c->ready)
+            pthread_cond_wait(&work_cond, &work_lock);
+        pthread_mutex_unlock(&work_lock);
+
+        consume_chunk(f, c);
+
+        pthread_mutex_lock(&work_lock);
+        f->consumed++;
+        pthread_cond_broadcast(&work_cond);
+        pthread_mutex_unlock(&work_lock);
+    }
+    finish_analysis(f);
+    close_split_files(f);
+    return NULL;
+}
+
+static void copy_to_stdout(FILE* in)
+{
+    char buf[64 * 1024];
+    size_t n;
+
+    rewind(in);
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, stdout) != n) {
+            fprintf(stderr, "%s: write error: %m\n", argv0);
+            exit(1);
+        }
+    }
+}
+
+static void read_all_files(void)
+{
+    pthread_t* workers = xmalloc(n_jobs * sizeof(pthread_t));
+    pthread_t* consumers = xmalloc(n_files * sizeof(pthread_t));
+    UInt i;
+
+    for (i = 0; i < n_files; i++) {
+        files[i].out = i == 0 ? stdout : tmpfile();
+        if (files[i].out == NULL) {
+            fprintf(stderr, "%s: cannot create temporary file: %m\n", argv0);
+            exit(1);
+        }
+        if (pthread_create(&consumers[i], NULL, consumer_main, &files[i]) != 0) {
+            fprintf(stderr, "%s: cannot create thread\n", argv0);
+            exit(1);
+        }
+    }
+    for (i = 0; i < n_jobs; i++) {
+        if (pthread_create(&workers[i], NULL, worker_main, NULL) != 0) {
+            fprintf(stderr, "%s: cannot create thread\n", argv0);
+            exit(1);
+        }
+    }
+    for (i = 0; i < n_files; i++) {
+        pthread_join(consumers[i], NULL);
+        if (i > 0) {
+            copy_to_stdout(files[i].out);
+            fclose(files[i].out);
+        }
+        close_mem_log_file(&files[i]);
+    }
+    for (i = 0; i < n_jobs; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    free(consumers);
 }
 
 static void usage(void)
 {
     fprintf(stderr,
             "Usage: %s [options] <filename1> <filename2> ...\n"
-            "    --help|-h               print this help message\n",
+            "    --thread=<tid>          only print the accesses of thread <tid>\n"
+            "    --split=<prefix>        write the accesses of thread N to <prefix>.N\n"
+            "                            (<prefix>.<file>.N with several input files)\n"
+            "    --reuse                 print reuse distance histograms and LRU hit rates\n"
+            "    --wss=<n>               print the working set size every <n> instructions\n"
+            "    --regions               print data access totals per region (needs a trace\n"
+            "                            written with --regions=yes)\n"
+            "    --by-fn                 print data accesses and misses per function\n"
+            "    --by-line               print data accesses and misses per source line\n"
+            "    --top=<n>               how many functions or lines to print [20]\n"
+            "    --data-only             ignore instruction fetches in --reuse and --wss\n"
+            "    --line-size=<n>         cache line size for --reuse and --wss [64]\n"
+            "    --page-size=<n>         page size for --reuse and --wss [4096]\n"
+            "    --jobs=<n>|-j <n>       decode with <n> threads [number of CPUs]\n"
+            "    --debug|-d              print debugging messages\n"
+            "    --help|-h               print this help message\n"
+            "  Each output line is: timestamp tid thread-clock address size type hit region pc\n"
+            "  Files are read concurrently; their output is printed in argument order.\n",
             argv0);
     exit(1);
 }
+// Parse a power of two size and return its log2.
+static UInt log2_of(const char* s)
+{
+    unsigned long v = strtoul(s, NULL, 0);
+    if (v == 0 || (v & (v - 1)) != 0) {
+        fprintf(stderr, "%s: '%s' is not a power of two\n", argv0, s);
+        exit(1);
+    }
+    return __builtin_ctzl(v);
+}
 
 int main(int argc, char** argv)
 {
@@ -137,6 +820,60 @@ int main(int argc, char** argv)
             mem_log_debug = True;
             continue;
         }
+        if (strncmp(argv[i], "--thread=", 9) == 0) {
+            only_tid = atoi(argv[i] + 9);
+            continue;
+        }
+        if (strncmp(argv[i], "--split=", 8) == 0) {
+            split_prefix = argv[i] + 8;
+            continue;
+        }
+        if (strcmp(argv[i], "--reuse") == 0) {
+            do_reuse = True;
+            continue;
+        }
+        if (strncmp(argv[i], "--wss=", 6) == 0) {
+            wss_window = strtoull(argv[i] + 6, NULL, 0);
+            if (wss_window == 0)
+                usage();
+            continue;
+        }
+        if (strcmp(argv[i], "--regions") == 0) {
+            do_regions = True;
+            continue;
+        }
+        if (strcmp(argv[i], "--by-fn") == 0) {
+            by_fn = True;
+            continue;
+        }
+        if (strcmp(argv[i], "--by-line") == 0) {
+            by_line = True;
+            continue;
+        }
+        if (strncmp(argv[i], "--top=", 6) == 0) {
+            top_n = atoi(argv[i] + 6);
+            continue;
+        }
+        if (strcmp(argv[i], "--data-only") == 0) {
+            data_only = True;
+            continue;
+        }
+        if (strncmp(argv[i], "--line-size=", 12) == 0) {
+            line_shift = log2_of(argv[i] + 12);
+            continue;
+        }
+        if (strncmp(argv[i], "--page-size=", 12) == 0) {
+            page_shift = log2_of(argv[i] + 12);
+            continue;
+        }
+        if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            n_jobs = atoi(argv[i] + 7);
+            continue;
+        }
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            n_jobs = atoi(argv[++i]);
+            continue;
+        }
         if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             usage();
             continue;
@@ -149,9 +886,17 @@ int main(int argc, char** argv)
     if (argc < 1)
         usage();
 
-    /* Scan args, all arguments are filenames */
-    for (i = 0; i < argc; i++) {
-        open_mem_log_file(argv[i]);
-        read_all_buffers();
+    if (n_jobs == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        n_jobs = n > 0 ? n : 1;
     }
+
+    /* Scan args, all arguments are filenames */
+    n_files = argc;
+    files = xmalloc(n_files * sizeof(MemLogFile));
+    for (i = 0; i < argc; i++)
+        open_mem_log_file(&files[i], argv[i], i);
+    read_all_files();
+    free(files);
+    return 0;
 }
\ No newline at end of file
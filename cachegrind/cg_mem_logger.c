@@ -1,4 +1,8 @@
+#include "pub_tool_debuginfo.h"
+#include "pub_tool_seqmatch.h"
+#include "pub_tool_transtab.h"
 #include "cg_arch.h"
+#include "cg_mem_format.h"
 
 /*------------------------------------------------------------*/
 /*--- Double Buffered Logging System                        ---*/
@@ -6,6 +10,15 @@
 
 #define MAX_FILENAME_LEN 256
 
+// A chunk being encoded.  The header must immediately precede the payload
+// so that both go out with a single write.
+typedef struct {
+    CgMemChunkHeader hdr;
+    UChar data[CGM_CHUNK_BYTES];
+    CgMemCodec codec;
+    Bool is_active;
+} LogBuffer;
+
 static LogBuffer buffer1;
 static LogBuffer buffer2;
 static LogBuffer* active_buffer;
@@ -13,11 +26,164 @@ static LogBuffer* inactive_buffer;
 static int mem_log_fd = -1;
 static Long guest_instrs_executed = 0;  // Global instruction counter
 
+// The thread running client code, and the instructions each thread has
+// executed, indexed by ThreadId.
+static ThreadId mem_log_tid = VG_INVALID_THREADID;
+static ULong* thread_instrs_executed = NULL;
+
+// Stats
+static ULong mem_log_records = 0;
+static ULong mem_log_bytes = 0;
+static ULong mem_log_chunks = 0;
+static ULong mem_log_thread_switches = 0;
+
+/*------------------------------------------------------------*/
+/*--- Instruction table                                     ---*/
+/*------------------------------------------------------------*/
+
+/* Read and write records carry the id of the instruction that made them.
+ * Ids are assigned at instrumentation time, one per distinct instruction
+ * address, so retranslated code keeps its ids; the helpers store the id in
+ * mem_log_instr before simulating a data access.  The table mapping ids
+ * to addresses and source locations is written at the end of the trace.
+ */
+
+typedef struct {
+    Addr addr;  // key; MUST BE FIRST
+    UInt id;
+    Int line;
+    const HChar* file;  // from cg_main.c's string table, so unique
+    const HChar* fn;
+} MemLogInstr;
+
+static OSet* mem_log_instrs = NULL;
+static UInt mem_log_n_instrs = 0;
+static UInt mem_log_instr = 0;  // id of the instruction being simulated
+
+// Only called while logging.
+static UInt mem_log_instr_id(Addr addr, const HChar* file, const HChar* fn, Int line)
+{
+    MemLogInstr* mi = VG_(OSetGen_Lookup)(mem_log_instrs, &addr);
+
+    if (mi == NULL) {
+        mi = VG_(OSetGen_AllocNode)(mem_log_instrs, sizeof(MemLogInstr));
+        mi->addr = addr;
+        mi->id = ++mem_log_n_instrs;
+        mi->line = line;
+        mi->file = file;
+        mi->fn = fn;
+        VG_(OSetGen_Insert)(mem_log_instrs, mi);
+    }
+    return mi->id;
+}
+
+/*------------------------------------------------------------*/
+/*--- Out-of-process drain (--mem-log-drain=yes)            ---*/
+/*------------------------------------------------------------*/
+
+/* With --mem-log-drain=yes the guest side only stores raw LogEntry
+ * records into a ring in memory shared with a helper process started
+ * with VG_(start_helper).  The helper (the "drainer") encodes the records
+ * and writes the chunks, so neither encoding nor write(2) are on the
+ * guest's path.  The guest only waits when the ring is full.
+ *
+ * head is only written by the guest, tail only by the drainer.  Both are
+ * free running counters; the slot of counter i is i & (n_entries - 1).
+ */
+
+// Publish the head to the drainer every so many records.
+#define RING_PUBLISH_EVERY 256
+// Milliseconds to sleep when the ring is full or empty.
+#define RING_WAIT_MS 1
+
+typedef struct {
+    volatile UWord head;  // records written by the guest
+    UChar pad1[64 - sizeof(UWord)];
+    volatile UWord tail;  // records consumed by the drainer
+    UChar pad2[64 - sizeof(UWord)];
+    volatile UWord done;  // set by the guest once it logged its last record
+    UWord n_entries;      // power of two
+    // Written by the drainer before it exits, for --stats=yes.
+    volatile ULong drained_bytes;
+    volatile ULong drained_chunks;
+    volatile ULong drainer_sleeps;
+    LogEntry entries[0];
+} MemLogRing;
+
+static MemLogRing* mem_log_ring = NULL;
+static UWord ring_mask = 0;
+static UWord ring_head = 0;         // private copy of mem_log_ring->head
+static UWord ring_tail_cache = 0;   // last tail value seen by the guest
+
+// Stats
+static UWord ring_high_water = 0;
+static ULong ring_stalls = 0;
+static ULong ring_stall_ms = 0;
+
+static void reset_mem_log_buffer(LogBuffer* buffer)
+{
+    buffer->hdr.magic = CGM_CHUNK_MAGIC;
+    buffer->hdr.payload_bytes = 0;
+    buffer->hdr.n_records = 0;
+    buffer->hdr.reserved = 0;
+    buffer->hdr.base_timestamp = 0;
+}
+
+static void write_mem_log(const void* buf, Int len)
+{
+    Int n = VG_(write)(mem_log_fd, buf, len);
+    if (n != len) {
+        VG_(umsg)("Failed to write to mem file\n");
+        VG_(exit)(1);
+    }
+    mem_log_bytes += len;
+}
+
+static void mem_log_start_client_code(ThreadId tid, ULong blocks_dispatched)
+{
+    if (tid != mem_log_tid) {
+        mem_log_tid = tid;
+        mem_log_thread_switches++;
+    }
+}
+
+static void mem_log_atfork_child(ThreadId tid);
+
+static const HChar* mem_log_file_template = NULL;
+static HChar* mem_log_file_name = NULL;
+
+static void open_mem_log_file(HChar* name)
+{
+    CgMemFileHeader fh;
+
+    VG_(printf)("Opening log file: %s\n", name);
+    SysRes o = VG_(open)(name, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_RDWR, 0600);
+    if (sr_isError(o)) {
+        VG_(umsg)("cannot create mem file %s\n", name);
+        VG_(exit)(1);
+    } else {
+        mem_log_fd = sr_Res(o);
+    }
+    mem_log_file_name = name;
+
+    VG_(memset)(&fh, 0, sizeof(fh));
+    VG_(memcpy)(fh.magic, CGM_MAGIC, CGM_MAGIC_LEN);
+    fh.version = CGM_VERSION;
+    fh.header_size = sizeof(fh);
+    fh.addr_bytes = sizeof(Addr);
+    fh.chunk_bytes = CGM_CHUNK_BYTES;
+    write_mem_log(&fh, sizeof(fh));
+}
+
 static void init_mem_logging(const HChar* filename)
 {
+    tl_assert(offsetof(LogBuffer, data) == sizeof(CgMemChunkHeader));
+
     // Initialize buffers
     VG_(memset)(&buffer1, 0, sizeof(LogBuffer));
     VG_(memset)(&buffer2, 0, sizeof(LogBuffer));
+    reset_mem_log_buffer(&buffer1);
+    reset_mem_log_buffer(&buffer2);
 
     // Set up active/inactive buffers
     active_buffer = &buffer1;
@@ -25,34 +191,24 @@ static void init_mem_logging(const HChar* filename)
     active_buffer->is_active = True;
     inactive_buffer->is_active = False;
 
-    HChar* cachegrind_mem_file = VG_(expand_file_name)("--cachegrind-mem-file", filename);
-
-    // Copy filename
+    thread_instrs_executed = VG_(calloc)("cg.mem.tie.1", VG_N_THREADS, sizeof(ULong));
+    mem_log_instrs = VG_(OSetGen_Create)(/*keyOff*/ 0, NULL, VG_(malloc), "cg.mem.instrs.1", VG_(free));
 
-    VG_(printf)("Opening log file: %s\n", cachegrind_mem_file);
-    // Open log file
-    SysRes o = VG_(open)(cachegrind_mem_file, VKI_O_CREAT | VKI_O_RDWR, 0600);
-    if (sr_isError(o)) {
-        VG_(umsg)("cannot create mem file %s\n", cachegrind_mem_file);
-        VG_(exit)(1);
-    } else {
-        mem_log_fd = sr_Res(o);
-    }
+    mem_log_file_template = filename;
+    open_mem_log_file(VG_(expand_file_name)("--cachegrind-mem-file", filename));
+    VG_(atfork)(NULL, NULL, mem_log_atfork_child);
 }
 
 static void flush_mem_log_to_file(LogBuffer* buffer)
 {
-    if (buffer->count == 0)
+    if (buffer->hdr.n_records == 0)
         return;
 
-    Int n = VG_(write)(mem_log_fd, buffer->entries, sizeof(LogEntry) * buffer->count);
-    if (n != sizeof(LogEntry) * buffer->count) {
-        VG_(umsg)("Failed to write to mem file\n");
-        VG_(exit)(1);
-    }
+    write_mem_log(&buffer->hdr, sizeof(CgMemChunkHeader) + buffer->hdr.payload_bytes);
+    mem_log_chunks++;
+
     // Reset buffer
-    buffer->count = 0;
-    VG_(memset)(buffer->entries, 0, sizeof(buffer->entries));
+    reset_mem_log_buffer(buffer);
 }
 
 static void swap_memlog_buffers(void)
@@ -68,39 +224,449 @@ static void swap_memlog_buffers(void)
     flush_mem_log_to_file(inactive_buffer);
 }
 
+static void encode_mem_log_entry(const LogEntry* entry)
+{
+    // If the next record might not fit in the active buffer, swap buffers
+    if (active_buffer->hdr.payload_bytes + CGM_MAX_RECORD > CGM_CHUNK_BYTES) {
+        swap_memlog_buffers();
+    }
+    // A chunk's delta state starts from its first record.
+    if (active_buffer->hdr.n_records == 0) {
+        active_buffer->hdr.base_timestamp = entry->timestamp - cgm_implicit_ts_delta(entry->type);
+        cgm_codec_reset(&active_buffer->codec, active_buffer->hdr.base_timestamp);
+    }
+
+    // Encode the entry into the active buffer
+    active_buffer->hdr.payload_bytes +=
+            cgm_encode_entry(&active_buffer->codec, active_buffer->data + active_buffer->hdr.payload_bytes, entry);
+    active_buffer->hdr.n_records++;
+}
+
+static void publish_ring_head(void)
+{
+    __atomic_store_n(&mem_log_ring->head, ring_head, __ATOMIC_RELEASE);
+}
+
+// Called when the ring looks full: wait for the drainer to make room.
+static void wait_for_ring_space(void)
+{
+    UInt start = 0;
+    Bool stalled = False;
+
+    publish_ring_head();
+    for (;;) {
+        ring_tail_cache = __atomic_load_n(&mem_log_ring->tail, __ATOMIC_ACQUIRE);
+        if (ring_head - ring_tail_cache < mem_log_ring->n_entries)
+            break;
+        if (!stalled) {
+            stalled = True;
+            ring_stalls++;
+            start = VG_(read_millisecond_timer)();
+        }
+        VG_(poll)(NULL, 0, RING_WAIT_MS);
+    }
+    if (stalled)
+        ring_stall_ms += VG_(read_millisecond_timer)() - start;
+}
+
+/*------------------------------------------------------------*/
+/*--- Sampling and capture windows                          ---*/
+/*------------------------------------------------------------*/
+
+/* Accesses are only logged inside a capture window.  A window opens and
+ * closes on the CACHEGRIND_START_MEM_LOG and CACHEGRIND_STOP_MEM_LOG
+ * client requests, and on entry to the functions given with
+ * --mem-log-start-fn and --mem-log-stop-fn.  Timestamps only advance
+ * inside windows.
+ *
+ * Without window functions, nothing is simulated outside windows either:
+ * cg_instrument then adds no helper calls at all, and every change of
+ * state discards all translations.  A window function is reached in the
+ * middle of a block, where translations cannot be discarded, so with them
+ * the cache is simulated throughout (and stays warm) and only the logging
+ * is switched.
+ *
+ * Inside a window, --mem-log-burst=M keeps the accesses of M instructions
+ * out of every --mem-log-period, and --mem-log-sample=N then keeps one
+ * instruction fetch in N and one data access in N.  The cache is still simulated for every access, so the
+ * kept records have exact hit types.  With --mem-log-random=yes the gaps
+ * are drawn at random, from --mem-log-seed, with the same means.
+ */
+
+static Bool clo_mem_log_atstart = True;
+static const HChar* clo_mem_log_start_fn = NULL;
+static const HChar* clo_mem_log_stop_fn = NULL;
+static UInt clo_mem_log_sample = 1;
+static UInt clo_mem_log_burst = 0;
+static UInt clo_mem_log_period = 1000000;
+static Bool clo_mem_log_random = False;
+static UInt clo_mem_log_seed = 1;
+
+static Bool mem_log_capturing = True;   // logging?
+static Bool mem_log_simulating = True;  // cg_instrument adds the helpers?
+static Bool mem_log_windows_enabled = False;  // set once logging is on
+static Bool mem_log_window_fns = False;       // --mem-log-start-fn/stop-fn given
+static Bool mem_log_sampling = False;         // --mem-log-burst or --mem-log-sample given
+static Bool burst_on = True;
+static ULong burst_countdown = 0;  // instructions left in the current burst or gap
+static ULong sample_countdown[2] = {0, 0}; // data accesses, instruction fetches to skip
+static UInt sample_seed = 1;
+
+// Stats
+static ULong mem_log_sampled_out = 0;
+static ULong mem_log_windows = 0;
+
+static Bool mem_log_process_option(const HChar* arg)
+{
+    if VG_BOOL_CLO (arg, "--mem-log-atstart", clo_mem_log_atstart) {
+    } else if VG_STR_CLO (arg, "--mem-log-start-fn", clo_mem_log_start_fn) {
+    } else if VG_STR_CLO (arg, "--mem-log-stop-fn", clo_mem_log_stop_fn) {
+    } else if VG_BINT_CLO (arg, "--mem-log-sample", clo_mem_log_sample, 1, 1 << 30) {
+    } else if VG_BINT_CLO (arg, "--mem-log-burst", clo_mem_log_burst, 0, 1 << 30) {
+    } else if VG_BINT_CLO (arg, "--mem-log-period", clo_mem_log_period, 1, 1 << 30) {
+    } else if VG_BOOL_CLO (arg, "--mem-log-random", clo_mem_log_random) {
+    } else if VG_BINT_CLO (arg, "--mem-log-seed", clo_mem_log_seed, 0, 0x7fffffff) {
+    } else
+        return False;
+    return True;
+}
+
+static void mem_log_print_usage(void)
+{
+    VG_(printf)(
+            "    --mem-log-atstart=yes|no         log from the start? [yes]\n"
+            "    --mem-log-start-fn=<name>        start logging on entry to <name>\n"
+            "                                     (implies --mem-log-atstart=no)\n"
+            "    --mem-log-stop-fn=<name>         stop logging on entry to <name>\n"
+            "    --mem-log-burst=<m>              log only <m> instructions out of every\n"
+            "                                     --mem-log-period instructions [0: all]\n"
+            "    --mem-log-period=<n>             [1000000]\n"
+            "    --mem-log-sample=<n>             log one access in <n> [1]\n"
+            "    --mem-log-random=yes|no          randomise the sampling gaps? [no]\n"
+            "    --mem-log-seed=<n>               seed for --mem-log-random [1]\n"
+            "    Without --mem-log-start-fn/stop-fn, nothing is simulated outside\n"
+            "    of logging windows, so the profile only covers the windows.\n");
+}
+
+// A gap of 'mean' on average: exactly 'mean', or drawn from [0, 2*mean].
+static ULong sample_gap(ULong mean)
+{
+    if (!clo_mem_log_random || mean == 0)
+        return mean;
+    return (((ULong)VG_(random)(&sample_seed) << 31) ^ VG_(random)(&sample_seed)) % (2 * mean + 1);
+}
+
+// Whether to keep the next record.  Instruction records drive the bursts.
+static __attribute__((noinline)) Bool mem_log_sample(AccessType type)
+{
+    // Fetches and data accesses are counted apart, or a loop making a
+    // multiple of N records per iteration would keep only one kind.
+    ULong* countdown = &sample_countdown[type == ACCESS_INSTR];
+
+    if (clo_mem_log_burst > 0 && type == ACCESS_INSTR) {
+        if (burst_countdown == 0) {
+            if (burst_on)
+                burst_countdown = sample_gap(clo_mem_log_period - clo_mem_log_burst);
+            burst_on = !burst_on || burst_countdown == 0;
+            if (burst_on)
+                burst_countdown = clo_mem_log_burst;
+        }
+        burst_countdown--;
+    }
+    if (!burst_on)
+        return False;
+    if (*countdown > 0) {
+        (*countdown)--;
+        return False;
+    }
+    *countdown = sample_gap(clo_mem_log_sample - 1);
+    return True;
+}
+
+static void init_mem_log_capture(void)
+{
+    mem_log_windows_enabled = True;
+    mem_log_window_fns = clo_mem_log_start_fn != NULL || clo_mem_log_stop_fn != NULL;
+    mem_log_capturing = clo_mem_log_atstart && clo_mem_log_start_fn == NULL;
+    mem_log_simulating = mem_log_capturing || mem_log_window_fns;
+    mem_log_windows = mem_log_capturing;
+
+    if (clo_mem_log_burst >= clo_mem_log_period)
+        clo_mem_log_burst = 0;
+    mem_log_sampling = clo_mem_log_burst > 0 || clo_mem_log_sample > 1;
+    sample_seed = clo_mem_log_seed;
+    burst_countdown = clo_mem_log_burst;
+    sample_countdown[0] = sample_gap(clo_mem_log_sample - 1);
+    sample_countdown[1] = sample_gap(clo_mem_log_sample - 1);
+}
+
+// Open or close a window.
+static void set_mem_log_capture(Bool on, const HChar* reason)
+{
+    if (!mem_log_windows_enabled || on == mem_log_capturing)
+        return;
+    mem_log_capturing = on;
+    if (on)
+        mem_log_windows++;
+    if (VG_(clo_verbosity) > 1)
+        VG_(dmsg)("cachegrind: %s: mem-log %s\n", reason, on ? "started" : "stopped");
+    if (!mem_log_window_fns) {
+        mem_log_simulating = on;
+        VG_(discard_translations_safely)((Addr)0x1000, ~(SizeT)0xfff, "cachegrind");
+    }
+}
+
+// 1 if 'a' is the entry of a --mem-log-start-fn function, 0 if of a
+// --mem-log-stop-fn one, -1 otherwise.
+static Int mem_log_window_fn(Addr a)
+{
+    const HChar* fnname;
+
+    if (!VG_(get_fnname_if_entry)(VG_(current_DiEpoch)(), a, &fnname))
+        return -1;
+    if (clo_mem_log_start_fn && VG_(string_match)(clo_mem_log_start_fn, fnname))
+        return 1;
+    if (clo_mem_log_stop_fn && VG_(string_match)(clo_mem_log_stop_fn, fnname))
+        return 0;
+    return -1;
+}
+
+// Called on entry to a window function.
+static VG_REGPARM(1) void mem_log_fn_entry(UWord start)
+{
+    set_mem_log_capture(start, start ? "--mem-log-start-fn" : "--mem-log-stop-fn");
+}
+
 __attribute__((always_inline)) static __inline__ void log_mem_access(Addr addr, UChar size, AccessType type,
                                                                      CacheHitType hit_type)
 {
-    if (mem_log_fd < 0) {
+    LogEntry* entry;
+    LogEntry local;
+
+    RegionKind region = REGION_NONE;
+
+    if (UNLIKELY(segmap_active) && type <= ACCESS_WRITE) {
+        region = segmap_note_access(addr, type, hit_type);
+    }
+    if (UNLIKELY(clo_heap_sites) && type <= ACCESS_WRITE) {
+        heap_note_access(addr, type, hit_type);
+    }
+    if (mem_log_fd < 0 || !mem_log_capturing) {
         return;
     }
 
-    // If active buffer is full, swap buffers
-    if (active_buffer->count >= BUFFER_SIZE) {
-        swap_memlog_buffers();
+    if (type == ACCESS_INSTR) {
+        guest_instrs_executed++;
+        thread_instrs_executed[mem_log_tid]++;
+    }
+    if (UNLIKELY(mem_log_sampling) && !mem_log_sample(type)) {
+        mem_log_sampled_out++;
+        return;
     }
+    mem_log_records++;
 
-    // Add entry to active buffer
-    LogEntry* entry = &active_buffer->entries[active_buffer->count++];
+    if (mem_log_ring) {
+        if (ring_head - ring_tail_cache >= mem_log_ring->n_entries) {
+            wait_for_ring_space();
+        }
+        entry = &mem_log_ring->entries[ring_head & ring_mask];
+    } else {
+        entry = &local;
+    }
     entry->addr = addr;
     entry->size = size;
+    entry->region = region;
     entry->type = type;
     entry->hit_type = hit_type;
-    if (type == ACCESS_INSTR) {
-        guest_instrs_executed++;
-    }
+    entry->tid = mem_log_tid;
+    entry->instr = mem_log_instr;
     entry->timestamp = guest_instrs_executed;
+    entry->thread_ts = thread_instrs_executed[mem_log_tid];
     //VG_(printf)("Logged mem access: %llu %p %d %c %c\n", entry->timestamp, (void*)entry->addr, (int)entry->size,
     //            access_type_char(entry->type), cache_hit_char(entry->hit_type));
+
+    if (mem_log_ring) {
+        ring_head++;
+        if ((ring_head & (RING_PUBLISH_EVERY - 1)) == 0) {
+            ring_tail_cache = __atomic_load_n(&mem_log_ring->tail, __ATOMIC_ACQUIRE);
+            if (ring_head - ring_tail_cache > ring_high_water)
+                ring_high_water = ring_head - ring_tail_cache;
+            publish_ring_head();
+        }
+    } else {
+        encode_mem_log_entry(entry);
+    }
 }
 
-static void flush_mem_logging(void)
+// Main loop of the drainer process.
+static void drain_mem_log_ring(void* shared)
 {
-    // Write any remaining entries in both buffers
-    flush_mem_log_to_file(active_buffer);
+    UWord tail = 0;
+    ULong sleeps = 0;
+
+    mem_log_ring = shared;
+    for (;;) {
+        UWord head = __atomic_load_n(&mem_log_ring->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            // A stop without 'done' means the guest went away without
+            // handing over the rest; drain what was published.
+            if (__atomic_load_n(&mem_log_ring->done, __ATOMIC_ACQUIRE) || VG_(helper_should_stop)(0)) {
+                head = __atomic_load_n(&mem_log_ring->head, __ATOMIC_ACQUIRE);
+                if (head == tail)
+                    break;
+                continue;
+            }
+            sleeps++;
+            VG_(helper_should_stop)(RING_WAIT_MS);
+            continue;
+        }
+        while (tail != head) {
+            encode_mem_log_entry(&mem_log_ring->entries[tail & ring_mask]);
+            tail++;
+            if ((tail & (RING_PUBLISH_EVERY - 1)) == 0)
+                __atomic_store_n(&mem_log_ring->tail, tail, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&mem_log_ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
     flush_mem_log_to_file(inactive_buffer);
+    flush_mem_log_to_file(active_buffer);
+    VG_(close)(mem_log_fd);
+    mem_log_ring->drained_bytes = mem_log_bytes;
+    mem_log_ring->drained_chunks = mem_log_chunks;
+    mem_log_ring->drainer_sleeps = sleeps;
+    __atomic_store_n(&mem_log_ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+// Hand the rest of the records over; called before the drainer stops,
+// at exit or when the client execs.
+static void mem_log_pre_stop(void)
+{
+    publish_ring_head();
+    __atomic_store_n(&mem_log_ring->done, 1, __ATOMIC_RELEASE);
+}
+
+/* A forked child logs to its own file, encoding in-process: the core has
+   already unmapped the parent's ring, and the buffers hold the parent's
+   records, which the parent writes. */
+static void mem_log_atfork_child(ThreadId tid)
+{
+    HChar* name;
+
+    if (mem_log_fd < 0)
+        return;
+    mem_log_ring = NULL;
+    reset_mem_log_buffer(&buffer1);
+    reset_mem_log_buffer(&buffer2);
+    VG_(close)(mem_log_fd);
+    mem_log_fd = -1;
+    mem_log_bytes = mem_log_chunks = 0;
+
+    name = VG_(expand_file_name)("--cachegrind-mem-file", mem_log_file_template);
+    if (VG_(strcmp)(name, mem_log_file_name) == 0) {
+        // No %p in the name; tell the files apart anyway.
+        HChar* unique = VG_(malloc)("cg.mem.child.1", VG_(strlen)(name) + 16);
+        VG_(sprintf)(unique, "%s.%d", name, VG_(getpid)());
+        VG_(free)(name);
+        name = unique;
+    }
+    open_mem_log_file(name);
+}
+
+/* Set up the shared ring and start the drainer.  On failure, logging
+   falls back to encoding in-process. */
+static void start_mem_log_drainer(UInt ring_mb)
+{
+    SizeT n_entries = 1;
+
+    while (n_entries * 2 * sizeof(LogEntry) <= (SizeT)ring_mb * 1024 * 1024)
+        n_entries *= 2;
+
+    // The drainer inherits ring_mask; it only learns the ring's address
+    // from its argument.
+    ring_mask = n_entries - 1;
+    mem_log_ring = VG_(start_helper)(sizeof(MemLogRing) + n_entries * sizeof(LogEntry), drain_mem_log_ring,
+                                     mem_log_pre_stop);
+    if (mem_log_ring == NULL) {
+        VG_(umsg)("warning: cannot start mem-log drainer, draining in-process\n");
+        return;
+    }
+    mem_log_ring->n_entries = n_entries;
+}
+
+// Append the instruction table.  Both buffers are empty by now; the first
+// one holds the table chunks.
+static void write_mem_log_instrs(void)
+{
+    LogBuffer* buffer = &buffer1;
+    CgMemSymCodec codec;
+    MemLogInstr* mi;
+
+    reset_mem_log_buffer(buffer);
+    buffer->hdr.magic = CGM_SYMS_MAGIC;
+    cgm_sym_codec_reset(&codec);
+    VG_(OSetGen_ResetIter)(mem_log_instrs);
+    while ((mi = VG_(OSetGen_Next)(mem_log_instrs)) != NULL) {
+        CgMemSym sym = {mi->id,
+                        mi->addr,
+                        mi->line,
+                        mi->file,
+                        VG_(strlen)(mi->file),
+                        mi->fn,
+                        VG_(strlen)(mi->fn)};
+        if (buffer->hdr.payload_bytes + CGM_MAX_SYM > CGM_CHUNK_BYTES) {
+            write_mem_log(&buffer->hdr, sizeof(CgMemChunkHeader) + buffer->hdr.payload_bytes);
+            buffer->hdr.payload_bytes = buffer->hdr.n_records = 0;
+            cgm_sym_codec_reset(&codec);
+        }
+        buffer->hdr.payload_bytes += cgm_encode_sym(&codec, buffer->data + buffer->hdr.payload_bytes, &sym);
+        buffer->hdr.n_records++;
+    }
+    if (buffer->hdr.n_records > 0)
+        write_mem_log(&buffer->hdr, sizeof(CgMemChunkHeader) + buffer->hdr.payload_bytes);
+    reset_mem_log_buffer(buffer);
+}
+
+static void flush_mem_logging(void)
+{
+    if (mem_log_ring) {
+        // Hand over the rest and wait for the drainer to finish.
+        VG_(stop_helper)(mem_log_ring);
+        // The drainer's counts include what was written before the fork.
+        mem_log_bytes = mem_log_ring->drained_bytes;
+        mem_log_chunks = mem_log_ring->drained_chunks;
+    } else {
+        // Write any remaining entries in both buffers
+        flush_mem_log_to_file(inactive_buffer);
+        flush_mem_log_to_file(active_buffer);
+    }
+    // The drainer has exited; the file offset is shared with it.
+    write_mem_log_instrs();
 
     // Close file
     VG_(close)(mem_log_fd);
     mem_log_fd = -1;
 }
+
+static void print_mem_log_stats(void)
+{
+    VG_(dmsg)("cachegrind: mem-log records : %llu\n", mem_log_records);
+    VG_(dmsg)("cachegrind: mem-log chunks  : %llu\n", mem_log_chunks);
+    VG_(dmsg)("cachegrind: mem-log bytes   : %llu (%.2f bytes/record, raw would be %llu)\n", mem_log_bytes,
+              mem_log_records ? mem_log_bytes * 1.0 / mem_log_records : 0.0,
+              mem_log_records * (ULong)sizeof(CgMemLegacyEntry));
+    VG_(dmsg)("cachegrind: mem-log threads : %llu switches\n", mem_log_thread_switches);
+    VG_(dmsg)("cachegrind: mem-log instrs  : %u\n", mem_log_n_instrs);
+    if (mem_log_sampling)
+        VG_(dmsg)("cachegrind: mem-log sampled : %llu of %llu records kept\n", mem_log_records,
+                  mem_log_records + mem_log_sampled_out);
+    if (mem_log_window_fns || !clo_mem_log_atstart)
+        VG_(dmsg)("cachegrind: mem-log windows : %llu\n", mem_log_windows);
+    if (mem_log_ring) {
+        VG_(dmsg)("cachegrind: mem-log ring    : %lu entries, high water %lu\n", mem_log_ring->n_entries,
+                  ring_high_water);
+        VG_(dmsg)("cachegrind: mem-log stalls  : %llu (%llu ms waiting for the drainer)\n", ring_stalls,
+                  ring_stall_ms);
+        VG_(dmsg)("cachegrind: mem-log drainer : %llu idle sleeps\n", mem_log_ring->drainer_sleeps);
+    }
+}
@@ -0,0 +1,296 @@
+/*--------------------------------------------------------------------*/
+/*--- Reuse distance and working set analysis.      cg_mem_reuse.c ---*/
+/*--------------------------------------------------------------------*/
+
+/*
+   This file is part of Cachegrind, a Valgrind tool for cache
+   profiling programs.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+#include <stdlib.h>
+#include "cg_mem_reuse.h"
+
+#define EMPTY_BLOCK ((UWord)-1)
+// Distances are UInt, so 33 buckets: 0, then [2^(k-1), 2^k) for k >= 1.
+#define N_BUCKETS 33
+#define MIN_TIMES (1 << 20)
+
+typedef struct {
+    UWord block;  // address >> block_shift, EMPTY_BLOCK if the slot is free
+    UInt last;    // time of the latest access, index into the Fenwick tree
+    UInt window;  // window of the latest access
+} BlockInfo;
+
+struct ReuseEngine {
+    const char* name;
+    UInt block_shift;
+
+    // Open addressing hash table of the blocks seen so far.
+    BlockInfo* blocks;
+    UWord n_blocks;
+    UInt hash_bits;
+
+    // Fenwick tree over access times, 1-based; holds one mark per block,
+    // at its latest access time.
+    UInt* tree;
+    UInt n_times;  // capacity of the tree
+    UInt now;      // next access time
+
+    UInt window;
+    ULong window_blocks;
+
+    ULong accesses;
+    ULong cold;
+    ULong hist[N_BUCKETS];
+};
+
+static void* xcalloc(size_t n, size_t size)
+{
+    void* p = calloc(n, size);
+    if (p == NULL) {
+        fprintf(stderr, "cg_mem_log: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void tree_add(ReuseEngine* re, UInt t, Int delta)
+{
+    for (UInt i = t + 1; i <= re->n_times; i += i & -i)
+        re->tree[i] += delta;
+}
+
+// Number of marks at times [0, t).
+static UInt tree_prefix(const ReuseEngine* re, UInt t)
+{
+    UInt sum = 0;
+    for (UInt i = t; i > 0; i -= i & -i)
+        sum += re->tree[i];
+    return sum;
+}
+
+static inline UWord hash_block(UWord block, UInt bits)
+{
+    return (UWord)(((ULong)block * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+static BlockInfo* alloc_blocks(UInt bits)
+{
+    BlockInfo* b = xcalloc((size_t)1 << bits, sizeof(BlockInfo));
+    for (UWord i = 0; i < ((UWord)1 << bits); i++)
+        b[i].block = EMPTY_BLOCK;
+    return b;
+}
+
+static void grow_blocks(ReuseEngine* re)
+{
+    BlockInfo* old = re->blocks;
+    UWord old_size = (UWord)1 << re->hash_bits;
+
+    re->hash_bits++;
+    re->blocks = alloc_blocks(re->hash_bits);
+    for (UWord i = 0; i < old_size; i++) {
+        if (old[i].block == EMPTY_BLOCK)
+            continue;
+        UWord mask = ((UWord)1 << re->hash_bits) - 1;
+        UWord h = hash_block(old[i].block, re->hash_bits);
+        while (re->blocks[h].block != EMPTY_BLOCK)
+            h = (h + 1) & mask;
+        re->blocks[h] = old[i];
+    }
+    free(old);
+}
+
+// Find the slot of 'block', or the free slot where it belongs.
+static BlockInfo* lookup_block(ReuseEngine* re, UWord block)
+{
+    UWord mask = ((UWord)1 << re->hash_bits) - 1;
+    UWord h = hash_block(block, re->hash_bits);
+    while (re->blocks[h].block != block && re->blocks[h].block != EMPTY_BLOCK)
+        h = (h + 1) & mask;
+    return &re->blocks[h];
+}
+
+static int cmp_last(const void* a, const void* b)
+{
+    UInt la = (*(BlockInfo* const*)a)->last;
+    UInt lb = (*(BlockInfo* const*)b)->last;
+    return la < lb ? -1 : la > lb;
+}
+
+/* The tree is full: renumber the latest access times 0..n_blocks-1,
+   keeping their order, so distances are unchanged.  Grow the tree if
+   that would leave too little room. */
+static void compact_times(ReuseEngine* re)
+{
+    UWord size = (UWord)1 << re->hash_bits;
+    BlockInfo** order = xcalloc(re->n_blocks ? re->n_blocks : 1, sizeof(BlockInfo*));
+    UWord n = 0;
+
+    for (UWord i = 0; i < size; i++) {
+        if (re->blocks[i].block != EMPTY_BLOCK)
+            order[n++] = &re->blocks[i];
+    }
+    qsort(order, n, sizeof(BlockInfo*), cmp_last);
+    for (UWord i = 0; i < n; i++)
+        order[i]->last = i;
+    free(order);
+
+    while (n > re->n_times / 2) {
+        if (re->n_times > 0x7fffffffU) {
+            fprintf(stderr, "cg_mem_log: too many distinct %ss\n", re->name);
+            exit(1);
+        }
+        re->n_times *= 2;
+    }
+    free(re->tree);
+    re->tree = xcalloc((size_t)re->n_times + 1, sizeof(UInt));
+    // Linear time build: n marks at times 0..n-1.
+    for (UInt i = 1; i <= re->n_times; i++) {
+        if (i <= n)
+            re->tree[i]++;
+        UInt parent = i + (i & -i);
+        if (parent <= re->n_times)
+            re->tree[parent] += re->tree[i];
+    }
+    re->now = n;
+}
+
+ReuseEngine* reuse_new(const char* name, UInt block_shift)
+{
+    ReuseEngine* re = xcalloc(1, sizeof(ReuseEngine));
+    re->name = name;
+    re->block_shift = block_shift;
+    re->hash_bits = 16;
+    re->blocks = alloc_blocks(re->hash_bits);
+    re->n_times = MIN_TIMES;
+    re->tree = xcalloc((size_t)re->n_times + 1, sizeof(UInt));
+    re->window = 1;  // BlockInfo.window 0 means never
+    return re;
+}
+
+void reuse_delete(ReuseEngine* re)
+{
+    free(re->blocks);
+    free(re->tree);
+    free(re);
+}
+
+static void access_block(ReuseEngine* re, UWord block)
+{
+    BlockInfo* bi;
+
+    if (re->now == re->n_times)
+        compact_times(re);
+
+    bi = lookup_block(re, block);
+    re->accesses++;
+    if (bi->block == EMPTY_BLOCK) {
+        re->cold++;
+        if ((re->n_blocks + 1) * 2 > ((UWord)1 << re->hash_bits)) {
+            grow_blocks(re);
+            bi = lookup_block(re, block);
+        }
+        bi->block = block;
+        re->n_blocks++;
+    } else {
+        // Marks after bi->last: all blocks touched since, except this one.
+        UInt d = (UInt)re->n_blocks - tree_prefix(re, bi->last + 1);
+        re->hist[d == 0 ? 0 : 32 - __builtin_clz(d)]++;
+        tree_add(re, bi->last, -1);
+    }
+    tree_add(re, re->now, 1);
+    bi->last = re->now++;
+    if (bi->window != re->window) {
+        bi->window = re->window;
+        re->window_blocks++;
+    }
+}
+
+void reuse_access(ReuseEngine* re, Addr addr, UInt size)
+{
+    UWord first = addr >> re->block_shift;
+    UWord last = (addr + (size ? size - 1 : 0)) >> re->block_shift;
+
+    for (UWord b = first; b <= last; b++)
+        access_block(re, b);
+}
+
+ULong reuse_end_window(ReuseEngine* re)
+{
+    ULong n = re->window_blocks;
+    re->window++;
+    re->window_blocks = 0;
+    return n;
+}
+
+static const char* fmt_bytes(ULong bytes, char* buf, size_t len)
+{
+    static const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    Int u = 0;
+    while (bytes >= 1024 && (bytes & 1023) == 0 && u < 4) {
+        bytes >>= 10;
+        u++;
+    }
+    snprintf(buf, len, "%llu %s", bytes, units[u]);
+    return buf;
+}
+
+void reuse_print(const ReuseEngine* re, FILE* out)
+{
+    char buf[32];
+    ULong cum = 0;
+    Int max_bucket = 0;
+    UInt block_bytes = 1U << re->block_shift;
+
+    fprintf(out, "%s reuse distance (%u-byte %ss): %llu accesses, %lu distinct %ss (%s)\n", re->name, block_bytes,
+            re->name, re->accesses, re->n_blocks, re->name,
+            fmt_bytes((ULong)re->n_blocks << re->block_shift, buf, sizeof(buf)));
+    if (re->accesses == 0)
+        return;
+
+    fprintf(out, "  %-24s %14s %8s\n", "distance", "accesses", "cum%");
+    for (Int k = 0; k < N_BUCKETS; k++) {
+        char range[32];
+        if (re->hist[k] == 0)
+            continue;
+        max_bucket = k;
+        cum += re->hist[k];
+        if (k <= 1)
+            snprintf(range, sizeof(range), "%d", k);
+        else
+            snprintf(range, sizeof(range), "%u-%u", 1U << (k - 1), (UInt)((1ULL << k) - 1));
+        fprintf(out, "  %-24s %14llu %7.2f%%\n", range, re->hist[k], cum * 100.0 / re->accesses);
+    }
+    fprintf(out, "  %-24s %14llu %7.2f%%\n", "cold", re->cold, 100.0);
+
+    // A cache of 2^j blocks hits the accesses with distance < 2^j, that is
+    // buckets 0..j.
+    fprintf(out, "  fully associative LRU cache:\n");
+    fprintf(out, "  %-12s %11s %8s\n", "size", re->name, "hit%");
+    cum = 0;
+    for (Int j = 0; j <= max_bucket; j++) {
+        cum += re->hist[j];
+        fprintf(out, "  %-12s %11llu %7.2f%%\n", fmt_bytes((ULong)block_bytes << j, buf, sizeof(buf)), 1ULL << j,
+                cum * 100.0 / re->accesses);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+/*--- end                                           cg_mem_reuse.c ---*/
+/*--------------------------------------------------------------------*/
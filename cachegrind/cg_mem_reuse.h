@@ -0,0 +1,69 @@
+/*--------------------------------------------------------------------*/
+/*--- Reuse distance and working set analysis.      cg_mem_reuse.h ---*/
+/*--------------------------------------------------------------------*/
+
+/*
+   This file is part of Cachegrind, a Valgrind tool for cache
+   profiling programs.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+/* Used by cg_mem_log only; plain libc, no VG_(...) functions.
+ *
+ * A ReuseEngine follows the accesses to fixed-size blocks (cache lines or
+ * pages) and computes, for each access, the LRU stack distance: the number
+ * of distinct other blocks touched since the previous access to the same
+ * block.  A fully associative LRU cache of C blocks hits exactly the
+ * accesses whose distance is below C, so one histogram gives the hit rate
+ * of every cache size.
+ *
+ * Each distinct block keeps one mark in a Fenwick tree indexed by the time
+ * of its latest access; the distance is the number of marks after that
+ * time, so every access costs O(log n).
+ *
+ * The engine also counts the distinct blocks touched per window, for
+ * working set size over time curves.
+ */
+
+#ifndef __CG_MEM_REUSE_H
+#define __CG_MEM_REUSE_H
+
+#include <stdio.h>
+#include "pub_tool_basics.h"
+
+typedef struct ReuseEngine ReuseEngine;
+
+// 'name' is used in reports, e.g. "line"; blocks are 1 << block_shift bytes.
+ReuseEngine* reuse_new(const char* name, UInt block_shift);
+void reuse_delete(ReuseEngine* re);
+
+// Record an access of 'size' bytes at 'addr'; touches every block it spans.
+void reuse_access(ReuseEngine* re, Addr addr, UInt size);
+
+// Distinct blocks touched since the previous call (or the start), and
+// start a new window.
+ULong reuse_end_window(ReuseEngine* re);
+
+// Print the distance histogram and the hit rate of LRU caches of each
+// power of two size.
+void reuse_print(const ReuseEngine* re, FILE* out);
+
+#endif  // __CG_MEM_REUSE_H
+
+/*--------------------------------------------------------------------*/
+/*--- end                                           cg_mem_reuse.h ---*/
+/*--------------------------------------------------------------------*/
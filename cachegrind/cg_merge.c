@@ -37,6 +37,8 @@
 #include <assert.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
 
 typedef  signed long   Word;
 typedef  unsigned long UWord;
@@ -115,9 +117,15 @@ static const char* argv0 = "cg_merge";
    print decent error messages. */
 typedef
    struct {
-      FILE* fp;
-      UInt  lno;
-      char* filename;
+      FILE*       fp;
+      UInt        lno;
+      const char* filename;
+      Int         file_ix;    // position among the input files
+      char*       line;       // the line readline returned last
+      size_t      linesiz;
+      Bool        unread;     // so readline returns it again
+      ULong*      counts;     // the counts of the count line being parsed
+      Int         countssiz;
    }
    SOURCE;
 
@@ -130,7 +138,8 @@ __attribute__((noreturn))
 static void mallocFail ( SOURCE* s, const char* who )
 {
    fprintf(stderr, "%s: out of memory in %s\n", argv0, who );
-   printSrcLoc( s );
+   if (s)
+      printSrcLoc( s );
    exit(2);
 }
 
@@ -146,7 +155,8 @@ __attribute__((noreturn))
 static void barf ( SOURCE* s, const char* msg )
 {
    fprintf(stderr, "%s: %s\n", argv0, msg );
-   printSrcLoc( s );
+   if (s)
+      printSrcLoc( s );
    exit(1);
 }
 
@@ -155,38 +165,26 @@ static void barf ( SOURCE* s, const char* msg )
 // every invocation. Caller must not free it.
 static const char *readline ( SOURCE* s )
 {
-   static char  *line = NULL;
-   static size_t linesiz = 0;
+   ssize_t n;
 
-   int ch, i = 0;
-
-   while (1) {
-      ch = getc(s->fp);
-      if (ch != EOF) {
-          if (i + 1 >= linesiz) {
-             linesiz += 500;
-             line = realloc(line, linesiz * sizeof *line);
-             if (line == NULL)
-                mallocFail(s, "readline:");
-          }
-          line[i++] = ch;
-          line[i] = 0;
-          if (ch == '\n') {
-             line[i-1] = 0;
-             s->lno++;
-             break;
-          }
-      } else {
-         if (ferror(s->fp)) {
-            perror(argv0);
-            barf(s, "I/O error while reading input file");
-         } else {
-            // hit EOF
-            break;
-         }
+   if (s->unread) {
+      s->unread = False;
+      return s->line;
+   }
+   n = getline(&s->line, &s->linesiz, s->fp);
+   if (n < 0) {
+      if (ferror(s->fp)) {
+         perror(argv0);
+         barf(s, "I/O error while reading input file");
       }
+      // hit EOF
+      return NULL;
    }
-   return i == 0 ? NULL : line;
+   if (n > 0 && s->line[n-1] == '\n') {
+      s->line[n-1] = 0;
+      s->lno++;
+   }
+   return s->line;
 }
 
 static Bool streqn ( const char* s1, const char* s2, size_t n )
@@ -202,12 +200,56 @@ static Bool streq ( const char* s1, const char* s2 )
 
 ////////////////////////////////////////////////////////////////
 
+/* File and function names are interned in a table shared by all the
+   parsing threads, so that they can be compared by pointer, and are
+   stored once however many files they appear in.  A lock covers
+   every N_NAME_LOCKS'th bucket. */
+#define N_NAME_BUCKETS (1 << 18)
+#define N_NAME_LOCKS   64
+
 typedef
-   struct {
-      char* fi_name;
-      char* fn_name;
+   struct _Name {
+      struct _Name* next;
+      char          str[1];
    }
-   FileFn;
+   Name;
+
+static Name*           name_table[N_NAME_BUCKETS];
+static pthread_mutex_t name_locks[N_NAME_LOCKS];
+
+static UWord hash_str ( const char* str )
+{
+   UWord h = 2166136261u;   // FNV-1a
+   for (; *str; str++)
+      h = (h ^ (unsigned char)*str) * 16777619u;
+   return h;
+}
+
+static const char* intern ( SOURCE* s, const char* str )
+{
+   UWord b = hash_str(str) % N_NAME_BUCKETS;
+   Name* nm;
+
+   pthread_mutex_lock(&name_locks[b % N_NAME_LOCKS]);
+   for (nm = name_table[b]; nm; nm = nm->next) {
+      if (streq(nm->str, str))
+         break;
+   }
+   if (nm == NULL) {
+      size_t len = strlen(str);
+      nm = malloc(sizeof(Name) + len);
+      if (nm == NULL)
+         mallocFail(s, "intern:");
+      memcpy(nm->str, str, len + 1);
+      nm->next = name_table[b];
+      name_table[b] = nm;
+   }
+   pthread_mutex_unlock(&name_locks[b % N_NAME_LOCKS]);
+   return nm->str;
+}
+
+
+////////////////////////////////////////////////////////////////
 
 typedef
    struct {
@@ -216,6 +258,15 @@ typedef
    }
    Counts;
 
+typedef
+   struct _FnEntry {
+      struct _FnEntry* next;
+      const char*      fi_name;   // interned
+      const char*      fn_name;   // interned
+      WordFM*          lines;     // line-number=UWord -> Counts
+   }
+   FnEntry;
+
 typedef
    struct {
       // null-terminated vector of desc_lines
@@ -224,57 +275,26 @@ typedef
       // Cmd line
       char* cmd_line;
 
+      // Input file which the desc and cmd lines are from: the first
+      // of those merged in
+      Int first_file;
+
       // Events line
       char* events_line;
       Int   n_events;
 
-      // Summary line (copied from input)
-      char* summary_line;
+      /* Hash table of the functions, keyed by their interned file
+         and function names. */
+      FnEntry** fns;
+      UWord     fns_size;    // a power of 2
+      UWord     n_fns;
 
-      /* Outermost map is
-            WordFM FileFn* innerMap
-         where innerMap is   WordFM line-number=UWord Counts */
-      WordFM* outerMap;
-
-      // Summary counts (computed whilst parsing)
-      // should match .summary_line
+      // Summary counts of the files merged in, each checked against
+      // the file's summary line.
       Counts* summary;
    }
    CacheProfFile;
 
-static FileFn* new_FileFn ( char* file_name, char* fn_name )
-{
-   FileFn* ffn = malloc(sizeof(FileFn));
-   if (ffn == NULL)
-      return NULL;
-   ffn->fi_name = file_name;
-   ffn->fn_name = fn_name;
-   return ffn;
-}
-
-static void ddel_FileFn ( FileFn* ffn )
-{
-   if (ffn->fi_name)
-      free(ffn->fi_name);
-   if (ffn->fn_name)
-      free(ffn->fn_name);
-   memset(ffn, 0, sizeof(FileFn));
-   free(ffn);
-}
-
-static FileFn* dopy_FileFn ( FileFn* ff )
-{
-   char *fi2, *fn2;
-   fi2 = strdup(ff->fi_name);
-   if (fi2 == NULL) return NULL;
-   fn2 = strdup(ff->fn_name);
-   if (fn2 == NULL) {
-      free(fi2);
-      return NULL;
-   }
-   return new_FileFn( fi2, fn2 );
-}
-
 static Counts* new_Counts ( Int n_counts, /*COPIED*/ULong* counts )
 {
    Int i;
@@ -317,12 +337,6 @@ static Counts* new_Counts_Zeroed ( Int n_counts )
    return cts;
 }
 
-static void sdel_Counts ( Counts* cts )
-{
-   memset(cts, 0, sizeof(Counts));
-   free(cts);
-}
-
 static void ddel_Counts ( Counts* cts )
 {
    if (cts->counts)
@@ -336,40 +350,26 @@ static Counts* dopy_Counts ( Counts* cts )
    return new_Counts( cts->n_counts, cts->counts );
 }
 
-static
-CacheProfFile* new_CacheProfFile ( char**  desc_lines,
-                                   char*   cmd_line,
-                                   char*   events_line,
-                                   Int     n_events,
-                                   char*   summary_line,
-                                   WordFM* outerMap,
-                                   Counts* summary )
+static CacheProfFile* new_CacheProfFile ( void )
 {
-   CacheProfFile* cpf = malloc(sizeof(CacheProfFile));
+   CacheProfFile* cpf = calloc(1, sizeof(CacheProfFile));
    if (cpf == NULL)
       return NULL;
-   cpf->desc_lines   = desc_lines;
-   cpf->cmd_line     = cmd_line;
-   cpf->events_line  = events_line;
-   cpf->n_events     = n_events;
-   cpf->summary_line = summary_line;
-   cpf->outerMap     = outerMap;
-   cpf->summary      = summary;
+   cpf->fns_size = 1024;
+   cpf->fns = calloc(cpf->fns_size, sizeof(FnEntry*));
+   if (cpf->fns == NULL) {
+      free(cpf);
+      return NULL;
+   }
    return cpf;
 }
 
-static WordFM* dopy_InnerMap ( WordFM* innerMap )
-{
-   return dopyFM ( innerMap, NULL,
-                             (Word(*)(Word))dopy_Counts );
-}
-
 static void ddel_InnerMap ( WordFM* innerMap )
 {
    deleteFM( innerMap, NULL, (void(*)(Word))ddel_Counts );
 }
 
-static void ddel_CacheProfFile ( CacheProfFile* cpf )
+static void free_desc_and_cmd ( CacheProfFile* cpf )
 {
    char** p;
    if (cpf->desc_lines) {
@@ -379,13 +379,26 @@ static void ddel_CacheProfFile ( CacheProfFile* cpf )
    }
    if (cpf->cmd_line)
       free(cpf->cmd_line);
+   cpf->desc_lines = NULL;
+   cpf->cmd_line   = NULL;
+}
+
+static void ddel_CacheProfFile ( CacheProfFile* cpf )
+{
+   UWord    i;
+   FnEntry *fe, *next;
+
+   free_desc_and_cmd(cpf);
    if (cpf->events_line)
       free(cpf->events_line);
-   if (cpf->summary_line)
-      free(cpf->summary_line);
-   if (cpf->outerMap)
-      deleteFM( cpf->outerMap, (void(*)(Word))ddel_FileFn, 
-                               (void(*)(Word))ddel_InnerMap );
+   for (i = 0; i < cpf->fns_size; i++) {
+      for (fe = cpf->fns[i]; fe; fe = next) {
+         next = fe->next;
+         ddel_InnerMap(fe->lines);
+         free(fe);
+      }
+   }
+   free(cpf->fns);
    if (cpf->summary)
       ddel_Counts(cpf->summary);
 
@@ -393,6 +406,78 @@ static void ddel_CacheProfFile ( CacheProfFile* cpf )
    free(cpf);
 }
 
+static UWord hash_FnEntry ( const char* fi_name, const char* fn_name )
+{
+   UWord h = ((UWord)fi_name >> 3) * 2654435761u;
+   return (h ^ ((UWord)fn_name >> 3)) * 2654435761u;
+}
+
+static FnEntry* lookup_FnEntry ( CacheProfFile* cpf,
+                                 const char* fi_name, const char* fn_name )
+{
+   FnEntry* fe = cpf->fns[hash_FnEntry(fi_name, fn_name)
+                          & (cpf->fns_size - 1)];
+   while (fe && (fe->fi_name != fi_name || fe->fn_name != fn_name))
+      fe = fe->next;
+   return fe;
+}
+
+static void add_FnEntry ( CacheProfFile* cpf, FnEntry* fe )
+{
+   UWord b;
+
+   // Keep the chains short.
+   if (cpf->n_fns >= cpf->fns_size) {
+      UWord     i, new_size = cpf->fns_size * 2;
+      FnEntry** new_fns = calloc(new_size, sizeof(FnEntry*));
+      FnEntry  *e, *next;
+      if (new_fns == NULL)
+         mallocFail(NULL, "add_FnEntry:");
+      for (i = 0; i < cpf->fns_size; i++) {
+         for (e = cpf->fns[i]; e; e = next) {
+            next = e->next;
+            b = hash_FnEntry(e->fi_name, e->fn_name) & (new_size - 1);
+            e->next = new_fns[b];
+            new_fns[b] = e;
+         }
+      }
+      free(cpf->fns);
+      cpf->fns      = new_fns;
+      cpf->fns_size = new_size;
+   }
+   b = hash_FnEntry(fe->fi_name, fe->fn_name) & (cpf->fns_size - 1);
+   fe->next = cpf->fns[b];
+   cpf->fns[b] = fe;
+   cpf->n_fns++;
+}
+
+static Word cmp_unboxed_UWord ( Word s1, Word s2 )
+{
+   UWord u1 = (UWord)s1;
+   UWord u2 = (UWord)s2;
+   if (u1 < u2) return -1;
+   if (u1 > u2) return 1;
+   return 0;
+}
+
+static FnEntry* get_FnEntry ( SOURCE* s, CacheProfFile* cpf,
+                              const char* fi_name, const char* fn_name )
+{
+   FnEntry* fe = lookup_FnEntry(cpf, fi_name, fn_name);
+   if (fe)
+      return fe;
+   fe = malloc(sizeof(FnEntry));
+   if (fe == NULL)
+      mallocFail(s, "get_FnEntry:");
+   fe->fi_name = fi_name;
+   fe->fn_name = fn_name;
+   fe->lines   = newFM( malloc, free, cmp_unboxed_UWord );
+   if (fe->lines == NULL)
+      mallocFail(s, "get_FnEntry:");
+   add_FnEntry(cpf, fe);
+   return fe;
+}
+
 static void showCounts ( FILE* f, Counts* c )
 {
    Int i;
@@ -401,35 +486,55 @@ static void showCounts ( FILE* f, Counts* c )
    }
 }
 
+static int cmp_FnEntry ( const void* v1, const void* v2 )
+{
+   const FnEntry* fe1 = *(FnEntry* const*)v1;
+   const FnEntry* fe2 = *(FnEntry* const*)v2;
+   int r = strcmp(fe1->fi_name, fe2->fi_name);
+   if (r == 0)
+      r = strcmp(fe1->fn_name, fe2->fn_name);
+   return r;
+}
+
 static void show_CacheProfFile ( FILE* f, CacheProfFile* cpf )
 {
-   Int     i;
-   char**  d;
-   FileFn* topKey;
-   WordFM* topVal;
-   UWord   subKey;
-   Counts* subVal;  
+   Int       i;
+   UWord     j, n = 0;
+   char**    d;
+   FnEntry*  fe;
+   FnEntry** sorted;
+   UWord     subKey;
+   Counts*   subVal;  
 
    for (d = cpf->desc_lines; *d; d++)
       fprintf(f, "%s\n", *d);
    fprintf(f, "%s\n", cpf->cmd_line);
    fprintf(f, "%s\n", cpf->events_line);
 
-   initIterFM( cpf->outerMap );
-   while (nextIterFM( cpf->outerMap, (Word*)(&topKey), (Word*)(&topVal) )) {
-      fprintf(f, "fl=%s\nfn=%s\n", 
-                 topKey->fi_name, topKey->fn_name );
-      initIterFM( topVal );
-      while (nextIterFM( topVal, (Word*)(&subKey), (Word*)(&subVal) )) {
+   // The functions, sorted by file and function name.
+   sorted = malloc(cpf->n_fns * sizeof(FnEntry*) + 1);
+   if (sorted == NULL)
+      mallocFail(NULL, "show_CacheProfFile:");
+   for (j = 0; j < cpf->fns_size; j++) {
+      for (fe = cpf->fns[j]; fe; fe = fe->next)
+         sorted[n++] = fe;
+   }
+   assert(n == cpf->n_fns);
+   qsort(sorted, n, sizeof(FnEntry*), cmp_FnEntry);
+
+   for (j = 0; j < n; j++) {
+      fe = sorted[j];
+      fprintf(f, "fl=%s\nfn=%s\n", fe->fi_name, fe->fn_name );
+      initIterFM( fe->lines );
+      while (nextIterFM( fe->lines, (Word*)(&subKey), (Word*)(&subVal) )) {
          fprintf(f, "%ld   ", subKey );
          showCounts( f, subVal );
          fprintf(f, "\n");
       }
-      doneIterFM( topVal );
+      doneIterFM( fe->lines );
    }
-   doneIterFM( cpf->outerMap );
+   free(sorted);
 
-   //fprintf(f, "%s\n", cpf->summary_line);
    fprintf(f, "summary:");
    for (i = 0; i < cpf->summary->n_counts; i++)
       fprintf(f, " %lld", cpf->summary->counts[i]);
@@ -438,27 +543,6 @@ static void show_CacheProfFile ( FILE* f, CacheProfFile* cpf )
 
 ////////////////////////////////////////////////////////////////
 
-static Word cmp_FileFn ( Word s1, Word s2 )
-{
-   FileFn* ff1 = (FileFn*)s1;
-   FileFn* ff2 = (FileFn*)s2;
-   Word r = strcmp(ff1->fi_name, ff2->fi_name);
-   if (r == 0)
-      r = strcmp(ff1->fn_name, ff2->fn_name);
-   return r;
-}
-
-static Word cmp_unboxed_UWord ( Word s1, Word s2 )
-{
-   UWord u1 = (UWord)s1;
-   UWord u2 = (UWord)s2;
-   if (u1 < u2) return -1;
-   if (u1 > u2) return 1;
-   return 0;
-}
-
-////////////////////////////////////////////////////////////////
-
 static Bool parse_ULong ( /*OUT*/ULong* res, /*INOUT*/const char** pptr)
 {
    ULong u64;
@@ -478,152 +562,85 @@ static Bool parse_ULong ( /*OUT*/ULong* res, /*INOUT*/const char** pptr)
    return True;
 }
 
-// str is a line of integers, starting with a line number.  Parse it,
-// returning the first number in *lnno and the rest in a newly
-// allocated Counts struct.  If lnno is non-NULL, treat the first
-// number as a line number and assign it to *lnno instead of
-// incorporating it in the counts array.
-static 
-Counts* splitUpCountsLine ( SOURCE* s, /*OUT*/UWord* lnno, const char* str )
+// str is a line of integers.  Parse them into s->counts, and return
+// how many there are.
+static Int splitUpCountsLine ( SOURCE* s, const char* str )
 {
-   Bool    ok;
-   Counts* counts;
-   ULong   *tmpC = NULL;
-   UInt     n_tmpC = 0, tmpCsize = 0;
+   Int n = 0;
    while (1) {
-      if (n_tmpC >= tmpCsize) {
-         tmpCsize += 50;
-         tmpC = realloc(tmpC, tmpCsize * sizeof *tmpC);
-         if (tmpC == NULL)
+      if (n >= s->countssiz) {
+         s->countssiz += 50;
+         s->counts = realloc(s->counts, s->countssiz * sizeof(ULong));
+         if (s->counts == NULL)
             mallocFail(s, "splitUpCountsLine:");
       }
-      ok = parse_ULong( &tmpC[n_tmpC], &str );
-      if (!ok)
+      if (!parse_ULong( &s->counts[n], &str ))
          break;
-      n_tmpC++;
+      n++;
    }
    if (*str != 0)
       parseError(s, "garbage in counts line");
-   if (lnno ? (n_tmpC < 2) : (n_tmpC < 1))
-      parseError(s, "too few counts in count line");
-
-   if (lnno) {
-      *lnno = (UWord)tmpC[0];
-      counts = new_Counts( n_tmpC-1, /*COPIED*/&tmpC[1] );
-   } else {
-      counts = new_Counts( n_tmpC, /*COPIED*/&tmpC[0] );
-   }
-   free(tmpC);
-
-   return counts;
+   return n;
 }
 
-static void addCounts ( SOURCE* s, /*OUT*/Counts* counts1, Counts* counts2 )
+static void addCounts ( /*OUT*/Counts* counts1, ULong* counts2 )
 {
    Int i;
-   if (counts1->n_counts != counts2->n_counts)
-      parseError(s, "addCounts: inconsistent number of counts");
    for (i = 0; i < counts1->n_counts; i++)
-      counts1->counts[i] += counts2->counts[i];
-}
-
-static Bool addCountsToMap ( SOURCE* s,
-                             WordFM* counts_map, 
-                             UWord lnno, Counts* newCounts )
-{
-   Counts* oldCounts;
-   // look up lnno in the map.  If none present, add a binding
-   // lnno->counts.  If present, add counts to the existing entry.
-   if (lookupFM( counts_map, (Word*)(&oldCounts), (Word)lnno )) {
-      // merge with existing binding
-      addCounts( s, oldCounts, newCounts );
-      return True;
-   } else {
-      // create new binding
-      addToFM( counts_map, (Word)lnno, (Word)newCounts );
-      return False;
-   }
+      counts1->counts[i] += counts2[i];
 }
 
+// A count line: a line number, then a count of each event.
 static
-void handle_counts ( SOURCE* s,
-                     CacheProfFile* cpf, 
-                     const char* fi, const char* fn, const char* newCountsStr )
+void handle_counts ( SOURCE* s, CacheProfFile* cpf, FnEntry* fe,
+                     Counts* summary, const char* newCountsStr )
 {
-   WordFM* countsMap;
-   Bool    freeNewCounts;
-   UWord   lnno;
+   Counts* oldCounts;
    Counts* newCounts;
-   FileFn* topKey; 
-
-   if (0)  printf("%s %s %s\n", fi, fn, newCountsStr );
-
-   // parse the numbers
-   newCounts = splitUpCountsLine( s, &lnno, newCountsStr );
+   UWord   lnno;
+   Int     n = splitUpCountsLine( s, newCountsStr );
 
+   if (n < 2)
+      parseError(s, "too few counts in count line");
    // Did we get the right number?
-   if (newCounts->n_counts != cpf->n_events)
-      goto oom;
-
-   // allocate the key
-   topKey = malloc(sizeof(FileFn));
-   if (topKey) {
-      topKey->fi_name = strdup(fi);
-      topKey->fn_name = strdup(fn);
-   }
-   if (! (topKey && topKey->fi_name && topKey->fn_name))
-      mallocFail(s, "handle_counts:");
-
-   // search for it
-   if (lookupFM( cpf->outerMap, (Word*)(&countsMap), (Word)topKey )) {
-      // found it.  Merge in new counts
-      freeNewCounts = addCountsToMap( s, countsMap, lnno, newCounts );
-      ddel_FileFn(topKey);
+   if (n - 1 != cpf->n_events)
+      parseError(s, "# counts doesn't match # events");
+   lnno = (UWord)s->counts[0];
+
+   // look up lnno in the map.  If none present, add a binding
+   // lnno->counts.  If present, add counts to the existing entry.
+   if (lookupFM( fe->lines, (Word*)(&oldCounts), (Word)lnno )) {
+      addCounts( oldCounts, &s->counts[1] );
    } else {
-      // not found in the top map.  Create new entry
-      countsMap = newFM( malloc, free, cmp_unboxed_UWord );
-      if (!countsMap)
-         goto oom;
-      addToFM( cpf->outerMap, (Word)topKey, (Word)countsMap );
-      freeNewCounts = addCountsToMap( s, countsMap, lnno, newCounts );
+      newCounts = new_Counts( cpf->n_events, &s->counts[1] );
+      if (newCounts == NULL)
+         mallocFail(s, "handle_counts:");
+      addToFM( fe->lines, (Word)lnno, (Word)newCounts );
    }
 
    // also add to running summary total
-   addCounts( s, cpf->summary, newCounts );
-
-   // if safe to do so, free up the count vector
-   if (freeNewCounts)
-      ddel_Counts(newCounts);
-
-   return;
-
-  oom:
-   parseError(s, "# counts doesn't match # events");
+   addCounts( summary, &s->counts[1] );
 }
 
 
-/* Parse a complete file from the stream in 's'.  If a parse error
-   happens, do not return; instead exit via parseError().  If an
-   out-of-memory condition happens, do not return; instead exit via
-   mallocError().
+/* Parse a complete profile from the stream in 's', and merge it into
+   'cpf'.  If a parse error happens, do not return; instead exit via
+   parseError().  If an out-of-memory condition happens, do not
+   return; instead exit via mallocError().
 */
-static CacheProfFile* parse_CacheProfFile ( SOURCE* s )
+static void parse_CacheProfFile ( SOURCE* s, CacheProfFile* cpf )
 {
-   Int            i;
+   Int            i, n;
    char**         tmp_desclines = NULL;
    unsigned       tmp_desclines_size = 0;
-   char*          p;
+   const char*    p;
    int            n_tmp_desclines = 0;
-   CacheProfFile* cpf;
-   Counts*        summaryRead; 
-   char*          curr_fn = strdup("???");
-   char*          curr_fl = strdup("???");
+   Counts*        summary; 
+   const char*    curr_fn = intern(s, "???");
+   const char*    curr_fl = curr_fn;
+   FnEntry*       curr_fe = NULL;
    const char*    line;
 
-   cpf = new_CacheProfFile( NULL, NULL, NULL, 0, NULL, NULL, NULL );
-   if (cpf == NULL)
-      mallocFail(s, "parse_CacheProfFile(1)");
-
    // Parse "desc:" lines
    while (1) {
       line = readline(s);
@@ -631,7 +648,7 @@ static CacheProfFile* parse_CacheProfFile ( SOURCE* s )
          break;
       if (!streqn(line, "desc: ", 6))
          break;
-      if (n_tmp_desclines >= tmp_desclines_size) {
+      if (n_tmp_desclines + 1 >= tmp_desclines_size) {
          tmp_desclines_size += 100;
          tmp_desclines = realloc(tmp_desclines,
                                  tmp_desclines_size * sizeof *tmp_desclines);
@@ -643,22 +660,26 @@ static CacheProfFile* parse_CacheProfFile ( SOURCE* s )
 
    if (n_tmp_desclines == 0)
       parseError(s, "parse_CacheProfFile: no DESC lines present");
-
-   cpf->desc_lines = malloc( (1+n_tmp_desclines) * sizeof(char*) );
-   if (cpf->desc_lines == NULL)
-      mallocFail(s, "parse_CacheProfFile(2)");
-
-   cpf->desc_lines[n_tmp_desclines] = NULL;
-   for (i = 0; i < n_tmp_desclines; i++)
-      cpf->desc_lines[i] = tmp_desclines[i];
+   tmp_desclines[n_tmp_desclines] = NULL;
 
    // Parse "cmd:" line
    if (!streqn(line, "cmd: ", 5))
       parseError(s, "parse_CacheProfFile: no CMD line present");
 
-   cpf->cmd_line = strdup(line);
-   if (cpf->cmd_line == NULL)
-      mallocFail(s, "parse_CacheProfFile(3)");
+   // The merged profile has the "desc:" and "cmd:" lines of the first
+   // input file.
+   if (cpf->desc_lines == NULL || s->file_ix < cpf->first_file) {
+      free_desc_and_cmd(cpf);
+      cpf->desc_lines = tmp_desclines;
+      cpf->first_file = s->file_ix;
+      cpf->cmd_line = strdup(line);
+      if (cpf->cmd_line == NULL)
+         mallocFail(s, "parse_CacheProfFile(3)");
+   } else {
+      for (i = 0; i < n_tmp_desclines; i++)
+         free(tmp_desclines[i]);
+      free(tmp_desclines);
+   }
 
    // Parse "events:" line and figure out how many events there are
    line = readline(s);
@@ -667,29 +688,32 @@ static CacheProfFile* parse_CacheProfFile ( SOURCE* s )
    if (!streqn(line, "events: ", 8))
       parseError(s, "parse_CacheProfFile: no EVENTS line present");
 
-   // figure out how many events there are by counting the number
-   // of space-alphanum transitions in the events_line
-   cpf->events_line = strdup(line);
-   if (cpf->events_line == NULL)
-      mallocFail(s, "parse_CacheProfFile(3)");
-
-   cpf->n_events = 0;
-   assert(cpf->events_line[6] == ':');
-   for (p = &cpf->events_line[6]; *p; p++) {
-      if (p[0] == ' ' && isalpha(p[1]))
-         cpf->n_events++;
+   if (cpf->events_line == NULL) {
+      cpf->events_line = strdup(line);
+      if (cpf->events_line == NULL)
+         mallocFail(s, "parse_CacheProfFile(3)");
+
+      // figure out how many events there are by counting the number
+      // of space-alphanum transitions in the events_line
+      cpf->n_events = 0;
+      for (p = &cpf->events_line[6]; *p; p++) {
+         if (p[0] == ' ' && isalpha(p[1]))
+            cpf->n_events++;
+      }
+
+      cpf->summary = new_Counts_Zeroed( cpf->n_events );
+      if (cpf->summary == NULL)
+         mallocFail(s, "parse_CacheProfFile(4)");
+   } else if (!streq( cpf->events_line, line )) {
+      barf(s, "\"events:\" line of most recent file does "
+              "not match those previously processed");
    }
 
-   // create the running cross-check summary
-   cpf->summary = new_Counts_Zeroed( cpf->n_events );
-   if (cpf->summary == NULL)
+   // the running cross-check summary of this profile
+   summary = new_Counts_Zeroed( cpf->n_events );
+   if (summary == NULL)
       mallocFail(s, "parse_CacheProfFile(4)");
 
-   // create the outer map (file+fn name --> inner map)
-   cpf->outerMap = newFM ( malloc, free, cmp_FileFn );
-   if (cpf->outerMap == NULL)
-      mallocFail(s, "parse_CacheProfFile(5)");
-
    // process count lines
    while (1) {
       line = readline(s);
@@ -697,19 +721,21 @@ static CacheProfFile* parse_CacheProfFile ( SOURCE* s )
          parseError(s, "parse_CacheProfFile: eof before SUMMARY line");
 
       if (isdigit(line[0])) {
-         handle_counts(s, cpf, curr_fl, curr_fn, line);
+         if (curr_fe == NULL)
+            curr_fe = get_FnEntry(s, cpf, curr_fl, curr_fn);
+         handle_counts(s, cpf, curr_fe, summary, line);
          continue;
       }
       else
       if (streqn(line, "fn=", 3)) {
-         free(curr_fn);
-         curr_fn = strdup(line+3);
+         curr_fn = intern(s, line+3);
+         curr_fe = NULL;
          continue;
       }
       else
       if (streqn(line, "fl=", 3)) {
-         free(curr_fl);
-         curr_fl = strdup(line+3);
+         curr_fl = intern(s, line+3);
+         curr_fe = NULL;
          continue;
       }
       else
@@ -720,56 +746,46 @@ static CacheProfFile* parse_CacheProfFile ( SOURCE* s )
          parseError(s, "parse_CacheProfFile: unexpected line in main data");
    }
 
-   // finally, the "summary:" line
-   if (!streqn(line, "summary: ", 9))
-      parseError(s, "parse_CacheProfFile: missing SUMMARY line");
-
-   cpf->summary_line = strdup(line);
-   if (cpf->summary_line == NULL)
-      mallocFail(s, "parse_CacheProfFile(6)");
-
-   // there should be nothing more
-   line = readline(s);
-   if (line)
-      parseError(s, "parse_CacheProfFile: "
-                    "extraneous content after SUMMARY line");
-
    // check the summary counts are as expected
-   summaryRead = splitUpCountsLine( s, NULL, &cpf->summary_line[8] );
-   if (summaryRead == NULL)
-      mallocFail(s, "parse_CacheProfFile(7)");
-   if (summaryRead->n_counts != cpf->n_events)
+   n = splitUpCountsLine( s, &line[8] );
+   if (n != cpf->n_events)
       parseError(s, "parse_CacheProfFile: wrong # counts in SUMMARY line");
-   for (i = 0; i < summaryRead->n_counts; i++) {
-      if (summaryRead->counts[i] != cpf->summary->counts[i]) {
+   for (i = 0; i < n; i++) {
+      if (s->counts[i] != summary->counts[i]) {
          parseError(s, "parse_CacheProfFile: "
                        "computed vs stated SUMMARY counts mismatch");
       }
    }
-   free(summaryRead->counts);
-   sdel_Counts(summaryRead);
-
-   // since the summary counts are OK, free up the summary_line text
-   // which contains the same info.
-   free(cpf->summary_line);
-   cpf->summary_line = NULL;
+   addCounts( cpf->summary, summary->counts );
+   ddel_Counts( summary );
+}
 
-   free(tmp_desclines);
-   free(curr_fn);
-   free(curr_fl);
+/* Parse the profiles in 's' into 'cpf'.  A stream, such as stdin,
+   can hold several, one after the other. */
+static void parse_CacheProfFiles ( SOURCE* s, CacheProfFile* cpf )
+{
+   const char* line;
 
-   // All looks OK
-   return cpf;
+   while (1) {
+      parse_CacheProfFile( s, cpf );
+      line = readline(s);
+      if (!line)
+         break;
+      if (!streqn(line, "desc: ", 6))
+         parseError(s, "parse_CacheProfFile: "
+                       "extraneous content after SUMMARY line");
+      s->unread = True;
+   }
 }
 
 
-static void merge_CacheProfInfo ( SOURCE* s,
-                                  /*MOD*/CacheProfFile* dst,
+/* Merge 'src' into 'dst', and delete it. */
+static void merge_CacheProfInfo ( /*MOD*/CacheProfFile* dst,
                                   CacheProfFile* src )
 {
    /* For each (filefn, innerMap) in src
       if filefn not in dst
-         add binding dopy(filefn)->dopy(innerMap) in src
+         move it to dst
       else
          // merge src->innerMap with dst->innerMap
          for each (lineno, counts) in src->innerMap
@@ -778,91 +794,186 @@ static void merge_CacheProfInfo ( SOURCE* s,
          else
             add counts into dst->innerMap[lineno]
    */
-   /* Outer iterator:  FileFn* -> WordFM* (inner iterator)
-      Inner iterator:  UWord   -> Counts*
-   */
-   FileFn* soKey;
-   WordFM* soVal;
-   WordFM* doVal;
-   UWord   siKey;
-   Counts* siVal;
-   Counts* diVal;
+   UWord    i;
+   FnEntry *sfe, *dfe, *next;
+   UWord    siKey;
+   Counts*  siVal;
+   Counts*  diVal;
 
    /* First check mundane things: that the events: lines are
       identical. */
    if (!streq( dst->events_line, src->events_line ))
-     barf(s, "\"events:\" line of most recent file does "
-             "not match those previously processed");
-
-   initIterFM( src->outerMap );
+     barf(NULL, "\"events:\" lines of the input files do not match");
+
+   if (src->first_file < dst->first_file) {
+      free_desc_and_cmd(dst);
+      dst->desc_lines = src->desc_lines;
+      dst->cmd_line   = src->cmd_line;
+      dst->first_file = src->first_file;
+      src->desc_lines = NULL;
+      src->cmd_line   = NULL;
+   }
 
    // for (filefn, innerMap) in src
-   while (nextIterFM( src->outerMap, (Word*)&soKey, (Word*)&soVal )) {
-
-      // is filefn in dst?   
-      if (! lookupFM( dst->outerMap, (Word*)&doVal, (Word)soKey )) {
-
-         // no .. add dopy(filefn) -> dopy(innerMap) to src
-         FileFn* c_soKey = dopy_FileFn(soKey);
-         WordFM* c_soVal = dopy_InnerMap(soVal);
-         if ((!c_soKey) || (!c_soVal)) goto oom;
-         addToFM( dst->outerMap, (Word)c_soKey, (Word)c_soVal );
-
-      } else {
+   for (i = 0; i < src->fns_size; i++) {
+      for (sfe = src->fns[i]; sfe; sfe = next) {
+         next = sfe->next;
+
+         // is filefn in dst?   
+         dfe = lookup_FnEntry( dst, sfe->fi_name, sfe->fn_name );
+         if (dfe == NULL) {
+            // no .. move it there
+            add_FnEntry( dst, sfe );
+            continue;
+         }
 
          // yes .. merge the two innermaps
-         initIterFM( soVal );
+         initIterFM( sfe->lines );
 
-         // for (lno, counts) in soVal (source inner map)
-         while (nextIterFM( soVal, (Word*)&siKey, (Word*)&siVal )) {
+         // for (lno, counts) in the source inner map
+         while (nextIterFM( sfe->lines, (Word*)&siKey, (Word*)&siVal )) {
 
             // is lno in the corresponding dst inner map?
-            if (! lookupFM( doVal, (Word*)&diVal, siKey )) {
+            if (! lookupFM( dfe->lines, (Word*)&diVal, siKey )) {
 
                // no .. add lineno->dopy(counts) to dst inner map
                Counts* c_siVal = dopy_Counts( siVal );
-               if (!c_siVal) goto oom;
-               addToFM( doVal, siKey, (Word)c_siVal );
+               if (!c_siVal)
+                  mallocFail(NULL, "merge_CacheProfInfo");
+               addToFM( dfe->lines, siKey, (Word)c_siVal );
 
             } else {
 
                // yes .. merge counts into dst inner map val
-               addCounts( s, diVal, siVal );
+               addCounts( diVal, siVal->counts );
 
             }
          }
-
+         doneIterFM( sfe->lines );
+         ddel_InnerMap( sfe->lines );
+         free( sfe );
       }
-
+      src->fns[i] = NULL;
    }
 
    // add the summaries too
-   addCounts(s, dst->summary, src->summary );
+   addCounts( dst->summary, src->summary->counts );
+
+   ddel_CacheProfFile( src );
+}
+
+
+////////////////////////////////////////////////////////////////
+
+/* The input files are parsed by up to n_jobs threads.  Each takes the
+   next file not yet taken, and merges it into a profile of its own.
+   Then pairs of those are merged, in parallel, until one is left. */
+static char**          inputs;
+static Int             n_inputs;
+static Int             next_input = 0;
+static pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void parse_input ( Int ix, CacheProfFile* cpf )
+{
+   SOURCE src;
+
+   fprintf(stderr, "%s: parsing %s\n", argv0, inputs[ix]);
+   memset(&src, 0, sizeof(src));
+   src.lno      = 1;
+   src.filename = inputs[ix];
+   src.file_ix  = ix;
+   if (streq(src.filename, "-")) {
+      src.filename = "(stdin)";
+      src.fp       = stdin;
+   } else {
+      src.fp = fopen(src.filename, "r");
+      if (!src.fp) {
+         perror(argv0);
+         barf(&src, "Cannot open input file");
+      }
+   }
+   parse_CacheProfFiles( &src, cpf );
+   if (src.fp != stdin)
+      fclose(src.fp);
+   free(src.line);
+   free(src.counts);
+}
 
-   return;
+static void* parse_main ( void* v )
+{
+   CacheProfFile** cpf = v;
+   Int ix;
 
-  oom:
-   mallocFail(s, "merge_CacheProfInfo");
+   while (1) {
+      pthread_mutex_lock(&input_lock);
+      ix = next_input++;
+      pthread_mutex_unlock(&input_lock);
+      if (ix >= n_inputs)
+         break;
+      if (*cpf == NULL) {
+         *cpf = new_CacheProfFile();
+         if (*cpf == NULL)
+            mallocFail(NULL, "parse_main");
+      }
+      parse_input( ix, *cpf );
+   }
+   return NULL;
+}
+
+static void* merge_main ( void* v )
+{
+   CacheProfFile** cpfs = v;   // merge cpfs[1] into cpfs[0]
+
+   if (cpfs[0] == NULL)
+      cpfs[0] = cpfs[1];
+   else if (cpfs[1] != NULL)
+      merge_CacheProfInfo( cpfs[0], cpfs[1] );
+   cpfs[1] = NULL;
+   return NULL;
+}
+
+// Run fn(args + i * stride) for i in 0 .. n-1, each in a thread.
+static void run_threads ( void* (*fn)(void*), CacheProfFile** args,
+                          Int n, Int stride )
+{
+   Int        i;
+   pthread_t* threads = malloc(n * sizeof(pthread_t));
+
+   if (threads == NULL)
+      mallocFail(NULL, "run_threads");
+   for (i = 0; i < n; i++) {
+      if (pthread_create(&threads[i], NULL, fn, &args[i * stride]) != 0) {
+         fprintf(stderr, "%s: cannot create a thread\n", argv0);
+         exit(1);
+      }
+   }
+   for (i = 0; i < n; i++)
+      pthread_join(threads[i], NULL);
+   free(threads);
 }
 
 static void usage ( void )
 {
    fprintf(stderr, "%s: Merges multiple cachegrind output files into one\n", 
                    argv0);
-   fprintf(stderr, "%s: usage: %s [-o outfile] [files-to-merge]\n", 
-                   argv0, argv0);
+   fprintf(stderr, "%s: usage: %s [-o outfile] [-j <n>|--jobs=<n>] "
+                   "[files-to-merge]\n", argv0, argv0);
+   fprintf(stderr, "%s: a file named - is stdin, which can hold several "
+                   "files, one after the other\n", argv0);
+   fprintf(stderr, "%s: -j <n> parses with <n> threads "
+                   "[number of CPUs]\n", argv0);
    exit(1);
 }
 
 int main ( int argc, char** argv )
 {
-   Int            i;
-   SOURCE         src;
-   CacheProfFile  *cpf, *cpfTmp;
+   Int             i, n_left;
+   CacheProfFile** cpfs;
+   CacheProfFile*  cpf;
 
    FILE*          outfile = NULL;
    char*          outfilename = NULL;
-   Int            outfileix = 0;
+   Int            n_jobs = 0;
 
    if (argv[0])
       argv0 = argv[0];
@@ -875,53 +986,55 @@ int main ( int argc, char** argv )
          usage();
    }
 
-   /* Scan args, looking for '-o outfilename'. */
+   /* Scan args: '-o outfilename', '-j n', and the files to merge. */
+   inputs   = malloc(argc * sizeof(char*));
+   n_inputs = 0;
+   if (inputs == NULL)
+      mallocFail(NULL, "main");
    for (i = 1; i < argc; i++) {
-      if (streq(argv[i], "-o")) {
-         if (i+1 < argc) {
-            outfilename = argv[i+1];
-            outfileix   = i;
-            break;
-         } else {
+      if (streq(argv[i], "-o") || streq(argv[i], "-j")) {
+         if (i+1 >= argc)
             usage();
-         }
+         if (streq(argv[i], "-o"))
+            outfilename = argv[i+1];
+         else
+            n_jobs = atoi(argv[i+1]);
+         i++;
+      } else if (streqn(argv[i], "--jobs=", 7)) {
+         n_jobs = atoi(argv[i] + 7);
+      } else {
+         inputs[n_inputs++] = argv[i];
       }
    }
 
    cpf = NULL;
 
-   for (i = 1; i < argc; i++) {
-
-      if (i == outfileix) {
-         /* Skip '-o' and whatever follows it */
-         i += 1;
-         continue;
+   if (n_inputs > 0) {
+      if (n_jobs <= 0) {
+         long n = sysconf(_SC_NPROCESSORS_ONLN);
+         n_jobs = n > 0 ? n : 1;
       }
-
-      fprintf(stderr, "%s: parsing %s\n", argv0, argv[i]);
-      src.lno      = 1;
-      src.filename = argv[i];
-      src.fp       = fopen(src.filename, "r");
-      if (!src.fp) {
-         perror(argv0);
-         barf(&src, "Cannot open input file");
-      }
-      assert(src.fp);
-      cpfTmp = parse_CacheProfFile( &src );
-      fclose(src.fp);
-
-      /* If this isn't the first file, merge */
-      if (cpf == NULL) {
-         /* this is the first file */
-         cpf = cpfTmp;
-      } else {
-         /* not the first file; merge */
-         fprintf(stderr, "%s: merging %s\n", argv0, argv[i]);
-         merge_CacheProfInfo( &src, cpf, cpfTmp );
-         ddel_CacheProfFile( cpfTmp );
+      if (n_jobs > n_inputs)
+         n_jobs = n_inputs;
+      for (i = 0; i < N_NAME_LOCKS; i++)
+         pthread_mutex_init(&name_locks[i], NULL);
+
+      cpfs = calloc(n_jobs, sizeof(CacheProfFile*));
+      if (cpfs == NULL)
+         mallocFail(NULL, "main");
+      run_threads( parse_main, cpfs, n_jobs, 1 );
+
+      /* Merge the threads' profiles as a tree: each round merges
+         cpfs[2i+1] into cpfs[2i], then packs the results to the front. */
+      for (n_left = n_jobs; n_left > 1; n_left = (n_left + 1) / 2) {
+         run_threads( merge_main, cpfs, n_left / 2, 2 );
+         for (i = 0; 2 * i < n_left; i++)
+            cpfs[i] = cpfs[2 * i];
       }
-
+      cpf = cpfs[0];
+      free(cpfs);
    }
+   free(inputs);
 
    /* Now create the output file. */
 
@@ -0,0 +1,724 @@
+/*--------------------------------------------------------------------*/
+/*--- Replay a memory log through the cache simulator. cg_replay.c ---*/
+/*--------------------------------------------------------------------*/
+
+/*
+   This file is part of Cachegrind, a Valgrind tool for cache
+   profiling programs.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+/* cg_replay feeds the instruction fetches, reads and writes of a trace
+ * written with --mem-log=yes through cg_sim.c, for one or more cache
+ * configurations, and writes a cachegrind.out style file per
+ * configuration.  The I1, D1 and LL caches each take a list of
+ * configurations; every combination is simulated.
+ *
+ * cg_sim.c keeps its caches in globals, so each configuration runs in its
+ * own forked process, --jobs of them at a time.
+ *
+ * Costs are attributed to instructions, and written under the file,
+ * function and line that the trace's instruction table gives for them.
+ * A data access belongs to the instruction whose id it records, or, if
+ * it has none, to the instruction fetched before it.  Instructions the
+ * table does not know are written as a function named after their
+ * address, in file "???".
+ */
+
+#include "pub_tool_basics.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "cg_arch.h"
+#include "cg_mem_format.h"
+
+static const char* argv0 = "cg_replay";
+
+static void* xmalloc(size_t n)
+{
+    void* p = calloc(1, n ? n : 1);
+    if (p == NULL) {
+        fprintf(stderr, "%s: out of memory\n", argv0);
+        exit(1);
+    }
+    return p;
+}
+
+// What cg_sim.c needs from the core.
+#define vgPlain_sprintf sprintf
+#define vgPlain_printf printf
+#define vgPlain_strlen strlen
+#define vgPlain_strcmp strcmp
+#define vgPlain_memset memset
+#define vgPlain_malloc(cc, n) xmalloc(n)
+
+static Int vgPlain_log2(UInt x)
+{
+    return __builtin_ctz(x);
+}
+
+static void vgPlain_tool_panic(const HChar* str)
+{
+    fprintf(stderr, "%s: panic: %s\n", argv0, str);
+    exit(1);
+}
+
+#include "cg_sim.c"
+
+// The replay does not write a memory log.
+__attribute__((always_inline)) static __inline__ void log_mem_access(Addr addr, UChar size, AccessType type,
+                                                                     CacheHitType hit_type)
+{
+}
+
+// The replay simulates a single core.
+static void cachesim_note_false_sharing(UWord block)
+{
+}
+
+// Nor does it simulate TLBs: it has no page sizes.
+static void tlbsim_ref(Addr a, UChar size, CacheCC* cc, Bool instr)
+{
+}
+
+// Nor does it know the heap blocks.
+static void heapsim_note_eviction(Addr a, Int wasted, Bool llc)
+{
+}
+
+/*------------------------------------------------------------*/
+/*--- Configurations                                       ---*/
+/*------------------------------------------------------------*/
+
+#define MAX_CONFIGS_PER_CACHE 32
+
+typedef struct {
+    cache_t c[MAX_CONFIGS_PER_CACHE];
+    Int n;
+} CacheList;
+
+static CacheList I1_list, D1_list, LL_list;
+static const cache_t default_I1 = {32768, 8, 64};
+static const cache_t default_D1 = {32768, 8, 64};
+static const cache_t default_LL = {8388608, 16, 64};
+
+static const char* out_prefix = "cachegrind.out.replay";
+static Int n_cores = 0;
+static CacheSimConfig sim_config; /* all but the caches and cores */
+static UInt n_jobs = 0;
+
+// Totals of one configuration, shared with the parent for the summary.
+typedef struct {
+    CacheCC Ir, Dr, Dw;
+    ULong LL_dirty_evictions;
+} ReplayTotals;
+
+static Bool is_pow2(Int x)
+{
+    return x > 0 && (x & (x - 1)) == 0;
+}
+
+// Parse "<size>,<assoc>,<line_size>", as the tool's --I1/--D1/--LL.
+static void parse_cache(const char* name, const char* spec, CacheList* list)
+{
+    cache_t c;
+    Int sets;
+
+    if (sscanf(spec, "%d,%d,%d", &c.size, &c.assoc, &c.line_size) != 3) {
+        fprintf(stderr, "%s: bad --%s argument '%s', expected <size>,<assoc>,<line_size>\n", argv0, name, spec);
+        exit(1);
+    }
+    if (c.size <= 0 || c.assoc <= 0 || !is_pow2(c.line_size) || c.line_size < MIN_LINE_SIZE
+        || c.line_size > 4 * 8 * (Int)sizeof(UWord)) {
+        fprintf(stderr, "%s: --%s=%s: bad size, associativity or line size\n", argv0, name, spec);
+        exit(1);
+    }
+    sets = c.size / c.line_size / c.assoc;
+    if (!is_pow2(sets) || sets * c.line_size * c.assoc != c.size) {
+        fprintf(stderr, "%s: --%s=%s: number of sets must be a power of two\n", argv0, name, spec);
+        exit(1);
+    }
+    if (list->n == MAX_CONFIGS_PER_CACHE) {
+        fprintf(stderr, "%s: too many --%s options\n", argv0, name);
+        exit(1);
+    }
+    list->c[list->n++] = c;
+}
+
+/*------------------------------------------------------------*/
+/*--- Per-instruction costs                                ---*/
+/*------------------------------------------------------------*/
+
+typedef struct {
+    Addr addr;  // 0 if the slot is free
+    CacheCC Ir, Dr, Dw;
+} InstrCC;
+
+static InstrCC* instr_ccs = NULL;
+static UWord n_instr_ccs = 0;
+static UInt instr_hash_bits = 0;
+
+static UWord hash_addr(Addr a)
+{
+    return (UWord)(((ULong)a * 0x9E3779B97F4A7C15ULL) >> (64 - instr_hash_bits));
+}
+
+static InstrCC* lookup_instr(Addr a)
+{
+    UWord mask = ((UWord)1 << instr_hash_bits) - 1;
+    UWord h = hash_addr(a);
+
+    while (instr_ccs[h].addr != a && instr_ccs[h].addr != 0)
+        h = (h + 1) & mask;
+    if (instr_ccs[h].addr == 0) {
+        if ((n_instr_ccs + 1) * 2 > mask + 1) {
+            InstrCC* old = instr_ccs;
+            instr_hash_bits++;
+            instr_ccs = xmalloc(sizeof(InstrCC) << instr_hash_bits);
+            n_instr_ccs = 0;
+            for (UWord i = 0; i <= mask; i++) {
+                if (old[i].addr != 0)
+                    *lookup_instr(old[i].addr) = old[i];
+            }
+            free(old);
+            return lookup_instr(a);
+        }
+        instr_ccs[h].addr = a;
+        n_instr_ccs++;
+    }
+    return &instr_ccs[h];
+}
+
+/*------------------------------------------------------------*/
+/*--- Replay                                               ---*/
+/*------------------------------------------------------------*/
+
+static const char* trace_name;
+static UChar* trace;
+static size_t trace_size;
+static UChar max_access_size = 0;
+
+// The instruction table, indexed by id, and sorted by address.  The names
+// point into the mapped trace.
+static CgMemSym* syms = NULL;
+static UInt n_syms = 0;
+static CgMemSym** syms_by_addr = NULL;
+static UInt n_syms_by_addr = 0;
+
+static void bad_trace(const char* why)
+{
+    fprintf(stderr, "%s: %s: %s\n", argv0, trace_name, why);
+    exit(1);
+}
+
+static void map_trace(const char* name)
+{
+    struct stat st;
+    int fd = open(name, O_RDONLY);
+
+    trace_name = name;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: cannot open '%s': %m\n", argv0, name);
+        exit(1);
+    }
+    trace_size = st.st_size;
+    if (trace_size > 0) {
+        trace = mmap(NULL, trace_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (trace == MAP_FAILED) {
+            fprintf(stderr, "%s: cannot mmap '%s': %m\n", argv0, name);
+            exit(1);
+        }
+        madvise(trace, trace_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
+
+static void add_syms(const UChar* data, UInt payload_bytes, UInt n_records)
+{
+    CgMemSymCodec codec;
+    const UChar* p = data;
+    const UChar* end = data + payload_bytes;
+
+    cgm_sym_codec_reset(&codec);
+    for (UInt i = 0; i < n_records; i++) {
+        CgMemSym sym;
+        if (!cgm_decode_sym(&codec, &p, end, &sym))
+            bad_trace("corrupt instruction table");
+        if (sym.id >= n_syms) {
+            UInt n = n_syms ? n_syms : 1024;
+            while (n <= sym.id)
+                n *= 2;
+            syms = realloc(syms, n * sizeof(CgMemSym));
+            if (syms == NULL) {
+                fprintf(stderr, "%s: out of memory\n", argv0);
+                exit(1);
+            }
+            memset(syms + n_syms, 0, (n - n_syms) * sizeof(CgMemSym));
+            n_syms = n;
+        }
+        syms[sym.id] = sym;
+    }
+}
+
+static int cmp_sym_addr(const void* a, const void* b)
+{
+    Addr x = (*(const CgMemSym* const*)a)->addr;
+    Addr y = (*(const CgMemSym* const*)b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+static void sort_syms(void)
+{
+    syms_by_addr = xmalloc(n_syms * sizeof(CgMemSym*));
+    for (UInt id = 1; id < n_syms; id++) {
+        if (syms[id].file != NULL)
+            syms_by_addr[n_syms_by_addr++] = &syms[id];
+    }
+    qsort(syms_by_addr, n_syms_by_addr, sizeof(CgMemSym*), cmp_sym_addr);
+}
+
+static const CgMemSym* sym_of_addr(Addr a)
+{
+    UInt lo = 0, hi = n_syms_by_addr;
+
+    while (lo < hi) {
+        UInt mid = lo + (hi - lo) / 2;
+        if (syms_by_addr[mid]->addr < a)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < n_syms_by_addr && syms_by_addr[lo]->addr == a ? syms_by_addr[lo] : NULL;
+}
+
+/* Decode the whole trace and pass each record to 'fn'.  Runs once to
+   check the access sizes and, with 'load_syms', read the instruction
+   table, then once per configuration. */
+static void scan_trace(void (*fn)(const LogEntry*, void*), void* arg, Bool load_syms)
+{
+    CgMemFileHeader fh;
+    size_t pos;
+
+    if (trace_size < sizeof(fh) || memcmp(trace, CGM_MAGIC, CGM_MAGIC_LEN) != 0) {
+        // Files written before the compact format are a raw array of entries.
+        const CgMemLegacyEntry* raw = (const CgMemLegacyEntry*)trace;
+        for (pos = 0; pos < trace_size / sizeof(CgMemLegacyEntry); pos++) {
+            LogEntry e = {.addr = raw[pos].addr,
+                          .size = raw[pos].size,
+                          .region = REGION_NONE,
+                          .type = raw[pos].type,
+                          .hit_type = raw[pos].hit_type,
+                          .timestamp = raw[pos].timestamp,
+                          .thread_ts = raw[pos].timestamp};
+            fn(&e, arg);
+        }
+        return;
+    }
+
+    memcpy(&fh, trace, sizeof(fh));
+    if (fh.version > CGM_VERSION)
+        bad_trace("unsupported format version");
+    if (fh.addr_bytes != sizeof(Addr))
+        bad_trace("written by a process with a different word size");
+    if (fh.header_size < sizeof(fh))
+        bad_trace("bad file header");
+
+    for (pos = fh.header_size; pos < trace_size;) {
+        CgMemChunkHeader ch;
+        CgMemCodec codec;
+        const UChar *p, *end;
+
+        if (trace_size - pos < sizeof(ch))
+            bad_trace("truncated file");
+        memcpy(&ch, trace + pos, sizeof(ch));
+        pos += sizeof(ch);
+        if (ch.magic != CGM_CHUNK_MAGIC && ch.magic != CGM_SYMS_MAGIC)
+            bad_trace("bad chunk header");
+        if (trace_size - pos < ch.payload_bytes)
+            bad_trace("truncated chunk");
+        if (ch.magic == CGM_SYMS_MAGIC) {
+            if (load_syms)
+                add_syms(trace + pos, ch.payload_bytes, ch.n_records);
+            pos += ch.payload_bytes;
+            continue;
+        }
+        p = trace + pos;
+        end = p + ch.payload_bytes;
+        cgm_codec_reset(&codec, ch.base_timestamp);
+        for (UInt i = 0; i < ch.n_records; i++) {
+            LogEntry e;
+            if (!cgm_decode_entry(&codec, &p, end, &e))
+                bad_trace("corrupt chunk");
+            fn(&e, arg);
+        }
+        pos += ch.payload_bytes;
+    }
+}
+
+// Records larger than a line would straddle more than two lines, which the
+// simulator cannot handle (the tool refuses such caches too).
+static void note_access_size(const LogEntry* e, void* arg)
+{
+    if (e->type <= ACCESS_INSTR && e->size > max_access_size)
+        max_access_size = e->size;
+}
+
+// 'arg' points to the InstrCC of the last instruction fetched.
+static void replay_entry(const LogEntry* e, void* arg)
+{
+    InstrCC** cur = arg;
+
+    if (n_cores > 0 && e->tid != 0)
+        cachesim_switch_core((e->tid - 1) % n_cores);
+    switch (e->type) {
+    case ACCESS_INSTR:
+        *cur = lookup_instr(e->addr);
+        // The same choice the tool makes at instrumentation time.
+        if (cachesim_is_IrNoX(e->addr, e->size))
+            cachesim_I1_doref_NoX(e->addr, e->size, &(*cur)->Ir);
+        else
+            cachesim_I1_doref_Gen(e->addr, e->size, &(*cur)->Ir);
+        break;
+    case ACCESS_READ:
+    case ACCESS_WRITE: {
+        InstrCC* cc = *cur;
+        if (e->instr != 0 && e->instr < n_syms && syms[e->instr].file != NULL)
+            cc = lookup_instr(syms[e->instr].addr);
+        // Accesses before the first instruction fetch go to address 1.
+        if (cc == NULL)
+            cc = *cur = lookup_instr(1);
+        cachesim_D1_doref(e->addr, e->size, e->type == ACCESS_READ ? &cc->Dr : &cc->Dw, e->type, cc->addr);
+        break;
+    }
+    default:
+        // LL fills and evictions of the original run; the replay makes its own.
+        break;
+    }
+}
+
+static void add_cc(CacheCC* total, const CacheCC* cc)
+{
+    total->a += cc->a;
+    total->m1 += cc->m1;
+    total->mL += cc->mL;
+    total->l1_words += cc->l1_words;
+    total->llc_words += cc->llc_words;
+}
+
+// The costs of a source line, or of an instruction the table does not know.
+typedef struct {
+    const HChar* file;
+    UInt file_len;
+    const HChar* fn;  // NULL for an unknown instruction, named in fn_buf
+    UInt fn_len;
+    UInt line;
+    char fn_buf[20];
+    CacheCC Ir, Dr, Dw;
+} LineCC;
+
+static const HChar* line_fn(const LineCC* l)
+{
+    return l->fn ? l->fn : l->fn_buf;
+}
+
+static int cmp_name(const HChar* a, UInt a_len, const HChar* b, UInt b_len)
+{
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    return c ? c : (a_len > b_len) - (a_len < b_len);
+}
+
+static int cmp_line_cc(const void* va, const void* vb)
+{
+    const LineCC* a = va;
+    const LineCC* b = vb;
+    int c = cmp_name(a->file, a->file_len, b->file, b->file_len);
+    if (c == 0)
+        c = cmp_name(line_fn(a), a->fn_len, line_fn(b), b->fn_len);
+    return c ? c : (a->line > b->line) - (a->line < b->line);
+}
+
+// Same layout as cg_main.c's fprint_CC_table_and_calc_totals() with
+// --cache-sim=yes --branch-sim=no.
+static void write_output(const char* filename, ReplayTotals* t)
+{
+    FILE* fp = fopen(filename, "w");
+    LineCC* lines;
+    UWord n = 0, n_lines = 0;
+
+    if (fp == NULL) {
+        fprintf(stderr, "%s: cannot create '%s': %m\n", argv0, filename);
+        exit(1);
+    }
+    fprintf(fp,
+            "desc: I1 cache:         %s\n"
+            "desc: D1 cache:         %s\n"
+            "desc: LL cache:         %s\n",
+            I1.desc_line, D1.desc_line, LL.desc_line);
+    fprintf(fp, "cmd: %s %s\n", argv0, trace_name);
+    fprintf(fp, "events: Ir I1mr ILmr I1u ILu Dr D1mr DLmr D1ru DLru Dw D1mw DLmw D1wu DLwu \n");
+
+    lines = xmalloc(n_instr_ccs * sizeof(LineCC));
+    for (UWord i = 0; i < ((UWord)1 << instr_hash_bits); i++) {
+        const InstrCC* cc = &instr_ccs[i];
+        const CgMemSym* sym;
+        LineCC* l;
+        if (cc->addr == 0)
+            continue;
+        l = &lines[n++];
+        sym = sym_of_addr(cc->addr);
+        if (sym != NULL) {
+            l->file = sym->file;
+            l->file_len = sym->file_len;
+            l->fn = sym->fn;
+            l->fn_len = sym->fn_len;
+            l->line = sym->line;
+        } else {
+            l->file = "???";
+            l->file_len = 3;
+            l->fn_len = snprintf(l->fn_buf, sizeof(l->fn_buf), "%#lx", (unsigned long)cc->addr);
+            l->line = 0;
+        }
+        l->Ir = cc->Ir;
+        l->Dr = cc->Dr;
+        l->Dw = cc->Dw;
+    }
+    qsort(lines, n, sizeof(LineCC), cmp_line_cc);
+
+    // Add up the instructions of each line, as the tool does.
+    for (UWord i = 0; i < n; i++) {
+        if (n_lines > 0 && cmp_line_cc(&lines[n_lines - 1], &lines[i]) == 0) {
+            add_cc(&lines[n_lines - 1].Ir, &lines[i].Ir);
+            add_cc(&lines[n_lines - 1].Dr, &lines[i].Dr);
+            add_cc(&lines[n_lines - 1].Dw, &lines[i].Dw);
+        } else if (n_lines++ != i)
+            lines[n_lines - 1] = lines[i];
+    }
+
+    memset(t, 0, sizeof(*t));
+    for (UWord i = 0; i < n_lines; i++) {
+        const LineCC* l = &lines[i];
+        if (i == 0 || cmp_name(l->file, l->file_len, lines[i - 1].file, lines[i - 1].file_len) != 0) {
+            fprintf(fp, "fl=%.*s\n", (int)l->file_len, l->file);
+            fprintf(fp, "fn=%.*s\n", (int)l->fn_len, line_fn(l));
+        } else if (cmp_name(line_fn(l), l->fn_len, line_fn(&lines[i - 1]), lines[i - 1].fn_len) != 0)
+            fprintf(fp, "fn=%.*s\n", (int)l->fn_len, line_fn(l));
+        fprintf(fp,
+                "%u %llu %llu %llu %llu %llu"
+                " %llu %llu %llu %llu %llu"
+                " %llu %llu %llu %llu %llu\n",
+                l->line, l->Ir.a, l->Ir.m1, l->Ir.mL, l->Ir.l1_words, l->Ir.llc_words, l->Dr.a, l->Dr.m1, l->Dr.mL,
+                l->Dr.l1_words, l->Dr.llc_words, l->Dw.a, l->Dw.m1, l->Dw.mL, l->Dw.l1_words, l->Dw.llc_words);
+        add_cc(&t->Ir, &l->Ir);
+        add_cc(&t->Dr, &l->Dr);
+        add_cc(&t->Dw, &l->Dw);
+    }
+    free(lines);
+    t->LL_dirty_evictions = LL.total_dirty_read_evictions + LL.total_dirty_write_evictions;
+
+    fprintf(fp,
+            "summary:"
+            " %llu %llu %llu %llu %llu"
+            " %llu %llu %llu %llu %llu"
+            " %llu %llu %llu %llu %llu\n",
+            t->Ir.a, t->Ir.m1, t->Ir.mL, t->Ir.l1_words, t->Ir.llc_words, t->Dr.a, t->Dr.m1, t->Dr.mL,
+            t->Dr.l1_words, t->Dr.llc_words, t->Dw.a, t->Dw.m1, t->Dw.mL, t->Dw.l1_words, t->Dw.llc_words);
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "%s: write error on '%s': %m\n", argv0, filename);
+        exit(1);
+    }
+}
+
+// Body of the child process simulating configuration 'n'.
+static void run_config(Int n, cache_t I1c, cache_t D1c, cache_t LLc, ReplayTotals* t)
+{
+    char filename[strlen(out_prefix) + 16];
+    InstrCC* cur = NULL;
+    CacheSimConfig config = sim_config;
+
+    config.I1 = I1c;
+    config.D1 = D1c;
+    config.LL = LLc;
+    config.cores = n_cores;
+    cachesim_initcaches(&config);
+    instr_hash_bits = 16;
+    instr_ccs = xmalloc(sizeof(InstrCC) << instr_hash_bits);
+    scan_trace(replay_entry, &cur, False);
+    snprintf(filename, sizeof(filename), "%s.%d", out_prefix, n);
+    write_output(filename, t);
+}
+
+static double pct(ULong part, ULong all)
+{
+    return all ? part * 100.0 / all : 0.0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <mem-log-file>\n"
+            "    --I1=<size>,<assoc>,<line_size>  I1 cache configuration [32768,8,64]\n"
+            "    --D1=<size>,<assoc>,<line_size>  D1 cache configuration [32768,8,64]\n"
+            "    --LL=<size>,<assoc>,<line_size>  LL cache configuration [8388608,16,64]\n"
+            "                            each may be given several times; every\n"
+            "                            combination is simulated\n"
+            "    --cores=<n>             give each of <n> cores its own I1 and D1, kept\n"
+            "                            coherent; threads go round robin [0: shared]\n"
+            "    --replacement=<policy>  replacement policy of all caches: lru, plru,\n"
+            "                            srrip, brrip or random [lru]\n"
+            "    --replacement-seed=<n>  seed of the random policy [1]\n"
+            "    --prefetch=<model>      D1 prefetcher: none, next-line, ip-stride or\n"
+            "                            stream [none]\n"
+            "    --prefetch-latency=<n>  data accesses a prefetch takes to complete [50]\n"
+            "    --out-prefix=<prefix>   write configuration N to <prefix>.N\n"
+            "                            [cachegrind.out.replay]\n"
+            "    --jobs=<n>|-j <n>       simulate <n> configurations at a time\n"
+            "                            [number of CPUs]\n"
+            "    --help|-h               print this help message\n"
+            "  The output files can be read by cg_annotate, cg_diff and cg_merge.\n",
+            argv0);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    Int i, n_configs, running = 0, next = 0;
+    ReplayTotals* totals;
+
+    if (argv[0])
+        argv0 = argv[0];
+
+    cachesim_default_config(&sim_config);
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strncmp(argv[i], "--I1=", 5) == 0)
+            parse_cache("I1", argv[i] + 5, &I1_list);
+        else if (strncmp(argv[i], "--D1=", 5) == 0)
+            parse_cache("D1", argv[i] + 5, &D1_list);
+        else if (strncmp(argv[i], "--LL=", 5) == 0)
+            parse_cache("LL", argv[i] + 5, &LL_list);
+        else if (strncmp(argv[i], "--cores=", 8) == 0)
+            n_cores = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--replacement=", 14) == 0) {
+            Int policy = cachesim_parse_policy(argv[i] + 14);
+            if (policy < 0)
+                usage();
+            sim_config.policies[0] = sim_config.policies[1] = sim_config.policies[2] = policy;
+        } else if (strncmp(argv[i], "--prefetch=", 11) == 0) {
+            Int prefetcher = cachesim_parse_prefetcher(argv[i] + 11);
+            if (prefetcher < 0)
+                usage();
+            sim_config.prefetchers[1] = prefetcher;
+        } else if (strncmp(argv[i], "--prefetch-latency=", 19) == 0)
+            sim_config.prefetch_latency = atoi(argv[i] + 19);
+        else if (strncmp(argv[i], "--replacement-seed=", 19) == 0)
+            cachesim_seed(strtoull(argv[i] + 19, NULL, 10));
+        else if (strncmp(argv[i], "--out-prefix=", 13) == 0)
+            out_prefix = argv[i] + 13;
+        else if (strncmp(argv[i], "--jobs=", 7) == 0)
+            n_jobs = atoi(argv[i] + 7);
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            n_jobs = atoi(argv[++i]);
+        else
+            usage();
+    }
+    if (argc - i != 1 || n_cores < 0 || n_cores > MAX_CORES)
+        usage();
+    if (I1_list.n == 0)
+        I1_list.c[I1_list.n++] = default_I1;
+    if (D1_list.n == 0)
+        D1_list.c[D1_list.n++] = default_D1;
+    if (LL_list.n == 0)
+        LL_list.c[LL_list.n++] = default_LL;
+    if (n_jobs == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        n_jobs = n > 0 ? n : 1;
+    }
+
+    map_trace(argv[i]);
+    scan_trace(note_access_size, NULL, True);
+    sort_syms();
+    n_configs = I1_list.n * D1_list.n * LL_list.n;
+    for (i = 0; i < n_configs; i++) {
+        const cache_t* c[3] = {&I1_list.c[i % I1_list.n], &D1_list.c[i / I1_list.n % D1_list.n],
+                               &LL_list.c[i / (I1_list.n * D1_list.n)]};
+        for (Int k = 0; k < 3; k++) {
+            if (c[k]->line_size < max_access_size) {
+                fprintf(stderr, "%s: the trace has %d-byte accesses, larger than the %d-byte lines of a cache\n",
+                        argv0, max_access_size, c[k]->line_size);
+                exit(1);
+            }
+        }
+    }
+
+    totals = mmap(NULL, n_configs * sizeof(ReplayTotals), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (totals == MAP_FAILED) {
+        fprintf(stderr, "%s: cannot map shared memory: %m\n", argv0);
+        exit(1);
+    }
+
+    // Configuration i is I1 i % nI1, D1 (i / nI1) % nD1, LL i / (nI1 * nD1).
+    while (next < n_configs || running > 0) {
+        int status;
+        if (next < n_configs && running < (Int)n_jobs) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                fprintf(stderr, "%s: cannot fork: %m\n", argv0);
+                exit(1);
+            }
+            if (pid == 0) {
+                run_config(next, I1_list.c[next % I1_list.n], D1_list.c[next / I1_list.n % D1_list.n],
+                           LL_list.c[next / (I1_list.n * D1_list.n)], &totals[next]);
+                exit(0);
+            }
+            next++;
+            running++;
+            continue;
+        }
+        if (wait(&status) < 0)
+            break;
+        running--;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%s: a simulation failed\n", argv0);
+            exit(1);
+        }
+    }
+
+    printf("%-6s %-18s %-18s %-18s %8s %8s %8s %8s\n", "config", "I1", "D1", "LL", "I1mr%", "D1mr%", "LLmr%",
+           "LLdirty");
+    for (i = 0; i < n_configs; i++) {
+        const cache_t* c[3] = {&I1_list.c[i % I1_list.n], &D1_list.c[i / I1_list.n % D1_list.n],
+                               &LL_list.c[i / (I1_list.n * D1_list.n)]};
+        const ReplayTotals* t = &totals[i];
+        char desc[3][32];
+        ULong d = t->Dr.a + t->Dw.a;
+        for (Int k = 0; k < 3; k++)
+            snprintf(desc[k], sizeof(desc[k]), "%d,%d,%d", c[k]->size, c[k]->assoc, c[k]->line_size);
+        printf("%-6d %-18s %-18s %-18s %7.3f%% %7.3f%% %7.3f%% %8llu\n", i, desc[0], desc[1], desc[2],
+               pct(t->Ir.m1, t->Ir.a), pct(t->Dr.m1 + t->Dw.m1, d), pct(t->Ir.mL + t->Dr.mL + t->Dw.mL, t->Ir.a + d),
+               t->LL_dirty_evictions);
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------------*/
+/*--- end                                              cg_replay.c ---*/
+/*--------------------------------------------------------------------*/
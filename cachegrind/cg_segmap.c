@@ -1,275 +1,302 @@
 /*--------------------------------------------------------------------*/
-/*--- Direct stack and heap detection for Cachegrind.             ---*/
+/*--- Run-time classification of data addresses for Cachegrind.   ---*/
 /*--------------------------------------------------------------------*/
 
-/* 
- * This code uses direct methods to identify stack and heap.
+/*
+ * With --regions=yes every data access is classified as stack, heap,
+ * global, mmap or other, and counted per region.
+ *
+ * The classification comes from a sorted table of client address
+ * intervals, built from the aspacemgr segments and the thread stacks.
+ * The table is only rebuilt, lazily, after the client's mappings
+ * changed: on mmap, munmap, mremap, brk, a new signal frame or a new
+ * thread.  A lookup first tries the two intervals hit most recently,
+ * which catches nearly all accesses, and only then does a binary search.
+ *
+ * Classification:
+ *  - the segment holding a thread's highest stack byte is stack;
+ *  - client heap segments (brk) are heap;
+ *  - file mappings of an object with an executable segment, and an
+ *    anonymous mapping directly following one (its .bss), are global;
+ *  - other client file, anonymous and shared mappings are mmap;
+ *  - everything else is other.
+ *
+ * The TLB simulation (cg_tlb.c) uses the same table to find the
+ * anonymous writable mappings, which may be backed by transparent huge
+ * pages; it maintains the table even with --regions=no.
  */
 
 #include "pub_tool_aspacemgr.h"
 #include "pub_tool_basics.h"
-#include "pub_tool_guest.h"
+#include "pub_tool_libcassert.h"
 #include "pub_tool_libcbase.h"
-#include "pub_tool_libcfile.h"
 #include "pub_tool_libcprint.h"
-#include "pub_tool_libcproc.h"
 #include "pub_tool_machine.h"
 #include "pub_tool_mallocfree.h"
 #include "pub_tool_threadstate.h"
-
-// Print information about a specific memory address
-static void print_address_info(Addr addr, const HChar* description)
+#include "pub_tool_tooliface.h"
+#include "cg_arch.h"
+
+typedef struct {
+    Addr start;
+    Addr end;  // highest byte, as in NSegment
+    RegionKind kind;
+    Bool thp;  // anonymous and writable, so may be backed by huge pages
+} RegionInterval;
+
+static Bool segmap_active = False;    // --regions=yes
+static Bool segmap_tracking = False;  // the table is kept up to date
+static Bool segmap_dirty = True;
+static UInt segmap_generation = 0;    // bumped whenever the mappings change
+static RegionInterval* region_table = NULL;
+static Int region_table_used = 0;
+static Int region_table_size = 0;
+static Addr* seg_starts = NULL;
+static Int seg_starts_size = 0;
+
+// The two intervals hit most recently, most recent first.
+static RegionInterval region_mru[2];
+
+// Per-region totals of data accesses, [region][0 = read, 1 = write].
+static CacheCC region_cc[N_REGIONS][2];
+
+// Stats
+static ULong segmap_rebuilds = 0;
+static ULong segmap_searches = 0;
+
+static void segmap_add(Addr start, Addr end, RegionKind kind, Bool thp)
 {
-    const NSegment* seg = VG_(am_find_nsegment)(addr);
-    if (!seg) {
-        VG_(umsg)("%s (0x%lx): Not in any valid segment\n", description, addr);
-        return;
+    if (region_table_used == region_table_size) {
+        region_table_size = region_table_size ? 2 * region_table_size : 256;
+        region_table = VG_(realloc)("cg.segmap.add.1", region_table, region_table_size * sizeof(RegionInterval));
     }
-
-    HChar perms[4];
-    perms[0] = seg->hasR ? 'r' : '-';
-    perms[1] = seg->hasW ? 'w' : '-';
-    perms[2] = seg->hasX ? 'x' : '-';
-    perms[3] = '\0';
-
-    VG_(umsg)("%s (0x%lx): In segment 0x%lx-0x%lx perms=%s isCH=%u kind=%u\n", description, addr, seg->start, seg->end,
-              perms, seg->isCH, seg->kind);
+    region_table[region_table_used].start = start;
+    region_table[region_table_used].end = end;
+    region_table[region_table_used].kind = kind;
+    region_table[region_table_used].thp = thp;
+    region_table_used++;
 }
 
-// Find stack segment using SP register
-static void find_stack_segment(void)
+// Empty the MRU entries, so the next lookup misses them.
+static void segmap_mru_reset(void)
 {
-    VG_(umsg)("\n=== STACK DETECTION ===\n");
+    region_mru[0].start = region_mru[1].start = 1;
+    region_mru[0].end = region_mru[1].end = 0;
+}
 
+static Bool segmap_is_stack(const NSegment* seg)
+{
     ThreadId tid;
-    Addr sp;
-
-    for (tid = 1; tid < VG_N_THREADS; tid++) {
-        // Simply check if tid is in valid range
-        // VG_N_THREADS is the max number of threads
-        if (tid >= 1 && tid < VG_N_THREADS) {
-            sp = VG_(get_SP)(tid);
-
-            // Only report if SP seems valid (non-zero)
-            if (sp != 0) {
-                VG_(umsg)("Thread %u SP = 0x%lx\n", tid, sp);
-                print_address_info(sp, "Stack pointer");
-            }
-        }
+    Addr stack_min, stack_max;
+
+    VG_(thread_stack_reset_iter)(&tid);
+    while (VG_(thread_stack_next)(&tid, &stack_min, &stack_max)) {
+        if (stack_max >= seg->start && stack_max <= seg->end)
+            return True;
     }
+    return False;
 }
 
-// Find heap segments directly
-static void find_heap_segments(void)
+static void segmap_rebuild(void)
 {
-    VG_(umsg)("\n=== HEAP DETECTION ===\n");
-
-    // Common heap start addresses
-    static const struct {
-        Addr addr;
-        const HChar* desc;
-    } heap_addrs[] = {
-            {0x08000000, "Common heap base (0x8000000)"        },
-            {0x08048000, "Another common heap area (0x8048000)"},
-            {0x00603000, "Classic brk-based heap (0x603000)"   },
-            {0x01000000, "mmap-based allocations (0x1000000)"  },
-            {0x00602000, "Another brk point (0x602000)"        },
-            {0x00601000, "Early brk point (0x601000)"          }
-    };
-
-    // Check known heap locations
-    for (Int i = 0; i < sizeof(heap_addrs) / sizeof(heap_addrs[0]); i++) {
-        print_address_info(heap_addrs[i].addr, heap_addrs[i].desc);
-    }
-
-    // Scan all segments for client heap (isCH) flag
-    VG_(umsg)("\nScanning memory for segments with isCH flag set:\n");
+    Int n, i;
+    const NSegment* prev_file = NULL;  // last file mapping of an object with code
+    Bool prev_file_has_code = False;
 
-    Bool found_ch = False;
-
-    // Scan common heap ranges more densely
-    for (Addr addr = 0x601000; addr < 0x610000; addr += 0x1000) {
-        const NSegment* seg = VG_(am_find_nsegment)(addr);
-        if (seg && seg->isCH) {
-            HChar perms[4];
-            perms[0] = seg->hasR ? 'r' : '-';
-            perms[1] = seg->hasW ? 'w' : '-';
-            perms[2] = seg->hasX ? 'x' : '-';
-            perms[3] = '\0';
-
-            VG_(umsg)("HEAP: 0x%lx-0x%lx perms=%s size=%lu bytes\n", seg->start, seg->end, perms,
-                      seg->end - seg->start);
-            found_ch = True;
-        }
+    if (seg_starts_size == 0) {
+        seg_starts_size = 256;
+        seg_starts = VG_(malloc)("cg.segmap.rebuild.1", seg_starts_size * sizeof(Addr));
+    }
+    // The number of segments can change between the two calls.
+    while ((n = VG_(am_get_segment_starts)(SkFileC | SkAnonC | SkShmC, seg_starts, seg_starts_size)) < 0) {
+        seg_starts_size = -n + 16;
+        seg_starts = VG_(realloc)("cg.segmap.rebuild.2", seg_starts, seg_starts_size * sizeof(Addr));
     }
 
-    for (Addr addr = 0x8000000; addr < 0x10000000; addr += 0x10000) {
-        const NSegment* seg = VG_(am_find_nsegment)(addr);
-        if (seg && seg->isCH) {
-            HChar perms[4];
-            perms[0] = seg->hasR ? 'r' : '-';
-            perms[1] = seg->hasW ? 'w' : '-';
-            perms[2] = seg->hasX ? 'x' : '-';
-            perms[3] = '\0';
-
-            VG_(umsg)("HEAP: 0x%lx-0x%lx perms=%s size=%lu bytes\n", seg->start, seg->end, perms,
-                      seg->end - seg->start);
-            found_ch = True;
+    region_table_used = 0;
+    for (i = 0; i < n; i++) {
+        const NSegment* seg = VG_(am_find_nsegment)(seg_starts[i]);
+        RegionKind kind;
+
+        if (seg == NULL)
+            continue;
+        if (segmap_is_stack(seg)) {
+            kind = REGION_STACK;
+        } else if (seg->kind == SkAnonC && seg->isCH) {
+            kind = REGION_HEAP;
+        } else if (seg->kind == SkFileC) {
+            // The segments of one object are adjacent and share dev/ino;
+            // look ahead for the executable one.
+            if (prev_file == NULL || prev_file->dev != seg->dev || prev_file->ino != seg->ino) {
+                Int j;
+                prev_file_has_code = False;
+                for (j = i; j < n; j++) {
+                    const NSegment* s = VG_(am_find_nsegment)(seg_starts[j]);
+                    if (s == NULL || s->kind != SkFileC || s->dev != seg->dev || s->ino != seg->ino)
+                        break;
+                    if (s->hasX)
+                        prev_file_has_code = True;
+                }
+            }
+            kind = prev_file_has_code ? REGION_GLOBAL : REGION_MMAP;
+            prev_file = seg;
+            segmap_add(seg->start, seg->end, kind, False);
+            continue;
+        } else if (seg->kind == SkAnonC && prev_file_has_code && prev_file && prev_file->end + 1 == seg->start) {
+            kind = REGION_GLOBAL;  // .bss
+        } else {
+            kind = REGION_MMAP;
         }
+        prev_file = NULL;
+        prev_file_has_code = False;
+        segmap_add(seg->start, seg->end, kind, seg->kind == SkAnonC && seg->hasW);
     }
 
-    if (!found_ch) {
-        VG_(umsg)("No segments with isCH flag found. This is unusual.\n");
-    }
+    segmap_mru_reset();
+    segmap_dirty = False;
+    segmap_rebuilds++;
 }
 
-// Dump target program's /proc/PID/maps
-static void dump_target_proc_maps(void)
+static const RegionInterval* segmap_search(Addr a)
 {
-    Int pid;
-    SysRes fd;
-    HChar procmaps_path[64];
-    HChar buf[8192];  // Increased buffer size
-    Int n_read;
-    HChar *line, *next_line;
-    Bool is_valgrind_map;
-    const HChar* region_type;
-    Bool direct_read_failed = False;
-
-    // First approach: Try reading /proc/self/maps which should be the client program's maps
-    VG_(umsg)("\n=== TARGET PROGRAM MEMORY MAPS ===\n");
-
-    // Construct the path to the maps file
-    VG_(strcpy)(procmaps_path, "/proc/self/maps");
-
-    VG_(umsg)("Attempting to read: %s\n", procmaps_path);
-
-    // Open the maps file
-    fd = VG_(open)(procmaps_path, VKI_O_RDONLY, 0);
-    if (sr_isError(fd)) {
-        VG_(umsg)("Error: Cannot open %s (error code: %ld)\n", procmaps_path, (long)sr_Err(fd));
-        direct_read_failed = True;
+    Int lo = 0, hi = region_table_used - 1;
+
+    segmap_searches++;
+    while (lo <= hi) {
+        Int mid = (lo + hi) / 2;
+        if (a < region_table[mid].start) {
+            hi = mid - 1;
+        } else if (a > region_table[mid].end) {
+            lo = mid + 1;
+        } else {
+            region_mru[1] = region_mru[0];
+            region_mru[0] = region_table[mid];
+            return &region_mru[0];
+        }
     }
+    return NULL;
+}
 
-    if (!direct_read_failed) {
-        VG_(umsg)("File opened successfully, reading contents...\n");
-        VG_(umsg)("    Address Range         Perms Offset   Dev   Inode      Path/Region\n");
-        VG_(umsg)("    --------------------  ----- -------- ----- --------- --------------------\n");
-
-        // Read and print the maps file contents in chunks
-        while (True) {
-            n_read = VG_(read)(sr_Res(fd), buf, sizeof(buf) - 1);
+// The interval holding 'a', or NULL if it is not mapped by the client.
+static __inline__ const RegionInterval* segmap_lookup(Addr a)
+{
+    if (a >= region_mru[0].start && a <= region_mru[0].end)
+        return &region_mru[0];
+    if (a >= region_mru[1].start && a <= region_mru[1].end) {
+        RegionInterval tmp = region_mru[0];
+        region_mru[0] = region_mru[1];
+        region_mru[1] = tmp;
+        return &region_mru[0];
+    }
+    if (segmap_dirty)
+        segmap_rebuild();
+    return segmap_search(a);
+}
 
-            if (n_read < 0) {
-                VG_(umsg)("Error reading maps file (error code: %d)\n", n_read);
-                direct_read_failed = True;
-                break;
-            }
+static __inline__ RegionKind segmap_classify(Addr a)
+{
+    const RegionInterval* ri = segmap_lookup(a);
+    return ri ? ri->kind : REGION_OTHER;
+}
 
-            if (n_read == 0) {
-                // End of file reached
-                break;
-            }
+// Called from log_mem_access for every data access.
+static __attribute__((noinline)) RegionKind segmap_note_access(Addr a, AccessType type, CacheHitType hit_type)
+{
+    RegionKind region = segmap_classify(a);
+    CacheCC* cc = &region_cc[region][type == ACCESS_WRITE];
+
+    cc->a++;
+    if (hit_type != CACHE_HIT_L1)
+        cc->m1++;
+    if (hit_type == CACHE_MISS_LL)
+        cc->mL++;
+    return region;
+}
 
-            // Null-terminate the buffer
-            buf[n_read] = '\0';
-
-            // Process the buffer line by line
-            line = buf;
-            while (line && *line) {
-                // Find the end of the current line
-                next_line = VG_(strchr)(line, '\n');
-                if (next_line) {
-                    *next_line = '\0';
-                    next_line++;
-                }
+/*------------------------------------------------------------*/
+/*--- Invalidation                                         ---*/
+/*------------------------------------------------------------*/
 
-                // Check if this is likely a Valgrind-related mapping
-                is_valgrind_map = False;
-                if (VG_(strstr)(line, "vgpreload") || VG_(strstr)(line, "valgrind") || VG_(strstr)(line, "vex")) {
-                    is_valgrind_map = True;
-                }
+static void segmap_invalidate(void)
+{
+    segmap_dirty = True;
+    segmap_generation++;
+    segmap_mru_reset();
+}
 
-                // Determine region type based on patterns
-                region_type = "";
-
-                if (VG_(strstr)(line, "[stack]")) {
-                    region_type = "[STACK]";
-                } else if (VG_(strstr)(line, "[heap]")) {
-                    region_type = "[HEAP]";
-                } else if (VG_(strstr)(line, ".text") || (VG_(strstr)(line, " r-x") && !is_valgrind_map)) {
-                    region_type = "[CODE]";
-                } else if (VG_(strstr)(line, ".data") || (VG_(strstr)(line, " rw-") && !is_valgrind_map)) {
-                    region_type = "[DATA]";
-                } else if (VG_(strstr)(line, ".bss")) {
-                    region_type = "[BSS]";
-                } else if (VG_(strstr)(line, "anon") || VG_(strstr)(line, "vvar") || VG_(strstr)(line, "vdso")) {
-                    region_type = "[SPECIAL]";
-                }
+static void segmap_new_mem_mmap(Addr a, SizeT len, Bool rr, Bool ww, Bool xx, ULong di_handle)
+{
+    segmap_invalidate();
+}
 
-                // Print the line, with classification
-                if (is_valgrind_map) {
-                    VG_(umsg)("V   %s %s\n", line, region_type);  // Valgrind mapping
-                } else {
-                    VG_(umsg)("    %s %s\n", line, region_type);  // Client program mapping
-                }
+static void segmap_die_mem(Addr a, SizeT len)
+{
+    segmap_invalidate();
+}
 
-                // Move to the next line
-                line = next_line;
-            }
-        }
+static void segmap_copy_mem_remap(Addr from, Addr to, SizeT len)
+{
+    segmap_invalidate();
+}
 
-        // Close the file
-        VG_(close)(sr_Res(fd));
-    }
+static void segmap_new_mem_tid(Addr a, SizeT len, ThreadId tid)
+{
+    segmap_invalidate();
+}
 
-    // Fallback: Try to use system command if direct read failed
-    if (direct_read_failed) {
-        VG_(umsg)("Direct read failed, trying system command fallback...\n");
+static void segmap_new_thread(ThreadId tid)
+{
+    segmap_invalidate();
+}
 
-        // Get the client process PID
-        pid = VG_(getpid)();
+// Keeps the table up to date, for --regions=yes or the TLB simulation.
+static void segmap_track(void)
+{
+    if (segmap_tracking)
+        return;
+    segmap_tracking = True;
+    segmap_invalidate();
+    VG_(track_new_mem_mmap)(segmap_new_mem_mmap);
+    VG_(track_die_mem_munmap)(segmap_die_mem);
+    VG_(track_copy_mem_remap)(segmap_copy_mem_remap);
+    VG_(track_new_mem_brk)(segmap_new_mem_tid);
+    VG_(track_die_mem_brk)(segmap_die_mem);
+    VG_(track_new_mem_stack_signal)(segmap_new_mem_tid);
+    VG_(track_pre_thread_first_insn)(segmap_new_thread);
+}
 
-        // Use system command to get maps
-        VG_(sprintf)(buf, "/bin/cat /proc/%d/maps", pid);
-        VG_(umsg)("Executing: %s\n", buf);
+static void segmap_init(void)
+{
+    segmap_active = True;
+    segmap_track();
+}
 
-        Int res = VG_(system)(buf);
-        if (res != 0) {
-            VG_(umsg)("System command failed with error code: %d\n", res);
+/*------------------------------------------------------------*/
+/*--- Output                                               ---*/
+/*------------------------------------------------------------*/
 
-            // One more fallback - try with /proc/self/maps
-            VG_(strcpy)(buf, "/bin/cat /proc/self/maps");
-            VG_(umsg)("Executing: %s\n", buf);
-            res = VG_(system)(buf);
+// One "desc:" line per region, so that cg_annotate shows them and
+// cg_merge/cg_diff accept the file unchanged.
+static void segmap_fprint_desc(VgFile* fp)
+{
+    Int r;
 
-            if (res != 0) {
-                VG_(umsg)("All approaches to read memory maps failed.\n");
-            }
-        }
+    if (!segmap_active)
+        return;
+    for (r = REGION_STACK; r < N_REGIONS; r++) {
+        const CacheCC* rd = &region_cc[r][0];
+        const CacheCC* wr = &region_cc[r][1];
+        VG_(fprintf)(fp, "desc: Region %-7s  Dr %llu D1mr %llu DLmr %llu Dw %llu D1mw %llu DLmw %llu\n",
+                     region_name(r), rd->a, rd->m1, rd->mL, wr->a, wr->m1, wr->mL);
     }
-
-    VG_(umsg)("\n=== END OF TARGET PROGRAM MEMORY MAPS ===\n\n");
 }
 
-// Direct stack and heap detection
-static void detect_stack_and_heap(void)
+static void segmap_print_stats(void)
 {
-    // Find stack segments first
-    find_stack_segment();
-
-    // Then find heap segments
-    find_heap_segments();
-
-    // Dump target program's memory maps
-    dump_target_proc_maps();
-
-    // Print separation line
-    VG_(umsg)("===============================================================\n");
+    VG_(dmsg)("cachegrind: region rebuilds : %llu\n", segmap_rebuilds);
+    VG_(dmsg)("cachegrind: region searches : %llu\n", segmap_searches);
 }
 
-/* 
- * Add to cg_fini:
- *
- * detect_stack_and_heap();
- */
+/*--------------------------------------------------------------------*/
+/*--- end                                              cg_segmap.c ---*/
+/*--------------------------------------------------------------------*/
@@ -38,8 +38,36 @@
 
 __attribute__((always_inline)) static __inline__ void log_mem_access(Addr addr, UChar size, AccessType type,
                                                                      CacheHitType hit_type);
+// Called for each false sharing invalidation with --cores; see below.
+static void cachesim_note_false_sharing(UWord block);
+// Called for each access with --tlb-sim=yes, see cg_tlb.c.
+static Bool sim_tlb = False;
+static void tlbsim_ref(Addr a, UChar size, CacheCC* cc, Bool instr);
+// Called for each D1 and LL line evicted with --heap-sites=yes, see cg_heap.c.
+static Bool sim_heap_sites = False;
+static void heapsim_note_eviction(Addr a, Int wasted, Bool llc);
 
-typedef struct {
+/* Replacement policies, see "Replacement policies" below. */
+#define REPL_LRU 0
+#define REPL_PLRU 1
+#define REPL_SRRIP 2
+#define REPL_BRRIP 3
+#define REPL_RANDOM 4
+#define N_REPL_POLICIES 5
+
+/* Prefetchers, see "Prefetchers" below. */
+#define PF_NONE 0
+#define PF_NEXT_LINE 1
+#define PF_IP_STRIDE 2
+#define PF_STREAM 3
+#define N_PREFETCHERS 4
+
+/* Inclusion policies of the levels below L1, see "Cache hierarchy" below. */
+#define CACHE_NINE 0
+#define CACHE_INCLUSIVE 1
+#define CACHE_EXCLUSIVE 2
+
+typedef struct cache_t2 {
     Int size; /* bytes */
     Int assoc;
     Int line_size; /* bytes */
@@ -57,10 +85,87 @@ typedef struct {
     UWord total_read_loads;            /* total number of loads due to read */
     UWord total_write_loads;           /* total number of loads due to write */
     Bool is_llc;                       /* Is this a Last Level Cache? */
+    CacheCC** owner;                   /* CC of the access that loaded each line, or NULL;
+                                          only with --wasted-bytes=yes */
+    UChar* state;                      /* MESI state of each line; only for D1 with --cores */
+    UChar policy;                      /* replacement policy, REPL_* */
+    Int plru_ways;                     /* REPL_PLRU: assoc rounded up to a power of two */
+    Int plru_words;                    /* REPL_PLRU: ULongs of tree bits per set */
+    ULong* plru;                       /* REPL_PLRU: tree bits of each set */
+    UChar* rrpv;                       /* REPL_SRRIP, REPL_BRRIP: re-reference prediction of each line */
+    Int last_line;                     /* not REPL_LRU: the line last hit or filled */
+    struct Prefetcher* pf;             /* the prefetcher of this level, or NULL */
+    Int level;                         /* 0 for L1, 1.. for --cache-level levels, then LL */
+    UChar inclusion;                   /* CACHE_NINE, CACHE_INCLUSIVE or CACHE_EXCLUSIVE */
+    struct cache_t2* victim_to;        /* the exclusive level below, which takes our victims */
 } cache_t2;
 
+// A line brought in by a prefetch that no access has used yet.
+typedef struct {
+    CacheCC* issuer; /* CC of the access that triggered the prefetch, or NULL
+                        if the line was not prefetched or has been used */
+    ULong issued_at; /* cachesim_pf_clock when it was issued */
+} PfLine;
+
+typedef struct {
+    Addr pc; /* the instruction, 0 if free */
+    Addr last;
+    Long stride;
+    Int confidence;
+} PfStrideEntry;
+
+typedef struct {
+    UWord region; /* the region the stream is in, 0 if free */
+    UWord last;   /* the last block missed in it */
+    Int dir;      /* +1 or -1, 0 until known */
+    Int confidence;
+    ULong used_at; /* cachesim_pf_clock, for LRU replacement */
+} PfStreamEntry;
+
+#define PF_STRIDE_ENTRIES 64
+#define PF_STREAMS 16
+
+typedef struct Prefetcher {
+    UChar model;
+    PfLine* lines; /* per line of the cache */
+    PfStrideEntry stride[PF_STRIDE_ENTRIES];
+    PfStreamEntry stream[PF_STREAMS];
+    ULong issued, useful, late;
+} Prefetcher;
+
+// Called for each line evicted from an inclusive cache, or one with an
+// exclusive cache below it; see below.
+static void cachesim_evicted(cache_t2* c, UWord tag, UWord u, UChar dirty);
+
+/* MESI states.  A line invalidated by another core keeps its way, with
+ * CACHESIM_INV_TAG set in its tag, so that it never hits and the next
+ * miss on it can be told to be a coherence miss.  Tags are block numbers,
+ * whose top bit is always clear.
+ */
+#define MESI_I 0
+#define MESI_S 1
+#define MESI_E 2
+#define MESI_M 3
+#define CACHESIM_INV_TAG ((UWord)1 << (sizeof(UWord) * 8 - 1))
+
+/* With --wasted-bytes=yes, the CC of the data access being simulated.  A
+ * line it loads remembers it, and when the line is evicted the bytes never
+ * accessed while it was cached are charged to it.  NULL for instruction
+ * fetches, whose lines are not tracked.
+ */
+static CacheCC* cachesim_owner = NULL;
+
+/* Whether the lines being loaded are prefetched, for the memory log. */
+static Bool cachesim_prefetching = False;
+
+static cache_t2 LL;
+static cache_t2 I1;
+static cache_t2 D1;
+static cache_t2 mid_levels[MAX_MID_LEVELS]; /* between L1 and LL, from the top */
+static Int n_mid_levels = 0;
+
 /* By this point, the size/assoc/line_size has been checked. */
-static void cachesim_initcache(cache_t config, cache_t2* c)
+static void cachesim_initcache(cache_t config, cache_t2* c, Bool track_owners)
 {
     Int i;
 
@@ -88,6 +193,22 @@ static void cachesim_initcache(cache_t config, cache_t2* c)
         c->dirty[i] = 0;
     }
     c->total_used = 0;
+    c->policy = REPL_LRU;
+    c->pf = NULL;
+    c->last_line = 0;
+    c->plru = NULL;
+    c->rrpv = NULL;
+    c->is_llc = False;
+    c->level = 0;
+    c->inclusion = CACHE_NINE;
+    c->victim_to = NULL;
+    c->state = NULL;
+    c->owner = NULL;
+    if (track_owners) {
+        c->owner = VG_(malloc)("cg.sim.ci.owner", sizeof(CacheCC*) * c->sets * c->assoc);
+        for (i = 0; i < c->sets * c->assoc; i++)
+            c->owner[i] = NULL;
+    }
 }
 
 /* SF: Brian Kernighan’s Algorithm */
@@ -101,6 +222,77 @@ __attribute__((always_inline)) static __inline__ Int count_bits(UWord n)
     return count;
 }
 
+/* The index of the line with this tag, or -1 if not cached. */
+static Int cachesim_find_line(const cache_t2* c, UWord tag)
+{
+    UInt set_no = tag & c->sets_min_1;
+    Int i;
+
+    for (i = 0; i < c->assoc; i++) {
+        if (c->tags[set_no * c->assoc + i] == tag)
+            return set_no * c->assoc + i;
+    }
+    return -1;
+}
+
+/* The used bitmask of the line with this tag, or NULL if not cached. */
+static UWord* cachesim_used_of(cache_t2* c, UWord tag)
+{
+    Int line = cachesim_find_line(c, tag);
+    return line < 0 ? NULL : &c->used[line];
+}
+
+/* Charge the untouched bytes of an evicted line to the access that loaded
+ * it.  Accesses hitting D1 never reach LL, so the used bits of a D1 line
+ * are merged into its LL copy when it is evicted, and those of a line still
+ * in D1 are counted when its LL copy is evicted.
+ */
+static void cachesim_note_eviction(cache_t2* c, UWord tag, UWord u, CacheCC* owner)
+{
+    Int used_words;
+
+    if ((tag & CACHESIM_INV_TAG) == 0 && D1.line_size == LL.line_size) {
+        UWord* other = cachesim_used_of(c->is_llc ? &D1 : &LL, tag);
+        if (other && c->is_llc) {
+            u |= *other;
+        } else if (other) {
+            LL.total_used += count_bits(*other | u) - count_bits(*other);
+            *other |= u;
+        }
+    }
+    if (owner == NULL)
+        return;
+    used_words = count_bits(u);
+    if (c->is_llc) {
+        owner->evL++;
+        owner->wbL += c->line_size - used_words * 4;
+    } else {
+        owner->ev1++;
+        owner->wb1 += c->line_size - used_words * 4;
+    }
+}
+
+/* Charge an evicted data line to the heap block holding its first word
+ * accessed, or its first word if none was, with its bytes never accessed.
+ * As in cachesim_note_eviction, an LL line also counts the words accessed
+ * in its D1 copy, if it still has one.
+ */
+static void cachesim_note_heap_eviction(cache_t2* c, UWord tag, UWord u)
+{
+    Int first = 0;
+
+    if (tag & CACHESIM_INV_TAG)
+        return;
+    if (c->is_llc && D1.line_size == LL.line_size) {
+        UWord* other = cachesim_used_of(&D1, tag);
+        if (other)
+            u |= *other;
+    }
+    if (u != 0)
+        first = __builtin_ctzl(u);
+    heapsim_note_eviction((tag << c->line_size_bits) + first * 4, c->line_size - count_bits(u) * 4, c->is_llc);
+}
+
 /* Set the given used bitmap according to the addr+size and line_size_bits.
  * Returns the size of bytes NOT accounted for. If the returned size is > 0
  * then its means that the touched area is spanned across the next line
@@ -121,6 +313,230 @@ static __inline__ Int set_used(UWord addr, Int size, Int line_size, UWord* used)
     return 0;
 }
 
+/* Replaces the line with index 'line' by the one with 'tag', on a miss. */
+__attribute__((always_inline)) static __inline__ void cachesim_fill_line(cache_t2* c, Int line, UWord tag, UWord u,
+                                                                         AccessType access_type)
+{
+    UWord victim = c->tags[line], victim_used = c->used[line];
+    UChar victim_dirty = c->dirty[line];
+
+    if (c->owner) {
+        cachesim_note_eviction(c, victim, victim_used, c->owner[line]);
+        c->owner[line] = cachesim_owner;
+    }
+    if (UNLIKELY(sim_heap_sites) && (c == &D1 || c == &LL))
+        cachesim_note_heap_eviction(c, victim, victim_used);
+    if (c->state) {
+        // The coherence code sets the state of the new line.
+        c->state[line] = MESI_I;
+    }
+    if (access_type == ACCESS_READ) {
+        c->total_read_loads++;
+    } else {
+        c->total_write_loads++;
+    }
+    if (victim_dirty != 0) {
+        if (access_type == ACCESS_READ) {
+            c->total_dirty_read_evictions++;
+        } else {
+            c->total_dirty_write_evictions++;
+        }
+        if (c->is_llc) {
+            log_mem_access(victim << c->line_size_bits, c->line_size, ACCESS_STORE, CACHE_STORE);
+        }
+    }
+    if (c->is_llc) {
+        log_mem_access(tag << c->line_size_bits, c->line_size, cachesim_prefetching ? ACCESS_PREFETCH : ACCESS_LOAD,
+                       CACHE_LOAD);
+    }
+    c->tags[line] = tag;
+    c->used[line] = u;
+    c->dirty[line] = access_type == ACCESS_WRITE ? 1 : 0;
+    c->total_used += count_bits(u) - count_bits(victim_used);
+    if (c->pf)
+        c->pf->lines[line].issuer = NULL;
+    if (c->inclusion == CACHE_INCLUSIVE || c->victim_to)
+        cachesim_evicted(c, victim, victim_used, victim_dirty);
+}
+
+/*------------------------------------------------------------*/
+/*--- Replacement policies                                 ---*/
+/*------------------------------------------------------------*/
+
+/* Each cache level has a replacement policy (--replacement):
+ *  - lru: true LRU.  The ways of a set are kept in recency order, and
+ *    shifted on every hit that is not on the MRU way.
+ *  - plru: tree pseudo-LRU.  A binary tree of bits over the ways of a set
+ *    points away from the most recently used ones.  With a number of ways
+ *    that is not a power of two, the tree has missing leaves, which are
+ *    never chosen.
+ *  - srrip, brrip: re-reference interval prediction (Jaleel et al., ISCA
+ *    2010), with 2 bits per line.  A hit predicts a near re-reference; the
+ *    victim is a line predicted distant, aging all lines until there is
+ *    one.  SRRIP inserts new lines as long re-reference, BRRIP as distant
+ *    but for one in 32, which resists thrashing.
+ *  - random: a victim chosen by a pseudo-random generator seeded with
+ *    --replacement-seed, so that runs are reproducible.
+ * Except for lru, lines stay in their way, and a miss first fills an
+ * empty way.  Hitting the line last hit or filled again needs no update of
+ * the policy state (but for a line srrip/brrip has yet to see re-referenced),
+ * which is checked inline; the rest is out of line.
+ */
+#define RRPV_MAX 3
+#define BRRIP_LONG_ONE_IN 32
+
+static const HChar* const repl_policy_names[N_REPL_POLICIES] = {"lru", "plru", "srrip", "brrip", "random"};
+
+static ULong cachesim_rand_state = 1;
+
+static Int cachesim_parse_policy(const HChar* name)
+{
+    Int i;
+
+    for (i = 0; i < N_REPL_POLICIES; i++) {
+        if (VG_(strcmp)(name, repl_policy_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void cachesim_seed(ULong seed)
+{
+    // xorshift gets stuck at 0.
+    cachesim_rand_state = seed ? seed : 1;
+}
+
+/* xorshift64* */
+static ULong cachesim_rand(void)
+{
+    cachesim_rand_state ^= cachesim_rand_state >> 12;
+    cachesim_rand_state ^= cachesim_rand_state << 25;
+    cachesim_rand_state ^= cachesim_rand_state >> 27;
+    return cachesim_rand_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void cachesim_set_policy(cache_t2* c, UChar policy)
+{
+    Int i;
+
+    c->policy = policy;
+    if (policy == REPL_PLRU) {
+        for (c->plru_ways = 1; c->plru_ways < c->assoc; c->plru_ways *= 2)
+            ;
+        c->plru_words = (c->plru_ways + 63) / 64;
+        c->plru = VG_(malloc)("cg.sim.plru", sizeof(ULong) * c->plru_words * c->sets);
+        for (i = 0; i < c->plru_words * c->sets; i++)
+            c->plru[i] = 0;
+    } else if (policy == REPL_SRRIP || policy == REPL_BRRIP) {
+        c->rrpv = VG_(malloc)("cg.sim.rrpv", c->sets * c->assoc);
+        for (i = 0; i < c->sets * c->assoc; i++)
+            c->rrpv[i] = RRPV_MAX;
+    }
+}
+
+/* Tree nodes are numbered from 1 at the root, the children of node n
+ * being 2n and 2n+1.  A set bit sends the victim search right.
+ */
+static void cachesim_plru_touch(cache_t2* c, UInt set_no, Int way)
+{
+    ULong* bits = &c->plru[set_no * c->plru_words];
+    Int node = 1, lo = 0, size = c->plru_ways;
+
+    while (size > 1) {
+        size /= 2;
+        if (way < lo + size) {
+            bits[node / 64] |= 1ULL << (node % 64);
+            node = 2 * node;
+        } else {
+            bits[node / 64] &= ~(1ULL << (node % 64));
+            lo += size;
+            node = 2 * node + 1;
+        }
+    }
+}
+
+static Int cachesim_plru_victim(cache_t2* c, UInt set_no)
+{
+    const ULong* bits = &c->plru[set_no * c->plru_words];
+    Int node = 1, lo = 0, size = c->plru_ways;
+
+    while (size > 1) {
+        size /= 2;
+        if ((bits[node / 64] >> (node % 64) & 1) && lo + size < c->assoc) {
+            lo += size;
+            node = 2 * node + 1;
+        } else {
+            node = 2 * node;
+        }
+    }
+    return lo;
+}
+
+static Int cachesim_rrip_victim(cache_t2* c, UInt set_no)
+{
+    UChar* rrpv = &c->rrpv[set_no * c->assoc];
+    Int i;
+
+    for (;;) {
+        for (i = 0; i < c->assoc; i++) {
+            if (rrpv[i] == RRPV_MAX)
+                return i;
+        }
+        for (i = 0; i < c->assoc; i++)
+            rrpv[i]++;
+    }
+}
+
+/* cachesim_setref_is_miss for the policies other than lru. */
+__attribute__((noinline)) static Bool cachesim_setref_policy_is_miss(cache_t2* c, UInt set_no, UWord tag, UWord u,
+                                                                     AccessType access_type)
+{
+    UInt base = set_no * c->assoc;
+    UWord* set = &c->tags[base];
+    Int i, way = -1;
+
+    for (i = 0; i < c->assoc; i++) {
+        if (set[i] == tag) {
+            c->total_used += count_bits(c->used[base + i] | u) - count_bits(c->used[base + i]);
+            c->used[base + i] |= u;
+            if (access_type == ACCESS_WRITE)
+                c->dirty[base + i] = 1;
+            if (c->policy == REPL_PLRU)
+                cachesim_plru_touch(c, set_no, i);
+            else if (c->rrpv)
+                c->rrpv[base + i] = 0;
+            c->last_line = base + i;
+            return 0; /* hit */
+        }
+        if (set[i] == ~(UWord)0 && way < 0)
+            way = i;
+    }
+
+    if (way < 0) {
+        switch (c->policy) {
+        case REPL_PLRU:
+            way = cachesim_plru_victim(c, set_no);
+            break;
+        case REPL_SRRIP:
+        case REPL_BRRIP:
+            way = cachesim_rrip_victim(c, set_no);
+            break;
+        default:
+            way = cachesim_rand() % c->assoc;
+            break;
+        }
+    }
+    cachesim_fill_line(c, base + way, tag, u, access_type);
+    c->last_line = base + way;
+    if (c->policy == REPL_PLRU)
+        cachesim_plru_touch(c, set_no, way);
+    else if (c->policy == REPL_SRRIP)
+        c->rrpv[base + way] = RRPV_MAX - 1;
+    else if (c->policy == REPL_BRRIP)
+        c->rrpv[base + way] = cachesim_rand() % BRRIP_LONG_ONE_IN == 0 ? RRPV_MAX - 1 : RRPV_MAX;
+    return 1; /* miss */
+}
+
 /* This attribute forces GCC to inline the function, getting rid of a
  * lot of indirection around the cache_t2 pointer, if it is known to be
  * constant in the caller (the caller is inlined itself).
@@ -135,6 +551,19 @@ __attribute__((always_inline)) static __inline__ Bool cachesim_setref_is_miss(ca
     UWord prev_used = 0; /* SF: prev used - used if shuffled */
     int prev_bits = 0, post_bits = 0;
 
+    if (c->policy != REPL_LRU) {
+        Int line = c->last_line;
+        if (c->tags[line] == tag && (c->rrpv == NULL || c->rrpv[line] == 0)) {
+            prev_bits = count_bits(c->used[line]);
+            c->used[line] |= u;
+            c->total_used += count_bits(c->used[line]) - prev_bits;
+            if (access_type == ACCESS_WRITE)
+                c->dirty[line] = 1;
+            return 0; /* hit */
+        }
+        return cachesim_setref_policy_is_miss(c, set_no, tag, u, access_type);
+    }
+
     set = &(c->tags[set_no * c->assoc]);
     used = &(c->used[set_no * c->assoc]);
     dirty = &(c->dirty[set_no * c->assoc]);
@@ -161,6 +590,27 @@ __attribute__((always_inline)) static __inline__ Bool cachesim_setref_is_miss(ca
                 set[j] = set[j - 1];
                 used[j] = used[j - 1];
             }
+            if (c->owner) {
+                CacheCC** owner = &(c->owner[set_no * c->assoc]);
+                CacheCC* hit_owner = owner[i];
+                for (j = i; j > 0; j--)
+                    owner[j] = owner[j - 1];
+                owner[0] = hit_owner;
+            }
+            if (c->state) {
+                UChar* state = &(c->state[set_no * c->assoc]);
+                UChar hit_state = state[i];
+                for (j = i; j > 0; j--)
+                    state[j] = state[j - 1];
+                state[0] = hit_state;
+            }
+            if (c->pf) {
+                PfLine* pf = &(c->pf->lines[set_no * c->assoc]);
+                PfLine hit_pf = pf[i];
+                for (j = i; j > 0; j--)
+                    pf[j] = pf[j - 1];
+                pf[0] = hit_pf;
+            }
             set[0] = tag;
             used[0] = prev_used | u;
             prev_bits = count_bits(prev_used);
@@ -174,36 +624,37 @@ __attribute__((always_inline)) static __inline__ Bool cachesim_setref_is_miss(ca
         }
     }
 
-    /* A miss;  install this tag as MRU, shuffle rest down. */
-    prev_bits = count_bits(used[c->assoc - 1]);
+    /* A miss;  install this tag as MRU, shuffle rest down, the LRU line
+     * going to the MRU way to be replaced.
+     */
+    UWord victim = set[c->assoc - 1], victim_used = used[c->assoc - 1];
+    UChar victim_dirty = dirty[c->assoc - 1];
+    if (c->owner) {
+        CacheCC** owner = &(c->owner[set_no * c->assoc]);
+        CacheCC* victim_owner = owner[c->assoc - 1];
+        for (j = c->assoc - 1; j > 0; j--)
+            owner[j] = owner[j - 1];
+        owner[0] = victim_owner;
+    }
+    if (c->state) {
+        UChar* state = &(c->state[set_no * c->assoc]);
+        for (j = c->assoc - 1; j > 0; j--)
+            state[j] = state[j - 1];
+    }
+    if (c->pf) {
+        PfLine* pf = &(c->pf->lines[set_no * c->assoc]);
+        for (j = c->assoc - 1; j > 0; j--)
+            pf[j] = pf[j - 1];
+    }
     for (j = c->assoc - 1; j > 0; j--) {
         set[j] = set[j - 1];
         used[j] = used[j - 1];
         dirty[j] = dirty[j - 1];
     }
-    if (access_type == ACCESS_READ) {
-        c->total_read_loads++;
-    } else {
-        c->total_write_loads++;
-    }
-    if (dirty[0] != 0) {
-        if (access_type == ACCESS_READ) {
-            c->total_dirty_read_evictions++;
-        } else {
-            c->total_dirty_write_evictions++;
-        }
-        if (c->is_llc) {
-            log_mem_access(set[0] << c->line_size_bits, c->line_size, ACCESS_STORE, CACHE_STORE);
-        }
-    }
-    if (c->is_llc) {
-        log_mem_access(tag << c->line_size_bits, c->line_size, ACCESS_LOAD, CACHE_LOAD);
-    }
-    set[0] = tag;
-    used[0] = u;
-    dirty[0] = access_type == ACCESS_WRITE ? 1 : 0;
-    post_bits = count_bits(used[0]);
-    c->total_used += post_bits - prev_bits;
+    set[0] = victim;
+    used[0] = victim_used;
+    dirty[0] = victim_dirty;
+    cachesim_fill_line(c, set_no * c->assoc, tag, u, access_type);
 
     return 1; /* miss */
 }
@@ -260,27 +711,631 @@ __attribute__((always_inline)) static __inline__ Bool cachesim_ref_is_miss(cache
     return 1;
 }
 
-static cache_t2 LL;
-static cache_t2 I1;
-static cache_t2 D1;
+/*------------------------------------------------------------*/
+/*--- Multi-core simulation                                ---*/
+/*------------------------------------------------------------*/
+
+/* With --cores=<n>, each simulated core has private I1 and D1 caches, and
+ * LL is shared.  The caches of the core running the current thread are
+ * kept in I1 and D1, so that the simulation functions are unchanged; they
+ * are swapped on a thread switch, which is rare.
+ *
+ * The D1 caches are kept coherent with MESI.  A write to a line that other
+ * cores hold invalidates their copies: when the words written are none of
+ * those the other core accessed, that is false sharing.  A later miss on an
+ * invalidated line is a coherence miss.
+ */
+#define MAX_CORES 64
+
+static Int sim_cores = 0; /* 0: one I1 and D1 shared by all threads */
+static Int sim_core = 0;  /* the core whose caches are in I1 and D1 */
+static cache_t2* core_I1; /* [sim_cores]; the entry of sim_core is stale */
+static cache_t2* core_D1;
+static cache_t2* core_mid; /* [sim_cores][MAX_MID_LEVELS]; the mid levels are private too */
+
+static void cachesim_set_prefetcher(cache_t2* c, UChar model);
+
+// Gives 'c' the place in the hierarchy, the replacement policy and the
+// prefetcher of 'model', the same cache of core 0.
+static void cachesim_copy_links(cache_t2* c, const cache_t2* model)
+{
+    cachesim_set_policy(c, model->policy);
+    cachesim_set_prefetcher(c, model->pf ? model->pf->model : PF_NONE);
+    c->level = model->level;
+    c->inclusion = model->inclusion;
+    c->victim_to = model->victim_to;
+}
 
-static void cachesim_initcaches(cache_t I1c, cache_t D1c, cache_t LLc)
+static void cachesim_initcores(cache_t I1c, cache_t D1c, const cache_t* midc, Bool wasted_bytes, Int cores)
 {
-    cachesim_initcache(I1c, &I1);
-    cachesim_initcache(D1c, &D1);
-    cachesim_initcache(LLc, &LL);
+    Int i, j, k;
+
+    sim_cores = cores;
+    core_I1 = VG_(malloc)("cg.sim.cores.1", sizeof(cache_t2) * cores);
+    core_D1 = VG_(malloc)("cg.sim.cores.2", sizeof(cache_t2) * cores);
+    core_mid = VG_(malloc)("cg.sim.cores.3", sizeof(cache_t2) * cores * MAX_MID_LEVELS);
+    for (k = 0; k < cores; k++) {
+        cache_t2* d1 = k == 0 ? &D1 : &core_D1[k];
+        if (k > 0) {
+            cachesim_initcache(I1c, &core_I1[k], False);
+            cachesim_copy_links(&core_I1[k], &I1);
+            cachesim_initcache(D1c, d1, wasted_bytes);
+            cachesim_copy_links(d1, &D1);
+            for (j = 0; j < n_mid_levels; j++) {
+                cache_t2* m = &core_mid[k * MAX_MID_LEVELS + j];
+                cachesim_initcache(midc[j], m, False);
+                cachesim_copy_links(m, &mid_levels[j]);
+            }
+        }
+        d1->state = VG_(malloc)("cg.sim.cores.state", d1->sets * d1->assoc);
+        for (i = 0; i < d1->sets * d1->assoc; i++)
+            d1->state[i] = MESI_I;
+    }
+}
+
+static void cachesim_switch_core(Int core)
+{
+    Int j;
+
+    if (core == sim_core)
+        return;
+    core_I1[sim_core] = I1;
+    core_D1[sim_core] = D1;
+    I1 = core_I1[core];
+    D1 = core_D1[core];
+    for (j = 0; j < n_mid_levels; j++) {
+        core_mid[sim_core * MAX_MID_LEVELS + j] = mid_levels[j];
+        mid_levels[j] = core_mid[core * MAX_MID_LEVELS + j];
+    }
+    sim_core = core;
+}
+
+// These also work without --cores, for core 0.
+static __inline__ cache_t2* cachesim_core_I1(Int core)
+{
+    return core == sim_core ? &I1 : &core_I1[core];
+}
+
+static __inline__ cache_t2* cachesim_core_D1(Int core)
+{
+    return core == sim_core ? &D1 : &core_D1[core];
+}
+
+static __inline__ cache_t2* cachesim_core_mid(Int core, Int j)
+{
+    return core == sim_core ? &mid_levels[j] : &core_mid[core * MAX_MID_LEVELS + j];
+}
+
+static Bool cachesim_drop_line(cache_t2* c, UWord tag);
+
+// Invalidates the copy of a line in the D1, and any mid level, of 'core'.
+static void cachesim_invalidate(Int core, Int line, UWord u, CacheCC* cc)
+{
+    cache_t2* c = cachesim_core_D1(core);
+    Int j;
+
+    cc->inv++;
+    if ((c->used[line] & u) == 0) {
+        cc->fs++;
+        cachesim_note_false_sharing(c->tags[line]);
+    }
+    for (j = 0; j < n_mid_levels; j++)
+        cachesim_drop_line(cachesim_core_mid(core, j), c->tags[line]);
+    c->tags[line] |= CACHESIM_INV_TAG;
+    c->state[line] = MESI_I;
+    c->dirty[line] = 0;
+    if (c->owner)
+        c->owner[line] = NULL;
+}
+
+// 'block' has just been accessed by the current core, and so is in its D1
+// (the MRU way, with lru); 'u' has the words accessed.
+static void cachesim_coherence_line(UWord block, UWord u, CacheCC* cc, AccessType access_type)
+{
+    UInt base = (block & D1.sets_min_1) * D1.assoc;
+    UChar* state = &D1.state[cachesim_find_line(&D1, block)];
+    Bool shared = False;
+    Int i, k;
+
+    if (*state == MESI_I) {
+        // Just loaded: a coherence miss if another core invalidated our copy.
+        for (i = 0; i < D1.assoc; i++) {
+            if (D1.tags[base + i] == (block | CACHESIM_INV_TAG)) {
+                cc->cm++;
+                D1.tags[base + i] = ~(UWord)0;
+                break;
+            }
+        }
+        for (k = 0; k < sim_cores; k++) {
+            cache_t2* c = cachesim_core_D1(k);
+            Int line;
+            if (k == sim_core || (line = cachesim_find_line(c, block)) < 0)
+                continue;
+            if (access_type == ACCESS_WRITE) {
+                cachesim_invalidate(k, line, u, cc);
+            } else {
+                c->state[line] = MESI_S;
+                shared = True;
+            }
+        }
+        *state = access_type == ACCESS_WRITE ? MESI_M : shared ? MESI_S : MESI_E;
+    } else if (access_type == ACCESS_WRITE && *state != MESI_M) {
+        if (*state == MESI_S) {
+            for (k = 0; k < sim_cores; k++) {
+                cache_t2* c = cachesim_core_D1(k);
+                Int line;
+                if (k != sim_core && (line = cachesim_find_line(c, block)) >= 0)
+                    cachesim_invalidate(k, line, u, cc);
+            }
+        }
+        *state = MESI_M;
+    }
+}
+
+static void cachesim_coherence(Addr a, UChar size, CacheCC* cc, AccessType access_type)
+{
+    UWord block1 = a >> D1.line_size_bits;
+    UWord block2 = (a + size - 1) >> D1.line_size_bits;
+    UWord u = 0;
+    Int left = set_used(a, size, D1.line_size, &u);
+
+    cachesim_coherence_line(block1, u, cc, access_type);
+    if (block2 != block1) {
+        set_used(0, left, D1.line_size, &u);
+        cachesim_coherence_line(block2, u, cc, access_type);
+    }
+}
+
+/*------------------------------------------------------------*/
+/*--- Cache hierarchy                                      ---*/
+/*------------------------------------------------------------*/
+
+/* With --cache-level, there are up to MAX_MID_LEVELS levels between L1
+ * and LL, looked up in order after an L1 miss.  Each of them, and LL, has
+ * an inclusion policy:
+ *  - nine (non-inclusive non-exclusive), what LL always was: a miss loads
+ *    the line, and evicting it does not affect the other levels;
+ *  - inclusive: evicting a line also evicts it from the levels above, so
+ *    that they only hold lines that are here too;
+ *  - exclusive (not for LL): a victim cache of the level above.  A miss does
+ *    not load the line, a hit moves it to the levels above, and the lines
+ *    they evict are put here instead.
+ * Levels other than nine need the line size of the levels above.
+ */
+typedef struct {
+    HChar name[8]; /* "L2" */
+    cache_t config;
+    UChar inclusion;
+} CacheLevelConfig;
+
+static const HChar* cachesim_inclusion_name(UChar inclusion)
+{
+    switch (inclusion) {
+    case CACHE_INCLUSIVE:
+        return "inclusive";
+    case CACHE_EXCLUSIVE:
+        return "exclusive";
+    default:
+        return "nine";
+    }
+}
+
+/* Removes the line with this tag, as if evicted.  False if not cached. */
+static Bool cachesim_drop_line(cache_t2* c, UWord tag)
+{
+    Int line = cachesim_find_line(c, tag);
+
+    if (line < 0)
+        return False;
+    if (c->owner) {
+        cachesim_note_eviction(c, tag, c->used[line], c->owner[line]);
+        c->owner[line] = NULL;
+    }
+    c->total_used -= count_bits(c->used[line]);
+    c->tags[line] = ~(UWord)0;
+    c->used[line] = 0;
+    c->dirty[line] = 0;
+    if (c->state)
+        c->state[line] = MESI_I;
+    if (c->pf)
+        c->pf->lines[line].issuer = NULL;
+    return True;
+}
+
+/* Puts a line evicted from the level above into the exclusive level 'c'. */
+__attribute__((noinline)) static void cachesim_install(cache_t2* c, UWord tag, UWord u, UChar dirty)
+{
+    cachesim_setref_is_miss(c, tag & c->sets_min_1, tag, u, dirty ? ACCESS_WRITE : ACCESS_READ);
+}
+
+static void cachesim_evicted(cache_t2* c, UWord tag, UWord u, UChar dirty)
+{
+    Int k, j, cores;
+
+    // Nothing was evicted from an empty or invalidated way.
+    if (tag == ~(UWord)0 || (tag & CACHESIM_INV_TAG) != 0)
+        return;
+    if (c->victim_to)
+        cachesim_install(c->victim_to, tag, u, dirty);
+    if (c->inclusion != CACHE_INCLUSIVE)
+        return;
+    // LL is shared by all cores, the other levels are private.
+    cores = c->is_llc && sim_cores > 0 ? sim_cores : 1;
+    for (k = 0; k < cores; k++) {
+        Int core = cores == 1 ? sim_core : k;
+        cachesim_drop_line(cachesim_core_I1(core), tag);
+        cachesim_drop_line(cachesim_core_D1(core), tag);
+        for (j = 0; j + 1 < c->level; j++)
+            cachesim_drop_line(cachesim_core_mid(core, j), tag);
+    }
+}
+
+/* A lookup in an exclusive level: the lines hit move to the level above. */
+static Bool cachesim_exclusive_ref_is_miss(cache_t2* c, Addr a, UChar size)
+{
+    UWord block1 = a >> c->line_size_bits;
+    UWord block2 = (a + size - 1) >> c->line_size_bits;
+    Bool miss = False;
+    UWord b;
+
+    for (b = block1; b <= block2; b++) {
+        if (!cachesim_drop_line(c, b))
+            miss = True;
+    }
+    return miss;
+}
+
+/* The deepest level the last cachesim_lower_ref reached: 1.. for the
+ * --cache-level levels, then LL.
+ */
+static Int cachesim_lower_hit_level;
+
+/* The levels below L1, after an L1 miss, when there are --cache-level
+ * levels.  Kept out of line, as the doref functions are inlined into every
+ * helper.
+ */
+__attribute__((noinline)) static CacheHitType cachesim_lower_ref(Addr a, UChar size, CacheCC* cc,
+                                                                 AccessType access_type)
+{
+    Int j;
+
+    for (j = 0; j < n_mid_levels; j++) {
+        cache_t2* c = &mid_levels[j];
+        Bool miss = c->inclusion == CACHE_EXCLUSIVE ? cachesim_exclusive_ref_is_miss(c, a, size)
+                                                    : cachesim_ref_is_miss(c, a, size, access_type);
+        cachesim_lower_hit_level = j + 1;
+        if (!miss)
+            return CACHE_MISS_L1;
+        cc->mm[j]++;
+    }
+    cachesim_lower_hit_level = n_mid_levels + 1;
+    if (cachesim_ref_is_miss(&LL, a, size, access_type)) {
+        cc->mL++;
+        return CACHE_MISS_LL;
+    }
+    return CACHE_MISS_L1;
+}
+
+// Appends the inclusion policy of 'c', if not the default, to its description.
+static void cachesim_set_inclusion(cache_t2* c, UChar inclusion)
+{
+    c->inclusion = inclusion;
+    if (inclusion != CACHE_NINE)
+        VG_(sprintf)(c->desc_line + VG_(strlen)(c->desc_line), ", %s", cachesim_inclusion_name(inclusion));
+}
+
+/*------------------------------------------------------------*/
+/*--- Prefetchers                                          ---*/
+/*------------------------------------------------------------*/
+
+/* With --prefetch, D1 and the levels below it can have a prefetcher.  It
+ * sees the data accesses reaching its level, and loads the lines it
+ * predicts into it, and into the levels below as a miss would:
+ *  - next-line: the line after one missed, or after a prefetched line on
+ *    its first use;
+ *  - ip-stride: per instruction, the next line one or more strides ahead,
+ *    once the same stride has been seen PF_STRIDE_CONFIDENCE times in a row;
+ *  - stream: the PF_STREAM_DEGREE lines ahead of a run of misses on
+ *    adjacent lines in one direction, tracking up to PF_STREAMS streams.
+ * Instruction fetches do not train them.  As hardware prefetchers work on
+ * physical addresses, they do not cross regions of 1 << PF_REGION_BITS.
+ *
+ * A prefetch is charged to the access triggering it as issued, and when
+ * the line is first accessed, as useful, or as late if that is fewer than
+ * --prefetch-latency data accesses after the prefetch.  A late prefetch
+ * still makes a hit, as the simulator has no notion of time.
+ */
+#define PF_REGION_BITS 12
+#define PF_STRIDE_CONFIDENCE 2
+#define PF_STREAM_CONFIDENCE 2
+#define PF_STREAM_DEGREE 4
+
+static const HChar* const prefetcher_names[N_PREFETCHERS] = {"none", "next-line", "ip-stride", "stream"};
+
+static Bool sim_prefetch = False;   /* does any level have a prefetcher? */
+static ULong cachesim_pf_latency;
+static ULong cachesim_pf_clock = 0; /* data accesses so far */
+
+static Int cachesim_parse_prefetcher(const HChar* name)
+{
+    Int i;
+
+    for (i = 0; i < N_PREFETCHERS; i++) {
+        if (VG_(strcmp)(name, prefetcher_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void cachesim_set_prefetcher(cache_t2* c, UChar model)
+{
+    Int i;
+
+    if (model == PF_NONE)
+        return;
+    c->pf = VG_(malloc)("cg.sim.pf.1", sizeof(Prefetcher));
+    VG_(memset)(c->pf, 0, sizeof(Prefetcher));
+    c->pf->model = model;
+    c->pf->lines = VG_(malloc)("cg.sim.pf.2", sizeof(PfLine) * c->sets * c->assoc);
+    for (i = 0; i < c->sets * c->assoc; i++)
+        c->pf->lines[i].issuer = NULL;
+    sim_prefetch = True;
+}
+
+// Level 0 is D1, then come the --cache-level levels and LL.
+static cache_t2* cachesim_level(Int k)
+{
+    return k == 0 ? &D1 : k <= n_mid_levels ? &mid_levels[k - 1] : &LL;
+}
+
+/* Loads the line of 'a' into level k, and into the levels below that miss
+ * it, unless level k has it already.
+ */
+static void cachesim_prefetch_line(Int k, Addr a, CacheCC* cc)
+{
+    cache_t2* c = cachesim_level(k);
+    UWord block = a >> c->line_size_bits;
+    Int j, line;
+
+    if (cachesim_find_line(c, block) >= 0)
+        return;
+    cc->pf++;
+    c->pf->issued++;
+    cachesim_prefetching = True;
+    for (j = k; j <= n_mid_levels + 1; j++) {
+        cache_t2* l = cachesim_level(j);
+        UWord b = a >> l->line_size_bits;
+        Bool miss = j > k && l->inclusion == CACHE_EXCLUSIVE
+                            ? !cachesim_drop_line(l, b)
+                            : cachesim_setref_is_miss(l, b & l->sets_min_1, b, 0, ACCESS_READ);
+        if (!miss)
+            break;
+    }
+    cachesim_prefetching = False;
+    line = cachesim_find_line(c, block);
+    if (line >= 0) {
+        c->pf->lines[line].issuer = cc;
+        c->pf->lines[line].issued_at = cachesim_pf_clock;
+    }
+}
+
+static void cachesim_prefetch_in_region(Int k, Addr from, Addr a, CacheCC* cc)
+{
+    if (a >> PF_REGION_BITS == from >> PF_REGION_BITS)
+        cachesim_prefetch_line(k, a, cc);
+}
+
+static void cachesim_train_stride(Int k, Prefetcher* pf, Addr a, Addr pc, CacheCC* cc)
+{
+    PfStrideEntry* e = &pf->stride[(pc ^ (pc >> 6)) % PF_STRIDE_ENTRIES];
+    Long line_size = cachesim_level(k)->line_size;
+    Long stride = (Long)(a - e->last), ahead;
+
+    if (e->pc != pc) {
+        e->pc = pc;
+        e->last = a;
+        e->stride = 0;
+        e->confidence = 0;
+        return;
+    }
+    if (stride != 0 && stride == e->stride) {
+        if (e->confidence < PF_STRIDE_CONFIDENCE)
+            e->confidence++;
+    } else {
+        e->stride = stride;
+        e->confidence = 0;
+    }
+    e->last = a;
+    if (e->confidence < PF_STRIDE_CONFIDENCE)
+        return;
+    // Small strides: the first line they reach past this one.
+    for (ahead = e->stride; ahead < line_size && ahead > -line_size; ahead += e->stride)
+        ;
+    cachesim_prefetch_in_region(k, a, a + ahead, cc);
+}
+
+static void cachesim_train_stream(Int k, Prefetcher* pf, Addr a, CacheCC* cc)
+{
+    Int line_size_bits = cachesim_level(k)->line_size_bits;
+    UWord block = a >> line_size_bits;
+    UWord region = (a >> PF_REGION_BITS) + 1;
+    PfStreamEntry *e = NULL, *lru = &pf->stream[0];
+    Long d;
+    Int i;
+
+    for (i = 0; i < PF_STREAMS && e == NULL; i++) {
+        if (pf->stream[i].region == region)
+            e = &pf->stream[i];
+        else if (pf->stream[i].used_at < lru->used_at)
+            lru = &pf->stream[i];
+    }
+    if (e == NULL) {
+        lru->region = region;
+        lru->last = block;
+        lru->dir = lru->confidence = 0;
+        lru->used_at = cachesim_pf_clock;
+        return;
+    }
+    e->used_at = cachesim_pf_clock;
+    d = (Long)(block - e->last);
+    if (d == 0)
+        return;
+    if (d == 1 || d == -1) {
+        if (d == e->dir) {
+            if (e->confidence < PF_STREAM_CONFIDENCE)
+                e->confidence++;
+        } else {
+            e->dir = d;
+            e->confidence = 1;
+        }
+    } else {
+        e->dir = e->confidence = 0;
+    }
+    e->last = block;
+    if (e->confidence < PF_STREAM_CONFIDENCE)
+        return;
+    for (i = 1; i <= PF_STREAM_DEGREE; i++)
+        cachesim_prefetch_in_region(k, a, (block + e->dir * i) << line_size_bits, cc);
+}
+
+/* A data access reached level k, and 'missed' there or not. */
+static void cachesim_prefetch_observe(Int k, Addr a, Addr pc, Bool missed, CacheCC* cc)
+{
+    cache_t2* c = cachesim_level(k);
+    Prefetcher* pf = c->pf;
+    Bool trigger = missed;
+    Int line;
+
+    if (!missed && (line = cachesim_find_line(c, a >> c->line_size_bits)) >= 0 && pf->lines[line].issuer) {
+        PfLine* l = &pf->lines[line];
+        if (cachesim_pf_clock - l->issued_at < cachesim_pf_latency) {
+            l->issuer->pfl++;
+            pf->late++;
+        } else {
+            l->issuer->pfu++;
+            pf->useful++;
+        }
+        l->issuer = NULL;
+        // So that the prefetcher stays ahead.
+        trigger = True;
+    }
+    switch (pf->model) {
+    case PF_NEXT_LINE:
+        if (trigger)
+            cachesim_prefetch_in_region(k, a, a + c->line_size, cc);
+        break;
+    case PF_IP_STRIDE:
+        cachesim_train_stride(k, pf, a, pc, cc);
+        break;
+    case PF_STREAM:
+        if (trigger)
+            cachesim_train_stream(k, pf, a, cc);
+        break;
+    }
+}
+
+/* After a data access made by the instruction at 'pc'. */
+__attribute__((noinline)) static void cachesim_prefetch_access(Addr a, Addr pc, CacheCC* cc, CacheHitType hit_type)
+{
+    // The deepest level reached.
+    Int reached = hit_type == CACHE_HIT_L1 ? 0 : n_mid_levels == 0 ? 1 : cachesim_lower_hit_level;
+    Int k;
+
+    cachesim_pf_clock++;
+    for (k = 0; k <= reached; k++) {
+        if (cachesim_level(k)->pf)
+            cachesim_prefetch_observe(k, a, pc, k < reached || hit_type == CACHE_MISS_LL, cc);
+    }
+}
+
+/*------------------------------------------------------------*/
+/*--- Setup                                                ---*/
+/*------------------------------------------------------------*/
+
+/* The configuration of the simulated caches.  The per-level arrays are
+ * indexed from the top: I1, D1, the 'mids', then LL.
+ */
+typedef struct {
+    cache_t I1, D1, LL;
+    CacheLevelConfig mids[MAX_MID_LEVELS];
+    Int n_mids;
+    UChar LL_inclusion;
+    UChar policies[MAX_MID_LEVELS + 3];
+    UChar prefetchers[MAX_MID_LEVELS + 3]; /* not for I1 */
+    ULong prefetch_latency;
+    Bool wasted_bytes;
+    Int cores;
+} CacheSimConfig;
+
+// Sets the replacement policy and prefetcher of 'c', and describes them.
+static void cachesim_set_level_config(cache_t2* c, const CacheSimConfig* config, Int level)
+{
+    UChar policy = config->policies[level], prefetcher = config->prefetchers[level];
+
+    cachesim_set_policy(c, policy);
+    if (policy != REPL_LRU)
+        VG_(sprintf)(c->desc_line + VG_(strlen)(c->desc_line), ", %s", repl_policy_names[policy]);
+    cachesim_set_prefetcher(c, prefetcher);
+    if (prefetcher != PF_NONE)
+        VG_(sprintf)(c->desc_line + VG_(strlen)(c->desc_line), ", %s prefetch", prefetcher_names[prefetcher]);
+}
+
+// The defaults: lru, no prefetching.
+static void cachesim_default_config(CacheSimConfig* config)
+{
+    VG_(memset)(config, 0, sizeof(CacheSimConfig));
+    config->LL_inclusion = CACHE_NINE;
+    config->prefetch_latency = 50;
+}
+
+static void cachesim_initcaches(const CacheSimConfig* config)
+{
+    cache_t midc[MAX_MID_LEVELS];
+    Int j, n_mids = config->n_mids;
+
+    cachesim_initcache(config->I1, &I1, False);
+    cachesim_set_level_config(&I1, config, 0);
+    cachesim_initcache(config->D1, &D1, config->wasted_bytes);
+    cachesim_set_level_config(&D1, config, 1);
+    cachesim_initcache(config->LL, &LL, config->wasted_bytes);
+    cachesim_set_level_config(&LL, config, n_mids + 2);
     LL.is_llc = True;
+    n_mid_levels = n_mids;
+    for (j = 0; j < n_mids; j++) {
+        midc[j] = config->mids[j].config;
+        cachesim_initcache(config->mids[j].config, &mid_levels[j], False);
+        cachesim_set_level_config(&mid_levels[j], config, j + 2);
+        mid_levels[j].level = j + 1;
+        cachesim_set_inclusion(&mid_levels[j], config->mids[j].inclusion);
+    }
+    LL.level = n_mids + 1;
+    cachesim_set_inclusion(&LL, config->LL_inclusion);
+    // Link each level to the exclusive one below it, if any.
+    if (n_mids > 0 && mid_levels[0].inclusion == CACHE_EXCLUSIVE)
+        I1.victim_to = D1.victim_to = &mid_levels[0];
+    for (j = 0; j + 1 < n_mids; j++) {
+        if (mid_levels[j + 1].inclusion == CACHE_EXCLUSIVE)
+            mid_levels[j].victim_to = &mid_levels[j + 1];
+    }
+    cachesim_pf_latency = config->prefetch_latency;
+    if (config->cores > 0)
+        cachesim_initcores(config->I1, config->D1, midc, config->wasted_bytes, config->cores);
 }
 
 __attribute__((always_inline)) static __inline__ void cachesim_I1_doref_Gen(Addr a, UChar size, CacheCC* cc)
 {
     cc->a++; /* access */
+    if (sim_tlb)
+        tlbsim_ref(a, size, cc, True);
+    cachesim_owner = NULL;
     CacheHitType hit_type = CACHE_HIT_L1;
     if (cachesim_ref_is_miss(&I1, a, size, ACCESS_INSTR)) {
         hit_type = CACHE_MISS_L1;
         cc->m1++;
 
-        if (cachesim_ref_is_miss(&LL, a, size, ACCESS_INSTR)) {
+        if (n_mid_levels > 0) {
+            hit_type = cachesim_lower_ref(a, size, cc, ACCESS_INSTR);
+        } else if (cachesim_ref_is_miss(&LL, a, size, ACCESS_INSTR)) {
             hit_type = CACHE_MISS_LL;
             cc->mL++;
         }
@@ -299,6 +1354,9 @@ __attribute__((always_inline)) static __inline__ void cachesim_I1_doref_NoX(Addr
     UInt I1_set = block & I1.sets_min_1;
 
     cc->a++; /* access */
+    if (sim_tlb)
+        tlbsim_ref(a, size, cc, True);
+    cachesim_owner = NULL;
     CacheHitType hit_type = CACHE_HIT_L1;
     // use block as tag
     UWord used = 0;
@@ -310,7 +1368,9 @@ __attribute__((always_inline)) static __inline__ void cachesim_I1_doref_NoX(Addr
         UInt LL_set = block & LL.sets_min_1;
         set_used(a, size, LL.line_size, &used);
         // can use block as tag as L1I and LL cache line sizes are equal
-        if (cachesim_setref_is_miss(&LL, LL_set, block, used, ACCESS_INSTR)) {
+        if (n_mid_levels > 0) {
+            hit_type = cachesim_lower_ref(a, size, cc, ACCESS_INSTR);
+        } else if (cachesim_setref_is_miss(&LL, LL_set, block, used, ACCESS_INSTR)) {
             /* LL miss */
             hit_type = CACHE_MISS_LL;
             cc->mL++;
@@ -324,15 +1384,20 @@ __attribute__((always_inline)) static __inline__ void cachesim_I1_doref_NoX(Addr
 }
 
 __attribute__((always_inline)) static __inline__ void cachesim_D1_doref(Addr a, UChar size, CacheCC* cc,
-                                                                        AccessType access_type)
+                                                                        AccessType access_type, Addr pc)
 {
     cc->a++; /* access */
+    if (sim_tlb)
+        tlbsim_ref(a, size, cc, False);
+    cachesim_owner = cc;
     CacheHitType hit_type = CACHE_HIT_L1;
     if (cachesim_ref_is_miss(&D1, a, size, access_type)) {
         /* L1d miss */
         cc->m1++;
         hit_type = CACHE_MISS_L1;
-        if (cachesim_ref_is_miss(&LL, a, size, access_type)) {
+        if (n_mid_levels > 0) {
+            hit_type = cachesim_lower_ref(a, size, cc, access_type);
+        } else if (cachesim_ref_is_miss(&LL, a, size, access_type)) {
             /* LL miss */
             hit_type = CACHE_MISS_LL;
             cc->mL++;
@@ -340,7 +1405,11 @@ __attribute__((always_inline)) static __inline__ void cachesim_D1_doref(Addr a,
         //VG_(umsg)("cachesim_D1_doref: MISS D1 used %d LL used %d\n", D1.total_used, LL.total_used);
     }
     //VG_(umsg)("cachesim_D1_doref: -D1 used %d LL used %d\n", D1.total_used, LL.total_used);
+    if (sim_cores > 0)
+        cachesim_coherence(a, size, cc, access_type);
     log_mem_access(a, size, access_type, hit_type);
+    if (sim_prefetch)
+        cachesim_prefetch_access(a, pc, cc, hit_type);
     cc->l1_words += D1.total_used;
     cc->llc_words += LL.total_used;
 }
@@ -0,0 +1,342 @@
+/*--------------------------------------------------------------------*/
+/*--- TLB simulation for Cachegrind.                     cg_tlb.c ---*/
+/*--------------------------------------------------------------------*/
+
+/*
+ * With --tlb-sim=yes every instruction fetch and data access simulated
+ * by cg_sim.c is also translated by a simulated TLB hierarchy: per core,
+ * an ITLB and a DTLB backed by an STLB shared by instructions and data.
+ * A miss in the ITLB or DTLB is an ITm or DTm event; if the STLB misses
+ * too, the translation needs a page walk, an ITw or DTw event.  The page
+ * walk itself is not simulated: its loads do not go through the caches.
+ *
+ * Each level is made of one or more set-associative LRU arrays, each
+ * holding translations of some page sizes, as on current x86 cores:
+ * --DTLB=64,4,4K --DTLB=32,4,2M --DTLB=4,4,1G.  A page size no array of
+ * a level holds always misses there.
+ *
+ * The page size of an address is set by --tlb-pages:
+ *  - 4k, 2m, 1g: every page has that size;
+ *  - thp: a 2M page lying wholly within an anonymous writable mapping
+ *    (heap, anonymous mmap, stacks, .bss) is huge, as with transparent
+ *    huge pages set to "always" and enough free memory; other pages are
+ *    4K.  The mappings come from cg_segmap.c.
+ * Comparing runs with --tlb-pages=4k and --tlb-pages=thp shows what huge
+ * pages would buy.
+ */
+
+#define PAGE_4K 0
+#define PAGE_2M 1
+#define PAGE_1G 2
+#define N_PAGE_SIZES 3
+
+static const Int tlb_page_bits[N_PAGE_SIZES] = {12, 21, 30};
+static const HChar* const tlb_page_names[N_PAGE_SIZES] = {"4K", "2M", "1G"};
+
+// One set-associative array of translations.
+typedef struct {
+    Int entries;
+    Int assoc;
+    UInt sizes;   // the page sizes it holds, a bit per PAGE_*
+    Int sets_min_1;
+    UWord* tags;  // [sets][assoc], most recently used first; 0 if empty
+} TlbArray;
+
+#define MAX_TLB_ARRAYS 4
+
+// The arrays of one level.
+typedef struct {
+    Int n_arrays;
+    TlbArray arrays[MAX_TLB_ARRAYS];
+    TlbArray* of_size[N_PAGE_SIZES];  // NULL if no array holds that size
+} TlbLevel;
+
+#define TLB_I 0
+#define TLB_D 1
+#define TLB_S 2
+#define N_TLB_LEVELS 3
+
+static const HChar* const tlb_level_names[N_TLB_LEVELS] = {"ITLB", "DTLB", "STLB"};
+
+#define TLB_PAGES_4K 0
+#define TLB_PAGES_2M 1
+#define TLB_PAGES_1G 2
+#define TLB_PAGES_THP 3
+
+static const HChar* const tlb_pages_names[] = {"4k", "2m", "1g", "thp"};
+
+static Bool clo_tlb_sim = False;
+static Int clo_tlb_pages = TLB_PAGES_4K;
+
+// The arrays given by --ITLB, --DTLB and --STLB.  A level not given gets
+// the default arrays below, which are those of a recent x86 core.
+static TlbLevel clo_tlb[N_TLB_LEVELS];
+static Bool clo_tlb_given[N_TLB_LEVELS];
+
+static const struct {
+    Int level, entries, assoc;
+    UInt sizes;
+} tlb_defaults[] = {
+    {TLB_I, 128, 8, 1 << PAGE_4K},
+    {TLB_I, 8, 8, 1 << PAGE_2M | 1 << PAGE_1G},
+    {TLB_D, 64, 4, 1 << PAGE_4K},
+    {TLB_D, 32, 4, 1 << PAGE_2M},
+    {TLB_D, 4, 4, 1 << PAGE_1G},
+    {TLB_S, 1536, 12, 1 << PAGE_4K | 1 << PAGE_2M},
+    {TLB_S, 16, 4, 1 << PAGE_1G},
+};
+
+// The levels of each core, [cores][N_TLB_LEVELS].
+static TlbLevel* tlb_cores = NULL;
+
+// The page size of the 4K page looked up last, valid while the mappings
+// do not change.
+static UWord tlb_memo_page = ~(UWord)0;
+static Int tlb_memo_size;
+static UInt tlb_memo_generation;
+
+/*------------------------------------------------------------*/
+/*--- Configuration                                        ---*/
+/*------------------------------------------------------------*/
+
+static void tlb_add_array(const HChar* opt, TlbLevel* level, Int entries, Int assoc, UInt sizes)
+{
+    TlbArray* t;
+    Int sets, s;
+
+    if (level->n_arrays == MAX_TLB_ARRAYS)
+        VG_(fmsg_bad_option)(opt, "At most %d arrays per TLB level\n", MAX_TLB_ARRAYS);
+    if (entries <= 0 || assoc <= 0 || entries % assoc != 0)
+        VG_(fmsg_bad_option)(opt, "The entries must be a multiple of the associativity\n");
+    sets = entries / assoc;
+    if ((sets & (sets - 1)) != 0)
+        VG_(fmsg_bad_option)(opt, "The number of sets (%d) must be a power of two\n", sets);
+    for (s = 0; s < N_PAGE_SIZES; s++) {
+        if ((sizes & (1 << s)) && level->of_size[s])
+            VG_(fmsg_bad_option)(opt, "Two arrays hold %s pages\n", tlb_page_names[s]);
+    }
+    t = &level->arrays[level->n_arrays++];
+    t->entries = entries;
+    t->assoc = assoc;
+    t->sizes = sizes;
+    t->sets_min_1 = sets - 1;
+    t->tags = NULL;
+    for (s = 0; s < N_PAGE_SIZES; s++) {
+        if (sizes & (1 << s))
+            level->of_size[s] = t;
+    }
+}
+
+// Parses "<entries>,<assoc>,<page sizes>", the sizes joined by '+'.
+static void tlb_parse_array(const HChar* opt, const HChar* val, Int level)
+{
+    HChar* end;
+    Long entries, assoc;
+    UInt sizes = 0;
+
+    entries = VG_(strtoll10)(val, &end);
+    if (*end != ',')
+        goto bad;
+    assoc = VG_(strtoll10)(end + 1, &end);
+    if (*end != ',' || entries > 1 << 20 || assoc > entries)
+        goto bad;
+    do {
+        Int s;
+        end++;
+        for (s = 0; s < N_PAGE_SIZES; s++) {
+            if (VG_(strncasecmp)(end, tlb_page_names[s], 2) == 0 && (end[2] == '+' || end[2] == '\0'))
+                break;
+        }
+        if (s == N_PAGE_SIZES)
+            goto bad;
+        sizes |= 1 << s;
+        end += 2;
+    } while (*end == '+');
+    tlb_add_array(opt, &clo_tlb[level], entries, assoc, sizes);
+    clo_tlb_given[level] = True;
+    return;
+
+bad:
+    VG_(fmsg_bad_option)(opt, "Expected <entries>,<assoc>,<page sizes>, eg. 64,4,4K or 1536,12,4K+2M\n");
+}
+
+static Bool tlbsim_process_option(const HChar* arg)
+{
+    const HChar* tmp_str;
+
+    if VG_BOOL_CLO (arg, "--tlb-sim", clo_tlb_sim) {
+    } else if VG_XACT_CLO (arg, "--tlb-pages=4k", clo_tlb_pages, TLB_PAGES_4K) {
+    } else if VG_XACT_CLO (arg, "--tlb-pages=2m", clo_tlb_pages, TLB_PAGES_2M) {
+    } else if VG_XACT_CLO (arg, "--tlb-pages=1g", clo_tlb_pages, TLB_PAGES_1G) {
+    } else if VG_XACT_CLO (arg, "--tlb-pages=thp", clo_tlb_pages, TLB_PAGES_THP) {
+    } else if VG_STR_CLO (arg, "--ITLB", tmp_str) {
+        tlb_parse_array(arg, tmp_str, TLB_I);
+    } else if VG_STR_CLO (arg, "--DTLB", tmp_str) {
+        tlb_parse_array(arg, tmp_str, TLB_D);
+    } else if VG_STR_CLO (arg, "--STLB", tmp_str) {
+        tlb_parse_array(arg, tmp_str, TLB_S);
+    } else
+        return False;
+    return True;
+}
+
+static void tlbsim_print_usage(void)
+{
+    VG_(printf)(
+            "    --tlb-sim=yes|no                 simulate the TLBs too? [no]\n"
+            "    --tlb-pages=4k|2m|1g|thp         page size of all pages, or thp: 2M for\n"
+            "                                     anonymous writable memory [4k]\n"
+            "    --ITLB=<entries>,<assoc>,<page sizes>  add an ITLB array, eg. 128,8,4K;\n"
+            "                                     repeat for more page sizes\n"
+            "                                     [128,8,4K 8,8,2M+1G]\n"
+            "    --DTLB=<entries>,<assoc>,<page sizes>  [64,4,4K 32,4,2M 4,4,1G]\n"
+            "    --STLB=<entries>,<assoc>,<page sizes>  [1536,12,4K+2M 16,4,1G]\n");
+}
+
+static void tlbsim_init(Int cores)
+{
+    Int i, k, l, n_cores = cores > 0 ? cores : 1;
+
+    for (i = 0; i < sizeof(tlb_defaults) / sizeof(tlb_defaults[0]); i++) {
+        l = tlb_defaults[i].level;
+        if (!clo_tlb_given[l])
+            tlb_add_array(tlb_level_names[l], &clo_tlb[l], tlb_defaults[i].entries, tlb_defaults[i].assoc,
+                          tlb_defaults[i].sizes);
+    }
+    tlb_cores = VG_(malloc)("cg.tlb.init.1", sizeof(TlbLevel) * N_TLB_LEVELS * n_cores);
+    for (k = 0; k < n_cores; k++) {
+        for (l = 0; l < N_TLB_LEVELS; l++) {
+            TlbLevel* level = &tlb_cores[k * N_TLB_LEVELS + l];
+            *level = clo_tlb[l];
+            for (i = 0; i < level->n_arrays; i++) {
+                TlbArray* t = &level->arrays[i];
+                t->tags = VG_(calloc)("cg.tlb.init.2", t->entries, sizeof(UWord));
+            }
+            for (i = 0; i < N_PAGE_SIZES; i++) {
+                if (clo_tlb[l].of_size[i])
+                    level->of_size[i] = &level->arrays[clo_tlb[l].of_size[i] - clo_tlb[l].arrays];
+            }
+        }
+    }
+    if (clo_tlb_pages == TLB_PAGES_THP)
+        segmap_track();
+    sim_tlb = True;
+}
+
+/*------------------------------------------------------------*/
+/*--- Simulation                                           ---*/
+/*------------------------------------------------------------*/
+
+static Int tlb_page_size(Addr a)
+{
+    const RegionInterval* ri;
+    Addr huge;
+    Int size;
+
+    switch (clo_tlb_pages) {
+    case TLB_PAGES_2M:
+        return PAGE_2M;
+    case TLB_PAGES_1G:
+        return PAGE_1G;
+    case TLB_PAGES_THP:
+        break;
+    default:
+        return PAGE_4K;
+    }
+    if (a >> 12 == tlb_memo_page && tlb_memo_generation == segmap_generation)
+        return tlb_memo_size;
+    huge = a & ~(((Addr)1 << 21) - 1);
+    ri = segmap_lookup(a);
+    size = ri && ri->thp && ri->start <= huge && ri->end >= huge + ((Addr)1 << 21) - 1 ? PAGE_2M : PAGE_4K;
+    tlb_memo_page = a >> 12;
+    tlb_memo_size = size;
+    tlb_memo_generation = segmap_generation;
+    return size;
+}
+
+// Looks up the page of 'a' in 'level', loading it on a miss.  Returns
+// True on a miss.
+static __inline__ Bool tlb_ref_is_miss(TlbLevel* level, Int size, Addr a)
+{
+    TlbArray* t = level->of_size[size];
+    UWord page = a >> tlb_page_bits[size];
+    UWord tag = page << 2 | (size + 1);  // never 0
+    UWord* set;
+    Bool miss;
+    Int i;
+
+    if (t == NULL)
+        return True;
+    set = &t->tags[(page & t->sets_min_1) * t->assoc];
+    if (set[0] == tag)
+        return False;
+    // On a hit, move the entry to the front; on a miss, evict the last one.
+    for (i = 1; i < t->assoc && set[i] != tag; i++)
+        ;
+    miss = i == t->assoc;
+    if (miss)
+        i--;
+    for (; i > 0; i--)
+        set[i] = set[i - 1];
+    set[0] = tag;
+    return miss;
+}
+
+static void tlb_translate(TlbLevel* levels, Bool instr, Addr a, Bool* miss, Bool* walk)
+{
+    Int size = tlb_page_size(a);
+
+    if (tlb_ref_is_miss(&levels[instr ? TLB_I : TLB_D], size, a)) {
+        *miss = True;
+        if (tlb_ref_is_miss(&levels[TLB_S], size, a))
+            *walk = True;
+    }
+}
+
+// Translates the 'size' bytes at 'a' for the access counted in 'cc', on
+// the current core.  Like the caches, counts one miss at most for an
+// access spanning two pages.
+static __attribute__((noinline)) void tlbsim_ref(Addr a, UChar size, CacheCC* cc, Bool instr)
+{
+    TlbLevel* levels = &tlb_cores[sim_core * N_TLB_LEVELS];
+    Addr last = a + size - 1;
+    Bool miss = False, walk = False;
+
+    tlb_translate(levels, instr, a, &miss, &walk);
+    if (UNLIKELY((a ^ last) >> 12))
+        tlb_translate(levels, instr, last, &miss, &walk);
+    cc->tm += miss;
+    cc->tw += walk;
+}
+
+/*------------------------------------------------------------*/
+/*--- Output                                               ---*/
+/*------------------------------------------------------------*/
+
+// One "desc:" line per level, and one for the page sizes.
+static void tlbsim_fprint_desc(VgFile* fp)
+{
+    Int l, i, s;
+
+    for (l = 0; l < N_TLB_LEVELS; l++) {
+        const TlbLevel* level = &tlb_cores[l];
+        VG_(fprintf)(fp, "desc: %s:%*s", tlb_level_names[l], 13, "");
+        for (i = 0; i < level->n_arrays; i++) {
+            const TlbArray* t = &level->arrays[i];
+            const HChar* sep = "";
+            VG_(fprintf)(fp, "%s%d entries, %d-way, ", i ? "; " : "", t->entries, t->assoc);
+            for (s = 0; s < N_PAGE_SIZES; s++) {
+                if (t->sizes & (1 << s)) {
+                    VG_(fprintf)(fp, "%s%s", sep, tlb_page_names[s]);
+                    sep = "+";
+                }
+            }
+        }
+        VG_(fprintf)(fp, "\n");
+    }
+    VG_(fprintf)(fp, "desc: TLB pages:%*s%s\n", 8, "", tlb_pages_names[clo_tlb_pages]);
+}
+
+/*--------------------------------------------------------------------*/
+/*--- end                                                 cg_tlb.c ---*/
+/*--------------------------------------------------------------------*/
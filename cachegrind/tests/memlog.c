@@ -0,0 +1,34 @@
+// A deterministic client for the --mem-log tests: it sweeps a global
+// array, one read per cache line, once before a capture window, twice
+// inside it and once after.  It is built with -O2 so that the sweeps keep
+// their counters in registers: the array is all the data they touch.
+
+#define N 4096
+
+volatile int a[N] __attribute__((aligned(64)));
+int sum;
+
+__attribute__((noinline)) void start_here(void) { __asm__ __volatile__(""); }
+__attribute__((noinline)) void stop_here(void) { __asm__ __volatile__(""); }
+
+__attribute__((noinline)) int sweep(void)
+{
+   int i, s = 0;
+
+   for (i = 0; i < N; i += 16)
+      s += a[i];
+   return s;
+}
+
+int main(void)
+{
+   int s = sweep();
+
+   start_here();
+   s += sweep();
+   s += sweep();
+   stop_here();
+   s += sweep();
+   sum = s;
+   return 0;
+}
@@ -0,0 +1,40 @@
+// Recursion which returns to one of three call sites in turn, to exercise
+// --ras: with 16 entries, the returns of shallow() are all predicted, but
+// those of deep() overflow the stack, and once they have popped the 16
+// entries it kept they are predicted from stale ones.
+
+#include <stdio.h>
+
+static int shallow(int n)
+{
+   if (n == 0)
+      return 0;
+   switch (n % 3) {
+      case 0:  return shallow(n - 1) + 1;
+      case 1:  return shallow(n - 1) + 2;
+      default: return shallow(n - 1) + 3;
+   }
+}
+
+static int deep(int n)
+{
+   if (n == 0)
+      return 0;
+   switch (n % 3) {
+      case 0:  return deep(n - 1) + 1;
+      case 1:  return deep(n - 1) + 2;
+      default: return deep(n - 1) + 3;
+   }
+}
+
+int main(void)
+{
+   int i, sum = 0;
+
+   for (i = 0; i < 100; i++) {
+      sum += shallow(12);
+      sum += deep(48);
+   }
+   printf("%d\n", sum);
+   return 0;
+}
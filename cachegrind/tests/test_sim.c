@@ -4,8 +4,10 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <strings.h>
 
 typedef signed long Word;
+typedef signed long long int Long;
 typedef unsigned long UWord;
 typedef unsigned char Bool;
 #define True ((Bool)1)
@@ -18,17 +20,77 @@ typedef size_t SizeT;
 typedef char HChar;
 typedef long Addr;
 typedef unsigned char UChar;
+typedef unsigned short UShort;
+typedef unsigned int ThreadId;
 
 #define VG_(x) vg_##x
 #define vg_sprintf sprintf
+#define vg_strlen strlen
+#define vg_strcmp strcmp
+#define vg_memset memset
 #define vg_printf printf
 #define vg_umsg printf
 #define vg_log2 log2
 #define vg_tool_panic printf
 #define vg_malloc(desc, sz) calloc(1, sz)
+#define vg_calloc(desc, n, sz) calloc(n, sz)
+#define vg_fprintf fprintf
+#define vg_strncasecmp strncasecmp
+#define vg_strtoll10(str, end) strtoll(str, end, 10)
+#define vg_fmsg_bad_option(opt, ...) Panic(__VA_ARGS__)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+typedef FILE VgFile;
+void Panic(const char *fmt, ...);
 #include "../cg_arch.h"
 #include "../cg_sim.c"
-//#include "cg_branchpred.c"
+
+/* cg_tlb.c is tested with tlb_parse_array; its options are not parsed. */
+#define VG_BOOL_CLO(arg, opt, var) (0)
+#define VG_XACT_CLO(arg, opt, var, val) (0)
+#define VG_STR_CLO(arg, opt, var) (0)
+
+/* A single mapping, for --tlb-pages=thp. */
+typedef struct {
+    Addr start;
+    Addr end;
+    RegionKind kind;
+    Bool thp;
+} RegionInterval;
+
+static UInt segmap_generation = 0;
+static RegionInterval test_region;
+
+static const RegionInterval* segmap_lookup(Addr a)
+{
+    return a >= test_region.start && a <= test_region.end ? &test_region : NULL;
+}
+
+static void segmap_track(void)
+{
+}
+#include "../cg_tlb.c"
+
+/* The memory log is not part of this test. */
+static void log_mem_access(Addr addr, UChar size, AccessType type, CacheHitType hit_type)
+{
+}
+
+/* The false sharing invalidations seen, see test_cores(). */
+static int false_sharing_count;
+static void cachesim_note_false_sharing(UWord block)
+{
+    false_sharing_count++;
+}
+
+/* Heap allocation sites are not part of this test. */
+static void heapsim_note_eviction(Addr a, Int wasted, Bool llc)
+{
+}
+
+/* The predictors are set up directly; their options are not parsed. */
+#define VG_BINT_CLO(arg, opt, var, lo, hi) (0)
+#define tl_assert assert
+#include "../cg_branchpred.c"
 
 /*------------------------------------------------------------*/
 /*--- Constants                                            ---*/
@@ -133,6 +195,38 @@ void test_set_used()
     printf("*** set_used() - OK.\n");
 }
 
+/* Simulate with the given configuration, from a clean state. */
+void init_config(const CacheSimConfig *config)
+{
+    sim_cores = 0;
+    sim_core = 0;
+    cachesim_seed(1);
+    sim_prefetch = False;
+    cachesim_pf_clock = 0;
+    cachesim_initcaches(config);
+    sprintf(I1.desc_line, "I1");
+    sprintf(D1.desc_line, "D1");
+    sprintf(LL.desc_line, "LL");
+}
+
+/* Simulate the given caches, with the default configuration otherwise. */
+void init_caches(cache_t I1c, cache_t D1c, cache_t LLc)
+{
+    CacheSimConfig config;
+
+    cachesim_default_config(&config);
+    config.I1 = I1c;
+    config.D1 = D1c;
+    config.LL = LLc;
+    init_config(&config);
+}
+
+void check(Bool ok, const char *what)
+{
+    if (!ok)
+        Panic("%s", what);
+}
+
 void dump_cache_t2(cache_t2 *c)
 {
     char tagstr[1024];
@@ -198,10 +292,7 @@ void test_caches()
 
     printf("*** Caches test...\n");
 
-    cachesim_initcaches(I1c, D1c, LLc);
-    sprintf(I1.desc_line, "I1");
-    sprintf(D1.desc_line, "D1");
-    sprintf(LL.desc_line, "LL");
+    init_caches(I1c, D1c, LLc);
 
     dump_cache_t2(&I1);
     dump_cache_t2(&D1);
@@ -228,7 +319,7 @@ void test_caches()
     {
         CacheCC dcc = {};
         printf("## D1: %s: Access %lu, size %d\n", t->desc, t->a, t->s);
-        cachesim_D1_doref(t->a, t->s, &dcc);
+        cachesim_D1_doref(t->a, t->s, &dcc, ACCESS_READ, 0);
         dump_cache_t2(&D1);
         dump_cache_t2(&LL);
         dump_CacheCC(&dcc);
@@ -266,10 +357,7 @@ void test_word_usage()
     cache_t D1c = {.assoc = 2, .line_size = 64, .size = 64 * 2};
     cache_t LLc = {.assoc = 2, .line_size = 64, .size = 64 * 128};
 
-    cachesim_initcaches(I1c, D1c, LLc);
-    sprintf(I1.desc_line, "I1");
-    sprintf(D1.desc_line, "D1");
-    sprintf(LL.desc_line, "LL");
+    init_caches(I1c, D1c, LLc);
 
     printf("*** Check word usage...\n");
     CacheCC icc = {};
@@ -304,10 +392,7 @@ void test_array()
     cache_t D1c = {.assoc = 1, .line_size = 32, .size = 2 * 32};
     cache_t LLc = {.assoc = 1, .line_size = 32, .size = 2 * 32};
 
-    cachesim_initcaches(I1c, D1c, LLc);
-    sprintf(I1.desc_line, "I1");
-    sprintf(D1.desc_line, "D1");
-    sprintf(LL.desc_line, "LL");
+    init_caches(I1c, D1c, LLc);
     dump_cache_t2(&D1);
     dump_cache_t2(&LL);
 
@@ -316,13 +401,387 @@ void test_array()
     for (int i = 4; i < 64 * 3200; i+= 4) {
         //printf("## I1 (gen): Access even words %d, size %d\n", i, 4);
         cachesim_I1_doref_Gen(i, 12, &icc);
-        cachesim_D1_doref(1000000+i, 12, &icc);
+        cachesim_D1_doref(1000000+i, 12, &icc, ACCESS_READ, i);
     }
     dump_CacheCC(&icc);
     printf("array counts: a %llu wl1 %llu wllc %llu l1u %%%.2f llcu %%%.2f\n",
         icc.a, icc.l1_words, icc.llc_words, icc.l1_words * 400.0 / icc.a / I1.size, icc.llc_words * 400.0 / icc.a / LL.size);
 }
 
+/* Two cores with private D1s, kept coherent with MESI. */
+void test_cores()
+{
+    CacheSimConfig config;
+    CacheCC cc = {};
+    UWord block = 0;
+
+    cachesim_default_config(&config);
+    config.I1 = config.D1 = (cache_t){.assoc = 2, .line_size = 64, .size = 64 * 4};
+    config.LL = (cache_t){.assoc = 4, .line_size = 64, .size = 64 * 16};
+    config.cores = 2;
+    init_config(&config);
+
+    printf("*** Cores test...\n");
+#define STATE(core) (cachesim_core_D1(core)->state[cachesim_find_line(cachesim_core_D1(core), block)])
+#define NO_LINE(core) (cachesim_find_line(cachesim_core_D1(core), block) < 0)
+
+    cachesim_D1_doref(0, 4, &cc, ACCESS_READ, 0);
+    check(STATE(0) == MESI_E, "core 0 read: E");
+
+    cachesim_switch_core(1);
+    cachesim_D1_doref(0, 4, &cc, ACCESS_READ, 0);
+    check(STATE(0) == MESI_S && STATE(1) == MESI_S, "core 1 read: S in both");
+
+    /* Core 0 only read word 0: writing word 8 is false sharing. */
+    cachesim_D1_doref(32, 4, &cc, ACCESS_WRITE, 0);
+    check(STATE(1) == MESI_M && NO_LINE(0), "core 1 write: M, core 0 invalid");
+    check(cc.inv == 1 && cc.fs == 1 && false_sharing_count == 1, "core 1 write: false sharing");
+
+    /* The line core 0 lost is a coherence miss. */
+    cachesim_switch_core(0);
+    cachesim_D1_doref(0, 4, &cc, ACCESS_READ, 0);
+    check(cc.cm == 1 && STATE(0) == MESI_S && STATE(1) == MESI_S, "core 0 reread: coherence miss");
+
+    /* Core 1 read word 0 too: writing it is true sharing. */
+    cachesim_D1_doref(0, 4, &cc, ACCESS_WRITE, 0);
+    check(STATE(0) == MESI_M && NO_LINE(1), "core 0 write: M, core 1 invalid");
+    check(cc.inv == 2 && cc.fs == 1 && false_sharing_count == 1, "core 0 write: true sharing");
+#undef STATE
+#undef NO_LINE
+
+    printf("invalidations %llu false sharing %llu coherence misses %llu\n", cc.inv, cc.fs, cc.cm);
+    printf("*** Cores test - OK.\n");
+}
+
+/* Adds a level between L1 and LL. */
+void add_mid_level(CacheSimConfig *config, cache_t c, UChar inclusion)
+{
+    CacheLevelConfig *m = &config->mids[config->n_mids++];
+
+    sprintf(m->name, "L%c", (char)('1' + config->n_mids));
+    m->config = c;
+    m->inclusion = inclusion;
+}
+
+/* Reads the line of block 'b' from D1, checking the misses below it. */
+void read_block(UWord b, CacheCC *cc, ULong mm, ULong mL, const char *what)
+{
+    cachesim_D1_doref(b * 64, 4, cc, ACCESS_READ, 0);
+    if (cc->mm[0] != mm || cc->mL != mL)
+        Panic("%s: L2 misses %llu LL misses %llu, expected %llu %llu", what, cc->mm[0], cc->mL, mm, mL);
+}
+
+/* An L2 between D1 and LL, with each inclusion policy.  Blocks 0 and 2
+ * conflict in D1.
+ */
+void test_levels()
+{
+    CacheSimConfig config;
+    cache_t LLc = {.assoc = 4, .line_size = 64, .size = 64 * 16};
+    CacheCC cc;
+
+    printf("*** Cache levels test...\n");
+
+    /* nine: a line evicted from D1 is still in L2. */
+    cachesim_default_config(&config);
+    config.I1 = config.D1 = (cache_t){.assoc = 1, .line_size = 64, .size = 64 * 2};
+    config.LL = LLc;
+    add_mid_level(&config, (cache_t){.assoc = 1, .line_size = 64, .size = 64 * 4}, CACHE_NINE);
+    init_config(&config);
+    printf("L2: %s\n", mid_levels[0].desc_line);
+    cc = (CacheCC){};
+    read_block(0, &cc, 1, 1, "nine, first read");
+    read_block(2, &cc, 2, 2, "nine, conflicting read");
+    read_block(0, &cc, 2, 2, "nine, reread");
+    check(cc.m1 == 3, "nine: D1 misses");
+
+    /* inclusive: a line evicted from L2 leaves D1 too. */
+    cachesim_default_config(&config);
+    config.I1 = config.D1 = (cache_t){.assoc = 2, .line_size = 64, .size = 64 * 2};
+    config.LL = LLc;
+    add_mid_level(&config, (cache_t){.assoc = 1, .line_size = 64, .size = 64 * 2}, CACHE_INCLUSIVE);
+    init_config(&config);
+    printf("L2: %s\n", mid_levels[0].desc_line);
+    cc = (CacheCC){};
+    read_block(0, &cc, 1, 1, "inclusive, first read");
+    read_block(2, &cc, 2, 2, "inclusive, conflicting read");
+    check(cachesim_find_line(&D1, 0) < 0 && cachesim_find_line(&D1, 2) >= 0, "inclusive: back-invalidation");
+
+    /* exclusive: L2 only holds the victims of D1. */
+    cachesim_default_config(&config);
+    config.I1 = config.D1 = (cache_t){.assoc = 1, .line_size = 64, .size = 64 * 2};
+    config.LL = LLc;
+    add_mid_level(&config, (cache_t){.assoc = 2, .line_size = 64, .size = 64 * 4}, CACHE_EXCLUSIVE);
+    init_config(&config);
+    printf("L2: %s\n", mid_levels[0].desc_line);
+    cc = (CacheCC){};
+    read_block(0, &cc, 1, 1, "exclusive, first read");
+    check(cachesim_find_line(&mid_levels[0], 0) < 0, "exclusive: a miss does not fill L2");
+    read_block(2, &cc, 2, 2, "exclusive, conflicting read");
+    check(cachesim_find_line(&mid_levels[0], 0) >= 0, "exclusive: the D1 victim goes to L2");
+    read_block(0, &cc, 2, 2, "exclusive, reread");
+    check(cachesim_find_line(&mid_levels[0], 0) < 0 && cachesim_find_line(&mid_levels[0], 2) >= 0,
+          "exclusive: a hit moves the line up, the new victim down");
+
+    printf("*** Cache levels test - OK.\n");
+}
+
+/* Reads each of the blocks 'from' to 'to' from D1. */
+void read_blocks(UWord from, UWord to)
+{
+    CacheCC cc = {};
+    UWord b;
+
+    for (b = from; b <= to; b++)
+        cachesim_D1_doref(b * 64, 4, &cc, ACCESS_READ, 0);
+}
+
+Bool in_D1(UWord b)
+{
+    return cachesim_find_line(&D1, b) >= 0;
+}
+
+/* A single 4-way D1 set with each replacement policy. */
+void test_policies()
+{
+    CacheSimConfig config;
+
+    printf("*** Replacement policies test...\n");
+    cachesim_default_config(&config);
+    config.I1 = config.D1 = (cache_t){.assoc = 4, .line_size = 64, .size = 64 * 4};
+    config.LL = (cache_t){.assoc = 4, .line_size = 64, .size = 64 * 16};
+
+    /* plru: after 0..3 and 0 again, the tree points at way 2, where true
+     * lru would pick block 1.
+     */
+    config.policies[1] = REPL_PLRU;
+    init_config(&config);
+    read_blocks(0, 3);
+    read_blocks(0, 0);
+    read_blocks(4, 4);
+    check(!in_D1(2) && in_D1(0) && in_D1(1) && in_D1(3), "plru: victim");
+
+    /* srrip: lines hit once survive a scan which lru would let evict
+     * block 0; the scanned lines replace each other.
+     */
+    config.policies[1] = REPL_SRRIP;
+    init_config(&config);
+    read_blocks(0, 3);
+    read_blocks(0, 2);
+    read_blocks(4, 5);
+    check(in_D1(0) && in_D1(1) && in_D1(2) && !in_D1(3) && !in_D1(4) && in_D1(5), "srrip: scan");
+    /* A longer scan ages them out. */
+    read_blocks(6, 21);
+    check(!in_D1(0) && !in_D1(1) && !in_D1(2), "srrip: long scan");
+
+    /* brrip: most lines are inserted distant, so the same long scan
+     * leaves the lines hit alone.
+     */
+    config.policies[1] = REPL_BRRIP;
+    init_config(&config);
+    read_blocks(0, 3);
+    read_blocks(0, 2);
+    read_blocks(4, 21);
+    check(in_D1(0) && in_D1(1) && in_D1(2), "brrip: long scan");
+
+    printf("*** Replacement policies test - OK.\n");
+}
+
+/* Reads the line of block 'b' from D1, for the instruction at 'pc'. */
+void read_block_at(UWord b, Addr pc, CacheCC *cc)
+{
+    cachesim_D1_doref(b * 64, 4, cc, ACCESS_READ, pc);
+}
+
+/* Each prefetcher on D1. */
+void test_prefetchers()
+{
+    CacheSimConfig config;
+    CacheCC cc;
+    UWord b;
+
+    printf("*** Prefetchers test...\n");
+    cachesim_default_config(&config);
+    config.I1 = config.D1 = (cache_t){.assoc = 8, .line_size = 64, .size = 64 * 64};
+    config.LL = (cache_t){.assoc = 8, .line_size = 64, .size = 64 * 256};
+    config.prefetch_latency = 2;
+
+    /* next-line: a miss, then the first use of a prefetched line, fetch
+     * the next line.  Using it one access later is late, two is not.
+     */
+    config.prefetchers[1] = PF_NEXT_LINE;
+    init_config(&config);
+    cc = (CacheCC){};
+    read_block_at(0, 0, &cc);
+    check(cc.pf == 1 && in_D1(1), "next-line: miss");
+    read_block_at(1, 0, &cc);
+    check(cc.m1 == 1 && cc.pf == 2 && cc.pfl == 1 && in_D1(2), "next-line: late use");
+    read_block_at(40, 0, &cc);
+    read_block_at(2, 0, &cc);
+    check(cc.m1 == 2 && cc.pf == 4 && cc.pfu == 1, "next-line: useful");
+
+    /* ip-stride: the third access with the same stride from one
+     * instruction fetches the next one.  Accesses made by other
+     * instructions in between do not disturb its training.
+     */
+    config.prefetchers[1] = PF_IP_STRIDE;
+    init_config(&config);
+    cc = (CacheCC){};
+    for (b = 0; b < 3; b++) {
+        read_block_at(b * 4, 0x1000, &cc);
+        read_block_at(32 + b * 3, 0x2004 + b * 4, &cc);
+    }
+    check(cc.pf == 0, "ip-stride: training");
+    read_block_at(12, 0x1000, &cc);
+    check(cc.pf == 1 && in_D1(16), "ip-stride: stride of 4 lines");
+
+    /* stream: three misses on adjacent lines fetch the next four, but
+     * not across a 4K region.
+     */
+    config.prefetchers[1] = PF_STREAM;
+    init_config(&config);
+    cc = (CacheCC){};
+    read_block_at(64, 0, &cc);
+    read_block_at(65, 0, &cc);
+    check(cc.pf == 0, "stream: training");
+    read_block_at(66, 0, &cc);
+    check(cc.pf == 4 && in_D1(67) && in_D1(70) && !in_D1(71), "stream: ascending");
+    read_block_at(125, 0, &cc);
+    read_block_at(126, 0, &cc);
+    read_block_at(127, 0, &cc);
+    check(cc.pf == 4 && !in_D1(128), "stream: region end");
+
+    printf("*** Prefetchers test - OK.\n");
+}
+
+/* A small TLB hierarchy: 4K pages, then huge pages under --tlb-pages=thp. */
+void test_tlb()
+{
+    cache_t c = {.assoc = 8, .line_size = 64, .size = 64 * 64};
+    CacheCC cc = {};
+
+    printf("*** TLB test...\n");
+    init_caches(c, c, c);
+    tlb_parse_array("--ITLB", "2,2,4K", TLB_I);
+    tlb_parse_array("--DTLB", "4,2,4K", TLB_D);
+    tlb_parse_array("--DTLB", "2,2,2M", TLB_D);
+    tlb_parse_array("--STLB", "8,2,4K+2M", TLB_S);
+    tlbsim_init(0);
+    tlbsim_fprint_desc(stdout);
+
+#define READ(a) cachesim_D1_doref(a, 4, &cc, ACCESS_READ, 0)
+#define TLB(m, w, what) check(cc.tm == m && cc.tw == w, what)
+    READ(0 << 12);
+    READ(1 << 12);
+    READ(2 << 12);
+    READ(3 << 12);
+    TLB(4, 4, "4K: DTLB and STLB misses");
+    READ(0 << 12);
+    TLB(4, 4, "4K: DTLB hit");
+    READ(4 << 12);
+    TLB(5, 5, "4K: DTLB evicts the lru page");
+    READ(2 << 12);
+    TLB(6, 5, "4K: STLB hit");
+    READ((8 << 12) - 2);
+    TLB(7, 6, "4K: one miss for two pages");
+    cachesim_I1_doref_Gen(4 << 12, 4, &cc);
+    TLB(8, 6, "4K: ITLB miss");
+
+    /* The mapping covers the 2M page at 2M but not the one at 4M. */
+    clo_tlb_pages = TLB_PAGES_THP;
+    test_region = (RegionInterval){.start = 0x200000, .end = 0x4fffff, .kind = REGION_HEAP, .thp = True};
+    segmap_generation++;
+    cc = (CacheCC){};
+    READ(0x200000);
+    READ(0x3ff000);
+    TLB(1, 1, "thp: one 2M page");
+    READ(0x400000);
+    READ(0x401000);
+    TLB(3, 3, "thp: 4K pages past the mapping");
+#undef READ
+#undef TLB
+
+    printf("*** TLB test - OK.\n");
+}
+
+/* Runs the conditional branch predictor 'p' on a loop of 'trips' iterations,
+ * 'n' times over, and returns its mispredicts in the second half.  The loop
+ * branch is taken trips - 1 times and then falls through.
+ */
+ULong run_cond_predictor(CondPredictor p, Int trips, Int n)
+{
+    ULong misses = 0;
+    Int i, j;
+
+    clo_cond_predictor = p;
+    clo_cond_predictor_bits = 0;
+    branchpred_init();
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < trips; j++) {
+            ULong m = do_cond_branch_predict(0x1000, j < trips - 1);
+            if (i >= n / 2)
+                misses += m;
+        }
+    }
+    return misses;
+}
+
+/* Runs the indirect branch predictor 'p' on two indirect branches: the one
+ * at 0x2000 goes round four targets, and the one at 0x2100 goes to a
+ * target chosen by where the first went.  Returns the mispredicts in the
+ * second half.
+ */
+ULong run_ind_predictor(IndPredictor p, Int n)
+{
+    ULong misses = 0;
+    Int i;
+
+    clo_ind_predictor = p;
+    clo_ind_predictor_bits = 9;
+    branchpred_init();
+    for (i = 0; i < n; i++) {
+        ULong m = do_ind_branch_predict(0x2000, 0x3000 + (i % 4) * 0x10);
+        m += do_ind_branch_predict(0x2100, 0x4000 + (i % 4) * 0x28);
+        if (i >= n / 2)
+            misses += m;
+    }
+    return misses;
+}
+
+void test_branch_predictors()
+{
+    ULong gshare, tage, perceptron, btac_misses, path_misses;
+
+    printf("*** Branch predictors test...\n");
+
+    /* A loop of 2 alternates: all of them learn it. */
+    gshare = run_cond_predictor(COND_GSHARE, 2, 2000);
+    tage = run_cond_predictor(COND_TAGE, 2, 2000);
+    perceptron = run_cond_predictor(COND_PERCEPTRON, 2, 2000);
+    printf("loop of 2: gshare %llu tage %llu perceptron %llu\n", gshare, tage, perceptron);
+    check(gshare == 0 && tage == 0 && perceptron == 0, "alternating");
+
+    /* A loop of 20: the previous exit is past gshare's 7 bits of history,
+     * so it mispredicts every exit; the longer histories of the other two
+     * learn it.
+     */
+    gshare = run_cond_predictor(COND_GSHARE, 20, 2000);
+    tage = run_cond_predictor(COND_TAGE, 20, 2000);
+    perceptron = run_cond_predictor(COND_PERCEPTRON, 20, 2000);
+    printf("loop of 20: gshare %llu tage %llu perceptron %llu\n", gshare, tage, perceptron);
+    check(gshare >= 1000, "loop: gshare");
+    check(tage <= 10 && perceptron <= 10, "loop: tage and perceptron");
+
+    /* The second indirect branch only has a pattern given the path to it. */
+    btac_misses = run_ind_predictor(IND_BTAC, 2000);
+    path_misses = run_ind_predictor(IND_PATH, 2000);
+    printf("indirect: btac %llu path %llu\n", btac_misses, path_misses);
+    check(btac_misses == 2000, "indirect: btac");
+    check(path_misses == 0, "indirect: path");
+
+    printf("*** Branch predictors test - OK.\n");
+}
+
 int main(int argc, char **argv)
 {
     test_count_bits();
@@ -330,5 +789,11 @@ int main(int argc, char **argv)
     test_caches();
     test_word_usage();
     test_array();
+    test_cores();
+    test_levels();
+    test_policies();
+    test_prefetchers();
+    test_tlb();
+    test_branch_predictors();
     return 0;
 }
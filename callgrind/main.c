@@ -2015,6 +2015,20 @@ static void clg_start_client_code_callback ( ThreadId tid, ULong blocks_done )
    CLG_(run_thread)( tid );
 }
 
+/* The options of the branch predictors in cg_branchpred.c. */
+static Bool clg_process_cmd_line_option(const HChar* arg)
+{
+   return branchpred_process_option(arg)
+          || CLG_(process_cmd_line_option)(arg);
+}
+
+static void clg_print_usage(void)
+{
+   CLG_(print_usage)();
+   VG_(printf)("\n   branch prediction options (with --branch-sim=yes):\n");
+   branchpred_print_usage();
+}
+
 static
 void CLG_(post_clo_init)(void)
 {
@@ -2081,6 +2095,8 @@ void CLG_(post_clo_init)(void)
    CLG_(init_dumps)();
 
    (*CLG_(cachesim).post_clo_init)();
+   if (CLG_(clo).simulate_branch)
+      branchpred_init();
 
    CLG_(init_eventsets)();
    CLG_(init_statistics)(& CLG_(stat));
@@ -2129,8 +2145,8 @@ void CLG_(pre_clo_init)(void)
     VG_(needs_superblock_discards)(clg_discard_superblock_info);
 
 
-    VG_(needs_command_line_options)(CLG_(process_cmd_line_option),
-				    CLG_(print_usage),
+    VG_(needs_command_line_options)(clg_process_cmd_line_option,
+				    clg_print_usage,
 				    CLG_(print_debug_usage));
 
     VG_(needs_client_requests)(CLG_(handle_client_request));
@@ -339,6 +339,7 @@ static void free_DebugInfo ( DebugInfo* di )
    if (di->fsm.filename) ML_(dinfo_free)(di->fsm.filename);
    if (di->fsm.dbgname)  ML_(dinfo_free)(di->fsm.dbgname);
    if (di->soname)       ML_(dinfo_free)(di->soname);
+   if (di->buildid)      ML_(dinfo_free)(di->buildid);
    if (di->loctab)       ML_(dinfo_free)(di->loctab);
    if (di->loctab_fndn_ix) ML_(dinfo_free)(di->loctab_fndn_ix);
    if (di->inltab)       ML_(dinfo_free)(di->inltab);
@@ -4863,6 +4864,11 @@ const HChar* VG_(DebugInfo_get_filename)(const DebugInfo* di)
    return di->fsm.filename;
 }
 
+const HChar* VG_(DebugInfo_get_buildid)(const DebugInfo* di)
+{
+   return di->buildid;
+}
+
 PtrdiffT VG_(DebugInfo_get_text_bias)(const DebugInfo* di)
 {
    return di->text_present ? di->text_bias : 0;
@@ -685,6 +685,10 @@ struct _DebugInfo {
    /* The file's soname. */
    HChar* soname;
 
+   /* The ELF build-id of the main object as a lowercase hex string,
+      or NULL if it has none. */
+   HChar* buildid;
+
    /* Description of some important mapped segments.  The presence or
       absence of the mapping is denoted by the _present field, since
       in some obscure circumstances (to do with data/sdata/bss) it is
@@ -3043,10 +3043,12 @@ Bool ML_(read_elf_debug_info) ( struct _DebugInfo* di )
          }
       }
 
-      if (buildid) {
-         ML_(dinfo_free)(buildid);
-         buildid = NULL; /* paranoia */
-      }
+      /* Keep the build-id; the persistent translation cache uses it
+         to recognise this object in later runs. */
+      if (di->buildid)
+         ML_(dinfo_free)(di->buildid);
+      di->buildid = buildid;
+      buildid = NULL; /* paranoia */
 
       /* As a last-ditch measure, try looking for in the
          --extra-debuginfo-path and/or on the --debuginfo-server, but
@@ -529,6 +529,11 @@ static VgVgdb VG_(gdbserver_instrumentation_needed) (const VexGuestExtents* vge)
    return Vg_VgdbNo;
 }
 
+Bool VG_(gdbserver_instruments) (const VexGuestExtents* vge)
+{
+   return VG_(gdbserver_instrumentation_needed) (vge) != Vg_VgdbNo;
+}
+
 // Clear gdbserved_addresses in gs_addresses.
 // If clear_only_jumps, clears only the addresses that are served
 // for jump reasons.
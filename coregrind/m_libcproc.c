@@ -27,6 +27,7 @@
 */
 
 #include "pub_core_basics.h"
+#include "pub_core_aspacemgr.h"
 #include "pub_core_machine.h"    // For VG_(machine_get_VexArchInfo)
 #include "pub_core_vki.h"
 #include "pub_core_vkiscnums.h"
@@ -279,6 +280,26 @@ void VG_(env_remove_valgrind_env_stuff)(HChar** envp, Bool ro_strings,
    VG_(free)(buf);
 }
 
+/* Removes the tool's vgpreload module, which the core put there when it
+   set up the client's environment, from the client's LD_PRELOAD.  Used
+   when the tool does not want the module in this run; the client must
+   not have started yet. */
+void VG_(env_remove_tool_preload)(HChar** envp, const HChar* toolname)
+{
+   Int i;
+   Int len = VG_(strlen)(VG_(LD_PRELOAD_var_name));
+   HChar buf[VG_(strlen)(VG_(libdir)) + VG_(strlen)(toolname)
+             + VG_(strlen)(VG_PLATFORM) + 16];
+
+   VG_(sprintf)(buf, "%s/vgpreload_%s-%s.so",
+                VG_(libdir), toolname, VG_PLATFORM);
+   for (i = 0; envp[i] != NULL; i++) {
+      if (VG_(strncmp)(envp[i], VG_(LD_PRELOAD_var_name), len) == 0
+          && envp[i][len] == '=')
+         mash_colon_env(&envp[i][len + 1], buf);
+   }
+}
+
 /* Resolves filename of VG_(cl_exec_fd) and copies it to the buffer.
    Buffer must not be NULL and buf_size must be at least 1.
    If buffer is not large enough it is terminated with '\0' only
@@ -1184,15 +1205,207 @@ void VG_(do_atfork_parent)(ThreadId tid)
          (*atforks[i].parent)(tid);
 }
 
+static void forget_helpers ( void );
+
 void VG_(do_atfork_child)(ThreadId tid)
 {
    Int i;
 
+   forget_helpers();
    for (i = 0; i < n_atfork; i++)
       if (atforks[i].child != NULL)
          (*atforks[i].child)(tid);
 }
 
+/* ---------------------------------------------------------------------
+   Helper processes
+   ------------------------------------------------------------------ */
+
+/* A helper is the grandchild of Valgrind's process: the intermediate
+   child exits at once and is reaped here, so the helper is reparented
+   and never shows up in the client's wait() calls.  Two pipes connect
+   it to Valgrind.  The helper sees EOF on "stop" once Valgrind closes
+   its end, which also happens when Valgrind dies or execs (the fd is
+   close-on-exec).  Valgrind sees EOF on "exited" once the helper has
+   exited, since only the helper holds the write end. */
+
+#define VG_MAX_HELPERS 4
+
+#if !defined(VKI_POLLIN)
+#  define VKI_POLLIN 0x0001   // the same everywhere
+#endif
+
+typedef struct {
+   void* shared;          // NULL if the slot is free
+   SizeT shared_szB;
+   Int   stop_fd;         // write end, in Valgrind
+   Int   exited_fd;       // read end, in Valgrind
+   void  (*pre_stop)(void);
+} Helper;
+
+static Helper helpers[VG_MAX_HELPERS];
+
+// In a helper process: the read end of its "stop" pipe.
+static Int helper_stop_fd = -1;
+
+static void* map_shared ( SizeT szB )
+{
+   const HChar* part = "helper-shm";
+   HChar* name = VG_(malloc)("helper.shm.name",
+                             VG_(mkstemp_fullname_bufsz)(VG_(strlen)(part)));
+   UChar zero = 0;
+   SysRes sres = VG_(mk_SysRes_Error)(VKI_ENOMEM);
+   Int fd = VG_(mkstemp)(part, name);
+
+   if (fd >= 0) {
+      // Give the file its size, then map it shared.  The name is not
+      // needed once the file is mapped.
+      if (VG_(lseek)(fd, szB - 1, VKI_SEEK_SET) >= 0
+          && VG_(write)(fd, &zero, 1) == 1)
+         sres = VG_(am_shared_mmap_file_float_valgrind)
+                   (szB, VKI_PROT_READ | VKI_PROT_WRITE, fd, 0);
+      VG_(close)(fd);
+      VG_(unlink)(name);
+   }
+   VG_(free)(name);
+   return sr_isError(sres) ? NULL : (void*)sr_Res(sres);
+}
+
+void* VG_(start_helper) ( SizeT shared_szB, void (*fn)(void* shared),
+                          void (*pre_stop)(void) )
+{
+   Helper* h = NULL;
+   Int stop[2], exited[2];
+   Int i, pid, status;
+   void* shared;
+
+   for (i = 0; i < VG_MAX_HELPERS; i++)
+      if (helpers[i].shared == NULL) {
+         h = &helpers[i];
+         break;
+      }
+   if (h == NULL)
+      return NULL;
+
+   shared_szB = VG_PGROUNDUP(shared_szB);
+   shared = map_shared(shared_szB);
+   if (shared == NULL)
+      return NULL;
+   if (VG_(pipe)(stop) != 0) {
+      VG_(am_munmap_valgrind)((Addr)shared, shared_szB);
+      return NULL;
+   }
+   if (VG_(pipe)(exited) != 0) {
+      VG_(close)(stop[0]);
+      VG_(close)(stop[1]);
+      VG_(am_munmap_valgrind)((Addr)shared, shared_szB);
+      return NULL;
+   }
+
+   pid = VG_(fork)();
+   if (pid == 0) {
+      vki_sigset_t all;
+
+      if (VG_(fork)() != 0)
+         VG_(exit_now)(0);
+      /* The helper.  It must not take any of the client's signals,
+         and must not run any of the cleanup VG_(exit) does on behalf
+         of Valgrind's process. */
+      VG_(sigfillset)(&all);
+      VG_(sigprocmask)(VKI_SIG_SETMASK, &all, NULL);
+      VG_(close)(stop[1]);
+      VG_(close)(exited[0]);
+      helper_stop_fd = stop[0];
+      fn(shared);
+      VG_(exit_now)(0);
+      /*NOTREACHED*/
+   }
+
+   VG_(close)(stop[0]);
+   VG_(close)(exited[1]);
+   if (pid < 0 || VG_(waitpid)(pid, &status, 0) != pid) {
+      VG_(close)(stop[1]);
+      VG_(close)(exited[0]);
+      VG_(am_munmap_valgrind)((Addr)shared, shared_szB);
+      return NULL;
+   }
+   // The client must not see, or be able to close, these fds.
+   h->stop_fd = VG_(safe_fd)(stop[1]);
+   h->exited_fd = VG_(safe_fd)(exited[0]);
+   h->shared = shared;
+   h->shared_szB = shared_szB;
+   h->pre_stop = pre_stop;
+   return shared;
+}
+
+Bool VG_(helper_should_stop) ( Int wait_ms )
+{
+   struct vki_pollfd pfd;
+   SysRes sres;
+
+   vg_assert(helper_stop_fd >= 0);
+   pfd.fd = helper_stop_fd;
+   pfd.events = VKI_POLLIN;
+   pfd.revents = 0;
+   sres = VG_(poll)(&pfd, 1, wait_ms);
+   return !sr_isError(sres) && sr_Res(sres) > 0;
+}
+
+static void stop_helper ( Helper* h )
+{
+   HChar c;
+
+   if (h->stop_fd < 0)
+      return;
+   if (h->pre_stop)
+      h->pre_stop();
+   VG_(close)(h->stop_fd);
+   h->stop_fd = -1;
+   while (VG_(read)(h->exited_fd, &c, 1) > 0)
+      ;
+   VG_(close)(h->exited_fd);
+   h->exited_fd = -1;
+}
+
+void VG_(stop_helper) ( void* shared )
+{
+   Int i;
+
+   for (i = 0; i < VG_MAX_HELPERS; i++)
+      if (helpers[i].shared != NULL && helpers[i].shared == shared) {
+         stop_helper(&helpers[i]);
+         return;
+      }
+   vg_assert(0);
+}
+
+void VG_(stop_all_helpers) ( void )
+{
+   Int i;
+
+   for (i = 0; i < VG_MAX_HELPERS; i++)
+      if (helpers[i].shared != NULL)
+         stop_helper(&helpers[i]);
+}
+
+// In a child the client forked: the helpers belong to the parent.
+static void forget_helpers ( void )
+{
+   Int i;
+
+   for (i = 0; i < VG_MAX_HELPERS; i++) {
+      Helper* h = &helpers[i];
+      if (h->shared == NULL)
+         continue;
+      if (h->stop_fd >= 0)
+         VG_(close)(h->stop_fd);
+      if (h->exited_fd >= 0)
+         VG_(close)(h->exited_fd);
+      VG_(am_munmap_valgrind)((Addr)h->shared, h->shared_szB);
+      VG_(memset)(h, 0, sizeof(*h));
+   }
+}
+
 /* ---------------------------------------------------------------------
    FreeBSD sysctlbyname(), modfind(), etc
    ------------------------------------------------------------------ */
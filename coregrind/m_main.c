@@ -183,6 +183,13 @@ static void usage_NORETURN ( int need_help )
 "                              checks for self-modifying code: none, only for\n"
 "                              code found in stacks, for all code, or for all\n"
 "                              code except that from file-backed mappings\n"
+"    --translation-cache=<dir> save translations of ELF objects with a build-id\n"
+"                              in <dir> and reuse them in later runs of the\n"
+"                              same tool with the same options, for tools\n"
+"                              that support it (Memcheck, Nulgrind) [none]\n"
+"    --hot-sb-threshold=<number> retranslate superblocks run <number> times\n"
+"                              between two profile scans as longer, more\n"
+"                              optimised superblocks [0 = never]\n"
 "    --read-inline-info=yes|no read debug info about inlined function calls\n"
 "                              and use it to do better stack traces.\n"
 "                              [yes] on Linux/Android/Solaris for the tools\n"
@@ -202,7 +209,13 @@ static void usage_NORETURN ( int need_help )
 "         where hint is one of:\n"
 "           lax-ioctls lax-doors fuse-compatible enable-outer\n"
 "           no-inner-prefix no-nptl-pthread-stackcache fallback-llsc none\n"
-"    --fair-sched=no|yes|try   schedule threads fairly on multicore systems [no]\n"
+"    --fair-sched=no|yes|try|handoff  schedule threads fairly on multicore\n"
+"                              systems; handoff wakes one chosen thread [no]\n"
+"    --sched-quantum=<number>  basic blocks a thread runs before others may\n"
+"                              be scheduled; smaller is finer grained [100000]\n"
+"    --sched-affinity-slice=<microseconds>  with --fair-sched=handoff, how\n"
+"                              long a thread that last ran on the releasing\n"
+"                              CPU may go ahead of longer waiters [2000]\n"
 "    --kernel-variant=variant1,variant2,...\n"
 "         handle non-standard kernel variants [none]\n"
 "         where variant is one of:\n"
@@ -212,6 +225,8 @@ static void usage_NORETURN ( int need_help )
 "           program counters in max <number> frames) [0]\n"
 "    --num-transtab-sectors=<number> size of translated code cache [%d]\n"
 "           more sectors may increase performance, but use more memory.\n"
+"    --max-transtab-sectors=<number> let the cache grow up to <number>\n"
+"           sectors when code is retranslated a lot [no growth]\n"
 "    --avg-transtab-entry-size=<number> avg size in bytes of a translated\n"
 "           basic block [0, meaning use tool provided default]\n"
 "    --aspace-minaddr=0xPP     avoid mapping memory below 0xPP [guessed]\n"
@@ -631,10 +646,16 @@ static void process_option (Clo_Mode mode,
          VG_(clo_fair_sched) = try_fair_sched;
       else if (VG_(strcmp)(tmp_str, "no") == 0)
          VG_(clo_fair_sched) = disable_fair_sched;
+      else if (VG_(strcmp)(tmp_str, "handoff") == 0)
+         VG_(clo_fair_sched) = handoff_fair_sched;
       else
          VG_(fmsg_bad_option)(arg,
-            "Bad argument, should be 'yes', 'try' or 'no'\n");
+            "Bad argument, should be 'yes', 'try', 'handoff' or 'no'\n");
    }
+   else if VG_BINT_CLO(arg, "--sched-quantum", VG_(clo_sched_quantum),
+                       1, 100000000) {}
+   else if VG_BINT_CLO(arg, "--sched-affinity-slice",
+                       VG_(clo_sched_affinity_slice), 0, 10000000) {}
    else if VG_BOOL_CLOM(cloPD, arg, "--trace-sched",      VG_(clo_trace_sched)) {}
    else if VG_BOOL_CLOM(cloPD, arg, "--trace-signals",    VG_(clo_trace_signals)) {}
    else if VG_BOOL_CLOM(cloPD, arg, "--trace-symtab",     VG_(clo_trace_symtab)) {}
@@ -678,6 +699,9 @@ static void process_option (Clo_Mode mode,
    else if VG_BINT_CLO(arg, "--num-transtab-sectors",
                        VG_(clo_num_transtab_sectors),
                        MIN_N_SECTORS, MAX_N_SECTORS) {}
+   else if VG_BINT_CLO(arg, "--max-transtab-sectors",
+                       VG_(clo_max_transtab_sectors),
+                       MIN_N_SECTORS, MAX_N_SECTORS) {}
    else if VG_BINT_CLO(arg, "--avg-transtab-entry-size",
                        VG_(clo_avg_transtab_entry_size),
                        50, 5000) {}
@@ -693,6 +717,12 @@ static void process_option (Clo_Mode mode,
                        VG_(clo_smc_check), Vg_SmcAll) {}
    else if VG_XACT_CLO(arg, "--smc-check=all-non-file",
                        VG_(clo_smc_check), Vg_SmcAllNonFile) {}
+   else if VG_STR_CLO (arg, "--translation-cache",
+                       VG_(clo_translation_cache)) {}
+   /* The scheduler looks for hot superblocks every 5,000,000 of them
+      (HOT_SB_INTERVAL), so no bigger threshold can be reached. */
+   else if VG_BINT_CLO(arg, "--hot-sb-threshold",
+                       VG_(clo_hot_sb_threshold), 0, 5000000) {}
 
    else if VG_USETX_CLO (arg, "--kernel-variant",
                          "bproc,"
@@ -1028,6 +1058,12 @@ void main_process_cmd_line_options( void )
          "Can't use --gen-suppressions= with %s\n"
          "because it doesn't generate errors.\n", VG_(details).name);
    }
+   if (VG_(clo_hot_sb_threshold) > 0 && VG_(clo_profyle_sbs)) {
+      VG_(clo_hot_sb_threshold) = 0;
+      VG_(fmsg_bad_option)("--hot-sb-threshold",
+         "--hot-sb-threshold= and --profile-flags= both use the\n"
+         "superblock profile counters, so can't be used together.\n");
+   }
    if ((VG_(clo_exit_on_first_error)) &&
        (VG_(clo_error_exitcode)==0)) {
       VG_(fmsg_bad_option)("--exit-on-first-error=yes",
@@ -1781,6 +1817,16 @@ Int valgrind_main ( Int argc, HChar **argv, HChar **envp )
       }
    }
 
+   //--------------------------------------------------------------
+   // Take the tool's vgpreload module out of the client's LD_PRELOAD,
+   // if the tool does not want it in this run.  The client has not
+   // started yet, so its dynamic linker never loads the module.
+   //   p: tool_post_clo_init [for VG_(needs).no_preload]
+   //   p: ii_create_image    [for VG_(client_envp)]
+   //--------------------------------------------------------------
+   if (VG_(needs).no_preload)
+      VG_(env_remove_tool_preload)(VG_(client_envp), VG_(clo_toolname));
+
    //--------------------------------------------------------------
    // Initialise translation table and translation cache
    //   p: aspacem         [??]
@@ -2264,6 +2310,9 @@ void shutdown_actions_NORETURN( ThreadId tid,
    if (VG_(clo_track_fds))
       VG_(show_open_fds)("at exit");
 
+   /* Write out the translations made by this run, if asked to. */
+   VG_(save_persistent_tt)();
+
    /* Call the tool's finalisation function.  This makes Memcheck's
       leak checker run, and possibly chuck a bunch of leak errors into
       the error management machinery. */
@@ -150,6 +150,8 @@ Bool   VG_(clo_debug_dump_frames) = False;
 Bool   VG_(clo_trace_redir)    = False;
 enum FairSchedType
        VG_(clo_fair_sched)     = disable_fair_sched;
+UInt   VG_(clo_sched_quantum)  = 100000;
+UInt   VG_(clo_sched_affinity_slice) = 2000;
 Bool   VG_(clo_trace_sched)    = False;
 Bool   VG_(clo_profile_heap)   = False;
 UInt   VG_(clo_progress_interval) = 0; /* in seconds, 1 .. 3600,
@@ -203,6 +205,9 @@ VgSmc VG_(clo_smc_check) = Vg_SmcStack;
 #  error "Unknown arch"
 #endif
 
+const HChar* VG_(clo_translation_cache) = NULL;
+ULong VG_(clo_hot_sb_threshold) = 0;
+
 #if defined(VGO_darwin)
 UInt VG_(clo_resync_filter) = 1; /* enabled, but quiet */
 #else
@@ -0,0 +1,397 @@
+/*--------------------------------------------------------------------*/
+/*--- Linux direct-handoff lock implementation                     ---*/
+/*---                                         handoff-lock-linux.c ---*/
+/*---                                                              ---*/
+/*--- The releasing thread picks exactly one successor and makes   ---*/
+/*--- it the owner before waking it, so the lock is never up for   ---*/
+/*--- grabs while threads are waiting.  The successor is normally  ---*/
+/*--- the longest waiter, but a waiter that last ran on the        ---*/
+/*--- releasing thread's CPU may overtake it for a bounded time.   ---*/
+/*--------------------------------------------------------------------*/
+
+/*
+   This file is part of Valgrind, a dynamic binary instrumentation
+   framework.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+#include "pub_core_basics.h"
+#include "pub_core_libcassert.h"
+#include "pub_core_libcbase.h"     // VG_(memset)()
+#include "pub_core_libcprint.h"
+#include "pub_core_syscall.h"
+#include "pub_core_vki.h"
+#include "pub_core_vkiscnums.h"    // __NR_futex
+#include "pub_core_libcproc.h"
+#include "pub_core_mallocfree.h"
+#include "pub_core_options.h"      // VG_(clo_sched_affinity_slice)
+#include "pub_core_threadstate.h"
+#include "pub_core_inner.h"
+#if defined(ENABLE_INNER_CLIENT_REQUEST)
+#include "helgrind/helgrind.h"
+#endif
+#include "priv_sched-lock.h"
+#include "priv_sched-lock-impl.h"
+
+/*
+ * A thread that finds the lock taken queues a waiter record on its own
+ * stack and sleeps on the record's futex word.  The record stays valid
+ * until that word becomes non-zero, which only the releasing thread
+ * does, after it has unlinked the record and made its thread the owner.
+ * The wait list and the owner field are protected by a small spin lock
+ * ("guard") that is only ever held for a handful of instructions.
+ */
+struct waiter {
+   struct waiter *next;
+   volatile unsigned granted;   // the futex word
+   int lwpid;
+   int cpu;                     // CPU the waiter last ran on, or -1
+   ULong since;                 // when it started waiting, in us
+};
+
+/* Lock wait times per thread, in log4 microsecond buckets:
+   <4us, <16us, <64us, <256us, <1ms, <4ms, <16ms and anything longer. */
+#define HL_N_BUCKETS 8
+
+struct thread_waits {
+   int lwpid;                   // 0 for an unused slot
+   ThreadId tid;                // 0 until the thread is known to the core
+   ULong n_uncontended;
+   ULong n_waits;
+   ULong total_us;
+   ULong max_us;
+   ULong bucket[HL_N_BUCKETS];
+};
+
+struct sched_lock {
+   volatile int guard;
+   volatile int owner;
+   struct waiter *head;
+   struct waiter *tail;
+   volatile unsigned n_waiters;
+   /* Statistics; only touched by the owner. */
+   ULong n_handoffs;
+   ULong n_affine;              // handed to a same-CPU waiter out of order
+   ULong n_slice_expired;       // affinity denied: head waited too long
+   UInt waits_size;             // power of 2
+   struct thread_waits *waits;  // open-addressed, keyed by lwpid
+   struct thread_waits waits_overflow;
+};
+
+static const HChar *get_sched_lock_name(void)
+{
+   return "handoff lock";
+}
+
+static struct sched_lock *create_sched_lock(void)
+{
+   struct sched_lock *p;
+   UInt size;
+
+   p = VG_(malloc)("sched_lock", sizeof(*p));
+   VG_(memset)(p, 0, sizeof(*p));
+
+   // The futex syscall requires that a futex takes four bytes.
+   vg_assert(sizeof(((struct waiter *)0)->granted) == 4);
+
+   // Room for twice the maximum number of threads keeps probes short.
+   for (size = 64; size < 2 * VG_N_THREADS; size *= 2)
+      ;
+   p->waits_size = size;
+   p->waits = VG_(calloc)("sched_lock.waits", size, sizeof(p->waits[0]));
+
+   INNER_REQUEST(ANNOTATE_RWLOCK_CREATE(p));
+   INNER_REQUEST(ANNOTATE_BENIGN_RACE_SIZED(&p->n_waiters,
+                                            sizeof(p->n_waiters), ""));
+   return p;
+}
+
+static void destroy_sched_lock(struct sched_lock *p)
+{
+   INNER_REQUEST(ANNOTATE_RWLOCK_DESTROY(p));
+   VG_(free)(p->waits);
+   VG_(free)(p);
+}
+
+static int get_sched_lock_owner(struct sched_lock *p)
+{
+   return p->owner;
+}
+
+static void guard_lock(struct sched_lock *p)
+{
+   UInt spins = 0;
+
+   while (__sync_lock_test_and_set(&p->guard, 1)) {
+      // The holder may have been preempted; don't burn a whole slice.
+      while (p->guard)
+         if (++spins % 128 == 0)
+            VG_(do_syscall0)(__NR_sched_yield);
+   }
+}
+
+static void guard_unlock(struct sched_lock *p)
+{
+   __sync_lock_release(&p->guard);
+}
+
+static ULong now_us(void)
+{
+   struct vki_timespec ts;
+   SysRes sres;
+
+   sres = VG_(do_syscall2)(__NR_clock_gettime, VKI_CLOCK_MONOTONIC,
+                           (UWord)&ts);
+   if (sr_isError(sres))
+      return 0;
+   return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int current_cpu(void)
+{
+   unsigned cpu;
+   SysRes sres;
+
+   sres = VG_(do_syscall3)(__NR_getcpu, (UWord)&cpu, 0, 0);
+   return sr_isError(sres) ? -1 : (int)cpu;
+}
+
+static struct thread_waits *get_thread_waits(struct sched_lock *p, int lwpid)
+{
+   UInt mask = p->waits_size - 1;
+   UInt i, n;
+
+   for (i = (UInt)lwpid * 2654435761U & mask, n = 0; n < p->waits_size;
+        i = (i + 1) & mask, n++) {
+      if (p->waits[i].lwpid == lwpid)
+         break;
+      if (p->waits[i].lwpid == 0) {
+         p->waits[i].lwpid = lwpid;
+         break;
+      }
+   }
+   if (n == p->waits_size) {
+      // More threads than slots over the run; lump the rest together.
+      return &p->waits_overflow;
+   }
+   /* A new thread takes the lock before the core records its lwpid, and
+      an exited thread's lwpid is cleared, so look the tid up while the
+      thread is alive and we hold the lock. */
+   if (p->waits[i].tid == 0)
+      p->waits[i].tid = VG_(lwpid_to_vgtid)(lwpid);
+   return &p->waits[i];
+}
+
+static void record_wait(struct thread_waits *tw, ULong us)
+{
+   UInt b;
+
+   tw->n_waits++;
+   tw->total_us += us;
+   if (us > tw->max_us)
+      tw->max_us = us;
+   for (b = 0; b < HL_N_BUCKETS - 1 && us >= (4ULL << (2 * b)); b++)
+      ;
+   tw->bucket[b]++;
+}
+
+/*
+ * Acquire the lock.  If it is free and nobody is queued, take it.
+ * Otherwise queue up and sleep until the releasing thread has made us
+ * the owner; there is no retry, the lock is handed over, not contended
+ * for.
+ */
+static void acquire_sched_lock(struct sched_lock *p)
+{
+   struct waiter w;
+   int lwpid = VG_(gettid)();
+   SysRes sres;
+
+   guard_lock(p);
+   if (p->owner == 0 && p->head == NULL) {
+      p->owner = lwpid;
+      guard_unlock(p);
+      __sync_synchronize();
+      INNER_REQUEST(ANNOTATE_RWLOCK_ACQUIRED(p, /*is_w*/1));
+      get_thread_waits(p, lwpid)->n_uncontended++;
+      return;
+   }
+   guard_unlock(p);
+
+   // System calls are kept out of the guarded section.
+   w.next = NULL;
+   w.granted = 0;
+   w.lwpid = lwpid;
+   w.cpu = VG_(clo_sched_affinity_slice) > 0 ? current_cpu() : -1;
+   w.since = now_us();
+
+   guard_lock(p);
+   if (p->owner == 0 && p->head == NULL) {
+      // Released while we were getting ready.
+      p->owner = lwpid;
+      w.granted = 1;
+   } else {
+      if (p->tail)
+         p->tail->next = &w;
+      else
+         p->head = &w;
+      p->tail = &w;
+      p->n_waiters++;
+   }
+   guard_unlock(p);
+
+   while (!w.granted) {
+      sres = VG_(do_syscall3)(__NR_futex, (UWord)&w.granted,
+                              VKI_FUTEX_WAIT | VKI_FUTEX_PRIVATE_FLAG, 0);
+      if (sr_isError(sres) && sr_Err(sres) != VKI_EAGAIN
+          && sr_Err(sres) != VKI_EINTR) {
+         VG_(printf)("futex_wait() returned error code %lu\n", sr_Err(sres));
+         vg_assert(False);
+      }
+   }
+   __sync_synchronize();
+   INNER_REQUEST(ANNOTATE_RWLOCK_ACQUIRED(p, /*is_w*/1));
+   vg_assert(p->owner == lwpid);
+   record_wait(get_thread_waits(p, lwpid), now_us() - w.since);
+}
+
+/*
+ * Release the lock.  If threads are waiting, choose one, make it the
+ * owner and wake it, and only it.  The longest waiter is chosen unless
+ * another waiter last ran on this CPU and the longest waiter has been
+ * waiting for less than --sched-affinity-slice microseconds.
+ */
+static void release_sched_lock(struct sched_lock *p)
+{
+   struct waiter *w, *prev, *chosen, *chosen_prev;
+   volatile unsigned *futex;
+   Bool affine = VG_(clo_sched_affinity_slice) > 0 && p->n_waiters > 1;
+   int cpu = affine ? current_cpu() : -1;
+   ULong now = affine ? now_us() : 0;
+   SysRes sres;
+
+   vg_assert(p->owner != 0);
+   INNER_REQUEST(ANNOTATE_RWLOCK_RELEASED(p, /*is_w*/1));
+
+   guard_lock(p);
+   chosen = p->head;
+   chosen_prev = NULL;
+   if (chosen == NULL) {
+      p->owner = 0;
+      guard_unlock(p);
+      return;
+   }
+   if (cpu >= 0 && chosen->cpu != cpu && chosen->next) {
+      if (now - chosen->since >= VG_(clo_sched_affinity_slice)) {
+         p->n_slice_expired++;
+      } else {
+         for (prev = chosen, w = chosen->next; w; prev = w, w = w->next) {
+            if (w->cpu == cpu) {
+               chosen_prev = prev;
+               chosen = w;
+               p->n_affine++;
+               break;
+            }
+         }
+      }
+   }
+   if (chosen_prev)
+      chosen_prev->next = chosen->next;
+   else
+      p->head = chosen->next;
+   if (p->tail == chosen)
+      p->tail = chosen_prev;
+   p->n_waiters--;
+   p->n_handoffs++;
+   p->owner = chosen->lwpid;
+   futex = &chosen->granted;
+   guard_unlock(p);
+
+   /* Once granted is set the waiter may return and its record go out
+      of scope.  A wakeup that then lands on a reused stack slot is
+      spurious, which the wait loop tolerates, and a vanished stack
+      makes the wake fail harmlessly. */
+   __sync_synchronize();
+   *futex = 1;
+   sres = VG_(do_syscall3)(__NR_futex, (UWord)futex,
+                           VKI_FUTEX_WAKE | VKI_FUTEX_PRIVATE_FLAG, 1);
+   vg_assert(!sr_isError(sres) || sr_Err(sres) == VKI_EFAULT);
+}
+
+static Int cmp_thread_waits_by_tid(const void *a, const void *b)
+{
+   const struct thread_waits *x = *(const struct thread_waits *const *)a;
+   const struct thread_waits *y = *(const struct thread_waits *const *)b;
+
+   return x->tid < y->tid ? -1 : x->tid > y->tid ? 1 : 0;
+}
+
+static void print_one_thread_waits(const struct thread_waits *tw,
+                                   const HChar *who)
+{
+   static const HChar *const bucket_name[HL_N_BUCKETS] = {
+      "<4us", "<16us", "<64us", "<256us", "<1ms", "<4ms", "<16ms", ">=16ms"
+   };
+   HChar buf[HL_N_BUCKETS * 32];
+   UInt b;
+   Int n;
+
+   for (b = 0, n = 0, buf[0] = 0; b < HL_N_BUCKETS; b++)
+      if (tw->bucket[b])
+         n += VG_(sprintf)(buf + n, " %s:%llu", bucket_name[b],
+                           tw->bucket[b]);
+   VG_(message)(Vg_DebugMsg,
+                "sched lock: %s: %'llu free, %'llu waits, "
+                "mean %lluus, max %lluus;%s\n",
+                who, tw->n_uncontended, tw->n_waits,
+                tw->total_us / tw->n_waits, tw->max_us, buf);
+}
+
+static void print_sched_lock_stats(struct sched_lock *p)
+{
+   struct thread_waits **sorted;
+   HChar who[40];
+   UInt i, n;
+
+   VG_(message)(Vg_DebugMsg,
+                "sched lock: %'llu handoffs, %'llu to a same-CPU waiter, "
+                "%'llu slice expiries\n",
+                p->n_handoffs, p->n_affine, p->n_slice_expired);
+
+   sorted = VG_(malloc)("sched_lock.stats", p->waits_size * sizeof(*sorted));
+   for (i = 0, n = 0; i < p->waits_size; i++)
+      if (p->waits[i].n_waits > 0)
+         sorted[n++] = &p->waits[i];
+   VG_(ssort)(sorted, n, sizeof(*sorted), cmp_thread_waits_by_tid);
+   for (i = 0; i < n; i++) {
+      VG_(sprintf)(who, "tid %u (lwp %d)", sorted[i]->tid, sorted[i]->lwpid);
+      print_one_thread_waits(sorted[i], who);
+   }
+   VG_(free)(sorted);
+   if (p->waits_overflow.n_waits > 0)
+      print_one_thread_waits(&p->waits_overflow, "other threads");
+}
+
+const struct sched_lock_ops ML_(linux_handoff_lock_ops) = {
+   .get_sched_lock_name    = get_sched_lock_name,
+   .create_sched_lock      = create_sched_lock,
+   .destroy_sched_lock     = destroy_sched_lock,
+   .get_sched_lock_owner   = get_sched_lock_owner,
+   .acquire_sched_lock     = acquire_sched_lock,
+   .release_sched_lock     = release_sched_lock,
+   .print_sched_lock_stats = print_sched_lock_stats,
+};
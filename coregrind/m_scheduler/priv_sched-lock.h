@@ -34,7 +34,8 @@
 
 struct sched_lock;
 
-enum SchedLockType { sched_lock_generic, sched_lock_ticket };
+enum SchedLockType { sched_lock_generic, sched_lock_ticket,
+                     sched_lock_handoff };
 
 Bool ML_(set_sched_lock_impl)(const enum SchedLockType t);
 const HChar *ML_(get_sched_lock_name)(void);
@@ -43,6 +44,7 @@ void ML_(destroy_sched_lock)(struct sched_lock *p);
 int ML_(get_sched_lock_owner)(struct sched_lock *p);
 void ML_(acquire_sched_lock)(struct sched_lock *p);
 void ML_(release_sched_lock)(struct sched_lock *p);
+void ML_(print_sched_lock_stats)(struct sched_lock *p);
 
 #endif   // __PRIV_SCHED_LOCK_H
 
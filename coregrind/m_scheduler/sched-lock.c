@@ -40,6 +40,7 @@ static struct sched_lock_ops const *const sched_lock_impl[] = {
    [sched_lock_generic] = &ML_(generic_sched_lock_ops),
 #ifdef ENABLE_LINUX_TICKET_LOCK
    [sched_lock_ticket]  = &ML_(linux_ticket_lock_ops),
+   [sched_lock_handoff] = &ML_(linux_handoff_lock_ops),
 #endif
 };
 
@@ -92,3 +93,9 @@ void ML_(release_sched_lock)(struct sched_lock *p)
 {
    return (sched_lock_ops->release_sched_lock)(p);
 }
+
+void ML_(print_sched_lock_stats)(struct sched_lock *p)
+{
+   if (sched_lock_ops->print_sched_lock_stats)
+      (sched_lock_ops->print_sched_lock_stats)(p);
+}
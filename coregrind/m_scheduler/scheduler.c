@@ -101,10 +101,10 @@
 
 /* ThreadId and ThreadState are defined elsewhere*/
 
-/* Defines the thread-scheduling timeslice, in terms of the number of
-   basic blocks we attempt to run each thread for.  Smaller values
-   give finer interleaving but much increased scheduling overheads. */
-#define SCHEDULING_QUANTUM   100000
+/* The thread-scheduling timeslice, in terms of the number of basic
+   blocks we attempt to run each thread for, is VG_(clo_sched_quantum)
+   (--sched-quantum).  Smaller values give finer interleaving but much
+   increased scheduling overheads. */
 
 /* If False, a fault is Valgrind-internal (ie, a bug) */
 Bool VG_(in_generated_code) = False;
@@ -128,6 +128,10 @@ static void mostly_clear_thread_record ( ThreadId tid );
 static ULong n_scheduling_events_MINOR = 0;
 static ULong n_scheduling_events_MAJOR = 0;
 
+/* Stats: number of chainings not done because making the destination's
+   translation recycled a sector. */
+static ULong n_chainings_abandoned = 0;
+
 /* Stats: number of XIndirs looked up in the fast cache, the number of hits in
    ways 1, 2 and 3, and the number of misses.  The number of hits in way 0 isn't
    recorded because it can be computed from these five numbers. */
@@ -150,6 +154,11 @@ static ULong stats__n_xIndir_misses = 0;
 static UInt sanity_fast_count = 0;
 static UInt sanity_slow_count = 0;
 
+/*
+ * Mutual exclusion object used to serialize threads.
+ */
+static struct sched_lock *the_BigLock;
+
 void VG_(print_scheduler_stats)(void)
 {
    VG_(message)(Vg_DebugMsg,
@@ -176,16 +185,15 @@ void VG_(print_scheduler_stats)(void)
    VG_(message)(Vg_DebugMsg,
       "scheduler: %'llu/%'llu major/minor sched events.\n",
       n_scheduling_events_MAJOR, n_scheduling_events_MINOR);
+   VG_(message)(Vg_DebugMsg,
+      "scheduler: %'llu chainings abandoned after sector recycling.\n",
+      n_chainings_abandoned);
    VG_(message)(Vg_DebugMsg, 
                 "   sanity: %u cheap, %u expensive checks.\n",
                 sanity_fast_count, sanity_slow_count );
+   ML_(print_sched_lock_stats)(the_BigLock);
 }
 
-/*
- * Mutual exclusion object used to serialize threads.
- */
-static struct sched_lock *the_BigLock;
-
 
 /* ---------------------------------------------------------------------
    Helper functions for the scheduler.
@@ -263,6 +271,25 @@ void maybe_show_sb_profile ( void )
    }
 }
 
+/* For --hot-sb-threshold: look for hot superblocks to retranslate
+   every HOT_SB_INTERVAL event checks. */
+#define HOT_SB_INTERVAL 5000000
+
+static
+void maybe_discard_hot_sbs ( void )
+{
+   /* DO NOT MAKE NON-STATIC */
+   static ULong bbs_done_lastcheck = 0;
+   /* */
+   vg_assert(VG_(clo_hot_sb_threshold) > 0);
+   Long delta = (Long)(bbs_done - bbs_done_lastcheck);
+   vg_assert(delta >= 0);
+   if ((ULong)delta >= HOT_SB_INTERVAL) {
+      bbs_done_lastcheck = bbs_done;
+      VG_(discard_hot_translations)(VG_(clo_hot_sb_threshold));
+   }
+}
+
 static
 const HChar* name_of_sched_event ( UInt event )
 {
@@ -680,7 +707,14 @@ ThreadId VG_(scheduler_init_phase1) ( void )
 
    VG_(debugLog)(1,"sched","sched_init_phase1\n");
 
-   if (VG_(clo_fair_sched) != disable_fair_sched
+   if (VG_(clo_fair_sched) == handoff_fair_sched) {
+      if (!ML_(set_sched_lock_impl)(sched_lock_handoff)) {
+         VG_(printf)("Error: handoff scheduling is not supported"
+                     " on this system.\n");
+         VG_(exit)(1);
+      }
+   }
+   else if (VG_(clo_fair_sched) != disable_fair_sched
        && !ML_(set_sched_lock_impl)(sched_lock_ticket)
        && VG_(clo_fair_sched) == enable_fair_sched)
    {
@@ -1161,6 +1195,7 @@ void handle_chain_me ( ThreadId tid, void* place_to_chain, Bool toFastEP )
    Addr ip             = VG_(get_IP)(tid);
    SECno to_sNo         = INV_SNO;
    TTEno to_tteNo       = INV_TTE;
+   ULong recycled       = VG_(get_sectors_recycled)();
 
    found = VG_(search_transtab)( NULL, &to_sNo, &to_tteNo,
                                  ip, False/*dont_upd_fast_cache*/ );
@@ -1171,6 +1206,14 @@ void handle_chain_me ( ThreadId tid, void* place_to_chain, Bool toFastEP )
          found = VG_(search_transtab)( NULL, &to_sNo, &to_tteNo,
                                        ip, False ); 
          vg_assert2(found, "handle_chain_me: missing tt_fast entry");
+         /* The translation recycled a sector.  place_to_chain may have
+            been in it, and carried hot code may now be packed at that
+            address, so it cannot be patched.  Leave the block
+            unchained; if it still exists, it will ask again. */
+         if (VG_(get_sectors_recycled)() != recycled) {
+            n_chainings_abandoned++;
+            return;
+         }
       } else {
 	 // If VG_(translate)() fails, it's because it had to throw a
 	 // signal because the client jumped to a bad address.  That
@@ -1361,7 +1404,7 @@ VgSchedReturnCode VG_(scheduler) ( ThreadId tid )
    
    vg_assert(VG_(is_running_thread)(tid));
 
-   dispatch_ctr = SCHEDULING_QUANTUM;
+   dispatch_ctr = VG_(clo_sched_quantum);
 
    while (!VG_(is_exiting)(tid)) {
 
@@ -1412,7 +1455,7 @@ VgSchedReturnCode VG_(scheduler) ( ThreadId tid )
 	 n_scheduling_events_MAJOR++;
 
 	 /* Figure out how many bbs to ask vg_run_innerloop to do. */
-         dispatch_ctr = SCHEDULING_QUANTUM;
+         dispatch_ctr = VG_(clo_sched_quantum);
 
 	 /* paranoia ... */
 	 vg_assert(tst->tid == tid);
@@ -1740,6 +1783,8 @@ VgSchedReturnCode VG_(scheduler) ( ThreadId tid )
 
       if (UNLIKELY(VG_(clo_profyle_sbs)) && VG_(clo_profyle_interval) > 0)
          maybe_show_sb_profile();
+      if (UNLIKELY(VG_(clo_hot_sb_threshold) > 0))
+         maybe_discard_hot_sbs();
    }
 
    if (VG_(clo_trace_sched))
@@ -3063,6 +3063,12 @@ void handle_pre_sys_execve(ThreadId tid, SyscallStatus *status, Addr pathname,
       VG_(gdbserver) (0);
    }
 
+   // The exec replaces this process, so write out its translations now.
+   VG_(save_persistent_tt)();
+
+   // Let the tool's helper processes finish their work for this process.
+   VG_(stop_all_helpers)();
+
    /* Resistance is futile.  Nuke all other threads.  POSIX mandates
       this. (Really, nuke them all, since the new process will make
       its own new thread.) */
@@ -3779,6 +3779,9 @@ PRE(sys_execve)
       VG_(gdbserver)(0);
    }
 
+   /* Let the tool's helper processes finish their work for this process. */
+   VG_(stop_all_helpers)();
+
    /* Resistance is futile.  Nuke all other threads.  POSIX mandates this.
       (Really, nuke them all, since the new process will make its own new
       thread.) */
@@ -97,7 +97,9 @@ VgNeeds VG_(needs) = {
    .var_info	         = False,
    .malloc_replacement   = False,
    .xml_output           = False,
-   .final_IR_tidy_pass   = False
+   .final_IR_tidy_pass   = False,
+   .persistent_translations = False,
+   .no_preload           = False
 };
 
 /* static */
@@ -206,6 +208,14 @@ Bool VG_(finish_needs_init)(const HChar** failmsg)
    VG_(tdict).any_die_mem_stack
       = VG_(tdict).track_die_mem_stack || any_die_mem_stack_N;
 
+   /* The malloc replacements are in the vgpreload module. */
+   if (VG_(needs).no_preload && VG_(needs).malloc_replacement) {
+      *failmsg = "Tool error: 'no_preload' and 'malloc_replacement' are\n"
+                 "   both set, but the malloc replacements need the tool's\n"
+                 "   vgpreload module\n";
+      return False;
+   }
+
    return True;
 
 #undef CHECK_NOT
@@ -223,6 +233,8 @@ NEEDS(libc_freeres)
 NEEDS(cxx_freeres)
 NEEDS(core_errors)
 NEEDS(var_info)
+NEEDS(persistent_translations)
+NEEDS(no_preload)
 
 void VG_(needs_superblock_discards)(
    void (*discard)(Addr, VexGuestExtents)
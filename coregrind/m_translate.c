@@ -1480,6 +1480,55 @@ typedef
    }
    T_Kind;
 
+/* Can this translation be taken from, or offered to, the persistent
+   translation cache?  Not if it is made only for its debug output.
+   No-redir translations live outside the main translation cache and
+   are never worth it.  On MIPS the translation also depends on the
+   thread's FP mode, which the cache key does not cover. */
+static Bool persistent_translation_ok ( Bool debugging_translation,
+                                        T_Kind kind, Int verbosity )
+{
+#  if defined(VGA_mips32) || defined(VGA_mips64) || defined(VGA_nanomips)
+   return False;
+#  endif
+   return !debugging_translation
+          && kind != T_NoRedir
+          && verbosity == 0;
+}
+
+/* Would a translation from VGE made now be the same as one made
+   earlier from the same guest bytes?  Not if a chase it made is no
+   longer allowed (each extent after the first starts at a chased-into
+   address), nor if gdbserver wants to instrument it, since that
+   depends on breakpoints which come and go at run time. */
+static Bool persistent_extents_ok ( void* closureV,
+                                    const VexGuestExtents* vge )
+{
+   UInt i;
+   for (i = 1; i < vge->n_used; i++) {
+      if (!chase_into_ok(closureV, vge->base[i]))
+         return False;
+   }
+   return !VG_(gdbserver_instruments)(vge);
+}
+
+/* VEX settings for second-tier translations of hot superblocks
+   (--hot-sb-threshold): the user's, but with the biggest instruction
+   budget and loop unrolling VEX allows.  VEX follows branches into the
+   extra instructions, so the tool and the optimiser see a longer
+   stretch of the hot path at once.  The optimisation level stays the
+   user's: it is already the highest by default, and a lower
+   --vex-iropt-level is usually asked for when debugging, which the
+   second tier must not undo. */
+static const VexControl* hot_vex_control ( void )
+{
+   static VexControl vcon;
+   vcon = VG_(clo_vex_control);
+   vcon.guest_max_insns     = 100;
+   vcon.iropt_unroll_thresh = 400;
+   return &vcon;
+}
+
 /* Translate the basic block beginning at NRADDR, and add it to the
    translation cache & translation table.  Unless
    DEBUGGING_TRANSLATION is true, in which case the call is being done
@@ -1502,6 +1551,7 @@ Bool VG_(translate) ( ThreadId tid,
    Addr               addr;
    T_Kind             kind;
    Int                tmpbuf_used, verbosity, i;
+   Bool               persist, hot;
    Bool (*preamble_fn)(void*,IRSB*);
    VexArch            vex_arch;
    VexArchInfo        vex_archinfo;
@@ -1671,6 +1721,41 @@ Bool VG_(translate) ( ThreadId tid,
    }
 #  endif
 
+   /* Set up closure args. */
+   closure.tid    = tid;
+   closure.nraddr = nraddr;
+   closure.readdr = addr;
+
+   /* Reuse a translation made by an earlier run, if there is one. */
+   persist = persistent_translation_ok(debugging_translation, kind, verbosity);
+   if (persist) {
+      const UChar* pt_code;
+      UInt         pt_code_len, pt_n_guest_instrs;
+      Bool         pt_is_self_checking;
+      if (VG_(lookup_persistent_tt)( nraddr, addr, kind,
+                                     persistent_extents_ok, &closure,
+                                     &vge, &pt_code, &pt_code_len,
+                                     &pt_is_self_checking,
+                                     &pt_n_guest_instrs )) {
+         for (i = 0; i < vge.n_used; i++)
+            VG_(am_set_segment_hasT)( vge.base[i] );
+         VG_(add_to_transtab)( &vge,
+                               nraddr,
+                               (Addr)pt_code,
+                               pt_code_len,
+                               pt_is_self_checking,
+                               -1,
+                               pt_n_guest_instrs );
+         return True;
+      }
+   }
+
+   /* Superblocks found hot by VG_(discard_hot_translations) get a
+      second-tier translation; the others carry a profile counter so
+      that they can be found hot. */
+   hot = VG_(clo_hot_sb_threshold) > 0 && kind != T_NoRedir
+         && VG_(is_hot_sb)(nraddr);
+
    /* ------ Actually do the translation. ------ */
    vg_assert2(VG_(tdict).tool_instrument,
               "you forgot to set VgToolInterface function 'tool_instrument'");
@@ -1750,11 +1835,6 @@ Bool VG_(translate) ( ThreadId tid,
            vex_archinfo.arm64_requires_fallback_LLSC;
 #  endif
 
-   /* Set up closure args. */
-   closure.tid    = tid;
-   closure.nraddr = nraddr;
-   closure.readdr = addr;
-
    /* Set up args for LibVEX_Translate. */
    vta.arch_guest       = vex_arch;
    vta.archinfo_guest   = vex_archinfo;
@@ -1797,7 +1877,9 @@ Bool VG_(translate) ( ThreadId tid,
    vta.preamble_function = preamble_fn;
    vta.traceflags        = verbosity;
    vta.sigill_diag       = VG_(clo_sigill_diag);
-   vta.addProfInc        = VG_(clo_profyle_sbs) && kind != T_NoRedir;
+   vta.addProfInc        = (VG_(clo_profyle_sbs)
+                            || (VG_(clo_hot_sb_threshold) > 0 && !hot))
+                           && kind != T_NoRedir;
 
    /* Set up the dispatch continuation-point info.  If this is a
       no-redir translation then it cannot be chained, and the chain-me
@@ -1828,7 +1910,11 @@ Bool VG_(translate) ( ThreadId tid,
       = VG_(fnptr_to_fnentry)( &VG_(disp_cp_xassisted) );
 
    /* Sheesh.  Finally, actually _do_ the translation! */
+   if (hot)
+      LibVEX_Update_Control( hot_vex_control() );
    tres = LibVEX_Translate ( &vta );
+   if (hot)
+      LibVEX_Update_Control( &VG_(clo_vex_control) );
 
    vg_assert(tres.status == VexTransOK);
    vg_assert(tres.n_sc_extents >= 0 && tres.n_sc_extents <= 3);
@@ -1867,6 +1953,14 @@ Bool VG_(translate) ( ThreadId tid,
                                 tres.n_sc_extents > 0,
                                 tres.offs_profInc,
                                 tres.n_guest_instrs );
+
+          // Keep it for later runs too, if we can.
+          if (persist && tres.offs_profInc == -1
+              && !VG_(gdbserver_instruments)(&vge))
+             VG_(add_to_persistent_tt)( nraddr, addr, kind, &vge,
+                                        tmpbuf, tmpbuf_used,
+                                        tres.n_sc_extents > 0,
+                                        tres.n_guest_instrs );
       } else {
           vg_assert(tres.offs_profInc == -1); /* -1 == unset */
           VG_(add_to_unredir_transtab)( &vge,
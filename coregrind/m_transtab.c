@@ -42,6 +42,10 @@
 #include "pub_core_mallocfree.h" // VG_(out_of_memory_NORETURN)
 #include "pub_core_xarray.h"
 #include "pub_core_dispatch.h"   // For VG_(disp_cp*) addresses
+#include "pub_core_debuginfo.h"  // VG_(DebugInfo_get_buildid)
+#include "pub_core_hashtable.h"
+#include "pub_core_libcfile.h"
+#include "pub_core_clientstate.h" // VG_(args_for_valgrind)
 
 
 #define DEBUG_TRANSTAB 0
@@ -53,9 +57,15 @@
 
 /* Nr of sectors provided via command line parameter. */
 UInt VG_(clo_num_transtab_sectors) = N_SECTORS_DEFAULT;
+/* Nr of sectors the cache may grow to when code is being retranslated
+   a lot (see advance_nursery), or 0 for no growth. */
+UInt VG_(clo_max_transtab_sectors) = 0;
 /* Nr of sectors.
    Will be set by VG_(init_tt_tc) to VG_(clo_num_transtab_sectors). */
 static SECno n_sectors = 0;
+/* Nr of sectors n_sectors may grow to.  Set by VG_(init_tt_tc), and
+   lowered to n_sectors if a new sector cannot be allocated. */
+static SECno max_sectors = 0;
 
 /* Average size of a transtab code entry. 0 means to use the tool
    provided default. */
@@ -207,6 +217,11 @@ typedef
       // should be the index 
       // of this TTEntry in the containing Sector's tt array.
 
+      /* How many more times this translation is to be copied into
+         the youngest sector when its own sector is recycled, instead
+         of being thrown away.  See carry_hot_ttes. */
+      UChar    carries;
+
       /* Admin information for chaining.  'in_edges' is a set of the
          patch points which jump to this translation -- hence are
          predecessors in the control flow graph.  'out_edges' points
@@ -436,6 +451,17 @@ typedef
    first time, and are full, we then re-use the oldest sector,
    endlessly. 
 
+   Recycling a sector throws away hot code along with cold.  So the
+   entry addresses of the translations in a recycled sector are
+   remembered in evicted[], and a translation made for one of them
+   soon afterwards, being of code that is still hot, is given
+   N_CARRIES carries.  When a sector is recycled, the translations
+   in it with carries left are first copied into the sector, once
+   emptied, with one carry fewer.  Code that merely comes round again,
+   as happens when the program's code does not fit in the cache, is
+   made too late to be carried, since carrying it would just take the
+   room of newer code.
+
    When running, youngest sector should be between >= 0 and <
    N_TC_SECTORS.  The initial  value indicates the TT/TC system is
    not yet initialised. 
@@ -443,6 +469,43 @@ typedef
 static Sector sectors[MAX_N_SECTORS];
 static Int    youngest_sector = INV_SNO;
 
+/* Entry addresses of translations thrown away by sector recycling,
+   and the value of n_in_count when that happened.  Direct-mapped and
+   lossy: a clash just means a translation is not carried when it
+   could have been.  Allocated at the first recycle. */
+typedef
+   struct {
+      Addr  entry;
+      ULong when;
+   }
+   EvictedEnt;
+
+#define N_EVICTED 16384
+#define EVICTED_HASH(_a) ((((UWord)(_a)) ^ (((UWord)(_a)) >> 14)) \
+                          & (N_EVICTED - 1))
+static EvictedEnt* evicted = NULL;
+
+/* Code retranslated within this many translations of being evicted
+   is given N_CARRIES carries. */
+#define CARRY_WINDOW (N_TTES_PER_SECTOR / 8)
+#define N_CARRIES    4
+
+/* One bit per hash of the entry addresses of all translations thrown
+   away by sector recycling, for estimating how much of what gets
+   translated was in the cache before, however long ago.  Cleared when
+   an eighth of the bits have been set, which keeps false hits below
+   about that.  Allocated at the first recycle. */
+#define N_EVICTED_BITS (1 << 23)
+#define EVICTED_BIT(_a) ((((UWord)(_a)) ^ (((UWord)(_a)) >> 23)) \
+                         & (N_EVICTED_BITS - 1))
+static UChar* evicted_bits = NULL;
+static UInt   n_evicted_bits_set = 0;
+
+/* Translations made, and how many of them hit in evicted_bits, since
+   the nursery last wrapped around. */
+static UInt n_made_this_lap = 0;
+static UInt n_evicted_hits_this_lap = 0;
+
 /* The number of ULongs in each TCEntry area.  This is computed once
    at startup and does not change. */
 static Int    tc_sector_szQ = 0;
@@ -512,6 +575,9 @@ static ULong n_in_sc_count = 0;
 static ULong n_dump_count = 0;
 static ULong n_dump_osize = 0;
 static ULong n_sectors_recycled = 0;
+static ULong n_carry_given = 0;
+static ULong n_carried = 0;
+static ULong n_sectors_grown = 0;
 
 /* Number/osize of translations discarded due to requests to do so. */
 static ULong n_disc_count = 0;
@@ -1057,6 +1123,42 @@ void unchain_in_preparation_for_deletion ( VexArch arch_host,
 }
 
 
+/* Undo the chained jumps out of the specified block, so that its
+   code is as VEX made it, and update its succs accordingly. */
+static
+void unchain_out_edges ( VexArch arch_host, VexEndness endness_host,
+                         SECno here_sNo, TTEno here_tteNo )
+{
+   UWord     i, j, n, m;
+   Int       evCheckSzB = LibVEX_evCheckSzB(arch_host);
+   TTEntryC* here_tteC  = index_tteC(here_sNo, here_tteNo);
+   vg_assert(index_tteH(here_sNo, here_tteNo)->status == InUse);
+
+   n = OutEdgeArr__size(&here_tteC->out_edges);
+   for (i = 0; i < n; i++) {
+      OutEdge* oe = OutEdgeArr__index(&here_tteC->out_edges, i);
+      TTEntryC* to_tteC = index_tteC(oe->to_sNo, oe->to_tteNo);
+      m = InEdgeArr__size(&to_tteC->in_edges);
+      vg_assert(m > 0); // it must have at least one entry
+      for (j = 0; j < m; j++) {
+         InEdge* ie = InEdgeArr__index(&to_tteC->in_edges, j);
+         if (ie->from_sNo == here_sNo && ie->from_tteNo == here_tteNo
+             && ie->from_offs == oe->from_offs)
+           break;
+      }
+      vg_assert(j < m); // "ie must be findable"
+      UChar* to_slow_EP = (UChar*)to_tteC->tcptr;
+      UChar* to_fast_EP = to_slow_EP + evCheckSzB;
+      unchain_one(arch_host, endness_host,
+                  InEdgeArr__index(&to_tteC->in_edges, j),
+                  to_fast_EP, to_slow_EP);
+      InEdgeArr__deleteIndex(&to_tteC->in_edges, j);
+   }
+
+   OutEdgeArr__makeEmpty(&here_tteC->out_edges);
+}
+
+
 /*-------------------------------------------------------------*/
 /*--- Address-range equivalence class stuff                 ---*/
 /*-------------------------------------------------------------*/
@@ -1541,10 +1643,39 @@ static void add_to_empty_tt_list (SECno sNo, TTEno tteno)
    sectors[sNo].empty_tt_list = tteno;
 }
 
-static void initialiseSector ( SECno sno )
+/* Map the tables of a sector used for the first time.  Returns False,
+   having mapped nothing, if there is not enough memory. */
+static Bool map_sector ( Sector* sec )
+{
+   SizeT szB[4] = { 8 * tc_sector_szQ,
+                    N_TTES_PER_SECTOR * sizeof(TTEntryC),
+                    N_TTES_PER_SECTOR * sizeof(TTEntryH),
+                    N_HTTES_PER_SECTOR * sizeof(TTEno) };
+   Addr  a[4];
+   UInt  i, j;
+
+   for (i = 0; i < 4; i++) {
+      SysRes sres = VG_(am_mmap_anon_float_valgrind)( szB[i] );
+      if (sr_isError(sres)) {
+         for (j = 0; j < i; j++)
+            VG_(am_munmap_valgrind)( a[j], szB[j] );
+         return False;
+      }
+      a[i] = sr_Res(sres);
+   }
+   sec->tc  = (ULong*)a[0];
+   sec->ttC = (TTEntryC*)a[1];
+   sec->ttH = (TTEntryH*)a[2];
+   sec->htt = (TTEno*)a[3];
+   return True;
+}
+
+/* Empty sector sno, allocating its tables if it has never been used.
+   If that fails, it returns False, changing nothing, when MAY_FAIL is
+   set, and otherwise runs out of memory. */
+static Bool initialiseSector ( SECno sno, Bool may_fail )
 {
    UInt i;
-   SysRes  sres;
    Sector* sec;
    vg_assert(isValidSector(sno));
 
@@ -1559,6 +1690,7 @@ static void initialiseSector ( SECno sno )
          tc. */
       vg_assert(sec->ttC == NULL);
       vg_assert(sec->ttH == NULL);
+      vg_assert(sec->htt == NULL);
       vg_assert(sec->tc_next == NULL);
       vg_assert(sec->tt_n_inuse == 0);
       for (EClassNo e = 0; e < ECLASS_N; e++) {
@@ -1568,34 +1700,20 @@ static void initialiseSector ( SECno sno )
       }
       vg_assert(sec->host_extents == NULL);
 
-      if (VG_(clo_stats) || VG_(debugLog_getLevel)() >= 1)
-         VG_(dmsg)("transtab: " "allocate sector %d\n", sno);
-
-      sres = VG_(am_mmap_anon_float_valgrind)( 8 * tc_sector_szQ );
-      if (sr_isError(sres)) {
-         VG_(out_of_memory_NORETURN)("initialiseSector(TC)", 
-                                     8 * tc_sector_szQ );
-	 /*NOTREACHED*/
-      }
-      sec->tc = (ULong*)(Addr)sr_Res(sres);
-
-      sres = VG_(am_mmap_anon_float_valgrind)
-                ( N_TTES_PER_SECTOR * sizeof(TTEntryC) );
-      if (sr_isError(sres)) {
-         VG_(out_of_memory_NORETURN)("initialiseSector(TTC)", 
-                                     N_TTES_PER_SECTOR * sizeof(TTEntryC) );
-	 /*NOTREACHED*/
+      if (!map_sector(sec)) {
+         if (may_fail)
+            return False;
+         VG_(out_of_memory_NORETURN)("initialiseSector",
+                                     8 * tc_sector_szQ
+                                     + N_TTES_PER_SECTOR
+                                       * (sizeof(TTEntryC)
+                                          + sizeof(TTEntryH))
+                                     + N_HTTES_PER_SECTOR * sizeof(TTEno));
+         /*NOTREACHED*/
       }
-      sec->ttC = (TTEntryC*)(Addr)sr_Res(sres);
 
-      sres = VG_(am_mmap_anon_float_valgrind)
-                ( N_TTES_PER_SECTOR * sizeof(TTEntryH) );
-      if (sr_isError(sres)) {
-         VG_(out_of_memory_NORETURN)("initialiseSector(TTH)", 
-                                     N_TTES_PER_SECTOR * sizeof(TTEntryH) );
-	 /*NOTREACHED*/
-      }
-      sec->ttH = (TTEntryH*)(Addr)sr_Res(sres);
+      if (VG_(clo_stats) || VG_(debugLog_getLevel)() >= 1)
+         VG_(dmsg)("transtab: " "allocate sector %d\n", sno);
 
       sec->empty_tt_list = HTT_EMPTY;
       for (TTEno ei = 0; ei < N_TTES_PER_SECTOR; ei++) {
@@ -1604,14 +1722,6 @@ static void initialiseSector ( SECno sno )
          add_to_empty_tt_list(sno, ei);
       }
 
-      sres = VG_(am_mmap_anon_float_valgrind)
-                ( N_HTTES_PER_SECTOR * sizeof(TTEno) );
-      if (sr_isError(sres)) {
-         VG_(out_of_memory_NORETURN)("initialiseSector(HTT)", 
-                                     N_HTTES_PER_SECTOR * sizeof(TTEno) );
-	 /*NOTREACHED*/
-      }
-      sec->htt = (TTEno*)(Addr)sr_Res(sres);
       for (HTTno hi = 0; hi < N_HTTES_PER_SECTOR; hi++)
          sec->htt[hi] = HTT_EMPTY;
 
@@ -1654,11 +1764,28 @@ static void initialiseSector ( SECno sno )
       if (DEBUG_TRANSTAB) VG_(printf)("QQQ unlink-entire-sector: %d START\n",
                                       sno);
       sec->empty_tt_list = HTT_EMPTY;
+      if (evicted == NULL) {
+         evicted = ttaux_malloc("transtab.evicted",
+                                N_EVICTED * sizeof(EvictedEnt));
+         for (i = 0; i < N_EVICTED; i++)
+            evicted[i].entry = TRANSTAB_BOGUS_GUEST_ADDR;
+         evicted_bits = ttaux_malloc("transtab.evicted_bits",
+                                     N_EVICTED_BITS / 8);
+         VG_(memset)(evicted_bits, 0, N_EVICTED_BITS / 8);
+      }
       for (TTEno ei = 0; ei < N_TTES_PER_SECTOR; ei++) {
          if (sec->ttH[ei].status == InUse) {
             vg_assert(sec->ttC[ei].n_tte2ec >= 1);
             vg_assert(sec->ttC[ei].n_tte2ec <= 3);
             n_dump_osize += TTEntryH__osize(&sec->ttH[ei]);
+            EvictedEnt* ev = &evicted[EVICTED_HASH(sec->ttC[ei].entry)];
+            ev->entry = sec->ttC[ei].entry;
+            ev->when  = n_in_count;
+            UInt bit = EVICTED_BIT(sec->ttC[ei].entry);
+            if (!(evicted_bits[bit >> 3] & (1 << (bit & 7)))) {
+               evicted_bits[bit >> 3] |= 1 << (bit & 7);
+               n_evicted_bits_set++;
+            }
             /* Tell the tool too. */
             if (VG_(needs).superblock_discards) {
                VexGuestExtents vge_tmp;
@@ -1680,6 +1807,10 @@ static void initialiseSector ( SECno sno )
 
       if (DEBUG_TRANSTAB) VG_(printf)("QQQ unlink-entire-sector: %d END\n",
                                       sno);
+      if (n_evicted_bits_set >= N_EVICTED_BITS / 8) {
+         VG_(memset)(evicted_bits, 0, N_EVICTED_BITS / 8);
+         n_evicted_bits_set = 0;
+      }
 
       /* Free up the eclass structures. */
       for (EClassNo e = 0; e < ECLASS_N; e++) {
@@ -1721,6 +1852,172 @@ static void initialiseSector ( SECno sno )
    { Bool sane = sanity_check_sector_search_order();
      vg_assert(sane);
    }
+   return True;
+}
+
+/* Is there room in sector sno for a translation of reqdQ quadwords? */
+static Bool sector_has_room ( SECno sno, Int reqdQ )
+{
+   Int tcAvailQ = ((ULong*)(&sectors[sno].tc[tc_sector_szQ]))
+                  - ((ULong*)(sectors[sno].tc_next));
+   vg_assert(tcAvailQ >= 0);
+   vg_assert(tcAvailQ <= tc_sector_szQ);
+   return tcAvailQ >= reqdQ && sectors[sno].tt_n_inuse < N_TTES_PER_SECTOR;
+}
+
+static void declare_sector_full ( SECno sno )
+{
+   Int tcAvailQ = ((ULong*)(&sectors[sno].tc[tc_sector_szQ]))
+                  - ((ULong*)(sectors[sno].tc_next));
+   vg_assert(tc_sector_szQ > 0);
+   Int tt_loading_pct = (100 * sectors[sno].tt_n_inuse) 
+                        / N_HTTES_PER_SECTOR;
+   Int tc_loading_pct = (100 * (tc_sector_szQ - tcAvailQ)) 
+                        / tc_sector_szQ;
+   if (VG_(clo_stats) || VG_(debugLog_getLevel)() >= 1) {
+      VG_(dmsg)("transtab: "
+                "declare  sector %d full "
+                "(TT loading %2d%%, TC loading %2d%%, avg tce size %d)\n",
+                sno, tt_loading_pct, tc_loading_pct,
+                8 * (tc_sector_szQ - tcAvailQ)/sectors[sno].tt_n_inuse);
+   }
+}
+
+/* forwards */
+static void unlink_tte ( /*MOD*/Sector* sec, SECno secNo, TTEno tteno,
+                         VexArch arch_host, VexEndness endness_host );
+static TTEno place_tte ( SECno y, const VexGuestExtents* vge, Addr entry,
+                         Addr code, UInt code_len, Int offs_profInc,
+                         UInt n_guest_instrs );
+
+/* A translation being carried over the recycling of its sector. */
+typedef
+   struct {
+      VexGuestExtents vge;
+      Addr   entry;
+      UInt   code_len;
+      UChar  carries;
+      UChar* code;
+   }
+   CarriedTTE;
+
+/* Sector sno is about to be recycled.  Take out of it those
+   translations which have carries left, up to a quarter of a
+   sector's worth, and return copies of them in an XArray of
+   CarriedTTE, or NULL if there are none.  They are unchained first,
+   so the copies are as VEX made them, and unlinked without telling
+   the tool, whose information about them stays valid.  Translations
+   with a profile counter are never carried, since their code points
+   at the counter. */
+static XArray* carry_hot_ttes ( SECno sno )
+{
+   Sector* sec = &sectors[sno];
+   XArray* carried = NULL;
+   UInt    budgetQ = tc_sector_szQ / 4;
+   UInt    budgetN = N_TTES_PER_SECTOR / 4;
+
+   if (VG_(clo_profyle_sbs) || VG_(clo_hot_sb_threshold) > 0)
+      return NULL;
+
+   VexArch     arch_host = VexArch_INVALID;
+   VexArchInfo archinfo_host;
+   VG_(bzero_inline)(&archinfo_host, sizeof(archinfo_host));
+   VG_(machine_get_VexArchInfo)( &arch_host, &archinfo_host );
+   VexEndness endness_host = archinfo_host.endness;
+
+   /* Visit the translations in host-code order, which is the order
+      they were made in. */
+   Word n = VG_(sizeXA)(sec->host_extents);
+   for (Word i = 0; i < n; i++) {
+      const HostExtent* hx = VG_(indexXA)(sec->host_extents, i);
+      if (HostExtent__is_dead(hx, sec))
+         continue;
+      TTEntryC* tteC = &sec->ttC[hx->tteNo];
+      if (tteC->carries == 0)
+         continue;
+      UInt reqdQ = (hx->len + 7) >> 3;
+      if (budgetN == 0 || reqdQ > budgetQ)
+         break;
+      budgetN--;
+      budgetQ -= reqdQ;
+
+      unchain_out_edges(arch_host, endness_host, sno, hx->tteNo);
+
+      CarriedTTE ct;
+      TTEntryH__to_VexGuestExtents(&ct.vge, &sec->ttH[hx->tteNo]);
+      ct.entry    = tteC->entry;
+      ct.code_len = hx->len;
+      ct.carries  = tteC->carries - 1;
+      ct.code     = ttaux_malloc("transtab.carry_hot_ttes.2", hx->len);
+      VG_(memcpy)(ct.code, hx->start, hx->len);
+      if (carried == NULL)
+         carried = VG_(newXA)(ttaux_malloc, "transtab.carry_hot_ttes.1",
+                              ttaux_free, sizeof(CarriedTTE));
+      VG_(addToXA)(carried, &ct);
+
+      unlink_tte(sec, sno, hx->tteNo, arch_host, endness_host);
+   }
+   return carried;
+}
+
+/* Put the translations taken out by carry_hot_ttes into sector sno,
+   just emptied. */
+static void place_carried_ttes ( SECno sno, XArray* carried )
+{
+   Word n = VG_(sizeXA)(carried);
+   for (Word i = 0; i < n; i++) {
+      CarriedTTE* ct = VG_(indexXA)(carried, i);
+      TTEno tteno = place_tte(sno, &ct->vge, ct->entry, (Addr)ct->code,
+                              ct->code_len, -1, 0);
+      sectors[sno].ttC[tteno].carries = ct->carries;
+      ttaux_free(ct->code);
+   }
+   n_carried += n;
+   VG_(deleteXA)(carried);
+}
+
+/* Move the nursery on from its full youngest sector.  Either to a
+   sector never used before, in which case it will get its tt/tc
+   allocated now, or to the oldest sector, which is emptied, except
+   for the translations still to be carried.  If, on the trip round
+   the cache just finished, a quarter of what was made was code thrown
+   out by earlier recycling, the cache is too small for the program,
+   so it grows by a sector instead of wrapping around, if
+   --max-transtab-sectors allows it and the sector can be allocated. */
+static SECno advance_nursery ( void )
+{
+   XArray* carried = NULL;
+   Bool    grow;
+
+   youngest_sector++;
+   if (youngest_sector >= n_sectors) {
+      grow = n_sectors < max_sectors
+             && n_evicted_hits_this_lap > 0
+             && n_evicted_hits_this_lap >= n_made_this_lap / 4;
+      n_made_this_lap = 0;
+      n_evicted_hits_this_lap = 0;
+      if (grow) {
+         n_sectors++;
+         if (initialiseSector(youngest_sector, True/*may_fail*/)) {
+            n_sectors_grown++;
+            if (VG_(clo_stats) || VG_(debugLog_getLevel)() >= 1)
+               VG_(dmsg)("transtab: " "grow to %d sectors\n", n_sectors);
+            return youngest_sector;
+         }
+         n_sectors--;
+         max_sectors = n_sectors;
+         if (VG_(clo_stats) || VG_(debugLog_getLevel)() >= 1)
+            VG_(dmsg)("transtab: " "cannot grow past %d sectors\n",
+                      n_sectors);
+      }
+      youngest_sector = 0;
+   }
+   if (sectors[youngest_sector].tc != NULL)
+      carried = carry_hot_ttes(youngest_sector);
+   initialiseSector(youngest_sector, False/*!may_fail*/);
+   if (carried != NULL)
+      place_carried_ttes(youngest_sector, carried);
+   return youngest_sector;
 }
 
 /* Add a translation of vge to TT/TC.  The translation is temporarily
@@ -1737,10 +2034,7 @@ void VG_(add_to_transtab)( const VexGuestExtents* vge,
                            Int              offs_profInc,
                            UInt             n_guest_instrs )
 {
-   Int    tcAvailQ, reqdQ, y;
-   ULong  *tcptr, *tcptr2;
-   UChar* srcP;
-   UChar* dstP;
+   Int    reqdQ, y;
 
    vg_assert(init_done);
    vg_assert(vge->n_used >= 1 && vge->n_used <= 3);
@@ -1765,42 +2059,52 @@ void VG_(add_to_transtab)( const VexGuestExtents* vge,
    vg_assert(isValidSector(y));
 
    if (sectors[y].tc == NULL)
-      initialiseSector(y);
+      initialiseSector(y, False/*!may_fail*/);
 
-   /* Try putting the translation in this sector. */
    reqdQ = (code_len + 7) >> 3;
 
-   /* Will it fit in tc? */
-   tcAvailQ = ((ULong*)(&sectors[y].tc[tc_sector_szQ]))
-              - ((ULong*)(sectors[y].tc_next));
-   vg_assert(tcAvailQ >= 0);
-   vg_assert(tcAvailQ <= tc_sector_szQ);
-
-   if (tcAvailQ < reqdQ 
-       || sectors[y].tt_n_inuse >= N_TTES_PER_SECTOR) {
-      /* No.  So move on to the next sector.  Either it's never been
-         used before, in which case it will get its tt/tc allocated
-         now, or it has been used before, in which case it is set to be
-         empty, hence throwing out the oldest sector. */
-      vg_assert(tc_sector_szQ > 0);
-      Int tt_loading_pct = (100 * sectors[y].tt_n_inuse) 
-                           / N_HTTES_PER_SECTOR;
-      Int tc_loading_pct = (100 * (tc_sector_szQ - tcAvailQ)) 
-                           / tc_sector_szQ;
-      if (VG_(clo_stats) || VG_(debugLog_getLevel)() >= 1) {
-         VG_(dmsg)("transtab: "
-                   "declare  sector %d full "
-                   "(TT loading %2d%%, TC loading %2d%%, avg tce size %d)\n",
-                   y, tt_loading_pct, tc_loading_pct,
-                   8 * (tc_sector_szQ - tcAvailQ)/sectors[y].tt_n_inuse);
+   /* Was this code thrown out by recycling, and is now needed again?
+      If so soon, it is to be carried over the next few recyclings. */
+   UChar carries = 0;
+   n_made_this_lap++;
+   if (evicted != NULL) {
+      EvictedEnt* ev  = &evicted[EVICTED_HASH(entry)];
+      UInt        bit = EVICTED_BIT(entry);
+      if (evicted_bits[bit >> 3] & (1 << (bit & 7)))
+         n_evicted_hits_this_lap++;
+      if (ev->entry == entry) {
+         ev->entry = TRANSTAB_BOGUS_GUEST_ADDR;
+         if (n_in_count - ev->when <= CARRY_WINDOW) {
+            carries = N_CARRIES;
+            n_carry_given++;
+         }
       }
-      youngest_sector++;
-      if (youngest_sector >= n_sectors)
-         youngest_sector = 0;
-      y = youngest_sector;
-      initialiseSector(y);
    }
 
+   if (!sector_has_room(y, reqdQ)) {
+      declare_sector_full(y);
+      y = advance_nursery();
+   }
+
+   TTEno tteix = place_tte(y, vge, entry, code, code_len, offs_profInc,
+                           n_guest_instrs);
+   sectors[y].ttC[tteix].carries = carries;
+}
+
+/* Copy a translation of vge, in code[0 .. code_len-1], into sector y,
+   which has room for it, and make a tt entry for it there.  Returns
+   the entry's number. */
+static TTEno place_tte ( SECno y, const VexGuestExtents* vge, Addr entry,
+                         Addr code, UInt code_len, Int offs_profInc,
+                         UInt n_guest_instrs )
+{
+   Int    tcAvailQ, reqdQ;
+   ULong  *tcptr, *tcptr2;
+   UChar* srcP;
+   UChar* dstP;
+
+   reqdQ = (code_len + 7) >> 3;
+
    /* Be sure ... */
    tcAvailQ = ((ULong*)(&sectors[y].tc[tc_sector_szQ]))
               - ((ULong*)(sectors[y].tc_next));
@@ -1900,6 +2204,8 @@ void VG_(add_to_transtab)( const VexGuestExtents* vge,
 
    /* Note the eclass numbers for this translation. */
    upd_eclasses_after_add( &sectors[y], tteix );
+
+   return tteix;
 }
 
 
@@ -1982,6 +2288,7 @@ Bool VG_(search_transtab) ( /*OUT*/Addr*  res_hcode,
 
 /* forward */
 static void unredir_discard_translations( Addr, ULong );
+static void hot_discard_translations( Addr, ULong );
 
 /* Stuff for deleting translations which intersect with a given
    address range.  Unfortunately, to make this run at a reasonable
@@ -2014,10 +2321,11 @@ Bool overlaps ( Addr start, ULong range, const TTEntryH* tteH )
 }
 
 
-/* Delete a tt entry, and update all the eclass data accordingly. */
+/* Remove a tt entry, and update all the eclass data accordingly.
+   This is all of deleting it except for the stats and telling the
+   tool. */
 
-static void delete_tte ( /*OUT*/Addr* ga_deleted,
-                         /*MOD*/Sector* sec, SECno secNo, TTEno tteno,
+static void unlink_tte ( /*MOD*/Sector* sec, SECno secNo, TTEno tteno,
                          VexArch arch_host, VexEndness endness_host )
 {
    Int      i, ec_idx;
@@ -2034,7 +2342,6 @@ static void delete_tte ( /*OUT*/Addr* ga_deleted,
 
    vg_assert(tteH->vge_n_used >= 1 && tteH->vge_n_used <= 3);
    vg_assert(tteH->vge_base[0] != TRANSTAB_BOGUS_GUEST_ADDR);
-   *ga_deleted = tteH->vge_base[0];
 
    /* Unchain .. */
    unchain_in_preparation_for_deletion(arch_host, endness_host, secNo, tteno);
@@ -2071,9 +2378,23 @@ static void delete_tte ( /*OUT*/Addr* ga_deleted,
    tteH->status   = Deleted;
    tteC->n_tte2ec = 0;
    add_to_empty_tt_list(secNo, tteno);
+   sec->tt_n_inuse--;
+}
+
+
+/* Delete a tt entry, and update all the eclass data accordingly. */
+
+static void delete_tte ( /*OUT*/Addr* ga_deleted,
+                         /*MOD*/Sector* sec, SECno secNo, TTEno tteno,
+                         VexArch arch_host, VexEndness endness_host )
+{
+   TTEntryC* tteC = &sec->ttC[tteno];
+   TTEntryH* tteH = &sec->ttH[tteno];
+   *ga_deleted = tteH->vge_base[0];
+
+   unlink_tte(sec, secNo, tteno, arch_host, endness_host);
 
    /* Stats .. */
-   sec->tt_n_inuse--;
    n_disc_count++;
    n_disc_osize += TTEntryH__osize(tteH);
 
@@ -2290,6 +2611,10 @@ void VG_(discard_translations) ( Addr guest_start, ULong range,
    /* don't forget the no-redir cache */
    unredir_discard_translations( guest_start, range );
 
+   /* nor the entries found hot in that range, as the code there is
+      going away or being replaced */
+   hot_discard_translations( guest_start, range );
+
    /* Post-deletion sanity check */
    if (VG_(clo_sanity_level) >= 4) {
       TTEno i;
@@ -2495,6 +2820,744 @@ static void unredir_discard_translations( Addr guest_start, ULong range )
 }
 
 
+/*------------------------------------------------------------*/
+/*--- Persistent translations (--translation-cache=<dir>). ---*/
+/*------------------------------------------------------------*/
+
+/* Translations of code in ELF objects that have a build-id are kept
+   in memory as VEX produced them, and written to <dir> at exit (or
+   exec), one file per object.  A file is named after the tool, the
+   object's build-id and load address, and a key hashing everything
+   else the generated code depends on: the tool executable, the host
+   CPU features and the command line.  A later run that executes code
+   from the same object at the same address takes translations from
+   the file instead of calling VEX.
+
+   This is safe because the stored code is the unchained code, so the
+   only absolute addresses in it are guest addresses in the object and
+   helper/dispatcher addresses in the tool executable, which is linked
+   at a fixed address; the file name pins both down.  Tools only get
+   this if they say (VG_(needs_persistent_translations)) that their
+   instrumentation records no per-superblock state and embeds no
+   pointers to run-time allocated memory.  In addition, before an
+   entry is reused the guest bytes it was made from are compared with
+   the current ones, and m_translate checks that any chased-into
+   address may still be chased into.  So a stale, damaged or
+   colliding file costs only a retranslation.
+
+   The host code itself cannot be checked: a file made to match runs
+   whatever code it holds.  So <dir> must belong to the effective user
+   and not be writable by group or others, and each file is read only
+   if it is a regular file with the same owner and permissions.
+
+   Files are written to a temporary name and renamed into place, so
+   concurrently exiting processes never see a partial file; the last
+   one to finish wins.  The entries held in memory, loaded or made in
+   this run, are limited to the size of the translation cache; beyond
+   that, translations are not kept. */
+
+/* Change this whenever the file layout changes. */
+#define PT_MAGIC "VGPTC001"
+
+typedef
+   struct {
+      HChar magic[8];
+      ULong key;
+      ULong text_avma;
+      ULong text_size;
+      ULong checksum;     /* of everything after the header */
+      UInt  buildid_len;
+      UInt  n_ents;
+   }
+   PTFileHdr;
+
+/* Followed in the file by the build-id, then by n_ents entries, each
+   a PTFileEnt followed by the guest bytes and then the host code. */
+typedef
+   struct {
+      ULong  nraddr;
+      ULong  addr;
+      ULong  base[3];
+      UShort len[3];
+      UShort n_used;
+      UInt   kind;
+      UInt   is_self_checking;
+      UInt   n_guest_instrs;
+      UInt   code_len;
+   }
+   PTFileEnt;
+
+typedef
+   struct _PTObj {
+      struct _PTObj* next;
+      HChar* buildid;
+      Addr   text_avma;
+      SizeT  text_size;
+      HChar* fname;
+      Bool   dirty;       /* holds translations not yet on disk */
+   }
+   PTObj;
+
+typedef
+   struct _PTEnt {
+      struct _PTEnt*  next;
+      UWord           nraddr;     /* hash key */
+      PTObj*          obj;
+      Addr            addr;
+      UInt            kind;
+      Bool            is_self_checking;
+      UInt            n_guest_instrs;
+      UInt            guest_len;
+      UInt            code_len;
+      VexGuestExtents vge;
+      UChar*          bytes;      /* guest_len guest bytes, then the code */
+   }
+   PTEnt;
+
+static Bool         pt_enabled   = False;
+static ULong        pt_key       = 0;
+static PTObj*       pt_objs      = NULL;
+static VgHashTable* pt_ents      = NULL;
+static ULong        pt_bytes     = 0;  /* guest bytes and code in pt_ents */
+static ULong        pt_max_bytes = 0;
+
+static ULong n_pt_loaded  = 0;
+static ULong n_pt_reused  = 0;
+static ULong n_pt_stale   = 0;
+static ULong n_pt_saved   = 0;
+static ULong n_pt_dropped = 0;
+
+#define PT_HASH_INIT 0xcbf29ce484222325ULL
+
+/* 64-bit FNV-1a. */
+static ULong pt_hash ( ULong h, const void* p, SizeT n )
+{
+   const UChar* b = p;
+   SizeT i;
+   for (i = 0; i < n; i++) {
+      h ^= b[i];
+      h *= 0x100000001b3ULL;
+   }
+   return h;
+}
+
+/* Options which only affect what is printed and where, and so do not
+   belong in the key. */
+static Bool pt_option_is_irrelevant ( const HChar* arg )
+{
+   static const HChar* const prefixes[] = {
+      "--translation-cache=",
+      "--log-fd=", "--log-file=", "--log-socket=",
+      "--xml-fd=", "--xml-file=", "--xml-socket=",
+      "--stats="
+   };
+   UInt i;
+   if (VG_STREQ(arg, "-v") || VG_STREQ(arg, "--verbose")
+       || VG_STREQ(arg, "-q") || VG_STREQ(arg, "--quiet"))
+      return True;
+   for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+      if (VG_(strncmp)(arg, prefixes[i], VG_(strlen)(prefixes[i])) == 0)
+         return True;
+   }
+   return False;
+}
+
+static void pt_atfork_child ( ThreadId tid )
+{
+   PTObj* obj;
+   /* The parent writes out what it had; we write out only what we add. */
+   for (obj = pt_objs; obj != NULL; obj = obj->next)
+      obj->dirty = False;
+}
+
+static void init_persistent_tt ( void )
+{
+   struct vg_stat st;
+   SysRes         sr;
+   VexArch        arch;
+   VexArchInfo    archinfo;
+   const HChar*   why = NULL;
+   ULong          h   = PT_HASH_INIT;
+   Word           i;
+
+   if (VG_(clo_translation_cache) == NULL)
+      return;
+
+   sr = VG_(stat)(VG_(clo_translation_cache), &st);
+   if (sr_isError(sr) || !VKI_S_ISDIR(st.mode))
+      VG_(fmsg_bad_option)("--translation-cache",
+                           "'%s' is not a directory\n",
+                           VG_(clo_translation_cache));
+
+   if (st.uid != VG_(geteuid)())
+      why = "the directory is not owned by the user";
+   else if (st.mode & (VKI_S_IWGRP | VKI_S_IWOTH))
+      why = "the directory is writable by group or others";
+   else if (!VG_(needs).persistent_translations)
+      why = "the tool does not support it";
+   else if (VG_(tdict).track_new_mem_stack_w_ECU)
+      /* The SP update pass puts this run's ExeContext numbers in the
+         code. */
+      why = "it cannot be used with origin tracking";
+   else if (VG_(clo_profyle_sbs))
+      why = "it cannot be used with --profile-flags";
+   else if (sr_isError(VG_(stat)("/proc/self/exe", &st)))
+      why = "the tool executable cannot be identified";
+
+   if (why) {
+      VG_(umsg)("Warning: ignoring --translation-cache: %s\n", why);
+      return;
+   }
+
+   /* st now describes the tool executable.  Anything that replaces it
+      may move the helpers and dispatcher the code calls. */
+   h = pt_hash(h, &st.dev, sizeof(st.dev));
+   h = pt_hash(h, &st.ino, sizeof(st.ino));
+   h = pt_hash(h, &st.size, sizeof(st.size));
+   h = pt_hash(h, &st.mtime, sizeof(st.mtime));
+   h = pt_hash(h, &st.mtime_nsec, sizeof(st.mtime_nsec));
+
+   VG_(machine_get_VexArchInfo)(&arch, &archinfo);
+   h = pt_hash(h, &arch, sizeof(arch));
+   h = pt_hash(h, &archinfo.hwcaps, sizeof(archinfo.hwcaps));
+   h = pt_hash(h, &archinfo.endness, sizeof(archinfo.endness));
+   h = pt_hash(h, &archinfo.ppc_icache_line_szB,
+               sizeof(archinfo.ppc_icache_line_szB));
+   h = pt_hash(h, &archinfo.ppc_dcbz_szB, sizeof(archinfo.ppc_dcbz_szB));
+   h = pt_hash(h, &archinfo.ppc_dcbzl_szB, sizeof(archinfo.ppc_dcbzl_szB));
+   h = pt_hash(h, &archinfo.arm64_dMinLine_lg2_szB,
+               sizeof(archinfo.arm64_dMinLine_lg2_szB));
+   h = pt_hash(h, &archinfo.arm64_iMinLine_lg2_szB,
+               sizeof(archinfo.arm64_iMinLine_lg2_szB));
+
+   /* This includes --tool= and anything from VALGRIND_OPTS and the
+      .valgrindrc files. */
+   for (i = 0; i < VG_(sizeXA)(VG_(args_for_valgrind)); i++) {
+      const HChar* arg = *(HChar**)VG_(indexXA)(VG_(args_for_valgrind), i);
+      if (!pt_option_is_irrelevant(arg))
+         h = pt_hash(h, arg, VG_(strlen)(arg) + 1);
+   }
+
+   pt_key       = h;
+   pt_ents      = VG_(HT_construct)("transtab.pt_ents");
+   pt_max_bytes = (ULong)n_sectors * 8 * tc_sector_szQ;
+   pt_enabled   = True;
+   VG_(atfork)(NULL, NULL, pt_atfork_child);
+
+   if (VG_(clo_verbosity) > 1)
+      VG_(message)(Vg_DebugMsg, "translation cache: %s, key %016llx\n",
+                   VG_(clo_translation_cache), pt_key);
+}
+
+static void pt_free_ent ( PTEnt* e )
+{
+   pt_bytes -= e->guest_len + e->code_len;
+   ttaux_free(e->bytes);
+   ttaux_free(e);
+}
+
+/* Add a translation to pt_ents, replacing any other one for NRADDR.
+   Returns False, adding nothing, if pt_ents is full. */
+static Bool pt_add_ent ( PTObj* obj, Addr nraddr, Addr addr, UInt kind,
+                         const VexGuestExtents* vge,
+                         const UChar* guest, UInt guest_len,
+                         const UChar* code, UInt code_len,
+                         Bool is_self_checking, UInt n_guest_instrs )
+{
+   PTEnt* e = VG_(HT_remove)(pt_ents, nraddr);
+   if (e)
+      pt_free_ent(e);
+   if (pt_bytes + guest_len + code_len > pt_max_bytes) {
+      n_pt_dropped++;
+      return False;
+   }
+
+   e = ttaux_malloc("transtab.pt_add_ent.1", sizeof(PTEnt));
+   e->nraddr           = nraddr;
+   e->obj              = obj;
+   e->addr             = addr;
+   e->kind             = kind;
+   e->is_self_checking = is_self_checking;
+   e->n_guest_instrs   = n_guest_instrs;
+   e->guest_len        = guest_len;
+   e->code_len         = code_len;
+   e->vge              = *vge;
+   e->bytes = ttaux_malloc("transtab.pt_add_ent.2", guest_len + code_len);
+   VG_(memcpy)(e->bytes, guest, guest_len);
+   VG_(memcpy)(e->bytes + guest_len, code, code_len);
+   VG_(HT_add_node)(pt_ents, e);
+   pt_bytes += guest_len + code_len;
+   return True;
+}
+
+/* Do the extents lie wholly inside OBJ's text? */
+static Bool pt_extents_in_obj ( const PTObj* obj, const VexGuestExtents* vge )
+{
+   UInt i;
+   if (vge->n_used < 1 || vge->n_used > 3)
+      return False;
+   for (i = 0; i < vge->n_used; i++) {
+      if (vge->base[i] < obj->text_avma
+          || vge->base[i] - obj->text_avma + vge->len[i] > obj->text_size)
+         return False;
+   }
+   return True;
+}
+
+/* Check and parse the contents of OBJ's file.  Returns False, having
+   added nothing after the first bad entry, if anything is amiss. */
+static Bool pt_parse ( PTObj* obj, const UChar* buf, SizeT size )
+{
+   PTFileHdr hdr;
+   SizeT     off;
+   UInt      n;
+
+   if (size < sizeof(hdr))
+      return False;
+   VG_(memcpy)(&hdr, buf, sizeof(hdr));
+   if (VG_(memcmp)(hdr.magic, PT_MAGIC, sizeof(hdr.magic)) != 0
+       || hdr.key != pt_key
+       || hdr.text_avma != obj->text_avma
+       || hdr.text_size != obj->text_size
+       || hdr.checksum != pt_hash(PT_HASH_INIT, buf + sizeof(hdr),
+                                  size - sizeof(hdr))
+       || hdr.buildid_len != VG_(strlen)(obj->buildid)
+       || size - sizeof(hdr) < hdr.buildid_len
+       || VG_(memcmp)(buf + sizeof(hdr), obj->buildid, hdr.buildid_len) != 0)
+      return False;
+
+   off = sizeof(hdr) + hdr.buildid_len;
+   for (n = 0; n < hdr.n_ents; n++) {
+      PTFileEnt       fe;
+      VexGuestExtents vge;
+      UInt            i, guest_len = 0;
+
+      if (size - off < sizeof(fe))
+         return False;
+      VG_(memcpy)(&fe, buf + off, sizeof(fe));
+      off += sizeof(fe);
+
+      if (fe.n_used < 1 || fe.n_used > 3
+          || fe.code_len == 0 || fe.code_len >= 65536)
+         return False;
+      VG_(memset)(&vge, 0, sizeof(vge));
+      vge.n_used = fe.n_used;
+      for (i = 0; i < fe.n_used; i++) {
+         vge.base[i] = (Addr)fe.base[i];
+         vge.len[i]  = fe.len[i];
+         guest_len  += fe.len[i];
+      }
+      if (!pt_extents_in_obj(obj, &vge)
+          || vge.base[0] != (Addr)fe.addr
+          || size - off < (SizeT)guest_len + fe.code_len)
+         return False;
+
+      /* Keep a translation made since, e.g. by a previous mapping of
+         another object at this address. */
+      if (VG_(HT_lookup)(pt_ents, (UWord)fe.nraddr) == NULL
+          && pt_add_ent(obj, (Addr)fe.nraddr, (Addr)fe.addr, fe.kind, &vge,
+                        buf + off, guest_len, buf + off + guest_len,
+                        fe.code_len, fe.is_self_checking != 0,
+                        fe.n_guest_instrs))
+         n_pt_loaded++;
+      off += guest_len + fe.code_len;
+   }
+   return off == size;
+}
+
+static void pt_load ( PTObj* obj )
+{
+   struct vg_stat st;
+   SysRes         sr;
+   UChar*         buf;
+   SizeT          done = 0;
+   Int            fd;
+
+   sr = VG_(open)(obj->fname, VKI_O_RDONLY, 0);
+   if (sr_isError(sr))
+      return;
+   fd = sr_Res(sr);
+   if (VG_(fstat)(fd, &st) != 0 || st.size > (1ULL << 30)) {
+      VG_(close)(fd);
+      return;
+   }
+   /* See "Persistent translations" above. */
+   if (!VKI_S_ISREG(st.mode) || st.uid != VG_(geteuid)()
+       || (st.mode & (VKI_S_IWGRP | VKI_S_IWOTH))) {
+      VG_(close)(fd);
+      if (VG_(clo_verbosity) > 1)
+         VG_(message)(Vg_DebugMsg,
+                      "translation cache: ignoring %s: not a regular file"
+                      " of the user's, or writable by others\n",
+                      obj->fname);
+      return;
+   }
+
+   buf = ttaux_malloc("transtab.pt_load", st.size + 1);
+   while (done < st.size) {
+      Int r = VG_(read)(fd, buf + done, st.size - done);
+      if (r <= 0)
+         break;
+      done += r;
+   }
+   VG_(close)(fd);
+
+   if (done != st.size || !pt_parse(obj, buf, done)) {
+      if (VG_(clo_verbosity) > 1)
+         VG_(message)(Vg_DebugMsg,
+                      "translation cache: ignoring damaged %s\n", obj->fname);
+   }
+   ttaux_free(buf);
+}
+
+/* Find, reading its file the first time, the object containing ADDR.
+   NULL if it is not an ELF object with a build-id. */
+static PTObj* pt_find_obj ( Addr addr )
+{
+   DebugInfo*   di = VG_(find_DebugInfo)(VG_(current_DiEpoch)(), addr);
+   const HChar* buildid;
+   PTObj*       obj;
+   Addr         avma;
+   SizeT        size;
+
+   if (di == NULL || (buildid = VG_(DebugInfo_get_buildid)(di)) == NULL)
+      return NULL;
+   avma = VG_(DebugInfo_get_text_avma)(di);
+   size = VG_(DebugInfo_get_text_size)(di);
+
+   for (obj = pt_objs; obj != NULL; obj = obj->next) {
+      if (obj->text_avma == avma && obj->text_size == size
+          && VG_(strcmp)(obj->buildid, buildid) == 0)
+         return obj;
+   }
+
+   obj = ttaux_malloc("transtab.pt_find_obj.1", sizeof(PTObj));
+   obj->buildid   = VG_(arena_strdup)(VG_AR_TTAUX, "transtab.pt_find_obj.2",
+                                      buildid);
+   obj->text_avma = avma;
+   obj->text_size = size;
+   obj->dirty     = False;
+   obj->fname     = ttaux_malloc("transtab.pt_find_obj.3",
+                                 VG_(strlen)(VG_(clo_translation_cache))
+                                 + VG_(strlen)(VG_(clo_toolname))
+                                 + VG_(strlen)(buildid) + 64);
+   VG_(sprintf)(obj->fname, "%s/%s-%s-%lx-%016llx",
+                VG_(clo_translation_cache), VG_(clo_toolname),
+                buildid, avma, pt_key);
+   obj->next = pt_objs;
+   pt_objs   = obj;
+
+   pt_load(obj);
+   return obj;
+}
+
+Bool VG_(lookup_persistent_tt) ( Addr nraddr, Addr addr, UInt kind,
+                                 Bool (*still_ok)
+                                    (void*, const VexGuestExtents*),
+                                 void* still_ok_opaque,
+                                 /*OUT*/VexGuestExtents* vge,
+                                 /*OUT*/const UChar**    code,
+                                 /*OUT*/UInt*            code_len,
+                                 /*OUT*/Bool*            is_self_checking,
+                                 /*OUT*/UInt*            n_guest_instrs )
+{
+   PTObj*       obj;
+   PTEnt*       e;
+   const UChar* guest;
+   UInt         i;
+
+   if (!pt_enabled)
+      return False;
+   obj = pt_find_obj(addr);
+   if (obj == NULL)
+      return False;
+   e = VG_(HT_lookup)(pt_ents, nraddr);
+   if (e == NULL)
+      return False;
+
+   if (e->obj != obj || e->addr != addr || e->kind != kind)
+      goto stale;
+   guest = e->bytes;
+   for (i = 0; i < e->vge.n_used; i++) {
+      Addr   base = e->vge.base[i];
+      UShort len  = e->vge.len[i];
+      if (len > 0
+          && (!VG_(am_is_valid_for_client)(base, len, VKI_PROT_READ)
+              || VG_(memcmp)((const void*)base, guest, len) != 0))
+         goto stale;
+      guest += len;
+   }
+   if (!still_ok(still_ok_opaque, &e->vge))
+      goto stale;
+
+   *vge              = e->vge;
+   *code             = e->bytes + e->guest_len;
+   *code_len         = e->code_len;
+   *is_self_checking = e->is_self_checking;
+   *n_guest_instrs   = e->n_guest_instrs;
+   n_pt_reused++;
+   return True;
+
+  stale:
+   n_pt_stale++;
+   return False;
+}
+
+void VG_(add_to_persistent_tt) ( Addr nraddr, Addr addr, UInt kind,
+                                 const VexGuestExtents* vge,
+                                 const UChar* code, UInt code_len,
+                                 Bool is_self_checking,
+                                 UInt n_guest_instrs )
+{
+   PTObj* obj;
+   UChar* guest;
+   UInt   i, guest_len = 0;
+
+   if (!pt_enabled)
+      return;
+   obj = pt_find_obj(addr);
+   /* The file name pins down the load address of this object only. */
+   if (obj == NULL || !pt_extents_in_obj(obj, vge))
+      return;
+
+   for (i = 0; i < vge->n_used; i++)
+      guest_len += vge->len[i];
+   guest = ttaux_malloc("transtab.add_to_persistent_tt", guest_len + 1);
+   guest_len = 0;
+   for (i = 0; i < vge->n_used; i++) {
+      VG_(memcpy)(guest + guest_len, (const void*)vge->base[i], vge->len[i]);
+      guest_len += vge->len[i];
+   }
+
+   if (pt_add_ent(obj, nraddr, addr, kind, vge, guest, guest_len,
+                  code, code_len, is_self_checking, n_guest_instrs))
+      obj->dirty = True;
+   ttaux_free(guest);
+}
+
+static Bool pt_write_all ( Int fd, const UChar* buf, SizeT n )
+{
+   while (n > 0) {
+      Int chunk = n > 0x40000000 ? 0x40000000 : (Int)n;
+      Int r     = VG_(write)(fd, buf, chunk);
+      if (r <= 0)
+         return False;
+      buf += r;
+      n   -= r;
+   }
+   return True;
+}
+
+static void pt_save ( PTObj* obj )
+{
+   PTFileHdr hdr;
+   PTEnt*    e;
+   UChar*    buf;
+   SizeT     size, off;
+   SysRes    sr;
+   Bool      ok;
+   UInt      n = 0, i;
+   HChar     tmpname[VG_(strlen)(obj->fname) + 32];
+
+   size = sizeof(hdr) + VG_(strlen)(obj->buildid);
+   VG_(HT_ResetIter)(pt_ents);
+   while ((e = VG_(HT_Next)(pt_ents))) {
+      if (e->obj == obj) {
+         size += sizeof(PTFileEnt) + e->guest_len + e->code_len;
+         n++;
+      }
+   }
+
+   buf = ttaux_malloc("transtab.pt_save", size);
+   off = sizeof(hdr);
+   VG_(memcpy)(buf + off, obj->buildid, VG_(strlen)(obj->buildid));
+   off += VG_(strlen)(obj->buildid);
+   VG_(HT_ResetIter)(pt_ents);
+   while ((e = VG_(HT_Next)(pt_ents))) {
+      PTFileEnt fe;
+      if (e->obj != obj)
+         continue;
+      VG_(memset)(&fe, 0, sizeof(fe));
+      fe.nraddr = e->nraddr;
+      fe.addr   = e->addr;
+      for (i = 0; i < e->vge.n_used; i++) {
+         fe.base[i] = e->vge.base[i];
+         fe.len[i]  = e->vge.len[i];
+      }
+      fe.n_used           = e->vge.n_used;
+      fe.kind             = e->kind;
+      fe.is_self_checking = e->is_self_checking;
+      fe.n_guest_instrs   = e->n_guest_instrs;
+      fe.code_len         = e->code_len;
+      VG_(memcpy)(buf + off, &fe, sizeof(fe));
+      off += sizeof(fe);
+      VG_(memcpy)(buf + off, e->bytes, e->guest_len + e->code_len);
+      off += e->guest_len + e->code_len;
+   }
+   vg_assert(off == size);
+
+   VG_(memset)(&hdr, 0, sizeof(hdr));
+   VG_(memcpy)(hdr.magic, PT_MAGIC, sizeof(hdr.magic));
+   hdr.key         = pt_key;
+   hdr.text_avma   = obj->text_avma;
+   hdr.text_size   = obj->text_size;
+   hdr.checksum    = pt_hash(PT_HASH_INIT, buf + sizeof(hdr),
+                             size - sizeof(hdr));
+   hdr.buildid_len = VG_(strlen)(obj->buildid);
+   hdr.n_ents      = n;
+   VG_(memcpy)(buf, &hdr, sizeof(hdr));
+
+   VG_(sprintf)(tmpname, "%s.%d.tmp", obj->fname, VG_(getpid)());
+   sr = VG_(open)(tmpname, VKI_O_CREAT|VKI_O_WRONLY|VKI_O_TRUNC,
+                  VKI_S_IRUSR|VKI_S_IWUSR);
+   ok = !sr_isError(sr);
+   if (ok) {
+      ok = pt_write_all(sr_Res(sr), buf, size);
+      VG_(close)(sr_Res(sr));
+      ok = ok && VG_(rename)(tmpname, obj->fname) == 0;
+      if (!ok)
+         VG_(unlink)(tmpname);
+   }
+   ttaux_free(buf);
+
+   if (ok) {
+      obj->dirty  = False;
+      n_pt_saved += n;
+   } else if (VG_(clo_verbosity) > 1) {
+      VG_(message)(Vg_DebugMsg,
+                   "translation cache: cannot write %s\n", obj->fname);
+   }
+}
+
+void VG_(save_persistent_tt) ( void )
+{
+   PTObj* obj;
+   if (!pt_enabled)
+      return;
+   for (obj = pt_objs; obj != NULL; obj = obj->next) {
+      if (obj->dirty)
+         pt_save(obj);
+   }
+}
+
+
+/*------------------------------------------------------------*/
+/*--- Retranslation of hot superblocks.                    ---*/
+/*------------------------------------------------------------*/
+
+/* With --hot-sb-threshold=<n>, VG_(translate) gives each first-tier
+   translation a profile counter, as for --profile-flags, and the
+   scheduler calls VG_(discard_hot_translations) now and then.  The
+   translations whose counter reached n since the previous call are
+   deleted and their entry addresses recorded in hot_ents.  The next
+   time the guest gets to one of them VG_(translate) makes a
+   second-tier translation, with a bigger instruction budget, more loop
+   unrolling and no counter.  Deleting a translation unchains its
+   predecessors, which rechain to the replacement as they reach it,
+   so nothing is ever patched under a running translation. */
+
+typedef
+   struct _HotEnt {
+      struct _HotEnt* next;
+      UWord           entry;      /* hash key */
+   }
+   HotEnt;
+
+static VgHashTable* hot_ents = NULL;
+
+static ULong n_hot_scans    = 0;
+static ULong n_hot_discards = 0;
+
+UInt VG_(discard_hot_translations) ( ULong threshold )
+{
+   SECno sno;
+   TTEno i;
+   Addr  ga_deleted;
+   UInt  n_deleted = 0;
+
+   vg_assert(init_done);
+   vg_assert(threshold > 0);
+
+   if (hot_ents == NULL)
+      hot_ents = VG_(HT_construct)("transtab.hot_ents");
+
+   VexArch     arch_host = VexArch_INVALID;
+   VexArchInfo archinfo_host;
+   VG_(bzero_inline)(&archinfo_host, sizeof(archinfo_host));
+   VG_(machine_get_VexArchInfo)( &arch_host, &archinfo_host );
+   VexEndness endness_host = archinfo_host.endness;
+
+   n_hot_scans++;
+
+   for (sno = 0; sno < n_sectors; sno++) {
+      Sector* sec = &sectors[sno];
+      if (sec->tc == NULL)
+         continue;
+      for (i = 0; i < N_TTES_PER_SECTOR; i++) {
+         if (sec->ttH[i].status != InUse)
+            continue;
+         /* Second-tier translations have no counter, so stay at 0. */
+         TTEntryC* tteC  = &sec->ttC[i];
+         ULong     count = tteC->usage.prof.count;
+         tteC->usage.prof.count = 0;
+         if (count < threshold)
+            continue;
+         if (VG_(HT_lookup)(hot_ents, tteC->entry) == NULL) {
+            HotEnt* h = ttaux_malloc("transtab.hot_ents", sizeof(HotEnt));
+            h->entry = tteC->entry;
+            VG_(HT_add_node)(hot_ents, h);
+         }
+         delete_tte( &ga_deleted, sec, sno, i, arch_host, endness_host );
+         n_deleted++;
+      }
+   }
+
+   if (n_deleted > 0) {
+      invalidateFastCache();
+      n_hot_discards += n_deleted;
+      VG_(debugLog)(2, "transtab",
+                       "discard_hot_translations: %u over %llu\n",
+                       n_deleted, threshold);
+   }
+
+   /* Post-deletion sanity check */
+   if (VG_(clo_sanity_level) >= 4) {
+      Bool sane = sanity_check_all_sectors();
+      vg_assert(sane);
+   }
+
+   return n_deleted;
+}
+
+Bool VG_(is_hot_sb) ( Addr entry )
+{
+   return hot_ents != NULL && VG_(HT_lookup)(hot_ents, entry) != NULL;
+}
+
+/* Forget the hot entries in guest_start .. guest_start+range-1, so
+   that code unmapped or rewritten there is not kept in hot_ents
+   forever, nor made at the second tier without having been found
+   hot. */
+static void hot_discard_translations ( Addr guest_start, ULong range )
+{
+   UInt          n, i;
+   VgHashNode**  nodes;
+
+   if (hot_ents == NULL || VG_(HT_count_nodes)(hot_ents) == 0)
+      return;
+
+   nodes = VG_(HT_to_array)(hot_ents, &n);
+   for (i = 0; i < n; i++) {
+      HotEnt* h = (HotEnt*)nodes[i];
+      if (h->entry - guest_start < range) {
+         VG_(HT_remove)(hot_ents, h->entry);
+         ttaux_free(h);
+      }
+   }
+   VG_(free)(nodes);
+}
+
+
 /*------------------------------------------------------------*/
 /*--- Initialisation.                                      ---*/
 /*------------------------------------------------------------*/
@@ -2591,6 +3654,9 @@ void VG_(init_tt_tc) ( void )
    n_sectors = VG_(clo_num_transtab_sectors);
    vg_assert(n_sectors >= MIN_N_SECTORS);
    vg_assert(n_sectors <= MAX_N_SECTORS);
+   max_sectors = VG_(clo_max_transtab_sectors) > n_sectors
+                 ? VG_(clo_max_transtab_sectors) : n_sectors;
+   vg_assert(max_sectors <= MAX_N_SECTORS);
 
    /* Initialise the sectors, even the ones we aren't going to use.
       Set all fields to zero. */
@@ -2609,6 +3675,9 @@ void VG_(init_tt_tc) ( void )
    /* and the unredir tt/tc */
    init_unredir_tt_tc();
 
+   /* and the persistent translations, if asked for */
+   init_persistent_tt();
+
    if (VG_(clo_verbosity) > 2 || VG_(clo_stats)
        || VG_(debugLog_getLevel) () >= 2) {
       VG_(message)(Vg_DebugMsg,
@@ -2674,6 +3743,11 @@ UInt VG_(get_bbs_discarded_or_dumped) ( void )
    return n_disc_count + n_dump_count;
 }
 
+ULong VG_(get_sectors_recycled) ( void )
+{
+   return n_sectors_recycled;
+}
+
 void VG_(print_tt_tc_stats) ( void )
 {
    VG_(message)(Vg_DebugMsg,
@@ -2698,6 +3772,21 @@ void VG_(print_tt_tc_stats) ( void )
    VG_(message)(Vg_DebugMsg,
                 " transtab: discarded  %'llu (%'llu -> ?" "?)\n",
                 n_disc_count, n_disc_osize );
+   VG_(message)(Vg_DebugMsg,
+                " transtab: carried    %'llu (%'llu made hot) "
+                "(%d sectors, %'llu added)\n",
+                n_carried, n_carry_given, n_sectors, n_sectors_grown );
+   if (pt_enabled)
+      VG_(message)(Vg_DebugMsg,
+                   " transtab: persistent %'llu loaded, %'llu reused, "
+                   "%'llu stale, %'llu saved, %'llu dropped\n",
+                   n_pt_loaded, n_pt_reused, n_pt_stale, n_pt_saved,
+                   n_pt_dropped );
+   if (VG_(clo_hot_sb_threshold) > 0)
+      VG_(message)(Vg_DebugMsg,
+                   " transtab: hot        %'llu discarded for retranslation "
+                   "(%'llu scans)\n",
+                   n_hot_discards, n_hot_scans );
 
    if (DEBUG_TRANSTAB) {
       VG_(printf)("\n");
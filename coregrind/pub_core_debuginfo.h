@@ -199,6 +199,10 @@ typedef
 # define SET_LOCAL_EP_AVMA(_sym_avmas, _val)  /* */
 #endif
 
+/* The ELF build-id of the object, as a lowercase hex string, or NULL
+   if it has none. */
+extern const HChar* VG_(DebugInfo_get_buildid) ( const DebugInfo *di );
+
 /* Functions for traversing all the symbols in a DebugInfo.  _howmany
    tells how many symbol table entries there are.  _getidx retrieves
    the n'th entry, for n in 0 .. _howmany-1.  You may not modify the
@@ -164,6 +164,11 @@ extern IRSB* VG_(instrument_for_gdbserver_if_needed)
       const VexGuestExtents* vge,
       IRType gWordTy, IRType hWordTy);
 
+/* True if VG_(instrument_for_gdbserver_if_needed) would currently
+   instrument a block made from vge, i.e. for a breakpoint, single
+   stepping or --vgdb=full. */
+extern Bool VG_(gdbserver_instruments) (const VexGuestExtents* vge);
+
 /* reason for which gdbserver connection must be finished */
 typedef
    enum {
@@ -74,6 +74,8 @@ extern void    VG_(env_unsetenv) ( HChar **env, const HChar *varname,
 extern void    VG_(env_remove_valgrind_env_stuff) ( HChar** env,
                                                     Bool ro_strings,
                                                     void (*free_fn) (void *) );
+extern void    VG_(env_remove_tool_preload) ( HChar** env,
+                                              const HChar* toolname );
 extern HChar **VG_(env_clone)    ( HChar **env_clone );
 
 // misc
@@ -85,6 +87,9 @@ extern void VG_(do_atfork_pre)    ( ThreadId tid );
 extern void VG_(do_atfork_parent) ( ThreadId tid );
 extern void VG_(do_atfork_child)  ( ThreadId tid );
 
+// Stops all helper processes; called before the client execs.
+extern void VG_(stop_all_helpers) ( void );
+
 #if defined(VGO_freebsd)
 // sysctl, modfind
 extern Int VG_(sysctlbyname)(const HChar *name, void *oldp, SizeT *oldlenp, const void *newp, SizeT newlen);
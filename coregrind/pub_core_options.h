@@ -207,8 +207,16 @@ extern Bool  VG_(clo_debug_dump_frames);
 /* DEBUG: print redirection details?  default: NO */
 extern Bool  VG_(clo_trace_redir);
 /* Enable fair scheduling on multicore systems? default: NO */
-enum FairSchedType { disable_fair_sched, enable_fair_sched, try_fair_sched };
+enum FairSchedType { disable_fair_sched, enable_fair_sched, try_fair_sched,
+                     handoff_fair_sched };
 extern enum FairSchedType VG_(clo_fair_sched);
+/* Basic blocks a thread runs for before another may be scheduled.
+   default: 100000 */
+extern UInt  VG_(clo_sched_quantum);
+/* With --fair-sched=handoff: for how many microseconds a waiter that last
+   ran on the releasing thread's CPU may overtake the longest waiter.
+   0 gives strict FIFO order. */
+extern UInt  VG_(clo_sched_affinity_slice);
 /* DEBUG: print thread scheduling events?  default: NO */
 extern Bool  VG_(clo_trace_sched);
 /* DEBUG: do heap profiling?  default: NO */
@@ -332,6 +340,9 @@ extern Int VG_(clo_merge_recursive_frames);
 
 /* Max number of sectors that will be used by the translation code cache. */
 extern UInt VG_(clo_num_transtab_sectors);
+/* Nr of sectors the translation cache may grow to when code is being
+   retranslated a lot, or 0 (the default) for no growth. */
+extern UInt VG_(clo_max_transtab_sectors);
 
 /* Average size of a transtab code entry. 0 means to use the tool
    provided default. */
@@ -366,6 +377,16 @@ typedef
    auto-detected. */
 extern VgSmc VG_(clo_smc_check);
 
+/* Directory in which to keep translations across runs, or NULL (the
+   default) for none.  See "Persistent translations" in m_transtab.c. */
+extern const HChar* VG_(clo_translation_cache);
+
+/* Retranslate, as longer and more optimised superblocks, those which
+   were run at least this many times between two scans of the profile
+   counters.  Zero (the default) disables it.  See "Retranslation of
+   hot superblocks" in m_transtab.c. */
+extern ULong VG_(clo_hot_sb_threshold);
+
 /* A set of minor kernel variants,
    so they can be properly handled by m_syswrap. */
 typedef
@@ -200,9 +200,46 @@ extern void VG_(discard_translations) ( Addr  start, ULong range,
 
 extern void VG_(print_tt_tc_stats) ( void );
 
+/* Translations kept across runs (--translation-cache=<dir>).  _lookup
+   finds one for NRADDR made from ADDR with redirection kind KIND,
+   provided the guest bytes it came from are unchanged and
+   STILL_OK(STILL_OK_OPAQUE, vge) holds for its extents.  The returned
+   code is unchained and remains owned by m_transtab.  _add offers a
+   translation just made by VEX, and _save writes out those not yet on
+   disk. */
+extern Bool VG_(lookup_persistent_tt) ( Addr nraddr, Addr addr, UInt kind,
+                                        Bool (*still_ok)
+                                           (void*, const VexGuestExtents*),
+                                        void* still_ok_opaque,
+                                        /*OUT*/VexGuestExtents* vge,
+                                        /*OUT*/const UChar**    code,
+                                        /*OUT*/UInt*            code_len,
+                                        /*OUT*/Bool*        is_self_checking,
+                                        /*OUT*/UInt*            n_guest_instrs );
+extern void VG_(add_to_persistent_tt) ( Addr nraddr, Addr addr, UInt kind,
+                                        const VexGuestExtents* vge,
+                                        const UChar* code, UInt code_len,
+                                        Bool is_self_checking,
+                                        UInt n_guest_instrs );
+extern void VG_(save_persistent_tt)   ( void );
+
+/* Retranslation of hot superblocks (--hot-sb-threshold=<n>).
+   _discard_hot deletes the translations whose profile counter reached
+   THRESHOLD, remembers their guest entry addresses, zeroes all the
+   counters and returns the number deleted.  _is_hot_sb says whether
+   ENTRY was found hot, so that it is to be retranslated at the second
+   tier. */
+extern UInt VG_(discard_hot_translations) ( ULong threshold );
+extern Bool VG_(is_hot_sb)                ( Addr entry );
+
 extern UInt VG_(get_bbs_translated) ( void );
 extern UInt VG_(get_bbs_discarded_or_dumped) ( void );
 
+/* Number of sectors recycled so far.  A caller holding a host code
+   address across a translation compares this before and after: if it
+   changed, the address may now be inside other (or carried) code. */
+extern ULong VG_(get_sectors_recycled) ( void );
+
 /* Add to / search the auxiliary, small, unredirected translation
    table. */
 
@@ -33,7 +33,9 @@
 
 /* Client requests for Cachegrind */
 typedef enum {
-   VG_USERREQ__ANALYZE_MEMORY = VG_USERREQ_TOOL_BASE('C', 'G')
+   VG_USERREQ__ANALYZE_MEMORY = VG_USERREQ_TOOL_BASE('C', 'G'),
+   VG_USERREQ__START_MEM_LOG,
+   VG_USERREQ__STOP_MEM_LOG
 } CachegrindClientRequest;
 
 /* Trigger stack and heap memory analysis from within the client program.
@@ -42,4 +44,13 @@ typedef enum {
 #define CACHEGRIND_ANALYZE_MEMORY \
    VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__ANALYZE_MEMORY, 0, 0, 0, 0, 0)
 
+/* With --mem-log=yes, open and close a logging window.  Outside of
+   windows Cachegrind neither simulates nor logs anything; start with
+   --mem-log-atstart=no to log only between these requests. */
+#define CACHEGRIND_START_MEM_LOG \
+   VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__START_MEM_LOG, 0, 0, 0, 0, 0)
+
+#define CACHEGRIND_STOP_MEM_LOG \
+   VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__STOP_MEM_LOG, 0, 0, 0, 0, 0)
+
 #endif /* __CACHEGRIND_H */ 
\ No newline at end of file
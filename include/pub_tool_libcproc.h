@@ -124,6 +124,35 @@ extern UInt VG_(get_user_milliseconds)(void);
 typedef void (*vg_atfork_t)(ThreadId);
 extern void VG_(atfork)(vg_atfork_t pre, vg_atfork_t parent, vg_atfork_t child);
 
+/* ---------------------------------------------------------------------
+   Helper processes
+   ------------------------------------------------------------------ */
+
+/* Lets a tool move work out of the client's process.  VG_(start_helper)
+   maps shared_szB bytes of zeroed memory shared with a new helper
+   process, which runs fn(shared) with all signals blocked and exits when
+   fn returns.  The helper is not a child of the client: the client
+   cannot wait for it and gets no SIGCHLD from it.  Returns the shared
+   memory, or NULL if no helper could be started.
+
+   The helper is stopped by VG_(stop_helper), and also before the client
+   execs.  Stopping first calls pre_stop (if not NULL) in Valgrind's
+   process, then asks fn to return, and waits until the helper has
+   exited.  fn finds out by calling VG_(helper_should_stop).
+
+   In a child the client forks, the shared memory is unmapped before the
+   tool's atfork handlers run, and the child has no helper. */
+extern void* VG_(start_helper) ( SizeT shared_szB, void (*fn)(void* shared),
+                                 void (*pre_stop)(void) );
+
+/* Called in a helper.  Waits up to wait_ms milliseconds for a request to
+   stop, and returns True if there is one. */
+extern Bool  VG_(helper_should_stop) ( Int wait_ms );
+
+/* Stops the helper sharing the given memory, see above.  The memory
+   stays mapped. */
+extern void  VG_(stop_helper) ( void* shared );
+
 
 #endif   // __PUB_TOOL_LIBCPROC_H
 
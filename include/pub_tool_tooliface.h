@@ -469,7 +469,9 @@ extern void VG_(needs_var_info) ( void );
 
 /* Does the tool replace malloc() and friends with its own versions?
    This has to be combined with the use of a vgpreload_<tool>.so module
-   or it won't work.  See massif/Makefile.am for how to build it. */
+   or it won't work.  See massif/Makefile.am for how to build it.
+   It can be called from post_clo_init, if the replacement depends on
+   the tool's options (see VG_(needs_no_preload)). */
 // The 'p' prefix avoids GCC complaints about overshadowing global names.
 extern void VG_(needs_malloc_replacement)(
    void* (*pmalloc)               ( ThreadId tid, SizeT n ),
@@ -499,6 +501,20 @@ extern void VG_(needs_xml_output) ( void );
    function here. */
 extern void VG_(needs_final_IR_tidy_pass) ( IRSB*(*final_tidy)(IRSB*) );
 
+/* Can the tool's translations be reused by a later run of the same tool
+   with the same options (--translation-cache)?  Only say so if the
+   generated code depends on nothing but the guest code and the command
+   line: the instrumentation function must not record per-superblock
+   state, nor embed pointers to memory allocated at run time. */
+extern void VG_(needs_persistent_translations) ( void );
+
+/* Is the tool's vgpreload_<tool>.so module to be left out of this run?
+   A tool which needs the module only for some of its options calls this
+   from post_clo_init when they are not given.  The core then takes the
+   module out of the client's LD_PRELOAD before the client starts, so
+   none of its redirections are done. */
+extern void VG_(needs_no_preload) ( void );
+
 
 /* ------------------------------------------------------------------ */
 /* Core events to track */
@@ -8400,6 +8400,7 @@ static void mc_pre_clo_init(void)
    MC_(Malloc_Redzone_SzB) = VG_(malloc_effective_client_redzone_size)();
 
    VG_(needs_xml_output)          ();
+   VG_(needs_persistent_translations) ();
 
    VG_(track_new_mem_startup)     ( mc_new_mem_startup );
 
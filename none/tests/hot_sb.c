@@ -0,0 +1,48 @@
+
+/* Runs a few small loops often enough for --hot-sb-threshold to
+   retranslate them, and prints what they compute, which must not
+   change. */
+
+#include <stdio.h>
+
+#define N 4000000
+
+static unsigned int table[256];
+
+static unsigned int step ( unsigned int x )
+{
+   return x * 1103515245u + 12345u;
+}
+
+int main ( void )
+{
+   unsigned int x = 1, sum = 0, crc;
+   double d = 0.0;
+   int i, j;
+
+   /* A loop with a call in it. */
+   for (i = 0; i < N; i++) {
+      x = step(x);
+      sum += x >> 16;
+   }
+   printf("lcg: %08x %08x\n", x, sum);
+
+   /* Nested loops over memory. */
+   for (i = 0; i < 256; i++) {
+      crc = i;
+      for (j = 0; j < 8; j++)
+         crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320u : crc >> 1;
+      table[i] = crc;
+   }
+   crc = 0xffffffffu;
+   for (i = 0; i < N; i++)
+      crc = table[(crc ^ i) & 0xff] ^ (crc >> 8);
+   printf("crc: %08x\n", crc ^ 0xffffffffu);
+
+   /* Floating point. */
+   for (i = 1; i <= N; i++)
+      d += 1.0 / ((double)i * i);
+   printf("sum: %.6f\n", d);
+
+   return 0;
+}
@@ -0,0 +1,39 @@
+// Eight threads which spin and share a counter, so that they queue up on
+// the scheduler lock at the end of every time slice.
+
+#include <pthread.h>
+#include <stdio.h>
+
+#define N_THREADS 8
+#define N_ROUNDS  100
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long counter;
+static volatile unsigned long spin;
+
+static void* worker(void* arg)
+{
+   int i, j;
+
+   for (i = 0; i < N_ROUNDS; i++) {
+      for (j = 0; j < 10000; j++)
+         spin++;
+      pthread_mutex_lock(&mutex);
+      counter++;
+      pthread_mutex_unlock(&mutex);
+   }
+   return NULL;
+}
+
+int main(void)
+{
+   pthread_t threads[N_THREADS];
+   int i;
+
+   for (i = 0; i < N_THREADS; i++)
+      pthread_create(&threads[i], NULL, worker, NULL);
+   for (i = 0; i < N_THREADS; i++)
+      pthread_join(threads[i], NULL);
+   printf("counter = %lu\n", counter);
+   return 0;
+}
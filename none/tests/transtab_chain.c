@@ -0,0 +1,65 @@
+/* Runs code too big for a small translation cache, with a hot
+   function whose rarely taken paths call out to the cold code, so
+   that many translations are carried over sector recycling and
+   sectors get recycled while the scheduler is chaining one block to
+   another.  Prints a checksum, which must not change. */
+
+#include <stdio.h>
+
+#define F(n) \
+   static unsigned int f##n ( unsigned int x ) \
+   { \
+      volatile unsigned int v = x; \
+      v = v * 3 + n; \
+      v ^= v >> 7; \
+      v += v << 3; \
+      v -= n; \
+      v ^= v >> 5; \
+      v += v << 2; \
+      return v; \
+   }
+#define F4(n)   F(n##0) F(n##1) F(n##2) F(n##3)
+#define F16(n)  F4(n##0) F4(n##1) F4(n##2) F4(n##3)
+#define F64(n)  F16(n##0) F16(n##1) F16(n##2) F16(n##3)
+#define F256(n) F64(n##0) F64(n##1) F64(n##2) F64(n##3)
+#define F1024(n) F256(n##0) F256(n##1) F256(n##2) F256(n##3)
+
+#define P(n)    f##n,
+#define P4(n)   P(n##0) P(n##1) P(n##2) P(n##3)
+#define P16(n)  P4(n##0) P4(n##1) P4(n##2) P4(n##3)
+#define P64(n)  P16(n##0) P16(n##1) P16(n##2) P16(n##3)
+#define P256(n) P64(n##0) P64(n##1) P64(n##2) P64(n##3)
+#define P1024(n) P256(n##0) P256(n##1) P256(n##2) P256(n##3)
+
+F1024(1) F1024(2) F1024(3) F1024(4)
+
+static unsigned int (*fns[])(unsigned int) = {
+   P1024(1) P1024(2) P1024(3) P1024(4)
+};
+
+#define T(n)    if (k == n) y = f##n(y);
+#define T4(n)   T(n##0) T(n##1) T(n##2) T(n##3)
+#define T16(n)  T4(n##0) T4(n##1) T4(n##2) T4(n##3)
+#define T64(n)  T16(n##0) T16(n##1) T16(n##2) T16(n##3)
+
+__attribute__((noinline))
+static unsigned int hot ( unsigned int y, volatile unsigned int k )
+{
+   T64(100) T64(101) T64(102)
+   return y;
+}
+
+int main ( void )
+{
+   unsigned int x = 1;
+   unsigned int i, round;
+
+   for (round = 0; round < 6; round++) {
+      for (i = 0; i < sizeof(fns) / sizeof(fns[0]); i++) {
+         x = fns[i](x);
+         x = hot(x, 100000 + (i * 7 + round) % 3000);
+      }
+   }
+   printf("%08x\n", x);
+   return 0;
+}
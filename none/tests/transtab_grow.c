@@ -0,0 +1,54 @@
+
+/* Runs code too big for a small translation cache, several times
+   round, so that Valgrind recycles sectors, carries hot translations
+   over the recycling and, with --max-transtab-sectors, grows the
+   cache.  Prints a checksum, which must not change. */
+
+#include <stdio.h>
+
+#define F(n) \
+   static unsigned int f##n ( unsigned int x ) \
+   { \
+      volatile unsigned int v = x; \
+      if (v & 1) \
+         v = v * 3 + n; \
+      else \
+         v = (v >> 1) ^ n; \
+      v += v >> 7; \
+      v ^= v << 3; \
+      return v; \
+   }
+#define F4(n)   F(n##0) F(n##1) F(n##2) F(n##3)
+#define F16(n)  F4(n##0) F4(n##1) F4(n##2) F4(n##3)
+#define F64(n)  F16(n##0) F16(n##1) F16(n##2) F16(n##3)
+#define F256(n) F64(n##0) F64(n##1) F64(n##2) F64(n##3)
+#define F1024(n) F256(n##0) F256(n##1) F256(n##2) F256(n##3)
+
+#define P(n)    f##n,
+#define P4(n)   P(n##0) P(n##1) P(n##2) P(n##3)
+#define P16(n)  P4(n##0) P4(n##1) P4(n##2) P4(n##3)
+#define P64(n)  P16(n##0) P16(n##1) P16(n##2) P16(n##3)
+#define P256(n) P64(n##0) P64(n##1) P64(n##2) P64(n##3)
+#define P1024(n) P256(n##0) P256(n##1) P256(n##2) P256(n##3)
+
+F1024(1) F1024(2) F1024(3) F1024(4)
+
+static unsigned int (*fns[])(unsigned int) = {
+   P1024(1) P1024(2) P1024(3) P1024(4)
+};
+
+int main ( void )
+{
+   unsigned int x = 1;
+   unsigned int i, round;
+
+   for (round = 0; round < 6; round++) {
+      for (i = 0; i < sizeof(fns) / sizeof(fns[0]); i++)
+         x = fns[i](x);
+      /* A hot loop, run between the trips round the big code. */
+      for (i = 0; i < 1000; i++)
+         x = fns[i & 3](x);
+   }
+   printf("%08x\n", x);
+   return 0;
+}